@@ -17,6 +17,8 @@
 
 #include "debug.h"
 #include "BTApp.h"
+#include "bt_utils.h"
+#include "rfcomm.h"
 
 /*
  * BT APP definitions
@@ -27,12 +29,33 @@
 #define DBG_CLASS DBG_CLASS_APP
 #endif
 
+/*Device of the selected stack instance (the call-backs get no context)*/
+#define gpsBTAPPDev ((BT_DEVICE *) gpsBTStack->pOwner)
+
+/*
+ * Bluetooth application variables
+ */
+
+/*
+ * Sensors of the installation the gateway pages, BD_ADDR least significant
+ * octet first (as in the HCI commands), up to HCI_MAX_PAGE_TARGETS, ended
+ * by an all-zero address. The HCI pages them once configured and again
+ * after the link drops. None: the gateway waits for the sensors to connect.
+ */
+static const BYTE gaaBTAPPTargets[][6] =
+{
+    /* {0x56, 0x34, 0x12, 0x5E, 0xDB, 0x00}, */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
 /*
  * Bluetooth application private function prototypes
  */
 
 BOOL BTAPP_API_putRFCOMMData(const BYTE *pData, UINT uLen);
 BOOL BTAPP_API_confComplete();
+BOOL BTAPP_API_L2CAPconnected(UINT16 uPSM, BOOL bConnected);
+BOOL BTAPP_API_linkOpen(BOOL isPaged);
 
 /*
  * Bluetooth application implementation
@@ -46,11 +69,37 @@ BOOL BTAPP_Initialise(BT_DEVICE **ppsBTDevice)
     
     *ppsBTDevice = (BT_DEVICE *) BT_malloc(sizeof(BT_DEVICE));
     psBTDev = *ppsBTDevice;
+    if (NULL == psBTDev)
+    {
+        return FALSE;
+    }
 
-    ASSERT(NULL != psBTDev);
+    /* A new stack instance, the layers below are created on it */
+    psBTDev->psStack = BT_stackCreate();
+    if (NULL == psBTDev->psStack)
+    {
+        BT_free(psBTDev);
+        *ppsBTDevice = NULL;
+        return FALSE;
+    }
+    psBTDev->psStack->pOwner = psBTDev;
+    psBTDev->isStarted = FALSE;
+    psBTDev->dwStartTicks = 0;
+    psBTDev->isInitiator = FALSE;
 
     /* Initialise all the BT stack layers */
-    HCIUSB_create();
+#if defined(HCI_TRANSPORT_H4)
+    if (!HCIH4_create())
+#else
+    if (!HCIUSB_create())
+#endif
+    {
+        /* No room for the transport buffers, the stack cannot run */
+        BT_stackDestroy(psBTDev->psStack);
+        BT_free(psBTDev);
+        *ppsBTDevice = NULL;
+        return FALSE;
+    }
     HCI_create();
     L2CAP_create();
     SDP_create();
@@ -63,56 +112,127 @@ BOOL BTAPP_Initialise(BT_DEVICE **ppsBTDevice)
 
 BOOL BTAPP_Start(BT_DEVICE *psBTDevice)
 {
-    HCIUSB_API sPHY;
+    HCI_TRANSPORT_API sTransport;
     HCI_API sHCI;
     L2CAP_API sL2CAP;
     DEVICE_API sAPI;
     RFCOMM_API sRFCOMM;
+    UINT i;
 
     ASSERT(NULL != psBTDevice);
+    BT_stackSelect(psBTDevice->psStack);
+    psBTDevice->dwStartTicks = BT_getTicks();
 
     /* Get all the APIs needed */
-    HCIUSB_getAPI(&sPHY);
     HCI_getAPI(&sHCI);
+    if (psBTDevice->isStarted)
+    {
+        /* Re-plugged: the stack is wired and configured already */
+        sHCI.cmdReset();
+        DBG_INFO("BTAPP: Bluetooth stack restart\n\r");
+        return TRUE;
+    }
     L2CAP_getAPI(&sL2CAP);
     RFCOMM_getAPI(&sRFCOMM);
-    /* Initialise the USB Device API directly related with the physical bus */
-    psBTDevice->sUSB.getACLBuff = sPHY.getACLBuff;
-    psBTDevice->sUSB.getEVTBuff = sPHY.getEVTBuff;
-    psBTDevice->sUSB.writeACL = sPHY.USBwriteACL;
-    psBTDevice->sUSB.writeCTL = sPHY.USBwriteCTL;
+#if defined(HCI_TRANSPORT_H4)
+    /* The H4 transport reads the stream itself and calls the HCI back */
+    HCIH4_getAPI(&sTransport);
+    HCIH4_installHCI(&sHCI);
+#else
+    {
+        HCIUSB_API sPHY;
+
+        HCIUSB_getAPI(&sPHY);
+        /* Initialise the USB Device API directly related with the bus */
+        psBTDevice->sUSB.getACLBuff = sPHY.getACLBuff;
+        psBTDevice->sUSB.getEVTBuff = sPHY.getEVTBuff;
+        psBTDevice->sUSB.writeACL = sPHY.USBwriteACL;
+        psBTDevice->sUSB.writeCTL = sPHY.USBwriteCTL;
+        sTransport.writeACL = sPHY.USBwriteACL;
+        sTransport.writeCTL = sPHY.USBwriteCTL;
+        sTransport.tasks = NULL;
+    }
     /* Initialise the last part of the USB Device API */
     psBTDevice->sUSB.readACL = sHCI.putData;
     psBTDevice->sUSB.readEVT = sHCI.putEvent;
+    psBTDevice->sUSB.writeACLDone = sHCI.putACLDone;
+    psBTDevice->sUSB.writeCTLDone = sHCI.putCMDDone;
+#endif
+    HCI_installTransport(&sTransport);
+    /* HCI API */
+    psBTDevice->tasks = sHCI.tasks;
+    psBTDevice->setPowerPolicy = sHCI.setPowerPolicy;
+    psBTDevice->addPageTarget = sHCI.addPageTarget;
     /* L2CAP API */
+    psBTDevice->L2CAPconnect = sL2CAP.connect;
     psBTDevice->L2CAPdisconnect = sL2CAP.disconnect;
     /* RFCOMM API */
     psBTDevice->SPPsendData = sRFCOMM.sendData;
     psBTDevice->SPPdisconnect = sRFCOMM.disconnect;
 
-    /* Install the Device call-backs in the RFCOMM and HCI layer */
+    /* Install the Device call-backs in the RFCOMM, L2CAP and HCI layer */
     sAPI.putRFCOMMData = &BTAPP_API_putRFCOMMData;
     sAPI.confComplete = &BTAPP_API_confComplete;
+    sAPI.L2CAPconnected = &BTAPP_API_L2CAPconnected;
+    sAPI.linkOpen = &BTAPP_API_linkOpen;
     RFCOMM_installDevCB(&sAPI);
+    L2CAP_installDevCB(&sAPI);
     HCI_installDevCB(&sAPI);
 
+    /* The sensors to page, the HCI keeps them over a restart */
+    for (i = 0; gaaBTAPPTargets[i][0] | gaaBTAPPTargets[i][1] |
+            gaaBTAPPTargets[i][2] | gaaBTAPPTargets[i][3] |
+            gaaBTAPPTargets[i][4] | gaaBTAPPTargets[i][5]; ++i)
+    {
+        if (!sHCI.addPageTarget(gaaBTAPPTargets[i]))
+        {
+            DBG_ERROR("BTAPP: page target %u not added\n\r", i);
+        }
+    }
+
     /* Issue the RESET command (which will trigger the HCI configuration) */
     sHCI.setLocalName("PIC_BT", 6);
 //    sHCI.setPINCode("1234", 4);
     sHCI.cmdReset();
+    psBTDevice->isStarted = TRUE;
 
     DBG_INFO("BTAPP: Bluetooth stack start\n\r");
 
     return TRUE;
 }
 
+/*
+ * The controller is gone (dongle unplugged): close the channels and flush
+ * the queues of every layer. The configuration and the link keys stay, so
+ * the next BTAPP_Start only has to bring the new controller up.
+ */
+BOOL BTAPP_Stop(BT_DEVICE *psBTDevice)
+{
+    ASSERT(NULL != psBTDevice);
+    BT_stackSelect(psBTDevice->psStack);
+
+    RFCOMM_reset();
+    L2CAP_reset();
+    HCI_reset();
+    psBTDevice->isInitiator = FALSE;
+
+    DBG_INFO("BTAPP: Bluetooth stack stop\n\r");
+    return TRUE;
+}
+
 BOOL BTAPP_Deinitialise()
 {
+#if defined(HCI_TRANSPORT_H4)
+    HCIH4_destroy();
+#else
     HCIUSB_destroy();
+#endif
     HCI_destroy();
     L2CAP_destroy();
     SDP_destroy();
     RFCOMM_destroy();
+    /* The selected instance is gone with its layers */
+    BT_stackDestroy(gpsBTStack);
     return TRUE;
 }
 
@@ -136,6 +256,56 @@ BOOL BTAPP_API_putRFCOMMData(const BYTE *pData, UINT uLen)
 /* Called by the HCI after completing the configuration of the local Device */
 BOOL BTAPP_API_confComplete()
 {
-    DBG_INFO("BTAPP: HCI Configured\n");
+    DBG_INFO("BTAPP: HCI Configured, connectable %lu us after start\n",
+            BT_ticksToUs(BT_getTicks() - gpsBTAPPDev->dwStartTicks));
+    return TRUE;
+}
+
+/* Called by the L2CAP when a channel opens, or closes (or fails to open) */
+BOOL BTAPP_API_L2CAPconnected(UINT16 uPSM, BOOL bConnected)
+{
+    RFCOMM_API sRFCOMM;
+
+    if (bConnected)
+    {
+        DBG_INFO("BTAPP: L2CAP channel open\n");
+        /* Our own channel: start the RFCOMM session on it */
+        if (uPSM == L2CAP_RFCOMM_PSM && gpsBTAPPDev->isInitiator)
+        {
+            RFCOMM_getAPI(&sRFCOMM);
+            sRFCOMM.connect();
+        }
+    }
+    else
+    {
+        DBG_INFO("BTAPP: L2CAP channel closed\n");
+        /* The RFCOMM session went with its channel */
+        if (uPSM == L2CAP_RFCOMM_PSM)
+        {
+            gpsBTAPPDev->isInitiator = FALSE;
+            RFCOMM_reset();
+        }
+    }
     return TRUE;
 }
+
+/*
+ * Called by the HCI once an ACL link is up. A device we paged does not
+ * open any channel itself: open the RFCOMM channel on it.
+ */
+BOOL BTAPP_API_linkOpen(BOOL isPaged)
+{
+    L2CAP_API sL2CAP;
+
+    if (!isPaged)
+    {
+        return TRUE;
+    }
+    L2CAP_getAPI(&sL2CAP);
+    gpsBTAPPDev->isInitiator = sL2CAP.connect(L2CAP_RFCOMM_PSM);
+    if (!gpsBTAPPDev->isInitiator)
+    {
+        DBG_ERROR("BTAPP: Unable to open the RFCOMM channel\n");
+    }
+    return gpsBTAPPDev->isInitiator;
+}
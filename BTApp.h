@@ -35,14 +35,29 @@ typedef struct _PHY_BUS
 
     BOOL (*readACL)(const BYTE*, UINT);
     BOOL (*readEVT)(const BYTE*, UINT);
+    void (*writeACLDone)(void);
+    void (*writeCTLDone)(void);
 } PHY_BUS;
 
 /* Device call-back interface */
 typedef struct _BT_DEVICE
 {
+    /* Stack instance driven through this device */
+    BT_STACK *psStack;
+    /* Wired up by the first BTAPP_Start, later starts only reset the HCI */
+    BOOL isStarted;
+    /* Core timer ticks when the controller was (re)started */
+    DWORD dwStartTicks;
+    /* The RFCOMM channel is ours to open (the link is the outcome of a page) */
+    BOOL isInitiator;
     /* PHY_BUS API */
     PHY_BUS sUSB;
+    /* HCI API */
+    void (*tasks)(void);
+    BOOL (*setPowerPolicy)(UINT8);
+    BOOL (*addPageTarget)(const BYTE*);
     /* L2CAP_API */
+    BOOL (*L2CAPconnect)(UINT16);
     BOOL (*L2CAPdisconnect)(UINT16);
     /* RFCOMM API */
     BOOL (*SPPsendData)(const BYTE*, UINT);
@@ -55,6 +70,7 @@ typedef struct _BT_DEVICE
 
 BOOL BTAPP_Initialise(BT_DEVICE **ppsBTDevice);
 BOOL BTAPP_Start(BT_DEVICE *psBTDevice);
+BOOL BTAPP_Stop(BT_DEVICE *psBTDevice);
 BOOL BTAPP_Deinitialise();
 
 #endif /*BTApp*/
@@ -22,7 +22,7 @@
 #define CONTROL_PACKET_LENGTH 32
 #define EVENT_PACKET_LENGTH 32
 #define MAX_ACL_R_BUFF_SIZE 1
-#define MAX_EVT_R_BUFF_SIZE 1
+#define MAX_EVT_R_BUFF_SIZE 2
 
 /*Protocol and service multiplexor*/
 #define L2CAP_SDP_PSM 0x0001
@@ -44,6 +44,24 @@
  * will be populated by the method "X_installY".
  */
 
+/*Transport write results*/
+#define HCI_TRANSPORT_SUCCESS 0x10
+#define HCI_TRANSPORT_BUSY 0x11
+#define HCI_TRANSPORT_ERROR 0x12
+
+/*
+ * HCI transport: carries the commands and ACL packets to the controller.
+ * A write is asynchronous, the HCI is told the packet went out through
+ * putCMDDone/putACLDone and hands the received packets to putEvent/putData.
+ */
+typedef struct _HCI_TRANSPORT_API
+{
+    INT (*writeACL)(const BYTE*, UINT);
+    INT (*writeCTL)(const BYTE*, UINT);
+    /*Moves the bytes of a stream transport (NULL if event driven)*/
+    void (*tasks)(void);
+} HCI_TRANSPORT_API;
+
 typedef struct _HCIUSB_API
 {
     BYTE* (*getACLBuff)(void);
@@ -53,6 +71,16 @@ typedef struct _HCIUSB_API
     INT (*USBwriteCTL)(const BYTE*, UINT);
 } HCIUSB_API;
 
+/* Page and inquiry scan activity (0.625 ms slots) */
+typedef struct _HCI_SCAN_PROFILE
+{
+    UINT16 uPageInterval;
+    UINT16 uPageWindow;
+    UINT16 uInqInterval;
+    UINT16 uInqWindow;
+    BOOL bInterlaced;
+} HCI_SCAN_PROFILE;
+
 typedef struct _HCI_API
 {
     void (*cmdReset)(void);
@@ -62,6 +90,16 @@ typedef struct _HCI_API
     BOOL (*sendData)(const BYTE*, UINT);
     BOOL (*putData)(const BYTE*, UINT);
     BOOL (*putEvent)(const BYTE*, UINT);
+    void (*putACLDone)(void);
+    void (*putCMDDone)(void);
+    void (*tasks)(void);
+    BOOL (*setPowerPolicy)(UINT8);
+    UINT16 (*getPacketType)(void);
+    BOOL (*subscribeEvent)(UINT8, void (*)(const BYTE*));
+    BOOL (*getEventStats)(UINT8, UINT16*, DWORD*);
+    BOOL (*setScanProfile)(UINT8, const HCI_SCAN_PROFILE*);
+    BOOL (*addPageTarget)(const BYTE*);
+    UINT16 (*getAclLength)(void);
 } HCI_API;
 
 typedef struct _L2CAP_API
@@ -69,6 +107,13 @@ typedef struct _L2CAP_API
     BOOL (*sendData)(UINT16, const BYTE*, UINT16);
     BOOL (*putData)(const BYTE*, UINT16, BOOL);
     BOOL (*disconnect)(UINT16);
+    BOOL (*setMode)(UINT16, UINT8, UINT8);
+    BOOL (*connect)(UINT16);
+    UINT16 (*getMTU)(UINT16);
+    BOOL (*sendControl)(UINT16, const BYTE*, UINT16);
+    BOOL (*setWeight)(UINT16, UINT8);
+    void (*txReady)(void);
+    void (*linkClosed)(void);
 } L2CAP_API;
 
 typedef struct _RFCOMM_API
@@ -76,6 +121,7 @@ typedef struct _RFCOMM_API
     BOOL (*sendData)(const BYTE*,UINT);
     BOOL (*putData)(const BYTE*,UINT);
     BOOL (*disconnect)(UINT8);
+    BOOL (*connect)(void);
 } RFCOMM_API;
 
 typedef struct _SDP_API
@@ -88,8 +134,39 @@ typedef struct _DEVICE_API
 {
     BOOL (*confComplete)(void);
     BOOL (*putRFCOMMData)(const BYTE *,UINT);
+    BOOL (*L2CAPconnected)(UINT16, BOOL);
+    BOOL (*linkOpen)(BOOL);
 } DEVICE_API;
 
+/*
+ * Stack instance: the control blocks of every layer driving one
+ * controller, with its HCI capture. The layers work on the selected
+ * instance (gpsBTStack), a caller driving several controllers selects the
+ * instance before calling into its stack; the calls between layers stay
+ * within that instance. The link-key store is the one of the device (a
+ * flash page pair), shared by the instances.
+ */
+typedef struct _BT_STACK
+{
+    UINT uIndex;
+    struct _HCIUSB_CONTROL_BLOCK *psHCIUSBCB;
+    struct _HCIH4_CONTROL_BLOCK *psHCIH4CB;
+    struct _HCI_CONTROL_BLOCK *psHCICB;
+    struct _L2CAP_CONTROL_BLOCK *psL2CAPCB;
+    struct _SDP_CONTROL_BLOCK *psSDPCB;
+    struct _RFCOMM_CONTROL_BLOCK *psRFCOMMCB;
+    struct _BT_SNOOP *psSnoop;
+    /*Application instance driving the stack, for its call-backs*/
+    void *pOwner;
+} BT_STACK;
+
+extern BT_STACK *gpsBTStack;
+
+/*A new (selected) instance, the layers are created on it afterwards*/
+BT_STACK* BT_stackCreate();
+BOOL BT_stackDestroy(BT_STACK *psStack);
+void BT_stackSelect(BT_STACK *psStack);
+
 /*
  * Common Bluetooth function definitions implemented on the respective layer.
  */
@@ -98,23 +175,33 @@ BOOL HCIUSB_create();
 BOOL HCIUSB_destroy();
 BOOL HCIUSB_getAPI(HCIUSB_API *psAPI);
 
+BOOL HCIH4_create();
+BOOL HCIH4_destroy();
+BOOL HCIH4_getAPI(HCI_TRANSPORT_API *psAPI);
+BOOL HCIH4_installHCI(HCI_API *psAPI);
+
 BOOL HCI_create();
 BOOL HCI_destroy();
+BOOL HCI_reset();
+BOOL HCI_installTransport(HCI_TRANSPORT_API *psAPI);
 BOOL HCI_installL2CAP(L2CAP_API *psAPI);
 BOOL HCI_installDevCB(DEVICE_API *psAPI);
 BOOL HCI_getAPI(HCI_API *psAPI);
 
 BOOL L2CAP_create();
 BOOL L2CAP_destroy();
+BOOL L2CAP_reset();
 BOOL L2CAP_getAPI(L2CAP_API *psAPI);
 BOOL L2CAP_installRFCOMM(RFCOMM_API *psAPI);
 BOOL L2CAP_installSDP(SDP_API *psAPI);
+BOOL L2CAP_installDevCB(DEVICE_API *psAPI);
 
 BOOL SDP_create();
 BOOL SDP_destroy();
 
 BOOL RFCOMM_create();
 BOOL RFCOMM_destroy();
+BOOL RFCOMM_reset();
 BOOL RFCOMM_getAPI(RFCOMM_API *psAPI);
 BOOL RFCOMM_installDevCB(DEVICE_API *psAPI);
 
@@ -0,0 +1,420 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#include <string.h>
+#include "GenericTypeDefs.h"
+#include "bt_keystore.h"
+#include "bt_utils.h"
+#include "debug.h"
+
+#ifdef BT_KEYSTORE_ENABLE
+
+/*
+ * Flash access.
+ * On the PIC32 the store lives in two pages of program flash reserved
+ * below, any other build keeps the pages in a file (flash emulator).
+ */
+
+#if defined(__PIC32MX__)
+
+static const BYTE gaKeyStorePages[BT_KEYSTORE_PAGES][BT_KEYSTORE_PAGE_SIZE]
+        __attribute__((aligned(BT_KEYSTORE_PAGE_SIZE))) =
+        {[0 ... BT_KEYSTORE_PAGES - 1] =
+            {[0 ... BT_KEYSTORE_PAGE_SIZE - 1] = 0xFF}};
+
+/*Read through KSEG1, the cache would not see the NVM writes*/
+static const BYTE* _BT_flashRead(UINT uPage)
+{
+    return (const BYTE *) KVA0_TO_KVA1(gaKeyStorePages[uPage]);
+}
+
+static BOOL _BT_flashErase(UINT uPage)
+{
+    return 0 == NVMErasePage((void *) gaKeyStorePages[uPage]);
+}
+
+static BOOL _BT_flashWriteWord(UINT uPage, UINT uOffset, DWORD dwWord)
+{
+    return 0 == NVMWriteWord((void *) &gaKeyStorePages[uPage][uOffset],
+            dwWord);
+}
+
+#else
+
+#include <stdio.h>
+
+#if !defined(BT_KEYSTORE_FILE)
+#define BT_KEYSTORE_FILE "bt_keystore.bin"
+#endif
+
+static BYTE gaKeyStorePages[BT_KEYSTORE_PAGES][BT_KEYSTORE_PAGE_SIZE];
+static BOOL gisKeyStoreLoaded = FALSE;
+/*Erase and program operations left before a power loss (-1: no limit)*/
+static INT giKeyStoreOpsLeft = -1;
+
+static BOOL _BT_flashSync()
+{
+    FILE *pFile;
+    BOOL bRetVal;
+
+    if(0 == giKeyStoreOpsLeft)
+    {
+        return FALSE;
+    }
+    if(giKeyStoreOpsLeft > 0)
+    {
+        --giKeyStoreOpsLeft;
+    }
+    pFile = fopen(BT_KEYSTORE_FILE, "wb");
+    if(NULL == pFile)
+    {
+        return FALSE;
+    }
+    bRetVal = (fwrite(gaKeyStorePages, sizeof(gaKeyStorePages), 1, pFile) == 1);
+    fclose(pFile);
+    return bRetVal;
+}
+
+static const BYTE* _BT_flashRead(UINT uPage)
+{
+    FILE *pFile;
+
+    if(!gisKeyStoreLoaded)
+    {
+        memset(gaKeyStorePages, 0xFF, sizeof(gaKeyStorePages));
+        pFile = fopen(BT_KEYSTORE_FILE, "rb");
+        if(NULL != pFile)
+        {
+            fread(gaKeyStorePages, sizeof(gaKeyStorePages), 1, pFile);
+            fclose(pFile);
+        }
+        gisKeyStoreLoaded = TRUE;
+    }
+    return gaKeyStorePages[uPage];
+}
+
+static BOOL _BT_flashErase(UINT uPage)
+{
+    BYTE aPage[BT_KEYSTORE_PAGE_SIZE];
+
+    /*A lost operation leaves the page as it was*/
+    memcpy(aPage, _BT_flashRead(uPage), BT_KEYSTORE_PAGE_SIZE);
+    memset(gaKeyStorePages[uPage], 0xFF, BT_KEYSTORE_PAGE_SIZE);
+    if(!_BT_flashSync())
+    {
+        memcpy(gaKeyStorePages[uPage], aPage, BT_KEYSTORE_PAGE_SIZE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL _BT_flashWriteWord(UINT uPage, UINT uOffset, DWORD dwWord)
+{
+    BYTE aWord[4];
+    UINT i;
+
+    memcpy(aWord, &_BT_flashRead(uPage)[uOffset], 4);
+    /*Like the real flash, programming only clears bits*/
+    for(i = 0; i < 4; ++i)
+    {
+        gaKeyStorePages[uPage][uOffset + i] &= (BYTE) (dwWord >> (8 * i));
+    }
+    if(!_BT_flashSync())
+    {
+        memcpy(&gaKeyStorePages[uPage][uOffset], aWord, 4);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+#endif /*__PIC32MX__*/
+
+/*
+ * Link-key store private functions
+ */
+
+static DWORD _BT_keyStoreSeq(UINT uPage)
+{
+    const BYTE *pPage = _BT_flashRead(uPage);
+
+    return pPage[BT_KEYSTORE_SEQ_OFF] |
+           (pPage[BT_KEYSTORE_SEQ_OFF+1] << 8) |
+           ((DWORD) pPage[BT_KEYSTORE_SEQ_OFF+2] << 16) |
+           ((DWORD) pPage[BT_KEYSTORE_SEQ_OFF+3] << 24);
+}
+
+/*
+ * The page holding the store: the complete one or, if the last compaction
+ * completed before the old page was erased, the newest. A blank flash
+ * starts on the first page. Returns -1 if that one cannot be set up.
+ */
+static INT _BT_keyStoreCurrent()
+{
+    DWORD dwSeq0 = _BT_keyStoreSeq(0);
+    DWORD dwSeq1 = _BT_keyStoreSeq(1);
+
+    if(BT_KEYSTORE_NO_SEQ != dwSeq0 && (BT_KEYSTORE_NO_SEQ == dwSeq1 ||
+            (INT32) (dwSeq0 - dwSeq1) > 0))
+    {
+        return 0;
+    }
+    if(BT_KEYSTORE_NO_SEQ != dwSeq1)
+    {
+        return 1;
+    }
+    if(!_BT_flashErase(0) || !_BT_flashWriteWord(0, BT_KEYSTORE_SEQ_OFF, 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static UINT _BT_keyStoreHash(const BYTE *pBDAddr)
+{
+    UINT i;
+    UINT uHash = 0;
+
+    for(i = 0; i < 6; ++i)
+    {
+        uHash = uHash * 31 + pBDAddr[i];
+    }
+    return uHash % BT_KEYSTORE_SLOTS;
+}
+
+static BOOL _BT_keyStoreIsErased(const BYTE *pRec)
+{
+    UINT i;
+
+    for(i = 0; i < BT_KEYSTORE_REC_LEN; ++i)
+    {
+        if(0xFF != pRec[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Probe from the home slot of the address. Returns the slot holding it or,
+ * if pFree is given, stores there the first slot it could be written to.
+ * The probe ends on a never written slot, deleted ones are skipped.
+ */
+static INT _BT_keyStoreLookup(UINT uPage, const BYTE *pBDAddr, INT *pFree)
+{
+    const BYTE *pPage = _BT_flashRead(uPage);
+    const BYTE *pRec;
+    UINT uSlot = _BT_keyStoreHash(pBDAddr);
+    UINT i;
+
+    if(NULL != pFree)
+    {
+        *pFree = -1;
+    }
+    for(i = 0; i < BT_KEYSTORE_SLOTS; ++i)
+    {
+        pRec = &pPage[uSlot * BT_KEYSTORE_REC_LEN];
+        if(_BT_keyStoreIsErased(pRec))
+        {
+            if(NULL != pFree && *pFree < 0)
+            {
+                *pFree = uSlot;
+            }
+            return -1;
+        }
+        if(BT_KEYSTORE_VALID == pRec[BT_KEYSTORE_STATE_OFF] &&
+           BT_isEqualBD_ADDR(&pRec[BT_KEYSTORE_ADDR_OFF], pBDAddr))
+        {
+            return uSlot;
+        }
+        uSlot = (uSlot + 1) % BT_KEYSTORE_SLOTS;
+    }
+    return -1;
+}
+
+/*Program a whole slot, the word carrying the state goes last*/
+static BOOL _BT_keyStoreWrite(UINT uPage, UINT uSlot, const BYTE *pRec)
+{
+    UINT i;
+    DWORD dwWord;
+
+    for(i = 0; i < BT_KEYSTORE_REC_LEN; i += 4)
+    {
+        dwWord = pRec[i] | (pRec[i+1] << 8) |
+                 ((DWORD) pRec[i+2] << 16) | ((DWORD) pRec[i+3] << 24);
+        if(!_BT_flashWriteWord(uPage, uSlot * BT_KEYSTORE_REC_LEN + i,
+                dwWord))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*Clear the state of a slot (the only bits ever reprogrammed)*/
+static BOOL _BT_keyStoreKill(UINT uPage, UINT uSlot)
+{
+    const BYTE *pRec = &_BT_flashRead(uPage)[uSlot * BT_KEYSTORE_REC_LEN];
+    UINT uOffset = BT_KEYSTORE_ADDR_OFF + 4;
+
+    return _BT_flashWriteWord(uPage, uSlot * BT_KEYSTORE_REC_LEN + uOffset,
+            pRec[uOffset] | (pRec[uOffset+1] << 8) |
+            ((DWORD) pRec[BT_KEYSTORE_TYPE_OFF] << 16) |
+            ((DWORD) BT_KEYSTORE_DELETED << 24));
+}
+
+/*
+ * Compaction: write the live slots (none if isKeep is FALSE) of the page
+ * at their home positions in the other page, then seal that one with the
+ * next sequence number. The old page stays untouched, it is the store
+ * until the seal is written. Returns the new page, -1 on failure.
+ */
+static INT _BT_keyStoreMove(UINT uPage, BOOL isKeep)
+{
+    const BYTE *pPage = _BT_flashRead(uPage);
+    const BYTE *pRec;
+    UINT uSpare = (uPage + 1) % BT_KEYSTORE_PAGES;
+    DWORD dwSeq = _BT_keyStoreSeq(uPage) + 1;
+    INT iFree;
+    UINT i;
+
+    if(!_BT_flashErase(uSpare))
+    {
+        return -1;
+    }
+    for(i = 0; isKeep && i < BT_KEYSTORE_SLOTS; ++i)
+    {
+        pRec = &pPage[i * BT_KEYSTORE_REC_LEN];
+        if(BT_KEYSTORE_VALID != pRec[BT_KEYSTORE_STATE_OFF])
+        {
+            continue;
+        }
+        _BT_keyStoreLookup(uSpare, &pRec[BT_KEYSTORE_ADDR_OFF], &iFree);
+        if(iFree < 0 || !_BT_keyStoreWrite(uSpare, iFree, pRec))
+        {
+            return -1;
+        }
+    }
+    if(BT_KEYSTORE_NO_SEQ == dwSeq)
+    {
+        dwSeq = 0;
+    }
+    if(!_BT_flashWriteWord(uSpare, BT_KEYSTORE_SEQ_OFF, dwSeq))
+    {
+        return -1;
+    }
+    return uSpare;
+}
+
+/*
+ * Link-key store public functions
+ */
+
+BOOL BT_keyStoreFind(const BYTE *pBDAddr, BYTE *pKey)
+{
+    INT iPage = _BT_keyStoreCurrent();
+    INT iSlot;
+
+    if(iPage < 0)
+    {
+        return FALSE;
+    }
+    iSlot = _BT_keyStoreLookup(iPage, pBDAddr, NULL);
+    if(iSlot < 0)
+    {
+        return FALSE;
+    }
+    memcpy(pKey, &_BT_flashRead(iPage)[iSlot * BT_KEYSTORE_REC_LEN +
+            BT_KEYSTORE_KEY_OFF], BT_LINK_KEY_LEN);
+    return TRUE;
+}
+
+BOOL BT_keyStorePut(const BYTE *pBDAddr, const BYTE *pKey, BYTE bKeyType)
+{
+    BYTE aRec[BT_KEYSTORE_REC_LEN];
+    INT iPage;
+    INT iSlot;
+    INT iFree;
+
+    iPage = _BT_keyStoreCurrent();
+    if(iPage < 0)
+    {
+        return FALSE;
+    }
+
+    /*A new pairing replaces the old key*/
+    iSlot = _BT_keyStoreLookup(iPage, pBDAddr, NULL);
+    if(iSlot >= 0)
+    {
+        if(0 == memcmp(pKey, &_BT_flashRead(iPage)[iSlot *
+                BT_KEYSTORE_REC_LEN + BT_KEYSTORE_KEY_OFF], BT_LINK_KEY_LEN))
+        {
+            return TRUE;
+        }
+        _BT_keyStoreKill(iPage, iSlot);
+    }
+
+    _BT_keyStoreLookup(iPage, pBDAddr, &iFree);
+    if(iFree < 0)
+    {
+        /*No never written slot left, reclaim the deleted ones*/
+        iPage = _BT_keyStoreMove(iPage, TRUE);
+        if(iPage < 0)
+        {
+            DBG_ERROR("Link-key store compaction failed.\n");
+            return FALSE;
+        }
+        _BT_keyStoreLookup(iPage, pBDAddr, &iFree);
+        if(iFree < 0)
+        {
+            /*Every slot holds a live key: start over*/
+            DBG_ERROR("Link-key store full, erasing it.\n");
+            iPage = _BT_keyStoreMove(iPage, FALSE);
+            if(iPage < 0)
+            {
+                return FALSE;
+            }
+            iFree = _BT_keyStoreHash(pBDAddr);
+        }
+    }
+
+    memcpy(&aRec[BT_KEYSTORE_KEY_OFF], pKey, BT_LINK_KEY_LEN);
+    memcpy(&aRec[BT_KEYSTORE_ADDR_OFF], pBDAddr, 6);
+    aRec[BT_KEYSTORE_TYPE_OFF] = bKeyType;
+    aRec[BT_KEYSTORE_STATE_OFF] = BT_KEYSTORE_VALID;
+
+    return _BT_keyStoreWrite(iPage, iFree, aRec);
+}
+
+BOOL BT_keyStoreDelete(const BYTE *pBDAddr)
+{
+    INT iPage = _BT_keyStoreCurrent();
+    INT iSlot;
+
+    if(iPage < 0)
+    {
+        return FALSE;
+    }
+    iSlot = _BT_keyStoreLookup(iPage, pBDAddr, NULL);
+    if(iSlot < 0)
+    {
+        return FALSE;
+    }
+    return _BT_keyStoreKill(iPage, iSlot);
+}
+
+#endif /*BT_KEYSTORE_ENABLE*/
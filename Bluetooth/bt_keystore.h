@@ -0,0 +1,80 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#ifndef __BT_KEYSTORE__
+#define __BT_KEYSTORE__
+
+#include "GenericTypeDefs.h"
+
+/*
+ * Link-key store: an open addressed hash table (indexed by BD_ADDR) kept in
+ * a program flash page, so the paired devices survive resets and re-plugs.
+ * Two pages take turns: compaction copies the live keys to the other page
+ * and only then makes it the current one, a power loss on the way leaves
+ * the old page in use.
+ */
+
+#define BT_LINK_KEY_LEN 16
+
+/*Flash pages holding the store (PIC32MX1xx/2xx erase page)*/
+#define BT_KEYSTORE_PAGE_SIZE 1024
+#define BT_KEYSTORE_PAGES 2
+#define BT_KEYSTORE_SLOTS 16
+
+/*
+ * Last word of a page: its sequence number, written once the page is
+ * complete. The page with the highest one is the current store.
+ */
+#define BT_KEYSTORE_SEQ_OFF (BT_KEYSTORE_PAGE_SIZE - 4)
+#define BT_KEYSTORE_NO_SEQ 0xFFFFFFFF
+
+/*Slot layout (6 words): key, BD_ADDR, key type and slot state*/
+#define BT_KEYSTORE_REC_LEN 24
+#define BT_KEYSTORE_KEY_OFF 0
+#define BT_KEYSTORE_ADDR_OFF 16
+#define BT_KEYSTORE_TYPE_OFF 22
+#define BT_KEYSTORE_STATE_OFF 23
+
+/*Slot states (erased flash reads 0xFF, a state is only ever cleared)*/
+#define BT_KEYSTORE_FREE 0xFF
+#define BT_KEYSTORE_VALID 0x5A
+#define BT_KEYSTORE_DELETED 0x00
+
+/*
+ * Built with BT_KEYSTORE_ENABLE only (two flash pages): without it no key
+ * is ever found nor kept, every connection pairs with the PIN again.
+ */
+#ifdef BT_KEYSTORE_ENABLE
+
+/*Find the key of a device, FALSE if it has never been paired*/
+BOOL BT_keyStoreFind(const BYTE *pBDAddr, BYTE *pKey);
+
+/*Store (or replace) the key of a device*/
+BOOL BT_keyStorePut(const BYTE *pBDAddr, const BYTE *pKey, BYTE bKeyType);
+
+/*Forget a device*/
+BOOL BT_keyStoreDelete(const BYTE *pBDAddr);
+
+#else
+
+#define BT_keyStoreFind(pBDAddr, pKey) FALSE
+#define BT_keyStorePut(pBDAddr, pKey, bKeyType) TRUE
+#define BT_keyStoreDelete(pBDAddr) FALSE
+
+#endif /*BT_KEYSTORE_ENABLE*/
+
+#endif /*BT_KEYSTORE*/
@@ -0,0 +1,241 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#include <string.h>
+#include "GenericTypeDefs.h"
+#include "bt_common.h"
+#include "bt_snoop.h"
+#include "bt_utils.h"
+#include "debug.h"
+
+#ifdef BT_SNOOP_ENABLE
+
+/*
+ * Capture ring (records are contiguous modulo the ring size) and the
+ * export state, one per stack instance. Everything runs from the main
+ * loop, no locking needed.
+ */
+
+BOOL BT_snoopCreate(void)
+{
+    BT_SNOOP *psSnoop;
+
+    ASSERT(NULL != gpsBTStack);
+    psSnoop = (BT_SNOOP *) BT_malloc(sizeof(BT_SNOOP));
+    gpsBTStack->psSnoop = psSnoop;
+    if(NULL == psSnoop)
+    {
+        /*Nothing is captured, the stack runs without*/
+        return FALSE;
+    }
+    psSnoop->uHead = 0;
+    psSnoop->uTail = 0;
+    psSnoop->uUsed = 0;
+    psSnoop->dwDrops = 0;
+    psSnoop->dwWraps = 0;
+    psSnoop->dwLastTicks = 0;
+    psSnoop->isExporting = FALSE;
+    psSnoop->uOutLen = 0;
+    psSnoop->uOutPos = 0;
+    return TRUE;
+}
+
+BOOL BT_snoopDestroy(void)
+{
+    ASSERT(NULL != gpsBTStack);
+    if(NULL != gpsBTStack->psSnoop)
+    {
+        BT_free(gpsBTStack->psSnoop);
+        gpsBTStack->psSnoop = NULL;
+    }
+    return TRUE;
+}
+
+static BT_SNOOP* _BT_snoopOf(BT_STACK *psStack)
+{
+    return (NULL != psStack) ? psStack->psSnoop : NULL;
+}
+
+static void _BT_snoopWrite(BT_SNOOP *psSnoop, const BYTE *pData, UINT uLen)
+{
+    UINT uFirst = BT_SNOOP_RING_SIZE - psSnoop->uHead;
+
+    if(uFirst > uLen)
+    {
+        uFirst = uLen;
+    }
+    memcpy(&psSnoop->aRing[psSnoop->uHead], pData, uFirst);
+    memcpy(psSnoop->aRing, &pData[uFirst], uLen - uFirst);
+    psSnoop->uHead = (psSnoop->uHead + uLen) % BT_SNOOP_RING_SIZE;
+    psSnoop->uUsed += uLen;
+}
+
+static void _BT_snoopRead(BT_SNOOP *psSnoop, BYTE *pData, UINT uLen)
+{
+    UINT uFirst = BT_SNOOP_RING_SIZE - psSnoop->uTail;
+
+    if(uFirst > uLen)
+    {
+        uFirst = uLen;
+    }
+    memcpy(pData, &psSnoop->aRing[psSnoop->uTail], uFirst);
+    memcpy(&pData[uFirst], psSnoop->aRing, uLen - uFirst);
+    psSnoop->uTail = (psSnoop->uTail + uLen) % BT_SNOOP_RING_SIZE;
+    psSnoop->uUsed -= uLen;
+}
+
+/*Forget the oldest record*/
+static void _BT_snoopDrop(BT_SNOOP *psSnoop)
+{
+    UINT uLen = psSnoop->aRing[(psSnoop->uTail + 1) % BT_SNOOP_RING_SIZE];
+
+    uLen += BT_SNOOP_REC_HDR_LEN;
+    psSnoop->uTail = (psSnoop->uTail + uLen) % BT_SNOOP_RING_SIZE;
+    psSnoop->uUsed -= uLen;
+    ++psSnoop->dwDrops;
+}
+
+void BT_snoopRecord(BYTE bType, BOOL isReceived, const BYTE *pData,
+        UINT uLen, UINT uOrigLen)
+{
+    BT_SNOOP *psSnoop = (NULL != gpsBTStack) ? gpsBTStack->psSnoop : NULL;
+    BYTE aHdr[BT_SNOOP_REC_HDR_LEN];
+    DWORD dwTicks = BT_getTicks();
+
+    if(NULL == psSnoop || NULL == pData)
+    {
+        return;
+    }
+    if(uLen > BT_SNOOP_SNAPLEN)
+    {
+        uLen = BT_SNOOP_SNAPLEN;
+    }
+    if(dwTicks < psSnoop->dwLastTicks)
+    {
+        ++psSnoop->dwWraps;
+    }
+    psSnoop->dwLastTicks = dwTicks;
+
+    while(psSnoop->uUsed + BT_SNOOP_REC_HDR_LEN + uLen > BT_SNOOP_RING_SIZE)
+    {
+        _BT_snoopDrop(psSnoop);
+    }
+
+    aHdr[0] = (bType & BT_SNOOP_TYPE_MASK) |
+            (isReceived ? BT_SNOOP_RECEIVED : 0) |
+            (BYTE) (psSnoop->dwWraps << BT_SNOOP_EPOCH_SHIFT);
+    aHdr[1] = (BYTE) uLen;
+    BT_storeLE16(uOrigLen, aHdr, 2);
+    BT_storeLE32(dwTicks, aHdr, 4);
+    _BT_snoopWrite(psSnoop, aHdr, BT_SNOOP_REC_HDR_LEN);
+    _BT_snoopWrite(psSnoop, pData, uLen);
+}
+
+/*Move the oldest record to the output buffer as a btsnoop record*/
+static BOOL _BT_snoopStage(BT_SNOOP *psSnoop)
+{
+    BYTE aHdr[BT_SNOOP_REC_HDR_LEN];
+    BYTE *pOut = psSnoop->aOut;
+    UINT uLen;
+    UINT64 qwUs;
+    DWORD dwWraps;
+    DWORD dwFlags;
+
+    if(0 == psSnoop->uUsed)
+    {
+        return FALSE;
+    }
+    _BT_snoopRead(psSnoop, aHdr, BT_SNOOP_REC_HDR_LEN);
+    uLen = aHdr[1];
+
+    /*Lengths count the H4 packet indicator too*/
+    BT_storeBE32(BT_readLE16(aHdr, 2) + 1, pOut, 0);
+    BT_storeBE32(uLen + 1, pOut, 4);
+    dwFlags = (aHdr[0] & BT_SNOOP_RECEIVED) ? BT_SNOOP_FLAG_RECEIVED : 0;
+    if(BT_SNOOP_ACL != (aHdr[0] & BT_SNOOP_TYPE_MASK))
+    {
+        dwFlags |= BT_SNOOP_FLAG_CMD_EVT;
+    }
+    BT_storeBE32(dwFlags, pOut, 8);
+    BT_storeBE32(psSnoop->dwDrops, pOut, 12);
+
+    /*Rebuild the 64 bit tick count from the epoch of the record*/
+    dwWraps = psSnoop->dwWraps - ((psSnoop->dwWraps -
+            (aHdr[0] >> BT_SNOOP_EPOCH_SHIFT)) & 0x0F);
+    qwUs = (((UINT64) dwWraps << 32) | (aHdr[4] | (aHdr[5] << 8) |
+            (aHdr[6] << 16) | ((DWORD) aHdr[7] << 24))) /
+            (GetSystemClock() / 2000000UL);
+    qwUs += BT_SNOOP_EPOCH_US;
+    BT_storeBE32((DWORD) (qwUs >> 32), pOut, 16);
+    BT_storeBE32((DWORD) qwUs, pOut, 20);
+
+    pOut[BT_SNOOP_PKT_HDR_LEN] = aHdr[0] & BT_SNOOP_TYPE_MASK;
+    _BT_snoopRead(psSnoop, &pOut[BT_SNOOP_PKT_HDR_LEN + 1], uLen);
+
+    psSnoop->uOutLen = BT_SNOOP_PKT_HDR_LEN + 1 + uLen;
+    psSnoop->uOutPos = 0;
+    return TRUE;
+}
+
+void BT_snoopExportStart(BT_STACK *psStack)
+{
+    BT_SNOOP *psSnoop = _BT_snoopOf(psStack);
+
+    if(NULL == psSnoop)
+    {
+        return;
+    }
+    memcpy(psSnoop->aOut, "btsnoop", 8);
+    BT_storeBE32(BT_SNOOP_VERSION, psSnoop->aOut, 8);
+    BT_storeBE32(BT_SNOOP_DATALINK_H4, psSnoop->aOut, 12);
+    psSnoop->uOutLen = BT_SNOOP_FILE_HDR_LEN;
+    psSnoop->uOutPos = 0;
+    psSnoop->isExporting = TRUE;
+}
+
+UINT BT_snoopExport(BT_STACK *psStack, BYTE *pBuff, UINT uMax)
+{
+    BT_SNOOP *psSnoop = _BT_snoopOf(psStack);
+    UINT uCount = 0;
+
+    while(NULL != psSnoop && psSnoop->isExporting && uCount < uMax)
+    {
+        if(psSnoop->uOutPos == psSnoop->uOutLen && !_BT_snoopStage(psSnoop))
+        {
+            break;
+        }
+        pBuff[uCount++] = psSnoop->aOut[psSnoop->uOutPos++];
+    }
+    return uCount;
+}
+
+BOOL BT_snoopExportPending(BT_STACK *psStack)
+{
+    BT_SNOOP *psSnoop = _BT_snoopOf(psStack);
+
+    return NULL != psSnoop && psSnoop->isExporting &&
+            (psSnoop->uOutPos != psSnoop->uOutLen || 0 != psSnoop->uUsed);
+}
+
+DWORD BT_snoopGetDrops(BT_STACK *psStack)
+{
+    BT_SNOOP *psSnoop = _BT_snoopOf(psStack);
+
+    return (NULL != psSnoop) ? psSnoop->dwDrops : 0;
+}
+
+#endif /*BT_SNOOP_ENABLE*/
@@ -0,0 +1,123 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#ifndef __BT_SNOOP__
+#define __BT_SNOOP__
+
+#include "GenericTypeDefs.h"
+#include "bt_common.h"
+
+/*
+ * HCI capture ring: every command, event and ACL packet crossing the HCI
+ * is kept as a compact record (header and the first bytes of the packet),
+ * the oldest records are overwritten when the ring is full. Capturing is
+ * a copy only, the btsnoop framing is built while exporting.
+ */
+
+/*A record takes up to REC_HDR_LEN + SNAPLEN bytes: about 16 of them*/
+#ifndef BT_SNOOP_RING_SIZE
+#define BT_SNOOP_RING_SIZE 512
+#endif
+/*Bytes kept of each packet (HCI, L2CAP and RFCOMM headers)*/
+#ifndef BT_SNOOP_SNAPLEN
+#define BT_SNOOP_SNAPLEN 24
+#endif
+
+/*Packet types, as the H4 packet indicators*/
+#define BT_SNOOP_CMD 0x01
+#define BT_SNOOP_ACL 0x02
+#define BT_SNOOP_EVT 0x04
+
+/*Ring record header: flags, kept length, length (LE) and ticks (LE)*/
+#define BT_SNOOP_REC_HDR_LEN 8
+#define BT_SNOOP_TYPE_MASK 0x07
+#define BT_SNOOP_RECEIVED 0x08
+/*Core timer wraps (mod 16) in the upper flag bits*/
+#define BT_SNOOP_EPOCH_SHIFT 4
+
+/*btsnoop file: header, version 1, H4 datalink and record layout*/
+#define BT_SNOOP_FILE_HDR_LEN 16
+#define BT_SNOOP_VERSION 1
+#define BT_SNOOP_DATALINK_H4 1002
+#define BT_SNOOP_PKT_HDR_LEN 24
+#define BT_SNOOP_FLAG_RECEIVED 0x01
+#define BT_SNOOP_FLAG_CMD_EVT 0x02
+/*Microseconds from year 0 to 1970 (the capture counts from power-on)*/
+#define BT_SNOOP_EPOCH_US 0x00DCDDB30F2F8000ULL
+
+/*Capture ring and export state of a stack instance*/
+typedef struct _BT_SNOOP
+{
+    BYTE aRing[BT_SNOOP_RING_SIZE];
+    UINT uHead;
+    UINT uTail;
+    UINT uUsed;
+    DWORD dwDrops;
+    /*Core timer extension: a wrap is only seen if packets flow every 214 s*/
+    DWORD dwWraps;
+    DWORD dwLastTicks;
+
+    BOOL isExporting;
+    BYTE aOut[BT_SNOOP_PKT_HDR_LEN + 1 + BT_SNOOP_SNAPLEN];
+    UINT uOutLen;
+    UINT uOutPos;
+} BT_SNOOP;
+
+/*
+ * Built with BT_SNOOP_ENABLE only (a ring per stack instance in the heap):
+ * without it nothing is captured and the export stream is always empty.
+ */
+#ifdef BT_SNOOP_ENABLE
+
+/*Capture of the selected instance (FALSE: no room, nothing is captured)*/
+BOOL BT_snoopCreate(void);
+BOOL BT_snoopDestroy(void);
+
+/*Capture a packet, uOrigLen is its full length (uLen bytes are there)*/
+void BT_snoopRecord(BYTE bType, BOOL isReceived, const BYTE *pData,
+        UINT uLen, UINT uOrigLen);
+
+/*
+ * Export of the capture of an instance, out of the stack calls (no
+ * instance needs to be selected).
+ */
+
+/*Start a btsnoop stream: file header, then the ring content and on*/
+void BT_snoopExportStart(BT_STACK *psStack);
+
+/*Next bytes of the stream (0 when there is nothing to send right now)*/
+UINT BT_snoopExport(BT_STACK *psStack, BYTE *pBuff, UINT uMax);
+
+/*Bytes of the stream are waiting to be exported*/
+BOOL BT_snoopExportPending(BT_STACK *psStack);
+
+/*Records lost since the instance was created (overwritten unexported)*/
+DWORD BT_snoopGetDrops(BT_STACK *psStack);
+
+#else
+
+#define BT_snoopCreate() TRUE
+#define BT_snoopDestroy() TRUE
+#define BT_snoopRecord(bType, isReceived, pData, uLen, uOrigLen)
+#define BT_snoopExportStart(psStack)
+#define BT_snoopExport(psStack, pBuff, uMax) 0
+#define BT_snoopExportPending(psStack) FALSE
+#define BT_snoopGetDrops(psStack) 0
+
+#endif /*BT_SNOOP_ENABLE*/
+
+#endif /*BT_SNOOP*/
@@ -0,0 +1,255 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#include "GenericTypeDefs.h"
+#include "bt_common.h"
+#include "bt_timer.h"
+#include "bt_utils.h"
+#include "debug.h"
+
+/*
+ * Wheel slots (lists linked through the timers), the expired timers
+ * waiting to run and the wheel time: gdwTimerNow ticks have been
+ * processed, the last one at the core timer value gdwTimerLast.
+ * Everything runs from the main loop, no locking needed.
+ */
+
+static BT_TIMER *gapTimerWheel[BT_TIMER_LEVELS][BT_TIMER_SLOTS];
+static BT_TIMER *gpTimerDue = NULL;
+static DWORD gdwTimerNow = 0;
+static DWORD gdwTimerLast = 0;
+/*Timers armed (in the wheel or due)*/
+static UINT guTimerArmed = 0;
+
+static void _BT_timerPush(BT_TIMER **ppHead, BT_TIMER *psTimer)
+{
+    psTimer->pNext = *ppHead;
+    if(NULL != psTimer->pNext)
+    {
+        psTimer->pNext->ppPrev = &psTimer->pNext;
+    }
+    *ppHead = psTimer;
+    psTimer->ppPrev = ppHead;
+}
+
+static void _BT_timerUnlink(BT_TIMER *psTimer)
+{
+    *psTimer->ppPrev = psTimer->pNext;
+    if(NULL != psTimer->pNext)
+    {
+        psTimer->pNext->ppPrev = psTimer->ppPrev;
+    }
+    psTimer->pNext = NULL;
+    psTimer->ppPrev = NULL;
+}
+
+/*Level 0 holds the next BT_TIMER_SLOTS ticks, each level above a turn more*/
+static void _BT_timerLink(BT_TIMER *psTimer)
+{
+    DWORD dwDelta = psTimer->dwExpiry - gdwTimerNow;
+    UINT uLevel = 0, uShift = 0;
+
+    while(uLevel < BT_TIMER_LEVELS - 1 &&
+          dwDelta >= (1UL << (uShift + BT_TIMER_SLOT_BITS)))
+    {
+        ++uLevel;
+        uShift += BT_TIMER_SLOT_BITS;
+    }
+    _BT_timerPush(&gapTimerWheel[uLevel]
+            [(psTimer->dwExpiry >> uShift) & BT_TIMER_SLOT_MASK], psTimer);
+}
+
+/*Spread a slot of an upper level over the levels below*/
+static void _BT_timerCascade(BT_TIMER **ppHead)
+{
+    BT_TIMER *psTimer, *psList = *ppHead;
+
+    *ppHead = NULL;
+    while(NULL != (psTimer = psList))
+    {
+        psList = psTimer->pNext;
+        _BT_timerLink(psTimer);
+    }
+}
+
+/*Advance one tick, the timers of the new level 0 slot are due*/
+static void _BT_timerTick(void)
+{
+    BT_TIMER *psTimer, *psList;
+    BT_TIMER **ppSlot;
+    UINT uLevel, uShift;
+
+    ++gdwTimerNow;
+    /*An upper slot is reached once the level below has turned*/
+    for(uLevel = 1, uShift = BT_TIMER_SLOT_BITS; uLevel < BT_TIMER_LEVELS;
+        ++uLevel, uShift += BT_TIMER_SLOT_BITS)
+    {
+        if(gdwTimerNow & ((1UL << uShift) - 1))
+        {
+            break;
+        }
+        _BT_timerCascade(&gapTimerWheel[uLevel]
+                [(gdwTimerNow >> uShift) & BT_TIMER_SLOT_MASK]);
+    }
+
+    ppSlot = &gapTimerWheel[0][gdwTimerNow & BT_TIMER_SLOT_MASK];
+    psList = *ppSlot;
+    *ppSlot = NULL;
+    while(NULL != (psTimer = psList))
+    {
+        psList = psTimer->pNext;
+        _BT_timerPush(&gpTimerDue, psTimer);
+    }
+}
+
+void BT_timerInit(BT_TIMER *psTimer, void (*pfnExpired)(void*),
+        void *pContext)
+{
+    ASSERT(NULL != psTimer);
+
+    psTimer->pNext = NULL;
+    psTimer->ppPrev = NULL;
+    psTimer->dwExpiry = 0;
+    psTimer->pfnExpired = pfnExpired;
+    psTimer->pContext = pContext;
+    psTimer->psStack = NULL;
+}
+
+void BT_timerStart(BT_TIMER *psTimer, DWORD dwMs)
+{
+    DWORD dwDelta;
+
+    ASSERT(NULL != psTimer);
+    ASSERT(NULL != psTimer->pfnExpired);
+
+    BT_timerStop(psTimer);
+    psTimer->psStack = gpsBTStack;
+    ++guTimerArmed;
+
+    /*Deferred work*/
+    if(0 == dwMs)
+    {
+        _BT_timerPush(&gpTimerDue, psTimer);
+        return;
+    }
+
+    /*
+     * One tick more for the part of the current one already gone, the
+     * ticks the wheel has not processed yet count too
+     */
+    if(dwMs > BT_TIMER_MAX_TICKS * BT_TIMER_TICK_MS)
+    {
+        dwMs = BT_TIMER_MAX_TICKS * BT_TIMER_TICK_MS;
+    }
+    dwDelta = (dwMs + BT_TIMER_TICK_MS - 1) / BT_TIMER_TICK_MS + 1;
+    dwDelta += (BT_getTicks() - gdwTimerLast) /
+            BT_usToTicks(BT_TIMER_TICK_MS * 1000UL);
+    if(dwDelta > BT_TIMER_MAX_TICKS)
+    {
+        dwDelta = BT_TIMER_MAX_TICKS;
+    }
+    psTimer->dwExpiry = gdwTimerNow + dwDelta;
+    _BT_timerLink(psTimer);
+}
+
+void BT_timerStop(BT_TIMER *psTimer)
+{
+    ASSERT(NULL != psTimer);
+
+    if(NULL != psTimer->ppPrev)
+    {
+        _BT_timerUnlink(psTimer);
+        --guTimerArmed;
+    }
+}
+
+BOOL BT_timerIsArmed(const BT_TIMER *psTimer)
+{
+    return (NULL != psTimer->ppPrev);
+}
+
+void BT_timerRun(void)
+{
+    BT_STACK *psSelected = gpsBTStack;
+    BT_TIMER *psTimer, *psDue;
+    DWORD dwTickLen = BT_usToTicks(BT_TIMER_TICK_MS * 1000UL);
+    DWORD dwElapsed;
+
+    dwElapsed = (BT_getTicks() - gdwTimerLast) / dwTickLen;
+    /*Nothing armed: just catch up with the core timer*/
+    if(0 == guTimerArmed)
+    {
+        gdwTimerNow += dwElapsed;
+        gdwTimerLast += dwElapsed * dwTickLen;
+        return;
+    }
+    for(; dwElapsed > 0; --dwElapsed)
+    {
+        gdwTimerLast += dwTickLen;
+        _BT_timerTick();
+    }
+
+    /*Timers started from the callbacks wait for the next run*/
+    psDue = gpTimerDue;
+    gpTimerDue = NULL;
+    if(NULL != psDue)
+    {
+        psDue->ppPrev = &psDue;
+    }
+    while(NULL != (psTimer = psDue))
+    {
+        BT_timerStop(psTimer);
+        BT_stackSelect(psTimer->psStack);
+        psTimer->pfnExpired(psTimer->pContext);
+    }
+    BT_stackSelect(psSelected);
+}
+
+DWORD BT_timerNextMs(void)
+{
+    BT_TIMER *psTimer;
+    DWORD dwNext = BT_TIMER_NONE, dwElapsed;
+    UINT uLevel, uSlot;
+
+    if(NULL != gpTimerDue)
+    {
+        return 0;
+    }
+    if(0 == guTimerArmed)
+    {
+        return BT_TIMER_NONE;
+    }
+    for(uLevel = 0; uLevel < BT_TIMER_LEVELS; ++uLevel)
+    {
+        for(uSlot = 0; uSlot < BT_TIMER_SLOTS; ++uSlot)
+        {
+            for(psTimer = gapTimerWheel[uLevel][uSlot]; NULL != psTimer;
+                psTimer = psTimer->pNext)
+            {
+                if(psTimer->dwExpiry - gdwTimerNow < dwNext)
+                {
+                    dwNext = psTimer->dwExpiry - gdwTimerNow;
+                }
+            }
+        }
+    }
+
+    /*Part of the next tick may be gone already*/
+    dwNext *= BT_TIMER_TICK_MS;
+    dwElapsed = BT_ticksToUs(BT_getTicks() - gdwTimerLast) / 1000;
+    return (dwNext > dwElapsed) ? (dwNext - dwElapsed) : 0;
+}
@@ -0,0 +1,72 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#ifndef __BT_TIMER__
+#define __BT_TIMER__
+
+#include "GenericTypeDefs.h"
+
+/*
+ * Protocol timers: a hierarchical timing wheel on the core timer, run to
+ * completion from the main loop (BT_timerRun). The first level turns one
+ * slot every tick, a slot of an upper level spans a whole turn of the
+ * level below and is spread over it when reached. Starting and stopping
+ * a timer is constant time, a timer lives in its owner (no allocation).
+ * A timer started with 0 ms is deferred work: it runs on the next
+ * BT_timerRun. Expired timers run on the stack instance they were
+ * started on.
+ */
+
+#define BT_TIMER_TICK_MS 10
+#ifndef BT_TIMER_SLOT_BITS
+#define BT_TIMER_SLOT_BITS 4
+#endif
+#ifndef BT_TIMER_LEVELS
+#define BT_TIMER_LEVELS 4
+#endif
+#define BT_TIMER_SLOTS (1 << BT_TIMER_SLOT_BITS)
+#define BT_TIMER_SLOT_MASK (BT_TIMER_SLOTS - 1)
+/*Longest delay (ticks), 16^4 ticks of 10 ms (655 s) by default*/
+#define BT_TIMER_MAX_TICKS ((1UL << (BT_TIMER_SLOT_BITS * BT_TIMER_LEVELS)) - 1)
+/*No timer armed (BT_timerNextMs)*/
+#define BT_TIMER_NONE 0xFFFFFFFFUL
+
+typedef struct _BT_TIMER
+{
+    struct _BT_TIMER *pNext;
+    /*Link pointing to this timer (NULL when not armed)*/
+    struct _BT_TIMER **ppPrev;
+    /*Wheel tick it expires at*/
+    DWORD dwExpiry;
+    void (*pfnExpired)(void*);
+    void *pContext;
+    struct _BT_STACK *psStack;
+} BT_TIMER;
+
+void BT_timerInit(BT_TIMER *psTimer, void (*pfnExpired)(void*),
+        void *pContext);
+/*(Re)start on the selected stack instance*/
+void BT_timerStart(BT_TIMER *psTimer, DWORD dwMs);
+void BT_timerStop(BT_TIMER *psTimer);
+BOOL BT_timerIsArmed(const BT_TIMER *psTimer);
+
+/*Advance the wheel to the core timer and run the expired timers*/
+void BT_timerRun(void);
+/*Milliseconds until the next timer expires (BT_TIMER_NONE if none)*/
+DWORD BT_timerNextMs(void);
+
+#endif /*__BT_TIMER__*/
@@ -15,7 +15,10 @@
  */
 
 #include <stdlib.h>
+#include <sys/types.h>
 #include "GenericTypeDefs.h"
+#include "bt_common.h"
+#include "bt_utils.h"
 #include "debug.h"
 
 void* BT_malloc(size_t uSize)
@@ -32,6 +35,64 @@ void BT_free(void* pData)
     free(pData);
 }
 
+/*Heap break (sbrk.c), it never moves down*/
+caddr_t sbrk(int nbytes);
+
+UINT BT_heapHighWater(void)
+{
+    extern int _end;
+
+    return (UINT) ((BYTE *) sbrk(0) - (BYTE *) &_end);
+}
+
+/*
+ * Stack instances
+ */
+
+BT_STACK *gpsBTStack = NULL;
+static UINT guBTStacks = 0;
+
+BT_STACK* BT_stackCreate()
+{
+    BT_STACK *psStack = (BT_STACK *) BT_malloc(sizeof(BT_STACK));
+
+    if(NULL == psStack)
+    {
+        return NULL;
+    }
+    psStack->uIndex = guBTStacks++;
+    psStack->psHCIUSBCB = NULL;
+    psStack->psHCIH4CB = NULL;
+    psStack->psHCICB = NULL;
+    psStack->psL2CAPCB = NULL;
+    psStack->psSDPCB = NULL;
+    psStack->psRFCOMMCB = NULL;
+    psStack->psSnoop = NULL;
+    psStack->pOwner = NULL;
+    gpsBTStack = psStack;
+    return psStack;
+}
+
+/*The layers of the instance are destroyed already*/
+BOOL BT_stackDestroy(BT_STACK *psStack)
+{
+    if(NULL == psStack)
+    {
+        return FALSE;
+    }
+    if(gpsBTStack == psStack)
+    {
+        gpsBTStack = NULL;
+    }
+    BT_free(psStack);
+    return TRUE;
+}
+
+void BT_stackSelect(BT_STACK *psStack)
+{
+    gpsBTStack = psStack;
+}
+
 /*Read (little-endian) 16bits*/
 WORD BT_readLE16(const BYTE *pData, UINT uOffset)
 {
@@ -145,3 +206,138 @@ BOOL BT_isEqualBD_ADDR(const BYTE *pBD_ADDR1, const BYTE *pBD_ADDR2)
     }
     return TRUE;
 }
+
+DWORD BT_getTicks(void)
+{
+    /*The PIC32 core timer runs at half the system clock*/
+    return ReadCoreTimer();
+}
+
+DWORD BT_ticksToUs(DWORD dwTicks)
+{
+    return dwTicks / (GetSystemClock() / 2000000UL);
+}
+
+DWORD BT_usToTicks(DWORD dwUs)
+{
+    return dwUs * (GetSystemClock() / 2000000UL);
+}
+
+/*
+ * Profiling
+ */
+
+#ifdef BT_PROFILE_ENABLE
+
+static BT_PROFILE gasBTProfile[BT_NUM_LAYERS];
+static DWORD gadwBTProfStart[BT_PROFILE_DEPTH];
+static DWORD gadwBTProfInner[BT_PROFILE_DEPTH];
+static UINT guBTProfDepth = 0;
+static UINT16 gauBTLatency[BT_LATENCY_BUCKETS];
+
+void BT_profileEnter(void)
+{
+    if(guBTProfDepth < BT_PROFILE_DEPTH)
+    {
+        gadwBTProfStart[guBTProfDepth] = BT_getTicks();
+        gadwBTProfInner[guBTProfDepth] = 0;
+    }
+    ++guBTProfDepth;
+}
+
+void BT_profileLeave(UINT uLayer, UINT uBytes)
+{
+    DWORD dwTicks;
+
+    ASSERT(guBTProfDepth > 0);
+    if(--guBTProfDepth >= BT_PROFILE_DEPTH)
+    {
+        return;
+    }
+    dwTicks = BT_getTicks() - gadwBTProfStart[guBTProfDepth];
+    /*The caller does not pay for this layer*/
+    if(guBTProfDepth > 0)
+    {
+        gadwBTProfInner[guBTProfDepth - 1] += dwTicks;
+    }
+    /*The core timer counts every other CPU cycle*/
+    ++gasBTProfile[uLayer].dwFrames;
+    gasBTProfile[uLayer].dwBytes += uBytes;
+    gasBTProfile[uLayer].dwCycles +=
+            (dwTicks - gadwBTProfInner[guBTProfDepth]) * 2;
+}
+
+const BT_PROFILE* BT_profileGet(UINT uLayer)
+{
+    return (uLayer < BT_NUM_LAYERS) ? &gasBTProfile[uLayer] : NULL;
+}
+
+void BT_latencyAdd(DWORD dwUs)
+{
+    UINT i = 0;
+
+    while(i < BT_LATENCY_BUCKETS - 1 && (dwUs >> (i + 1)) != 0)
+    {
+        ++i;
+    }
+    if(gauBTLatency[i] < 0xFFFF)
+    {
+        ++gauBTLatency[i];
+    }
+}
+
+DWORD BT_latencyPercentile(UINT uPercent)
+{
+    DWORD dwTotal = 0, dwCount = 0;
+    UINT i;
+
+    for(i = 0; i < BT_LATENCY_BUCKETS; ++i)
+    {
+        dwTotal += gauBTLatency[i];
+    }
+    for(i = 0; i < BT_LATENCY_BUCKETS && dwTotal > 0; ++i)
+    {
+        dwCount += gauBTLatency[i];
+        if(dwCount * 100 >= dwTotal * uPercent)
+        {
+            return 2UL << i;
+        }
+    }
+    return 0;
+}
+
+void BT_profileReset(void)
+{
+    UINT i;
+
+    for(i = 0; i < BT_NUM_LAYERS; ++i)
+    {
+        gasBTProfile[i].dwFrames = 0;
+        gasBTProfile[i].dwBytes = 0;
+        gasBTProfile[i].dwCycles = 0;
+    }
+    for(i = 0; i < BT_LATENCY_BUCKETS; ++i)
+    {
+        gauBTLatency[i] = 0;
+    }
+}
+
+void BT_profileReport(void)
+{
+    static const CHAR *asLayer[BT_NUM_LAYERS] =
+            {"HCI", "L2CAP", "RFCOMM", "SDP"};
+    UINT i;
+
+    for(i = 0; i < BT_NUM_LAYERS; ++i)
+    {
+        DBG_INFO("BT profile %s: %lu frames, %lu B, %lu cycles/B\n",
+                asLayer[i], gasBTProfile[i].dwFrames,
+                gasBTProfile[i].dwBytes, gasBTProfile[i].dwBytes ?
+                    gasBTProfile[i].dwCycles / gasBTProfile[i].dwBytes : 0);
+    }
+    DBG_INFO("BT profile ACL latency: p50 < %lu us, p90 < %lu us,"
+            " p99 < %lu us\n", BT_latencyPercentile(50),
+            BT_latencyPercentile(90), BT_latencyPercentile(99));
+}
+
+#endif /*BT_PROFILE_ENABLE*/
@@ -25,6 +25,9 @@ void BT_free(void* pData);
 #define BT_MALLOC(X)    BT_malloc(X);
 #define BT_FREE(X)       BT_free(X);
 
+/*Heap high-water mark (bytes)*/
+UINT BT_heapHighWater(void);
+
 /*Read (little-endian 16bits*/
 WORD BT_readLE16(const BYTE *pData, UINT uOffset);
 
@@ -51,4 +54,57 @@ BOOL store_STR(const char *str, int str_size, BYTE *pData, UINT uOffset);
 
 BOOL BT_isEqualBD_ADDR(const BYTE *pBD_ADDR1, const BYTE *pBD_ADDR2);
 
+/*Free running time base (core timer ticks, counting since power-on)*/
+DWORD BT_getTicks(void);
+
+/*Convert a tick interval to microseconds*/
+DWORD BT_ticksToUs(DWORD dwTicks);
+
+/*Convert microseconds to a tick interval*/
+DWORD BT_usToTicks(DWORD dwUs);
+
+/*
+ * Profiling: the layer entry points count frames, bytes and the CPU
+ * cycles spent in the layer itself (the layers they call are excluded),
+ * the HCI adds the time the controller took to complete each ACL frame.
+ * Built with BT_PROFILE_ENABLE only, without it the calls are empty.
+ */
+#define BT_LAYER_HCI 0
+#define BT_LAYER_L2CAP 1
+#define BT_LAYER_RFCOMM 2
+#define BT_LAYER_SDP 3
+#define BT_NUM_LAYERS 4
+/*Layer calls nesting depth followed*/
+#define BT_PROFILE_DEPTH 6
+/*Latency histogram: bucket i counts latencies below 2^(i+1) us*/
+#define BT_LATENCY_BUCKETS 20
+
+typedef struct _BT_PROFILE
+{
+    DWORD dwFrames;
+    DWORD dwBytes;
+    DWORD dwCycles;
+} BT_PROFILE;
+
+#ifdef BT_PROFILE_ENABLE
+
+void BT_profileEnter(void);
+void BT_profileLeave(UINT uLayer, UINT uBytes);
+const BT_PROFILE* BT_profileGet(UINT uLayer);
+void BT_latencyAdd(DWORD dwUs);
+/*Upper bound (us) of the latency under which uPercent of the frames are*/
+DWORD BT_latencyPercentile(UINT uPercent);
+void BT_profileReset(void);
+void BT_profileReport(void);
+
+#else
+
+#define BT_profileEnter()
+#define BT_profileLeave(uLayer, uBytes)
+#define BT_latencyAdd(dwUs)
+#define BT_profileReset()
+#define BT_profileReport()
+
+#endif /*BT_PROFILE_ENABLE*/
+
 #endif /*BT_UTILS*/
@@ -16,8 +16,9 @@
 
 #include "GenericTypeDefs.h"
 #include "hci.h"
-#include "hci_usb.h"
 #include "bt_utils.h"
+#include "bt_keystore.h"
+#include "bt_snoop.h"
 #include "debug.h"
 
 /*
@@ -41,7 +42,8 @@
  * HCI variables
  */
 
-static HCI_CONTROL_BLOCK *gpsHCICB = NULL;
+/*Control block of the selected stack instance*/
+#define gpsHCICB (gpsBTStack->psHCICB)
 
 /*
  * HCI public functions implementation
@@ -51,12 +53,12 @@ BOOL HCI_create()
 {
     HCI_CONFIGURATION_DATA *psConfData;
     HCI_CONNECTION_DATA *psConnData;
+    HCI_PAGE_DATA *psPageData;
     CHAR *pcDefaultName = "PIC32_BTv1";
     CHAR *pcDefaultPIN = "0000";
     UINT i;
     UINT uDefNameLen = 10;
     UINT uDefPINLen = 4;
-    HCIUSB_API sHCIUSB;
 
     /*Allocate the control block memory*/
     gpsHCICB = BT_malloc(sizeof(HCI_CONTROL_BLOCK));
@@ -83,8 +85,33 @@ BOOL HCI_create()
         psConfData->sPinCode[i] = pcDefaultPIN[i];
     }
     
+    /*Advertise the real RX pool, the controller holds whatever exceeds it*/
     psConfData->uHostAclBufferSize = DATA_PACKET_LENGTH - HCI_ACL_HDR_LEN;
-    psConfData->uHostNumAclBuffers = 0; /*Infinite*/
+    psConfData->uHostNumAclBuffers = MAX_ACL_R_BUFF_SIZE;
+    psConfData->bCHFlowControl = FALSE;
+    for(i = 0; i < HCI_FEATURES_LEN; ++i)
+    {
+        psConfData->aLocalFeatures[i] = 0;
+    }
+    psConfData->uCtrlNumAclBuffers = 0; /*Unknown until READ_BUFFER_SIZE*/
+    psConfData->uCtrlAclLen = 0;
+    psConfData->bInitNext = HCI_INIT_STEPS;
+    psConfData->isInitFailed = FALSE;
+    psConfData->dwConnectableUs = 0;
+
+    /*Fast connectable: interlaced 11.25 ms windows every 160 ms*/
+    psConfData->asScanProfile[HCI_SCAN_FAST].uPageInterval = 0x0100;
+    psConfData->asScanProfile[HCI_SCAN_FAST].uPageWindow = 0x0012;
+    psConfData->asScanProfile[HCI_SCAN_FAST].uInqInterval = 0x0100;
+    psConfData->asScanProfile[HCI_SCAN_FAST].uInqWindow = 0x0012;
+    psConfData->asScanProfile[HCI_SCAN_FAST].bInterlaced = TRUE;
+    /*Low duty: the specification defaults (1.28 s and 2.56 s)*/
+    psConfData->asScanProfile[HCI_SCAN_LOW_DUTY].uPageInterval = 0x0800;
+    psConfData->asScanProfile[HCI_SCAN_LOW_DUTY].uPageWindow = 0x0012;
+    psConfData->asScanProfile[HCI_SCAN_LOW_DUTY].uInqInterval = 0x1000;
+    psConfData->asScanProfile[HCI_SCAN_LOW_DUTY].uInqWindow = 0x0012;
+    psConfData->asScanProfile[HCI_SCAN_LOW_DUTY].bInterlaced = FALSE;
+    psConfData->bScanProfile = HCI_SCAN_FAST;
 
     /*Allocate and initialise the connection data*/
     gpsHCICB->psHCIConnData = BT_malloc(sizeof(HCI_CONNECTION_DATA));
@@ -93,13 +120,66 @@ BOOL HCI_create()
     
     psConnData->isConnected = FALSE;
     psConnData->uPacketsToAck = 0;
+    psConnData->uHostPendingAcks = 0;
+    psConnData->bStampHead = 0;
+    psConnData->bStampCount = 0;
     psConnData->uConnHandler = 0;
+    psConnData->bPolicy = HCI_DEFAULT_POLICY;
+    psConnData->bLinkMode = HCI_MODE_ACTIVE;
+    psConnData->isModePending = FALSE;
+    psConnData->uPacketType = HCI_PKT_DM1 | HCI_PKT_DH1;
+
+    /*Allocate and initialise the paging data (no targets)*/
+    gpsHCICB->psHCIPageData = BT_malloc(sizeof(HCI_PAGE_DATA));
+    psPageData = gpsHCICB->psHCIPageData;
+    ASSERT(NULL != psPageData);
+
+    psPageData->bNumTargets = 0;
+    psPageData->bNextTarget = 0;
+    psPageData->bState = HCI_PAGE_IDLE;
+    psPageData->isInquired = FALSE;
+    psPageData->isInquiryDue = FALSE;
+    psPageData->isRoundPause = FALSE;
+    psPageData->isRoundHit = FALSE;
+    for(i = 0; i < HCI_INQ_CACHE_SIZE; ++i)
+    {
+        psPageData->asInqCache[i].isValid = FALSE;
+    }
 
-    /*Initialise the internal API*/
-    HCIUSB_getAPI(&sHCIUSB);
+    /*The transport is installed before the stack starts*/
+    gpsHCICB->PHY_w_ACL = NULL;
+    gpsHCICB->PHY_w_CTL = NULL;
+    gpsHCICB->PHY_tasks = NULL;
+    gpsHCICB->L2CAPtxReady = NULL;
+    gpsHCICB->L2CAPlinkClosed = NULL;
+    gpsHCICB->linkOpen = NULL;
+
+    /*Empty command queue*/
+    gpsHCICB->pCmdHead = NULL;
+    gpsHCICB->pCmdTail = NULL;
+    gpsHCICB->bNumCmdPackets = 1;
+    gpsHCICB->isCtlBusy = FALSE;
+
+    /*No subscribers, only the events handled here*/
+    for(i = 0; i < HCI_MAX_EVT_SUBSCRIBERS; ++i)
+    {
+        gpsHCICB->asEvtSubscriber[i].bEvent = 0;
+        gpsHCICB->asEvtSubscriber[i].putEvent = NULL;
+    }
+    for(i = 0; i < HCI_NUM_EVENTS; ++i)
+    {
+        gpsHCICB->asEvtStats[i].uCount = 0;
+        gpsHCICB->asEvtStats[i].dwCycles = 0;
+    }
+    gpsHCICB->qwEventMask = HCI_EVENT_MASK;
+    gpsHCICB->isEventMaskPending = FALSE;
+    gpsHCICB->uEvtSkip = 0;
 
-    gpsHCICB->PHY_w_ACL = sHCIUSB.USBwriteACL;
-    gpsHCICB->PHY_w_CTL = sHCIUSB.USBwriteCTL;
+    /*Capture of the traffic of this controller (optional, RAM permitting)*/
+    if(!BT_snoopCreate())
+    {
+        DBG_ERROR("HCI: No room for the capture ring\n");
+    }
 
     /*Raise the initialised flag*/
     gpsHCICB->isInitialised = TRUE;
@@ -110,6 +190,7 @@ BOOL HCI_destroy()
 {
     if(NULL != gpsHCICB)
     {
+        _HCI_cmdFlush();
         if(NULL != gpsHCICB->psHCIConfData)
         {
             BT_free(gpsHCICB->psHCIConfData->sLocalName);
@@ -120,8 +201,67 @@ BOOL HCI_destroy()
         {
             BT_free(gpsHCICB->psHCIConnData);
         }
+        if(NULL != gpsHCICB->psHCIPageData)
+        {
+            BT_free(gpsHCICB->psHCIPageData);
+        }
         BT_free(gpsHCICB);
         gpsHCICB = NULL;
+        (void) BT_snoopDestroy();
+    }
+    return TRUE;
+}
+
+/*
+ * The controller is gone: drop the link and the queued commands. The
+ * configuration (name, PIN, scan profiles, page targets and subscribers)
+ * stays, HCI_API_cmdReset brings the next controller up with it.
+ */
+BOOL HCI_reset()
+{
+    HCI_CONNECTION_DATA *psConnData;
+    HCI_PAGE_DATA *psPageData;
+    UINT i;
+
+    if(NULL == gpsHCICB)
+    {
+        return FALSE;
+    }
+    psConnData = gpsHCICB->psHCIConnData;
+    psPageData = gpsHCICB->psHCIPageData;
+
+    _HCI_cmdFlush();
+    gpsHCICB->isCtlBusy = FALSE;
+    gpsHCICB->uEvtSkip = 0;
+    gpsHCICB->psHCIConfData->isConfigured = FALSE;
+    gpsHCICB->psHCIConfData->bInitNext = HCI_INIT_STEPS;
+    gpsHCICB->psHCIConfData->bCHFlowControl = FALSE;
+    gpsHCICB->psHCIConfData->uCtrlNumAclBuffers = 0;
+    gpsHCICB->psHCIConfData->uCtrlAclLen = 0;
+
+    if(psConnData->isConnected)
+    {
+        psConnData->isConnected = FALSE;
+        _HCI_linkClosed();
+    }
+    psConnData->uPacketsToAck = 0;
+    psConnData->uHostPendingAcks = 0;
+    psConnData->bStampCount = 0;
+    psConnData->bLinkMode = HCI_MODE_ACTIVE;
+    psConnData->isModePending = FALSE;
+
+    /*
+     * Paging starts over. The inquiry cache is kept, the devices are where
+     * they were: only the clock offsets were the old controller's.
+     */
+    psPageData->bNextTarget = 0;
+    psPageData->bState = HCI_PAGE_IDLE;
+    psPageData->isInquiryDue = FALSE;
+    psPageData->isRoundPause = FALSE;
+    psPageData->isRoundHit = FALSE;
+    for(i = 0; i < HCI_INQ_CACHE_SIZE; ++i)
+    {
+        psPageData->asInqCache[i].isClockValid = FALSE;
     }
     return TRUE;
 }
@@ -130,18 +270,47 @@ BOOL HCI_getAPI(HCI_API *psAPI)
 {
     ASSERT(NULL != gpsHCICB);
     psAPI->cmdReset = &HCI_API_cmdReset;
+#ifdef BT_PROFILE_ENABLE
+    psAPI->putData = &_HCI_profPutData;
+#else
     psAPI->putData = &HCI_API_putData;
+#endif
     psAPI->putEvent = &HCI_API_putEvent;
+    psAPI->putACLDone = &HCI_API_putACLDone;
+    psAPI->putCMDDone = &HCI_API_putCMDDone;
+    psAPI->tasks = &HCI_API_tasks;
+    psAPI->setPowerPolicy = &HCI_API_setPowerPolicy;
+    psAPI->getPacketType = &HCI_API_getPacketType;
+    psAPI->subscribeEvent = &HCI_API_subscribeEvent;
+    psAPI->getEventStats = &HCI_API_getEventStats;
+    psAPI->setScanProfile = &HCI_API_setScanProfile;
+    psAPI->addPageTarget = &HCI_API_addPageTarget;
+    psAPI->getAclLength = &HCI_API_getAclLength;
+#ifdef BT_PROFILE_ENABLE
+    psAPI->sendData = &_HCI_profSendData;
+#else
     psAPI->sendData = &HCI_API_sendData;
+#endif
     psAPI->setLocalName = &HCI_API_setLocalName;
     psAPI->setPINCode = &HCI_API_setPINCode;
     return TRUE;
 }
 
+BOOL HCI_installTransport(HCI_TRANSPORT_API *psAPI)
+{
+    ASSERT(NULL != gpsHCICB);
+    gpsHCICB->PHY_w_ACL = psAPI->writeACL;
+    gpsHCICB->PHY_w_CTL = psAPI->writeCTL;
+    gpsHCICB->PHY_tasks = psAPI->tasks;
+    return TRUE;
+}
+
 BOOL HCI_installL2CAP(L2CAP_API *psAPI)
 {
     ASSERT(NULL != psAPI);
     gpsHCICB->L2CAPputData = psAPI->putData;
+    gpsHCICB->L2CAPtxReady = psAPI->txReady;
+    gpsHCICB->L2CAPlinkClosed = psAPI->linkClosed;
     return TRUE;
 }
 
@@ -149,6 +318,7 @@ BOOL HCI_installDevCB(DEVICE_API *psAPI)
 {
     ASSERT(NULL != psAPI);
     gpsHCICB->configurationComplete = psAPI->confComplete;
+    gpsHCICB->linkOpen = psAPI->linkOpen;
     return TRUE;
 }
 
@@ -176,413 +346,1518 @@ BOOL _HCI_isConnected()
     return gpsHCICB->psHCIConnData->isConnected;
 }
 
+/*Largest ACL frame (header included) the stack and the controller take*/
 int _HCI_getMaxAclFrameSize()
 {
+    UINT16 uCtrlAclLen = gpsHCICB->psHCIConfData->uCtrlAclLen;
+
+    if(0 != uCtrlAclLen && uCtrlAclLen + HCI_ACL_HDR_LEN < DATA_PACKET_LENGTH)
+    {
+        return uCtrlAclLen + HCI_ACL_HDR_LEN;
+    }
     return DATA_PACKET_LENGTH;
 }
 
-int _HCI_cmd(const BYTE *pData, BYTE bOCF, BYTE bOGF, unsigned uLen)
+int _HCI_cmd(const BYTE *pData, BYTE bOCF, BYTE bOGF, unsigned uLen,
+        void (*cmdDone)(const BYTE*, UINT16, BYTE))
 {
     int i;
-    BYTE aCmdBuffer[uLen];
+    HCI_COMMAND *psCmd;
     UINT16 uCmdCode;
 
+    ASSERT(NULL != gpsHCICB);
+
     /*Get the command code*/
     uCmdCode = bOCF | (bOGF<<10);
 
     /*Validate the input arguments*/
     ASSERT(uLen >= HCI_CMD_HDR_LEN);
 
+    /*The command stays allocated until the controller answers it*/
+    psCmd = (HCI_COMMAND *) BT_malloc(sizeof(HCI_COMMAND) + uLen);
+    if(NULL == psCmd)
+    {
+        DBG_ERROR("HCI: No room for command 0x%04X.\n", uCmdCode);
+        return 0;
+    }
+    psCmd->pNext = NULL;
+    psCmd->uOpcode = uCmdCode;
+    psCmd->uLen = uLen;
+    psCmd->isSent = FALSE;
+    psCmd->cmdDone = cmdDone;
+
     /*Store the command header*/
-    BT_storeLE16(uCmdCode, aCmdBuffer, 0);
-    BT_storeLE16(uLen-HCI_CMD_HDR_LEN, aCmdBuffer, 2);
+    BT_storeLE16(uCmdCode, psCmd->aCmd, 0);
+    psCmd->aCmd[2] = uLen - HCI_CMD_HDR_LEN;
 
     /*Copy the data into the command buffer*/
     for(i=HCI_CMD_HDR_LEN; i<uLen; ++i)
     {
-        aCmdBuffer[i] = pData[i-HCI_CMD_HDR_LEN];
+        psCmd->aCmd[i] = pData[i-HCI_CMD_HDR_LEN];
+    }
+
+    /*Queue the command and send it as soon as the controller allows*/
+    if(NULL == gpsHCICB->pCmdTail)
+    {
+        gpsHCICB->pCmdHead = psCmd;
+    }
+    else
+    {
+        gpsHCICB->pCmdTail->pNext = psCmd;
+    }
+    gpsHCICB->pCmdTail = psCmd;
+
+    _HCI_cmdSend();
+    return uLen;
+}
+
+/*Write the queued commands while the controller has command credits*/
+void _HCI_cmdSend()
+{
+    HCI_COMMAND *psCmd;
+
+    ASSERT(NULL != gpsHCICB);
+
+    /*One control transfer at a time, retried on the control write done*/
+    if(gpsHCICB->isCtlBusy)
+    {
+        return;
+    }
+
+    /*Returning RX buffers to the controller takes no command credit*/
+    if(_HCI_hostNumComplSend())
+    {
+        return;
+    }
+
+    /*Skip the commands already waiting for their completion*/
+    psCmd = gpsHCICB->pCmdHead;
+    while(NULL != psCmd && psCmd->isSent)
+    {
+        psCmd = psCmd->pNext;
+    }
+
+    if(NULL != psCmd && gpsHCICB->bNumCmdPackets > 0)
+    {
+        /*EP0 busy: retried on the next control write done or event*/
+        if(gpsHCICB->PHY_w_CTL(psCmd->aCmd, psCmd->uLen) ==
+                HCI_TRANSPORT_BUSY)
+        {
+            return;
+        }
+        DBG_INFO( "HCI w CMD: ");
+        DBG_DUMP(psCmd->aCmd, psCmd->uLen);
+        BT_snoopRecord(BT_SNOOP_CMD, FALSE, psCmd->aCmd, psCmd->uLen,
+                psCmd->uLen);
+
+        gpsHCICB->isCtlBusy = TRUE;
+        psCmd->isSent = TRUE;
+        --gpsHCICB->bNumCmdPackets;
+    }
+}
+
+/*
+ * Host_Number_Of_Completed_Packets: hand the consumed RX buffers back to
+ * the controller. The pool is a single buffer (MAX_ACL_R_BUFF_SIZE), so
+ * every consumed one is reported straight away, nothing is batched. The
+ * command has no completion event, so it is built in a buffer of its own.
+ */
+BOOL _HCI_hostNumComplSend()
+{
+    HCI_CONNECTION_DATA *psConnData;
+    BYTE *pCmd;
+
+    psConnData = gpsHCICB->psHCIConnData;
+    pCmd = gpsHCICB->aHostNumCompl;
+
+    if(0 == psConnData->uHostPendingAcks)
+    {
+        return FALSE;
     }
 
-	DelayMs(10);
+    BT_storeLE16(HCI_H_NUM_COMPL_OCF|(HCI_HC_BB_OGF<<10), pCmd, 0);
+    pCmd[2] = HCI_H_NUM_COMPL_PLEN - HCI_CMD_HDR_LEN;
+    /*Number of handles*/
+    pCmd[3] = 1;
+    BT_storeLE16(psConnData->uConnHandler, pCmd, 4);
+    BT_storeLE16(psConnData->uHostPendingAcks, pCmd, 6);
+
+    if(gpsHCICB->PHY_w_CTL(pCmd, HCI_H_NUM_COMPL_PLEN) == HCI_TRANSPORT_BUSY)
+    {
+        return FALSE;
+    }
     DBG_INFO( "HCI w CMD: ");
-    DBG_DUMP(aCmdBuffer,uLen);
+    DBG_DUMP(pCmd, HCI_H_NUM_COMPL_PLEN);
+    BT_snoopRecord(BT_SNOOP_CMD, FALSE, pCmd, HCI_H_NUM_COMPL_PLEN,
+            HCI_H_NUM_COMPL_PLEN);
+
+    gpsHCICB->isCtlBusy = TRUE;
+    psConnData->uHostPendingAcks = 0;
+    return TRUE;
+}
+
+/*Drop every queued command (the controller is reset or gone)*/
+void _HCI_cmdFlush()
+{
+    HCI_COMMAND *psCmd;
+
+    ASSERT(NULL != gpsHCICB);
 
-    /*Write the command*/
-    gpsHCICB->PHY_w_CTL(aCmdBuffer, uLen);
-	return uLen;
+    while(NULL != gpsHCICB->pCmdHead)
+    {
+        psCmd = gpsHCICB->pCmdHead;
+        gpsHCICB->pCmdHead = psCmd->pNext;
+        BT_free(psCmd);
+    }
+    gpsHCICB->pCmdTail = NULL;
+    /*Until told otherwise the controller accepts a single command*/
+    gpsHCICB->bNumCmdPackets = 1;
 }
 
+/*
+ * COMMAND_COMPLETE and COMMAND_STATUS events: refresh the command credits
+ * and hand the event to the call-back of the command that caused it.
+ */
 void _HCI_commandEnd(const BYTE *pEventData)
 {
-    BYTE aData[CONTROL_PACKET_LENGTH - HCI_CMD_HDR_LEN];
-    HCI_CONFIGURATION_DATA *psConfData;
-    INT i;
+    HCI_COMMAND *psCmd;
+    HCI_COMMAND *psPrev = NULL;
     UINT16 uCmdCode;
+    BYTE bStatus;
 
     ASSERT(NULL != gpsHCICB);
-    psConfData = gpsHCICB->psHCIConfData;
 
-    ASSERT(NULL != psConfData);
+    if(HCI_COMMAND_COMPLETE == pEventData[0])
+    {
+        gpsHCICB->bNumCmdPackets = pEventData[2];
+        uCmdCode = BT_readLE16(pEventData, 3);
+        bStatus = pEventData[5];
+    }
+    else
+    {
+        bStatus = pEventData[2];
+        gpsHCICB->bNumCmdPackets = pEventData[3];
+        uCmdCode = BT_readLE16(pEventData, 4);
+    }
 
-    /*Identify the completed command*/
-    uCmdCode = BT_readLE16(pEventData, 3);
-    switch (uCmdCode)
+    /*Identify the completed command (opcode 0 only returns credits)*/
+    psCmd = gpsHCICB->pCmdHead;
+    while(NULL != psCmd && !(psCmd->isSent && psCmd->uOpcode == uCmdCode))
     {
-        /*RESET complete*/
-        case HCI_RESET_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO( "HCI_RESET DONE\n");
+        psPrev = psCmd;
+        psCmd = psCmd->pNext;
+    }
 
-            /*Issue the next command (READ_BUFFER_SIZE)*/
-            _HCI_cmd(NULL, HCI_R_BUF_SIZE_OCF, HCI_INFO_PARAM_OGF,
-                    HCI_R_BD_ADDR_PLEN);
-            break;
+    if(NULL != psCmd)
+    {
+        /*Unlink it before the call-back queues anything else*/
+        if(NULL == psPrev)
+        {
+            gpsHCICB->pCmdHead = psCmd->pNext;
+        }
+        else
+        {
+            psPrev->pNext = psCmd->pNext;
+        }
+        if(gpsHCICB->pCmdTail == psCmd)
+        {
+            gpsHCICB->pCmdTail = psPrev;
+        }
+
+        if(HCI_SUCCESS != bStatus)
+        {
+            DBG_ERROR("HCI: Command 0x%04X failed (0x%02X).\n",
+                    uCmdCode, bStatus);
+        }
+        if(NULL != psCmd->cmdDone)
+        {
+            psCmd->cmdDone(pEventData, uCmdCode, bStatus);
+        }
+        BT_free(psCmd);
+    }
+    else if(0 != uCmdCode)
+    {
+        DBG_INFO("HCI: Unexpected completion of 0x%04X\n", uCmdCode);
+    }
 
-        /*READ_BUFFER_SIZE complete*/
-        case HCI_R_BUF_SIZE_OCF|(HCI_INFO_PARAM_OGF<<10):
+    /*Keep the controller command pipe full*/
+    _HCI_cmdSend();
+}
 
-            DBG_INFO( "HCI_R_BUF_SIZE DONE\n");
-            i = BT_readLE16(pEventData, 6);
-            DBG_INFO( "HC_ACL_Data_Packet_Length: %d\n", i);
-            i = BT_readLE16(pEventData, 9);
-            DBG_INFO( "HC_Total_Num_ACL_Data_Packets: %d\n", i);
+/*
+ * Controller bring-up sequence.
+ * RESET runs alone, its completion queues every other step at once and the
+ * controller then takes them as fast as its Num_HCI_Command_Packets allows.
+ * A step without room for its command buffer stops the queueing there, the
+ * following completions (or HCI_API_tasks) queue it again, in order.
+ * WRITE_SCAN_ENABLE goes last so the device is only connectable once it is
+ * fully configured. A controller that rejects an optional step (an older
+ * one without interlaced scans or the 2nd event mask word, say) is only
+ * configured without it, a failed mandatory step stops the bring-up.
+ */
+static const HCI_INIT_STEP gasHCIInitSeq[HCI_INIT_STEPS] =
+{
+    {HCI_RESET_OCF, HCI_HC_BB_OGF, "RESET",
+            FALSE, NULL, NULL},
+    {HCI_R_BUF_SIZE_OCF, HCI_INFO_PARAM_OGF, "READ_BUFFER_SIZE",
+            FALSE, NULL, &_HCI_readBufSizeDone},
+    {HCI_R_BD_ADDR_OCF, HCI_INFO_PARAM_OGF, "READ_BD_ADDR",
+            FALSE, NULL, &_HCI_readBDAddrDone},
+    {HCI_R_LOCAL_FEATURES_OCF, HCI_INFO_PARAM_OGF, "READ_LOCAL_FEATURES",
+            TRUE, NULL, &_HCI_readLocalFeaturesDone},
+    {HCI_H_BUF_SIZE_OCF, HCI_HC_BB_OGF, "HOST_BUFFER_SIZE",
+            TRUE, &_HCI_initHostBufSize, NULL},
+    {HCI_SET_CH_FLOW_CTRL_OCF, HCI_HC_BB_OGF, "SET_FLOW_CONTROL",
+            TRUE, &_HCI_initFlowControl, &_HCI_flowControlDone},
+    {HCI_W_LOCAL_NAME_OCF, HCI_HC_BB_OGF, "WRITE_LOCAL_NAME",
+            TRUE, &_HCI_initLocalName, NULL},
+    {HCI_W_COD_OCF, HCI_HC_BB_OGF, "WRITE_CLASS_OF_DEVICE",
+            TRUE, &_HCI_initClassOfDevice, NULL},
+    {HCI_SET_EVENT_MASK_OCF, HCI_HC_BB_OGF, "SET_EVENT_MASK",
+            TRUE, &_HCI_initEventMask, NULL},
+    {HCI_W_PAGE_SCAN_ACT_OCF, HCI_HC_BB_OGF, "WRITE_PAGE_SCAN_ACTIVITY",
+            TRUE, &_HCI_initPageScanActivity, NULL},
+    {HCI_W_PAGE_SCAN_TYPE_OCF, HCI_HC_BB_OGF, "WRITE_PAGE_SCAN_TYPE",
+            TRUE, &_HCI_initPageScanType, NULL},
+    {HCI_W_INQ_SCAN_ACT_OCF, HCI_HC_BB_OGF, "WRITE_INQUIRY_SCAN_ACTIVITY",
+            TRUE, &_HCI_initInqScanActivity, NULL},
+    {HCI_W_INQ_SCAN_TYPE_OCF, HCI_HC_BB_OGF, "WRITE_INQUIRY_SCAN_TYPE",
+            TRUE, &_HCI_initInqScanType, NULL},
+    {HCI_W_SCAN_EN_OCF, HCI_HC_BB_OGF, "WRITE_SCAN_ENABLE",
+            FALSE, &_HCI_initScanEnable, NULL},
+};
+
+/*Queue one step of the bring-up sequence*/
+BOOL _HCI_initQueue(UINT uStep)
+{
+    BYTE aData[CONTROL_PACKET_LENGTH - HCI_CMD_HDR_LEN];
+    const HCI_INIT_STEP *psStep;
+    unsigned uLen = 0;
 
-            /*Issue the next command (READ_BD_ADDRESS)*/
-            _HCI_cmd(NULL, HCI_R_BD_ADDR_OCF, HCI_INFO_PARAM_OGF,
-                    HCI_R_BD_ADDR_PLEN);
-            break;
+    ASSERT(uStep < HCI_INIT_STEPS);
+    psStep = &gasHCIInitSeq[uStep];
 
-        /*READ_BD_ADDRESS complete*/
-        case HCI_R_BD_ADDR_OCF|(HCI_INFO_PARAM_OGF<<10):
-            DBG_INFO( "HCI_R_BD_ADDR DONE\n");
+    if(NULL != psStep->getParams)
+    {
+        uLen = psStep->getParams(aData);
+    }
+    return (0 != _HCI_cmd(aData, psStep->bOCF, psStep->bOGF,
+            HCI_CMD_HDR_LEN + uLen, &_HCI_initStepDone));
+}
 
-            /*Store the Local Name and the BDADDR that we've just read*/
-            for(i=0; i<6; ++i)
-            {
-                psConfData->aLocalADDR[5-i] = pEventData[6+i];
-            }
-			DelayMs(10);
-            DBG_INFO( "Local DB_ADDR: ");
-            DBG_DUMP(psConfData->aLocalADDR, 6);
-            DBG_INFO( "Local Name: ");
-            DBG_DUMP(psConfData->sLocalName,psConfData->uLocalNameLen);
-
-            /*Fill the next command parameters*/
-
-            /*ACL data packet length*/
-            BT_storeLE16(psConfData->uHostAclBufferSize,aData,0);
-            /*SYNC data packet length*/
-            aData[2] = 0;
-            /*Host ACL data packet buffer (0 = Infinite)*/
-            BT_storeLE16(psConfData->uHostNumAclBuffers,aData,3);
-            /*Host SYNC packet buffer*/
-            BT_storeLE16(0,aData,5);
-
-            /*Issue the next command (WRITE_HOST_BUFFER_SIZE)*/
-            _HCI_cmd(aData,HCI_H_BUF_SIZE_OCF, HCI_HC_BB_OGF,
-                    HCI_H_BUF_SIZE_PLEN);
-            break;
+/*Queue the pending bring-up steps while there is room for them*/
+void _HCI_initFill()
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
 
-        /*WRITE_HOST_BUFFER_SIZE complete*/
-        case HCI_H_BUF_SIZE_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO( "HCI_CONF_WRITE_HOST_BUFFER_SIZE DONE\n");
+    while(psConfData->bInitNext < HCI_INIT_STEPS)
+    {
+        if(!_HCI_initQueue(psConfData->bInitNext))
+        {
+            DBG_ERROR("HCI: Bring-up step %s delayed\n",
+                    gasHCIInitSeq[psConfData->bInitNext].sName);
+            return;
+        }
+        /*RESET runs alone, its completion queues the rest*/
+        psConfData->bInitNext = (0 == psConfData->bInitNext) ?
+                HCI_INIT_STEPS : psConfData->bInitNext + 1;
+    }
+}
 
-            /*Issue the next command (WRITE_LOCAL_NAME)*/
-            _HCI_cmd(psConfData->sLocalName,HCI_W_LOCAL_NAME_OCF,HCI_HC_BB_OGF,
-            HCI_CHANGE_LOCAL_NAME_PLEN + psConfData->uLocalNameLen);
-            break;
+/*Completion (or rejection) of any step of the bring-up sequence*/
+void _HCI_initStepDone(const BYTE *pEventData, UINT16 uOpcode, BYTE bStatus)
+{
+    HCI_CONFIGURATION_DATA *psConfData;
+    const HCI_INIT_STEP *psStep;
+    UINT i;
 
-        /*WRITE_LOCAL_NAME completed*/
-        case HCI_W_LOCAL_NAME_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO( "HCI_CONF_WRITE_LOCAL_NAME DONE\n");
+    ASSERT(NULL != gpsHCICB);
+    psConfData = gpsHCICB->psHCIConfData;
+    ASSERT(NULL != psConfData);
 
-            /*Issue the next command (READ_CLASS_OF_DEVICE)*/
-            _HCI_cmd(NULL, HCI_R_COD_OCF, HCI_HC_BB_OGF, HCI_R_COD_PLEN);
+    /*Find the step from the opcode the command queue matched*/
+    for(i = 0; i < HCI_INIT_STEPS; ++i)
+    {
+        if((gasHCIInitSeq[i].bOCF | (gasHCIInitSeq[i].bOGF<<10)) == uOpcode)
+        {
             break;
+        }
+    }
+    ASSERT(i < HCI_INIT_STEPS);
+    psStep = &gasHCIInitSeq[i];
 
-        /*READ_CLASS_OF_DEVICE completed*/
-        case HCI_R_COD_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO("HCI_CONF_READ_CLASS_DEVICE DONE\n");
-
-            /*Fill the next command parameters*/
-            #ifdef PC_CLASS
-                /*
-                 * PC class:
-                 * Major Class = Computer
-                 * Minor Class = Desktop
-                 */
-                aData[0]=0x04;
-                aData[1]=0x01;
-                aData[2]=0x18;
-            #elif CELL_CLASS
-                /*
-                 * Mobile phone class:
-                 * Major Class = Mobile device
-                 * Minor Class = Cell phone
-                 * Services = Information
-                 */
-                aData[0]=0x04;
-                aData[1]=0x02;
-                aData[2]=0x80;
-            #else
-                #error
-            #endif
-
-            /*Issue the next command (WRITE_CLASS_OF_DEVICE)*/
-            _HCI_cmd(aData, HCI_W_COD_OCF, HCI_HC_BB_OGF, HCI_W_COD_PLEN);
-            break;
+    psConfData->adwInitDone[i] = BT_getTicks();
+    if(HCI_SUCCESS != bStatus)
+    {
+        if(!psStep->isOptional)
+        {
+            DBG_ERROR("HCI_%s failed, bring-up stopped\n", psStep->sName);
+            psConfData->isInitFailed = TRUE;
+            psConfData->bInitNext = HCI_INIT_STEPS;
+            return;
+        }
+        DBG_INFO( "HCI_%s SKIPPED\n", psStep->sName);
+    }
+    else
+    {
+        DBG_INFO( "HCI_%s DONE\n", psStep->sName);
+        if(NULL != psStep->cmdDone)
+        {
+            psStep->cmdDone(pEventData);
+        }
+    }
 
-        /*WRITE_CLASS_OF_DEVICE completed*/
-        case HCI_W_COD_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO( "HCI_CONF_WRITE_CLASS_DEVICE DONE\n");
+    if(psConfData->isInitFailed)
+    {
+        return;
+    }
+    if(0 == i)
+    {
+        /*RESET done: fill the controller command pipe with the rest*/
+        psConfData->bInitNext = 1;
+        _HCI_initFill();
+    }
+    else if(HCI_INIT_STEPS - 1 == i)
+    {
+        _HCI_initComplete();
+    }
+}
 
-            /*
-             * Fill the next command parameters
-             * Inquiry Scan - Activate
-             * Page Scan - Activate
-             */
-            aData[0]=0x03;
+/*Last step done: report the bring-up timing and notify the device*/
+void _HCI_initComplete()
+{
+    HCI_CONFIGURATION_DATA *psConfData;
+    DWORD dwPrev;
+    UINT i;
 
-            /*Issue the next command (WRITE_SCAN_ENABLE)*/
-            _HCI_cmd(aData, HCI_W_SCAN_EN_OCF, HCI_HC_BB_OGF,
-                    HCI_W_SCAN_EN_PLEN);
-            break;
+    psConfData = gpsHCICB->psHCIConfData;
 
-         /*WRITE_SCAN_ENABLE complete*/
-         case HCI_W_SCAN_EN_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO( "HCI_CONF_WRITE_SCAN_ENABLE DONE\n");
+    dwPrev = psConfData->dwInitStart;
+    for(i = 0; i < HCI_INIT_STEPS; ++i)
+    {
+        DBG_INFO( "HCI init %s: %lu us\n", gasHCIInitSeq[i].sName,
+                BT_ticksToUs(psConfData->adwInitDone[i] - dwPrev));
+        dwPrev = psConfData->adwInitDone[i];
+    }
+    /*The core timer starts counting at power-on*/
+    psConfData->dwConnectableUs = BT_ticksToUs(dwPrev);
+    DBG_INFO( "HCI connectable after %lu us (%lu us since RESET)\n",
+            psConfData->dwConnectableUs,
+            BT_ticksToUs(dwPrev - psConfData->dwInitStart));
 
-            psConfData->isConfigured = TRUE;
-            gpsHCICB->configurationComplete();
-            break;
+    /*The fast connectable window starts now*/
+    psConfData->dwScanSince = dwPrev;
 
-         /* WRITE STORED LINK KEY complete*/
-        case HCI_W_STORED_LINK_KEY_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO( "HCI_W_STORED_LINK_KEY DONE\n");
-           /* Store the BD_ADDR */
-            for (i = 0; i < 6; ++i)
-            {
-                aData[i] = gpsHCICB->psHCIConnData->aRemoteADDR[i];
-            }
-            aData[6] = 0x01;
-            /*Issue the command (READ STORED LINK KEY)*/
-            _HCI_cmd(aData, HCI_R_STORED_LINK_KEY_OCF, HCI_HC_BB_OGF,
-                    HCI_R_STORED_LINK_KEY_PLEN);
-            break;
+    psConfData->isConfigured = TRUE;
+    gpsHCICB->configurationComplete();
+}
 
-        case HCI_R_STORED_LINK_KEY_OCF|(HCI_HC_BB_OGF<<10):
-            DBG_INFO("HCI_R_STORED_LINK_KEY DONE\n");
-            i = pEventData[5];
-            if (i == 0x00)
-            {
-                DBG_INFO("Status: Command succeed\n");
-                i = BT_readLE16(pEventData, 6);
-                DBG_INFO("Max num keys: %d\n", i);
-                i = BT_readLE16(pEventData, 8);
-                DBG_INFO("Keys read: %d\n", i);
-            }
-            break;
+unsigned _HCI_initHostBufSize(BYTE *pData)
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+
+    /*ACL data packet length*/
+    BT_storeLE16(psConfData->uHostAclBufferSize,pData,0);
+    /*SYNC data packet length*/
+    pData[2] = 0;
+    /*Host ACL data packet buffer (0 = Infinite)*/
+    BT_storeLE16(psConfData->uHostNumAclBuffers,pData,3);
+    /*Host SYNC packet buffer*/
+    BT_storeLE16(0,pData,5);
+    return HCI_H_BUF_SIZE_PLEN - HCI_CMD_HDR_LEN;
+}
 
-        default:
-            break;
+unsigned _HCI_initFlowControl(BYTE *pData)
+{
+    /*ACL flow control on, SCO flow control off*/
+    pData[0] = 0x01;
+    return HCI_SET_CH_FLOW_CTRL_PLEN - HCI_CMD_HDR_LEN;
+}
+
+void _HCI_flowControlDone(const BYTE *pEventData)
+{
+    /*A step skipped leaves it off: the controller sends as it has data*/
+    gpsHCICB->psHCIConfData->bCHFlowControl = TRUE;
+}
+
+unsigned _HCI_initLocalName(BYTE *pData)
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+    unsigned uLen = psConfData->uLocalNameLen;
+    unsigned i;
+
+    /*The name has to fit in a single control packet (NUL included)*/
+    if(uLen > CONTROL_PACKET_LENGTH - HCI_CMD_HDR_LEN - 1)
+    {
+        uLen = CONTROL_PACKET_LENGTH - HCI_CMD_HDR_LEN - 1;
+    }
+    for(i = 0; i < uLen; ++i)
+    {
+        pData[i] = psConfData->sLocalName[i];
     }
+    pData[uLen] = 0x00;
+    return uLen + 1;
 }
 
-void _HCI_eventHandler(const BYTE *pEventData)
+unsigned _HCI_initClassOfDevice(BYTE *pData)
 {
-    BYTE aBDAddr[6];
-    BYTE aData[EVENT_PACKET_LENGTH];
-    UINT i, j, k;
-    HCI_CONNECTION_DATA *psConnData;
-    HCI_CONFIGURATION_DATA *psConfData;
+    #ifdef PC_CLASS
+        /*
+         * PC class:
+         * Major Class = Computer
+         * Minor Class = Desktop
+         */
+        pData[0]=0x04;
+        pData[1]=0x01;
+        pData[2]=0x18;
+    #elif CELL_CLASS
+        /*
+         * Mobile phone class:
+         * Major Class = Mobile device
+         * Minor Class = Cell phone
+         * Services = Information
+         */
+        pData[0]=0x04;
+        pData[1]=0x02;
+        pData[2]=0x80;
+    #else
+        #error
+    #endif
+    return HCI_W_COD_PLEN - HCI_CMD_HDR_LEN;
+}
 
-    ASSERT(NULL != gpsHCICB);
+unsigned _HCI_initEventMask(BYTE *pData)
+{
+    /*Only the events the stack handles or has subscribers for*/
+    BT_storeLE32((DWORD) gpsHCICB->qwEventMask, pData, 0);
+    BT_storeLE32((DWORD) (gpsHCICB->qwEventMask >> 32), pData, 4);
+    gpsHCICB->isEventMaskPending = FALSE;
+    return HCI_SET_EVENT_MASK_PLEN - HCI_CMD_HDR_LEN;
+}
 
-    psConnData = gpsHCICB->psHCIConnData;
-    psConfData = gpsHCICB->psHCIConfData;
+unsigned _HCI_initScanEnable(BYTE *pData)
+{
+    /*
+     * Inquiry Scan - Activate
+     * Page Scan - Activate
+     */
+    pData[0]=0x03;
+    return HCI_W_SCAN_EN_PLEN - HCI_CMD_HDR_LEN;
+}
+
+unsigned _HCI_initPageScanActivity(BYTE *pData)
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+    HCI_SCAN_PROFILE *psProfile =
+            &psConfData->asScanProfile[psConfData->bScanProfile];
+
+    BT_storeLE16(psProfile->uPageInterval, pData, 0);
+    BT_storeLE16(psProfile->uPageWindow, pData, 2);
+    return HCI_W_SCAN_ACT_PLEN - HCI_CMD_HDR_LEN;
+}
 
-    /*Switch cases according to the event code*/
-    switch(pEventData[0])
+unsigned _HCI_initPageScanType(BYTE *pData)
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+
+    /*0 = Standard, 1 = Interlaced*/
+    pData[0] = psConfData->asScanProfile[psConfData->bScanProfile].bInterlaced
+            ? 0x01 : 0x00;
+    return HCI_W_SCAN_TYPE_PLEN - HCI_CMD_HDR_LEN;
+}
+
+unsigned _HCI_initInqScanActivity(BYTE *pData)
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+    HCI_SCAN_PROFILE *psProfile =
+            &psConfData->asScanProfile[psConfData->bScanProfile];
+
+    BT_storeLE16(psProfile->uInqInterval, pData, 0);
+    BT_storeLE16(psProfile->uInqWindow, pData, 2);
+    return HCI_W_SCAN_ACT_PLEN - HCI_CMD_HDR_LEN;
+}
+
+unsigned _HCI_initInqScanType(BYTE *pData)
+{
+    /*Same scan type for inquiry and page scans*/
+    return _HCI_initPageScanType(pData);
+}
+
+/*Switch the scan activity to another profile (scan enable is untouched)*/
+void _HCI_scanApply(BYTE bProfile)
+{
+    BYTE aData[HCI_W_SCAN_ACT_PLEN - HCI_CMD_HDR_LEN];
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+    unsigned uLen;
+
+    psConfData->bScanProfile = bProfile;
+    psConfData->dwScanSince = BT_getTicks();
+
+    uLen = _HCI_initPageScanActivity(aData);
+    _HCI_cmd(aData, HCI_W_PAGE_SCAN_ACT_OCF, HCI_HC_BB_OGF,
+            HCI_CMD_HDR_LEN + uLen, NULL);
+    uLen = _HCI_initPageScanType(aData);
+    _HCI_cmd(aData, HCI_W_PAGE_SCAN_TYPE_OCF, HCI_HC_BB_OGF,
+            HCI_CMD_HDR_LEN + uLen, NULL);
+    uLen = _HCI_initInqScanActivity(aData);
+    _HCI_cmd(aData, HCI_W_INQ_SCAN_ACT_OCF, HCI_HC_BB_OGF,
+            HCI_CMD_HDR_LEN + uLen, NULL);
+    uLen = _HCI_initInqScanType(aData);
+    _HCI_cmd(aData, HCI_W_INQ_SCAN_TYPE_OCF, HCI_HC_BB_OGF,
+            HCI_CMD_HDR_LEN + uLen, NULL);
+}
+
+/*Send the event mask a subscription changed (again if it found no room)*/
+void _HCI_eventMaskTasks()
+{
+    BYTE aData[HCI_SET_EVENT_MASK_PLEN - HCI_CMD_HDR_LEN];
+
+    if(!gpsHCICB->isEventMaskPending || !_HCI_isConfigured())
     {
-        /*NUMBER_OF_COMPLETED_PACKETS event*/
-        case HCI_NBR_OF_COMPLETED_PACKETS:
-            /*Verify the connection*/
-            if(!_HCI_isConnected())
-            {
-                DBG_ERROR("HCI not connected.\n");
-                return;
-            }
-            /*Check the connection handler*/
-            if(BT_readLE16(pEventData, 3) == psConnData->uConnHandler)
-            {
-              /*Keep track of the packets to acknowledge by the device*/
-              psConnData->uPacketsToAck -= pEventData[5];
-            }
-            break;
+        return;
+    }
+    _HCI_initEventMask(aData);
+    if(!_HCI_cmd(aData, HCI_SET_EVENT_MASK_OCF, HCI_HC_BB_OGF,
+            HCI_SET_EVENT_MASK_PLEN, NULL))
+    {
+        gpsHCICB->isEventMaskPending = TRUE;
+    }
+}
+
+/*Close the fast connectable window once it has run out*/
+void _HCI_scanTasks()
+{
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
 
-        /*PIN_CODE_REQUEST even*/
-        case HCI_PIN_CODE_REQUEST:
-            DBG_INFO( "HCI_PIN_CODE_REQUEST (Will return: 00)\n");
+    if(!_HCI_isConfigured() || HCI_SCAN_FAST != psConfData->bScanProfile)
+    {
+        return;
+    }
+    if(BT_ticksToUs(BT_getTicks() - psConfData->dwScanSince) / 1000 >=
+            HCI_FAST_CONNECTABLE_MS)
+    {
+        DBG_INFO( "HCI: Fast connectable window closed\n");
+        _HCI_scanApply(HCI_SCAN_LOW_DUTY);
+    }
+}
+
+/*
+ * Outbound paging.
+ * The targets are paged back to back from HCI_API_tasks: each
+ * CONNECTION_COMPLETE (or a rejected CREATE_CONNECTION) moves on to the
+ * next one, nothing waits on the controller. A target is paged straight
+ * away, with its cached parameters or else the default ones (R1, no clock
+ * offset). Only a failed page makes an inquiry due, at most one per cache
+ * lifetime; targets that are connectable but not discoverable keep being
+ * paged with the default parameters.
+ */
+void _HCI_pageTasks()
+{
+    BYTE aData[HCI_CREATE_CONN_PLEN - HCI_CMD_HDR_LEN];
+    HCI_PAGE_DATA *psPageData = gpsHCICB->psHCIPageData;
+    HCI_INQ_ENTRY *psEntry;
+    const BYTE *pBDAddr;
+    DWORD dwNow = BT_getTicks();
+    UINT i;
+
+    /*Expire old entries before the tick difference wraps*/
+    for(i = 0; i < HCI_INQ_CACHE_SIZE; ++i)
+    {
+        psEntry = &psPageData->asInqCache[i];
+        if(psEntry->isValid && BT_ticksToUs(dwNow - psEntry->dwSeen) / 1000 >=
+                HCI_INQ_CACHE_TTL_MS)
+        {
+            psEntry->isValid = FALSE;
+        }
+    }
+    if(psPageData->isInquired && HCI_PAGE_INQUIRY != psPageData->bState &&
+       BT_ticksToUs(dwNow - psPageData->dwLastInquiry) / 1000 >=
+            HCI_INQ_CACHE_TTL_MS)
+    {
+        psPageData->isInquired = FALSE;
+    }
+
+    if(!_HCI_isConfigured() || _HCI_isConnected() ||
+       0 == psPageData->bNumTargets || HCI_PAGE_IDLE != psPageData->bState)
+    {
+        return;
+    }
+    if(psPageData->isInquiryDue && !psPageData->isInquired)
+    {
+        /*General inquiry, the results fill the cache*/
+        aData[0] = (BYTE) HCI_GIAC_LAP;
+        aData[1] = (BYTE) (HCI_GIAC_LAP >> 8);
+        aData[2] = (BYTE) (HCI_GIAC_LAP >> 16);
+        aData[3] = HCI_INQUIRY_LEN;
+        aData[4] = HCI_INQUIRY_MAX_RSP;
+        if(!_HCI_cmd(aData, HCI_INQUIRY_OCF, HCI_LINK_CTRL_OGF,
+                HCI_INQUIRY_PLEN, &_HCI_inquiryCmdDone))
+        {
+            return;
+        }
+        DBG_INFO( "HCI: Inquiry\n");
+        psPageData->bState = HCI_PAGE_INQUIRY;
+        psPageData->isInquired = TRUE;
+        psPageData->dwLastInquiry = dwNow;
+        /*The inquiry took the pause, the round starts over with the results*/
+        psPageData->isRoundPause = FALSE;
+    }
+    psPageData->isInquiryDue = FALSE;
+    if(HCI_PAGE_IDLE != psPageData->bState)
+    {
+        return;
+    }
+    /*Nobody answered in the last round, give the air a rest*/
+    if(psPageData->isRoundPause)
+    {
+        if(BT_ticksToUs(dwNow - psPageData->dwRoundEnd) / 1000 <
+                HCI_PAGE_ROUND_MS)
+        {
+            return;
+        }
+        psPageData->isRoundPause = FALSE;
+    }
+
+    pBDAddr = psPageData->aaTarget[psPageData->bNextTarget];
+    psEntry = _HCI_inqCacheFind(pBDAddr);
+
+    /*BD_ADDR, packet types, page scan repetition mode, clock offset*/
+    for(i = 0; i < HCI_BD_ADDR_LEN; ++i)
+    {
+        aData[i] = pBDAddr[i];
+    }
+    BT_storeLE16(HCI_PKT_DM1 | HCI_PKT_DH1 | HCI_PKT_DM3 | HCI_PKT_DH3 |
+            HCI_PKT_DM5 | HCI_PKT_DH5, aData, 6);
+    aData[8] = (NULL != psEntry) ? psEntry->bPageScanRepMode : HCI_PSRM_R1;
+    aData[9] = 0x00;
+    BT_storeLE16((NULL != psEntry && psEntry->isClockValid) ?
+            (psEntry->uClockOffset | HCI_CLOCK_OFFSET_VALID) : 0, aData, 10);
+    /*Allow the target to become the master*/
+    aData[12] = 0x01;
+    if(_HCI_cmd(aData, HCI_CREATE_CONN_OCF, HCI_LINK_CTRL_OGF,
+            HCI_CREATE_CONN_PLEN, &_HCI_pageCmdDone))
+    {
+        DBG_INFO( "HCI: Paging target %d%s\n", psPageData->bNextTarget,
+                (NULL != psEntry) ? " (cached)" : "");
+        psPageData->bState = HCI_PAGE_CONNECTING;
+    }
+}
+
+/*The current page attempt is over, the next target follows*/
+void _HCI_pageNext(BOOL isConnected)
+{
+    HCI_PAGE_DATA *psPageData = gpsHCICB->psHCIPageData;
+    HCI_INQ_ENTRY *psEntry;
+
+    psPageData->bState = HCI_PAGE_IDLE;
+    if(isConnected)
+    {
+        psPageData->isRoundHit = TRUE;
+    }
+    else
+    {
+        /*The parameters did not work, an inquiry may find better ones*/
+        psEntry = _HCI_inqCacheFind(
+                psPageData->aaTarget[psPageData->bNextTarget]);
+        if(NULL != psEntry)
+        {
+            psEntry->isValid = FALSE;
+        }
+        psPageData->isInquiryDue = TRUE;
+    }
+
+    if(++psPageData->bNextTarget >= psPageData->bNumTargets)
+    {
+        psPageData->bNextTarget = 0;
+        if(!psPageData->isRoundHit)
+        {
+            psPageData->isRoundPause = TRUE;
+            psPageData->dwRoundEnd = BT_getTicks();
+        }
+        psPageData->isRoundHit = FALSE;
+    }
+}
+
+/*COMMAND_STATUS of CREATE_CONNECTION*/
+void _HCI_pageCmdDone(const BYTE *pEventData, UINT16 uOpcode, BYTE bStatus)
+{
+    /*On success the CONNECTION_COMPLETE event ends the attempt*/
+    if(HCI_COMMAND_STATUS != pEventData[0] || HCI_SUCCESS != bStatus)
+    {
+        DBG_INFO( "HCI: Page rejected (0x%02X)\n", bStatus);
+        _HCI_pageNext(FALSE);
+    }
+}
+
+/*COMMAND_STATUS of INQUIRY*/
+void _HCI_inquiryCmdDone(const BYTE *pEventData, UINT16 uOpcode,
+        BYTE bStatus)
+{
+    /*Page with the default parameters instead*/
+    if(HCI_COMMAND_STATUS != pEventData[0] || HCI_SUCCESS != bStatus)
+    {
+        gpsHCICB->psHCIPageData->bState = HCI_PAGE_IDLE;
+    }
+}
+
+HCI_INQ_ENTRY* _HCI_inqCacheFind(const BYTE *pBDAddr)
+{
+    HCI_INQ_ENTRY *psEntry = gpsHCICB->psHCIPageData->asInqCache;
+    UINT i;
+
+    for(i = 0; i < HCI_INQ_CACHE_SIZE; ++i, ++psEntry)
+    {
+        if(psEntry->isValid && BT_isEqualBD_ADDR(psEntry->aBDAddr, pBDAddr))
+        {
+            return psEntry;
+        }
+    }
+    return NULL;
+}
+
+/*Refresh or add an entry, replacing a free or else the oldest one*/
+void _HCI_inqCachePut(const BYTE *pBDAddr, BYTE bPageScanRepMode,
+        UINT16 uClockOffset)
+{
+    HCI_INQ_ENTRY *psCache = gpsHCICB->psHCIPageData->asInqCache;
+    HCI_INQ_ENTRY *psEntry;
+    DWORD dwNow = BT_getTicks();
+    UINT i;
+
+    psEntry = _HCI_inqCacheFind(pBDAddr);
+    for(i = 0; NULL == psEntry && i < HCI_INQ_CACHE_SIZE; ++i)
+    {
+        if(!psCache[i].isValid)
+        {
+            psEntry = &psCache[i];
+        }
+    }
+    if(NULL == psEntry)
+    {
+        psEntry = &psCache[0];
+        for(i = 1; i < HCI_INQ_CACHE_SIZE; ++i)
+        {
+            if(dwNow - psCache[i].dwSeen > dwNow - psEntry->dwSeen)
+            {
+                psEntry = &psCache[i];
+            }
+        }
+    }
+
+    for(i = 0; i < HCI_BD_ADDR_LEN; ++i)
+    {
+        psEntry->aBDAddr[i] = pBDAddr[i];
+    }
+    psEntry->bPageScanRepMode = bPageScanRepMode;
+    psEntry->uClockOffset = uClockOffset & ~HCI_CLOCK_OFFSET_VALID;
+    psEntry->isClockValid = TRUE;
+    psEntry->dwSeen = dwNow;
+    psEntry->isValid = TRUE;
+}
+
+/*Ask the name of a device, the cached page parameters speed it up*/
+void _HCI_remoteNameRequest(const BYTE *pBDAddr)
+{
+    BYTE aData[HCI_REMOTE_NAME_REQ_PLEN - HCI_CMD_HDR_LEN];
+    HCI_INQ_ENTRY *psEntry = _HCI_inqCacheFind(pBDAddr);
+    UINT i;
+
+    for(i = 0; i < HCI_BD_ADDR_LEN; ++i)
+    {
+        aData[i] = pBDAddr[i];
+    }
+    aData[6] = (NULL != psEntry) ? psEntry->bPageScanRepMode : HCI_PSRM_R1;
+    aData[7] = 0x00;
+    BT_storeLE16((NULL != psEntry && psEntry->isClockValid) ?
+            (psEntry->uClockOffset | HCI_CLOCK_OFFSET_VALID) : 0, aData, 8);
+    _HCI_cmd(aData, HCI_REMOTE_NAME_REQ_OCF, HCI_LINK_CTRL_OGF,
+            HCI_REMOTE_NAME_REQ_PLEN, NULL);
+}
+
+void _HCI_readBufSizeDone(const BYTE *pEventData)
+{
+    INT i;
+
+    i = BT_readLE16(pEventData, 6);
+    DBG_INFO( "HC_ACL_Data_Packet_Length: %d\n", i);
+    /*No ACL packet longer than one controller buffer (no fragmentation)*/
+    gpsHCICB->psHCIConfData->uCtrlAclLen = i;
+    i = BT_readLE16(pEventData, 9);
+    DBG_INFO( "HC_Total_Num_ACL_Data_Packets: %d\n", i);
+    /*Never have more packets in the controller than it can hold*/
+    gpsHCICB->psHCIConfData->uCtrlNumAclBuffers = i;
+}
+
+void _HCI_readBDAddrDone(const BYTE *pEventData)
+{
+    HCI_CONFIGURATION_DATA *psConfData;
+    INT i;
+
+    psConfData = gpsHCICB->psHCIConfData;
+
+    /*Store the BDADDR that we've just read*/
+    for(i=0; i<6; ++i)
+    {
+        psConfData->aLocalADDR[5-i] = pEventData[6+i];
+    }
+    DBG_INFO( "Local DB_ADDR: ");
+    DBG_DUMP(psConfData->aLocalADDR, 6);
+    DBG_INFO( "Local Name: ");
+    DBG_DUMP(psConfData->sLocalName,psConfData->uLocalNameLen);
+}
+
+void _HCI_readLocalFeaturesDone(const BYTE *pEventData)
+{
+    INT i;
+
+    for(i = 0; i < HCI_FEATURES_LEN; ++i)
+    {
+        gpsHCICB->psHCIConfData->aLocalFeatures[i] = pEventData[6+i];
+    }
+    DBG_INFO( "Local features: ");
+    DBG_DUMP(gpsHCICB->psHCIConfData->aLocalFeatures, HCI_FEATURES_LEN);
+}
+
+/*Both ends support a feature (given as byte, bit mask)*/
+BOOL _HCI_hasFeature(const BYTE *pRemoteFeatures, UINT uByte, BYTE bMask)
+{
+    return (gpsHCICB->psHCIConfData->aLocalFeatures[uByte] &
+            pRemoteFeatures[uByte] & bMask) != 0;
+}
+
+/*Highest throughput ACL packet types both ends support*/
+UINT16 _HCI_selectPacketType(const BYTE *pRemoteFeatures)
+{
+    UINT16 uType = HCI_PKT_DM1 | HCI_PKT_DH1 |
+                   HCI_PKT_NO_2_DH1 | HCI_PKT_NO_3_DH1 |
+                   HCI_PKT_NO_2_DH3 | HCI_PKT_NO_3_DH3 |
+                   HCI_PKT_NO_2_DH5 | HCI_PKT_NO_3_DH5;
+    BOOL bEDR2M = _HCI_hasFeature(pRemoteFeatures, HCI_FEAT_EDR_2M);
+    BOOL bEDR3M = _HCI_hasFeature(pRemoteFeatures, HCI_FEAT_EDR_3M);
+
+    /*Multi-slot basic rate packets*/
+    if(_HCI_hasFeature(pRemoteFeatures, HCI_FEAT_3_SLOT))
+    {
+        uType |= HCI_PKT_DM3 | HCI_PKT_DH3;
+    }
+    if(_HCI_hasFeature(pRemoteFeatures, HCI_FEAT_5_SLOT))
+    {
+        uType |= HCI_PKT_DM5 | HCI_PKT_DH5;
+    }
+
+    /*EDR packets: clear the "shall not be used" bits*/
+    if(bEDR2M)
+    {
+        uType &= ~HCI_PKT_NO_2_DH1;
+    }
+    if(bEDR3M)
+    {
+        uType &= ~HCI_PKT_NO_3_DH1;
+    }
+    if(_HCI_hasFeature(pRemoteFeatures, HCI_FEAT_EDR_3_SLOT))
+    {
+        uType &= ~((bEDR2M ? HCI_PKT_NO_2_DH3 : 0) |
+                   (bEDR3M ? HCI_PKT_NO_3_DH3 : 0));
+    }
+    if(_HCI_hasFeature(pRemoteFeatures, HCI_FEAT_EDR_5_SLOT))
+    {
+        uType &= ~((bEDR2M ? HCI_PKT_NO_2_DH5 : 0) |
+                   (bEDR3M ? HCI_PKT_NO_3_DH5 : 0));
+    }
+    return uType;
+}
+
+/*
+ * Link power policies: idle time before sniffing and the range the sniff
+ * interval adapts in (20 ms steps of 0.625 ms slots).
+ */
+static const HCI_POWER_POLICY gasHCIPolicy[HCI_NUM_POLICIES] =
+{
+    /*HCI_POLICY_LATENCY: always active*/
+    {0, 0, 0},
+    /*HCI_POLICY_BALANCED: 2 s idle, 50 ms to 500 ms*/
+    {2000, 0x0050, 0x0320},
+    /*HCI_POLICY_POWER: 500 ms idle, 100 ms to 1 s*/
+    {500, 0x00A0, 0x0640},
+};
+
+/*A new ACL link starts active, with sniff allowed by the link policy*/
+void _HCI_linkOpen()
+{
+    BYTE aData[HCI_W_LINK_POLICY_PLEN - HCI_CMD_HDR_LEN];
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    psConnData->bLinkMode = HCI_MODE_ACTIVE;
+    psConnData->isModePending = FALSE;
+    psConnData->uSniffInterval =
+            gasHCIPolicy[psConnData->bPolicy].uMinInterval;
+    psConnData->dwLastActivity = BT_getTicks();
+    psConnData->dwModeSince = psConnData->dwLastActivity;
+    psConnData->dwActiveMs = 0;
+    psConnData->dwSniffMs = 0;
+    /*Controller default until the packet types are negotiated*/
+    psConnData->uPacketType = HCI_PKT_DM1 | HCI_PKT_DH1;
+    psConnData->dwTxBytes = 0;
+    psConnData->dwRxBytes = 0;
+    psConnData->bStampHead = 0;
+    psConnData->bStampCount = 0;
+    BT_profileReset();
+
+    BT_storeLE16(psConnData->uConnHandler, aData, 0);
+    BT_storeLE16(HCI_LINK_POLICY_SNIFF, aData, 2);
+    _HCI_cmd(aData, HCI_W_LINK_POLICY_OCF, HCI_LINK_POLICY_OGF,
+            HCI_W_LINK_POLICY_PLEN, NULL);
+
+    /*The remote features decide the ACL packet types*/
+    _HCI_cmd(aData, HCI_R_REMOTE_FEATURES_OCF, HCI_LINK_CTRL_OGF,
+            HCI_R_REMOTE_FEATURES_PLEN, NULL);
+}
+
+void _HCI_linkClosed()
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    /*Account the last mode period*/
+    _HCI_linkSetMode(psConnData->bLinkMode);
+    psConnData->isModePending = FALSE;
+    DBG_INFO("HCI link: %lu ms active, %lu ms sniff\n",
+            psConnData->dwActiveMs, psConnData->dwSniffMs);
+    /*Throughput with the negotiated packet types*/
+    DBG_INFO("HCI link: Packet types 0x%04X, %lu B sent, %lu B received"
+            " in %lu ms\n", psConnData->uPacketType, psConnData->dwTxBytes,
+            psConnData->dwRxBytes,
+            psConnData->dwActiveMs + psConnData->dwSniffMs);
+    if(0 != psConnData->dwActiveMs + psConnData->dwSniffMs)
+    {
+        DBG_INFO("HCI link: Goodput %lu B/s\n",
+                (psConnData->dwTxBytes + psConnData->dwRxBytes) /
+                ((psConnData->dwActiveMs + psConnData->dwSniffMs + 999)/1000));
+    }
+    BT_profileReport();
+}
+
+/*An ACL packet was written: remember when (dropped if the FIFO is full)*/
+void _HCI_txStampPush()
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    if(psConnData->bStampCount < HCI_TX_STAMPS)
+    {
+        psConnData->adwTxStamp[(psConnData->bStampHead +
+                psConnData->bStampCount) % HCI_TX_STAMPS] = BT_getTicks();
+        ++psConnData->bStampCount;
+    }
+}
+
+/*The controller completed some packets: account their latency*/
+void _HCI_txStampPop(UINT uPackets)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    while(uPackets-- > 0 && psConnData->bStampCount > 0)
+    {
+        BT_latencyAdd(BT_ticksToUs(BT_getTicks() -
+                psConnData->adwTxStamp[psConnData->bStampHead]));
+        psConnData->bStampHead = (psConnData->bStampHead + 1) % HCI_TX_STAMPS;
+        --psConnData->bStampCount;
+    }
+}
+
+/*Data is moving: leave sniff mode straight away*/
+void _HCI_linkActivity()
+{
+    BYTE aData[HCI_EXIT_SNIFF_MODE_PLEN - HCI_CMD_HDR_LEN];
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    psConnData->dwLastActivity = BT_getTicks();
+    if(HCI_MODE_SNIFF != psConnData->bLinkMode || psConnData->isModePending)
+    {
+        return;
+    }
+
+    BT_storeLE16(psConnData->uConnHandler, aData, 0);
+    if(_HCI_cmd(aData, HCI_EXIT_SNIFF_MODE_OCF, HCI_LINK_POLICY_OGF,
+            HCI_EXIT_SNIFF_MODE_PLEN, &_HCI_linkModeCmdDone))
+    {
+        psConnData->isModePending = TRUE;
+    }
+}
+
+/*Account the time spent in the current mode and switch to bMode*/
+void _HCI_linkSetMode(BYTE bMode)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+    const HCI_POWER_POLICY *psPolicy = &gasHCIPolicy[psConnData->bPolicy];
+    DWORD dwNow = BT_getTicks();
+    DWORD dwMs = BT_ticksToUs(dwNow - psConnData->dwModeSince) / 1000;
+
+    if(HCI_MODE_SNIFF == psConnData->bLinkMode)
+    {
+        psConnData->dwSniffMs += dwMs;
+
+        /*
+         * Adapt the next sniff interval to the traffic: short sniff
+         * periods mean bursty traffic (shorter interval, less latency),
+         * long ones an idle peer (longer interval, less power).
+         */
+        if(HCI_MODE_ACTIVE == bMode)
+        {
+            if(dwMs * 8 < (DWORD) psConnData->uSniffInterval * 5 *
+                    HCI_SNIFF_BUSY_PERIODS)
+            {
+                psConnData->uSniffInterval /= 2;
+            }
+            else
+            {
+                psConnData->uSniffInterval *= 2;
+            }
+            if(psConnData->uSniffInterval < psPolicy->uMinInterval)
+            {
+                psConnData->uSniffInterval = psPolicy->uMinInterval;
+            }
+            if(psConnData->uSniffInterval > psPolicy->uMaxInterval)
+            {
+                psConnData->uSniffInterval = psPolicy->uMaxInterval;
+            }
+        }
+    }
+    else
+    {
+        psConnData->dwActiveMs += dwMs;
+    }
+
+    psConnData->bLinkMode = bMode;
+    psConnData->dwModeSince = dwNow;
+}
+
+/*COMMAND_STATUS of SNIFF_MODE/EXIT_SNIFF_MODE*/
+void _HCI_linkModeCmdDone(const BYTE *pEventData, UINT16 uOpcode,
+        BYTE bStatus)
+{
+    /*On success the MODE_CHANGE event ends the transition*/
+    if(HCI_COMMAND_STATUS != pEventData[0] || HCI_SUCCESS != bStatus)
+    {
+        gpsHCICB->psHCIConnData->isModePending = FALSE;
+    }
+}
+
+/*
+ * HCI event dispatch.
+ * Built-in handlers are indexed by event code, the subscribers of an event
+ * run after them. Every event counts its occurrences and the core cycles
+ * spent processing it.
+ */
+static void (* const gapfnHCIEvent[HCI_NUM_EVENTS])(const BYTE*) =
+{
+    [HCI_INQUIRY_COMPLETE] = &_HCI_evtInquiryComplete,
+    [HCI_INQUIRY_RESULT] = &_HCI_evtInquiryResult,
+    [HCI_CONNECTION_COMPLETE] = &_HCI_evtConnectionComplete,
+    [HCI_CONNECTION_REQUEST] = &_HCI_evtConnectionRequest,
+    [HCI_DISCONNECTION_COMPLETE] = &_HCI_evtDisconnectionComplete,
+    [HCI_REMOTE_NAME_REQ_COMPLETE] = &_HCI_evtRemoteNameComplete,
+    [HCI_READ_REMOTE_FEATURES_COMPLETE] = &_HCI_evtRemoteFeatures,
+    [HCI_COMMAND_COMPLETE] = &_HCI_commandEnd,
+    [HCI_COMMAND_STATUS] = &_HCI_commandEnd,
+    [HCI_NBR_OF_COMPLETED_PACKETS] = &_HCI_evtCompletedPackets,
+    [HCI_MODE_CHANGE] = &_HCI_evtModeChange,
+    [HCI_PIN_CODE_REQUEST] = &_HCI_evtPinCodeRequest,
+    [HCI_LINK_KEY_REQUEST] = &_HCI_evtLinkKeyRequest,
+    [HCI_LINK_KEY_NOTIFICATION] = &_HCI_evtLinkKeyNotification,
+    [HCI_MAX_SLOTS_CHANGE] = &_HCI_evtMaxSlotsChange,
+    [HCI_CONN_PACKET_TYPE_CHANGED] = &_HCI_evtPacketTypeChanged,
+};
+
+void _HCI_eventHandler(const BYTE *pEventData)
+{
+    BYTE bEvent = pEventData[0];
+    DWORD dwStart;
+    UINT i;
+
+    ASSERT(NULL != gpsHCICB);
+
+    if(bEvent >= HCI_NUM_EVENTS)
+    {
+        DBG_INFO( "HCI: Event 0x%02X out of range\n", bEvent);
+        return;
+    }
+    dwStart = BT_getTicks();
+
+    if(NULL != gapfnHCIEvent[bEvent])
+    {
+        gapfnHCIEvent[bEvent](pEventData);
+    }
+    for(i = 0; i < HCI_MAX_EVT_SUBSCRIBERS; ++i)
+    {
+        if(gpsHCICB->asEvtSubscriber[i].bEvent == bEvent &&
+           NULL != gpsHCICB->asEvtSubscriber[i].putEvent)
+        {
+            gpsHCICB->asEvtSubscriber[i].putEvent(pEventData);
+        }
+    }
+
+    /*The core timer counts every other CPU cycle*/
+    ++gpsHCICB->asEvtStats[bEvent].uCount;
+    gpsHCICB->asEvtStats[bEvent].dwCycles += (BT_getTicks() - dwStart) * 2;
+}
+
+/*NUMBER_OF_COMPLETED_PACKETS event*/
+void _HCI_evtCompletedPackets(const BYTE *pEventData)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    /*Verify the connection*/
+    if(!_HCI_isConnected())
+    {
+        DBG_ERROR("HCI not connected.\n");
+        return;
+    }
+    /*Check the connection handler*/
+    if(BT_readLE16(pEventData, 3) == psConnData->uConnHandler)
+    {
+      _HCI_txStampPop(pEventData[5]);
+      /*Keep track of the packets to acknowledge by the device*/
+      if (psConnData->uPacketsToAck > pEventData[5])
+      {
+          psConnData->uPacketsToAck -= pEventData[5];
+      }
+      else
+      {
+          psConnData->uPacketsToAck = 0;
+      }
+      /*There is room in the controller again*/
+      if (NULL != gpsHCICB->L2CAPtxReady)
+      {
+          gpsHCICB->L2CAPtxReady();
+      }
+    }
+}
+
+/*PIN_CODE_REQUEST event*/
+void _HCI_evtPinCodeRequest(const BYTE *pEventData)
+{
+    BYTE aBDAddr[6];
+    HCI_CONFIGURATION_DATA *psConfData = gpsHCICB->psHCIConfData;
+    UINT i;
+
+    DBG_INFO( "HCI_PIN_CODE_REQUEST (Will return: 00)\n");
+
+    /*Verify the configuration*/
+    if(!_HCI_isConfigured())
+    {
+        DBG_ERROR("HCI not configured.\n");
+        return;
+    }
+
+    /*Respond with a PIN Code Request Reply command*/
+
+    /*Get the remote device BD ADDRESS*/
+    for(i=0; i<6; ++i)
+    {
+        aBDAddr[i] = pEventData[2+i];
+    }
+    /*Issue the command using the external HCI API*/
+    _HCI_cmdPinCodeRequestReply(aBDAddr, psConfData->sPinCode,
+            psConfData->uPinCodeLen);
+}
+
+/*CONNECTION_REQUEST event*/
+void _HCI_evtConnectionRequest(const BYTE *pEventData)
+{
+    BYTE aData[HCI_ACCEPT_CONN_REQ_PLEN - HCI_CMD_HDR_LEN];
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+    UINT i;
+
+    /*Verify the configuration*/
+    if(!_HCI_isConfigured())
+    {
+        DBG_ERROR("HCI not configured.\n");
+        return;
+    }
+
+    /*Save the remote device BD ADDRESS*/
+    for(i=0;i<6;++i)
+    {
+        psConnData->aRemoteADDR[i]=pEventData[HCI_EVENT_HDR_LEN+i];
+    }
+
+    /*Accept the connection*/
+
+    /*Fill the command parameters*/
+    /*The remote address*/
+    for(i=0;i<6;++i)
+    {
+        aData[i] = psConnData->aRemoteADDR[i];
+    }
+    /*Continue as a slave*/
+    aData[6] = 0x01;
+
+    /*Issue the command (ACCEPT_CONNECTION_REQUEST)*/
+    _HCI_cmd(aData, HCI_ACCEPT_CONN_REQ_OCF, HCI_LINK_CTRL_OGF,
+            HCI_ACCEPT_CONN_REQ_PLEN, NULL);
+}
+
+/*CONNECTION_COMPLETE event*/
+void _HCI_evtConnectionComplete(const BYTE *pEventData)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+    HCI_PAGE_DATA *psPageData = gpsHCICB->psHCIPageData;
+    BOOL isPaged;
+    UINT i;
+
+    /*Verify the configuration*/
+    if(!_HCI_isConfigured())
+    {
+        DBG_ERROR("HCI not configured.\n");
+        return;
+    }
+
+    /*Is it the outcome of our own page?*/
+    isPaged = HCI_PAGE_CONNECTING == psPageData->bState &&
+            BT_isEqualBD_ADDR(&pEventData[5],
+                psPageData->aaTarget[psPageData->bNextTarget]);
+    if(isPaged)
+    {
+        _HCI_pageNext(HCI_SUCCESS == pEventData[2]);
+    }
+
+    /*If the connection was sucessful*/
+    if(pEventData[2] == HCI_SUCCESS)
+    {
+            /*Save the connection handler and the remote address*/
+            psConnData->uConnHandler = BT_readLE16(pEventData,3);
+            for(i = 0; i < HCI_BD_ADDR_LEN; ++i)
+            {
+                psConnData->aRemoteADDR[i] = pEventData[5 + i];
+            }
+            DBG_INFO( "HCI_CONNECTION_COMPLETE%s\n",
+                    isPaged ? " (paged)" : "");
+
+            /*Raise the connection flag*/
+            psConnData->isConnected = TRUE;
+            _HCI_linkOpen();
+            if(isPaged)
+            {
+                _HCI_remoteNameRequest(psConnData->aRemoteADDR);
+            }
+            /*The device opens the channels of the links it paged*/
+            if(NULL != gpsHCICB->linkOpen)
+            {
+                gpsHCICB->linkOpen(isPaged);
+            }
+
+            /*Time the peer needed to reach us, then scan at low duty*/
+            DBG_INFO( "HCI connected after %lu ms of scan profile %d\n",
+                    BT_ticksToUs(BT_getTicks() -
+                        gpsHCICB->psHCIConfData->dwScanSince) / 1000,
+                    gpsHCICB->psHCIConfData->bScanProfile);
+            if(HCI_SCAN_LOW_DUTY != gpsHCICB->psHCIConfData->bScanProfile)
+            {
+                _HCI_scanApply(HCI_SCAN_LOW_DUTY);
+            }
+    }
+    else
+    {
+            DBG_INFO( "HCI_CONNECTION_ERROR\n");
+            psConnData->isConnected = FALSE;
+    }
+}
+
+/*DISCONNECTION COMPLETE event*/
+void _HCI_evtDisconnectionComplete(const BYTE *pEventData)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
+
+    /*Verify the connection*/
+    if(!_HCI_isConnected())
+    {
+        DBG_ERROR("HCI not connected.\n");
+        return;
+    }
+
+    /*Lower the connection flag*/
+    psConnData->isConnected = FALSE;
+    _HCI_linkClosed();
+    /*The controller flushes the packets of the link*/
+    psConnData->uPacketsToAck = 0;
+    psConnData->bStampCount = 0;
+    psConnData->uHostPendingAcks = 0;
+    DBG_INFO( "HCI_DISCONNECTION_COMPLETE\n");
+
+    /*The channels went with the link, a new link opens new ones*/
+    if(NULL != gpsHCICB->L2CAPlinkClosed)
+    {
+        gpsHCICB->L2CAPlinkClosed();
+    }
 
-            /*Verify the configuration*/
-            if(!_HCI_isConfigured())
-            {
-                DBG_ERROR("HCI not configured.\n");
-                return;
-            }
+    /*The peer is likely to come back soon: fast connectable again*/
+    _HCI_scanApply(HCI_SCAN_FAST);
+}
 
-            /*Respond with a PIN Code Request Reply command*/
+/*MODE_CHANGE event*/
+void _HCI_evtModeChange(const BYTE *pEventData)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
 
-            /*Get the remote device BD ADDRESS*/
-            for(i=0; i<6; ++i)
-            {
-                aBDAddr[i] = pEventData[2+i];
-            }
-            /*Issue the command using the external HCI API*/
-            _HCI_cmdPinCodeRequestReply(aBDAddr, psConfData->sPinCode,
-                    psConfData->uPinCodeLen);
-            break;
+    /*Verify the connection*/
+    if(!_HCI_isConnected())
+    {
+        DBG_ERROR("HCI not connected.\n");
+        return;
+    }
+    psConnData->isModePending = FALSE;
+    if(pEventData[2] != HCI_SUCCESS ||
+       BT_readLE16(pEventData, 3) != psConnData->uConnHandler)
+    {
+        return;
+    }
+    DBG_INFO( "HCI_MODE_CHANGE: Mode %d, interval %d\n",
+            pEventData[5], BT_readLE16(pEventData, 6));
+    _HCI_linkSetMode(pEventData[5]);
+
+    /*Data queued while entering sniff: back to active*/
+    if(HCI_MODE_SNIFF == pEventData[5] &&
+       BT_ticksToUs(BT_getTicks() - psConnData->dwLastActivity) / 1000 <
+            gasHCIPolicy[psConnData->bPolicy].uIdleMs)
+    {
+        _HCI_linkActivity();
+    }
+}
 
-        /*CONNECTION_REQUEST event*/
-        case HCI_CONNECTION_REQUEST:
-            /*Verify the configuration*/
-            if(!_HCI_isConfigured())
-            {
-                DBG_ERROR("HCI not configured.\n");
-                return;
-            }
+/*READ_REMOTE_SUPPORTED_FEATURES complete*/
+void _HCI_evtRemoteFeatures(const BYTE *pEventData)
+{
+    BYTE aData[HCI_CHANGE_PKT_TYPE_PLEN - HCI_CMD_HDR_LEN];
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
 
-            /*Save the remote device BD ADDRESS*/
-            for(i=0;i<6;++i)
-            {
-                psConnData->aRemoteADDR[i]=pEventData[HCI_EVENT_HDR_LEN+i];
-            }
+    if(!_HCI_isConnected() || pEventData[2] != HCI_SUCCESS ||
+       BT_readLE16(pEventData, 3) != psConnData->uConnHandler)
+    {
+        return;
+    }
+    DBG_INFO( "Remote features: ");
+    DBG_DUMP(&pEventData[5], HCI_FEATURES_LEN);
+
+    /*Ask for the best packet types both ends support*/
+    BT_storeLE16(psConnData->uConnHandler, aData, 0);
+    BT_storeLE16(_HCI_selectPacketType(&pEventData[5]), aData, 2);
+    _HCI_cmd(aData, HCI_CHANGE_PKT_TYPE_OCF, HCI_LINK_CTRL_OGF,
+            HCI_CHANGE_PKT_TYPE_PLEN, NULL);
+}
 
-            /*Accept the connection*/
+/*CONNECTION_PACKET_TYPE_CHANGED event*/
+void _HCI_evtPacketTypeChanged(const BYTE *pEventData)
+{
+    HCI_CONNECTION_DATA *psConnData = gpsHCICB->psHCIConnData;
 
-            /*Fill the command parameters*/
-            /*The remote address*/
-            for(i=0;i<6;++i)
-            {
-                aData[i] = psConnData->aRemoteADDR[i];
-            }
-            /*Continue as a slave*/
-            aData[6] = 0x01;
+    if(!_HCI_isConnected() || pEventData[2] != HCI_SUCCESS ||
+       BT_readLE16(pEventData, 3) != psConnData->uConnHandler)
+    {
+        return;
+    }
+    psConnData->uPacketType = BT_readLE16(pEventData, 5);
+    DBG_INFO( "HCI_CONN_PACKET_TYPE_CHANGED: 0x%04X\n",
+            psConnData->uPacketType);
+}
 
-            /*Issue the command (ACCEPT_CONNECTION_REQUEST)*/
-            _HCI_cmd(aData, HCI_ACCEPT_CONN_REQ_OCF, HCI_LINK_CTRL_OGF,
-                    HCI_ACCEPT_CONN_REQ_PLEN);
-            break;
+/*MAX_SLOTS_CHANGE event*/
+void _HCI_evtMaxSlotsChange(const BYTE *pEventData)
+{
+    DBG_INFO( "HCI_MAX_SLOTS_CHANGE: %d slots\n", pEventData[4]);
+}
 
-        /*CONNECTION_COMPLETE event*/
-        case HCI_CONNECTION_COMPLETE:
-            /*Verify the configuration*/
-            if(!_HCI_isConfigured())
-            {
-                DBG_ERROR("HCI not configured.\n");
-                return;
-            }
+/* LINK KEY REQUEST event */
+void _HCI_evtLinkKeyRequest(const BYTE *pEventData)
+{
+    BYTE aData[HCI_LINK_KEY_REQ_REP_PLEN - HCI_CMD_HDR_LEN];
+    UINT i;
 
-            /*If the connection was sucessful*/
-            if(pEventData[2] == HCI_SUCCESS)
-            {
-                    /*Save the connection handler*/
-                    psConnData->uConnHandler = BT_readLE16(pEventData,3);
-                    DBG_INFO( "HCI_CONNECTION_COMPLETE\n");
+    /* Answer from the host key store, no controller round-trip */
+    for (i = 0; i < 6; ++i)
+    {
+        aData[i] = pEventData[2+i];
+    }
+    if (BT_keyStoreFind(aData, &aData[6]))
+    {
+        DBG_INFO("HCI_LINK_KEY_REQUEST: Key found\n");
+        _HCI_cmd(aData, HCI_LINK_KEY_REQ_REP_OCF, HCI_LINK_CTRL_OGF,
+                HCI_LINK_KEY_REQ_REP_PLEN, NULL);
+    }
+    else
+    {
+        /* Unknown device: the controller falls back to the PIN */
+        DBG_INFO("HCI_LINK_KEY_REQUEST: No key\n");
+        _HCI_cmd(aData, HCI_LINK_KEY_NEG_REP_OCF, HCI_LINK_CTRL_OGF,
+                HCI_LINK_KEY_NEG_REP_PLEN, NULL);
+    }
+}
 
-                    /*Raise the connection flag*/
-                    psConnData->isConnected = TRUE;
-            }
-            else
-            {
-                    DBG_INFO( "HCI_CONNECTION_ERROR\n");
-                    psConnData->isConnected = FALSE;
-            }
-            break;
+/* LINK KEY NOTIFICATION event */
+void _HCI_evtLinkKeyNotification(const BYTE *pEventData)
+{
+    /* BD_ADDR, the key itself and the key type */
+    if (!BT_keyStorePut(&pEventData[2], &pEventData[8],
+            pEventData[8 + BT_LINK_KEY_LEN]))
+    {
+        DBG_ERROR("Link key not stored.\n");
+    }
+}
 
-        /*COMAND COMPLETE event*/
-        case HCI_COMMAND_COMPLETE:
-            /*Let the command handler take care of it...*/
-            _HCI_commandEnd(pEventData);
-            break;
+/*INQUIRY_RESULT event*/
+void _HCI_evtInquiryResult(const BYTE *pEventData)
+{
+    UINT uNum = pEventData[2];
+    UINT i;
 
-        /*DISCONNECTION COMPLETE event*/
-        case HCI_DISCONNECTION_COMPLETE:
-            /*Verify the connection*/
-            if(!_HCI_isConnected())
-            {
-                DBG_ERROR("HCI not connected.\n");
-                return;
-            }
+    /*
+     * The parameters are arrays (all the addresses, then all the page scan
+     * repetition modes...), a result cut by the event buffer is useless.
+     */
+    if(HCI_EVENT_HDR_LEN + 1 + uNum * 14 > EVENT_PACKET_LENGTH)
+    {
+        DBG_INFO( "HCI: %d inquiry results dropped\n", uNum);
+        return;
+    }
+    for(i = 0; i < uNum; ++i)
+    {
+        /*BD_ADDR, page scan repetition mode and clock offset*/
+        _HCI_inqCachePut(&pEventData[3 + i * HCI_BD_ADDR_LEN],
+                pEventData[3 + uNum * 6 + i],
+                BT_readLE16(pEventData, 3 + uNum * 12 + i * 2));
+    }
+}
 
-            /*Lower the connection flag*/
-            psConnData->isConnected = FALSE;
-            DBG_INFO( "HCI_DISCONNECTION_COMPLETE\n");
+/*INQUIRY_COMPLETE event*/
+void _HCI_evtInquiryComplete(const BYTE *pEventData)
+{
+    HCI_PAGE_DATA *psPageData = gpsHCICB->psHCIPageData;
 
-            break;
+    DBG_INFO( "HCI_INQUIRY_COMPLETE (0x%02X)\n", pEventData[2]);
 
-        /* LINK KEY REQUEST event */
-       case HCI_LINK_KEY_REQUEST:
-           /* Store the BD_ADDR */
-            for (i = 0; i < 6; ++i)
-            {
-                aData[i] = pEventData[2+i];
-            }
-            aData[6] = 0x01;
-            /*Issue the command (READ STORED LINK KEY)*/
-            _HCI_cmd(aData, HCI_R_STORED_LINK_KEY_OCF, HCI_HC_BB_OGF,
-                    HCI_R_STORED_LINK_KEY_PLEN);
-           break;
-
-        /* LINK KEY NOTIFICATION event */
-        case HCI_LINK_KEY_NOTIFICATION:
-            /* Number of keys to store */
-            aData[0] = 0x01;
-            /* Store the BD_ADDR */
-            for (i = 0; i < 6; ++i)
-            {
-                aData[1 + i] = pEventData[2+i];
-            }
-            /* Store the key itself */
-            for (i = 0; i < 16; ++i)
-            {
-                aData[1 + 6 + i] = pEventData[8+i];
-            }
-            /*Issue the command (ACCEPT_CONNECTION_REQUEST)*/
-            _HCI_cmd(aData, HCI_W_STORED_LINK_KEY_OCF, HCI_HC_BB_OGF,
-                    HCI_W_STORED_LINK_KEY_PLEN);
-            break;
+    /*Page straight away, with or without the target in the cache*/
+    if(HCI_PAGE_INQUIRY == psPageData->bState)
+    {
+        psPageData->bState = HCI_PAGE_IDLE;
+    }
+}
 
-        /* RETURN LINK KEY event */
-        case HCI_RETURN_LINK_KEYS:
-            DBG_INFO("Return Link Key event returned %d keys\n", i);
-            /*
-             * Check for each of the returned BD_ADDR if the value is the same
-             * as the remote device. In case it is send the KEY REQUEST REPLY
-             * command with the pair BDADDR/KEY.
-             */
-            i = pEventData[2];
-            for (j = 0; j < i; ++j)
-            {
-                if (BT_isEqualBD_ADDR(psConnData->aRemoteADDR, 
-                        &pEventData[1 + j*6]))
-                {
-                    for(k = 0; k < 6; ++k)
-                    {
-                        aData[k] = pEventData[1 + j*6 + k];
-                    }
-                    for(k = 0; k < 16; ++k)
-                    {
-                        aData[6 + k] = pEventData[1 + i*6 + k];
-                    }
-                    _HCI_cmd(aData, HCI_LINK_KEY_REQ_REP_OCF, HCI_LINK_CTRL_OGF,
-                            HCI_LINK_KEY_REQ_REP_PLEN);
-                }
-            }
-            break;
+/*REMOTE_NAME_REQUEST_COMPLETE event*/
+void _HCI_evtRemoteNameComplete(const BYTE *pEventData)
+{
+    CHAR sName[HCI_REMOTE_NAME_LEN + 1];
+    UINT i;
 
-        default:
-            break;
+    if(HCI_SUCCESS != pEventData[2])
+    {
+        DBG_INFO( "HCI: Remote name error 0x%02X\n", pEventData[2]);
+        return;
+    }
+    /*Only the beginning of the name fits in the event buffer*/
+    for(i = 0; i < HCI_REMOTE_NAME_LEN && '\0' != pEventData[9 + i]; ++i)
+    {
+        sName[i] = pEventData[9 + i];
     }
+    sName[i] = '\0';
+    DBG_INFO( "HCI: Remote name \"%s\"\n", sName);
 }
 
 /*
@@ -591,8 +1866,17 @@ void _HCI_eventHandler(const BYTE *pEventData)
 
 void HCI_API_cmdReset()
 {
-    /*Send the RESET command to the device*/
-    _HCI_cmd(NULL,HCI_RESET_OCF,HCI_HC_BB_OGF,HCI_RESET_PLEN);
+    ASSERT(NULL != gpsHCICB);
+
+    /*Forget whatever was pending and start the bring-up with RESET*/
+    _HCI_cmdFlush();
+    gpsHCICB->psHCIConfData->isConfigured = FALSE;
+    gpsHCICB->psHCIPageData->bState = HCI_PAGE_IDLE;
+    gpsHCICB->uEvtSkip = 0;
+    gpsHCICB->psHCIConfData->dwInitStart = BT_getTicks();
+    gpsHCICB->psHCIConfData->bInitNext = 0;
+    gpsHCICB->psHCIConfData->isInitFailed = FALSE;
+    _HCI_initFill();
 }
 
 BOOL HCI_API_setLocalName(const CHAR *pName, UINT uLen)
@@ -659,7 +1943,7 @@ void _HCI_cmdDisconnect()
     aData[2]=0x13;
 
     /*Send the DISCONNECT command to the device*/
-    _HCI_cmd(aData, HCI_DISCONN_OCF,HCI_LINK_CTRL_OGF, HCI_DISCONN_PLEN);
+    _HCI_cmd(aData, HCI_DISCONN_OCF,HCI_LINK_CTRL_OGF, HCI_DISCONN_PLEN, NULL);
 }
 
 int _HCI_cmdPinCodeRequestReply(BYTE aBDAddr[6], const char *sPIN, unsigned uPINLen)
@@ -695,10 +1979,34 @@ int _HCI_cmdPinCodeRequestReply(BYTE aBDAddr[6], const char *sPIN, unsigned uPIN
     }
 
     /*Send the PIN_CODE_REQUEST_REPLY command to the device*/
-    _HCI_cmd(aData, cmd_code,HCI_LINK_CTRL_OGF, HCI_PIN_CODE_REQ_REP_PLEN);
+    _HCI_cmd(aData, cmd_code,HCI_LINK_CTRL_OGF, HCI_PIN_CODE_REQ_REP_PLEN,
+            NULL);
     return HCI_PIN_CODE_REQ_REP_PLEN;
 }
 
+#ifdef BT_PROFILE_ENABLE
+/*Data path entry points, profiled*/
+BOOL _HCI_profSendData(const BYTE *pData, unsigned uLen)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = HCI_API_sendData(pData, uLen);
+    BT_profileLeave(BT_LAYER_HCI, uLen);
+    return bRetVal;
+}
+
+BOOL _HCI_profPutData(const BYTE *pData, unsigned uLen)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = HCI_API_putData(pData, uLen);
+    BT_profileLeave(BT_LAYER_HCI, uLen);
+    return bRetVal;
+}
+#endif
+
 /*Send data to the remote device*/
 /*NOTICE: Does not support fragmentation*/
 BOOL HCI_API_sendData(const BYTE *pData, unsigned uLen)
@@ -709,10 +2017,22 @@ BOOL HCI_API_sendData(const BYTE *pData, unsigned uLen)
     UINT16 ConnHandler;
     BYTE aUSBData[uLen + HCI_ACL_HDR_LEN];
 
-    /*Verify the connection*/
-    ASSERT(_HCI_isConnected());
+    /*Verify the connection (the L2CAP keeps the frame meanwhile)*/
+    if(!_HCI_isConnected())
+    {
+        return FALSE;
+    }
     psConnData = gpsHCICB->psHCIConnData;
 
+    /*Wait until the controller has a free ACL buffer*/
+    if(gpsHCICB->psHCIConfData->uCtrlNumAclBuffers != 0 &&
+       psConnData->uPacketsToAck >=
+            gpsHCICB->psHCIConfData->uCtrlNumAclBuffers)
+    {
+        DBG_INFO( "HCI w ACL: Controller full\n");
+        return FALSE;
+    }
+
     /*Verify the data*/
     if(NULL == pData || !uLen)
     {
@@ -728,7 +2048,8 @@ BOOL HCI_API_sendData(const BYTE *pData, unsigned uLen)
 
     /*Check if the data fits in a single HCI frame*/
     uLength = uLen + HCI_ACL_HDR_LEN;
-    ASSERT(uLength <= DATA_PACKET_LENGTH);/* Packet frag. not implemented */
+    /* Packet frag. not implemented: the L2CAP keeps its frames this short */
+    ASSERT(uLength <= _HCI_getMaxAclFrameSize());
 
     /*Fill the header with the connection handler and the data lenght*/
     BT_storeLE16(ConnHandler, aUSBData, 0);
@@ -738,13 +2059,18 @@ BOOL HCI_API_sendData(const BYTE *pData, unsigned uLen)
     {
         aUSBData[i+HCI_ACL_HDR_LEN] = pData[i];
     }
+    /*Wake the link up if it sleeps in sniff mode*/
+    _HCI_linkActivity();
+
     /*Write the packet (using the hci_usb API)*/
-    if(gpsHCICB->PHY_w_ACL(aUSBData, uLength)!=HCI_USB_BUSY)
+    if(gpsHCICB->PHY_w_ACL(aUSBData, uLength)!=HCI_TRANSPORT_BUSY)
     {
-		DelayMs(10);
         DBG_INFO( "HCI w ACL: ");
         DBG_DUMP(aUSBData, uLen + HCI_ACL_HDR_LEN);
+        BT_snoopRecord(BT_SNOOP_ACL, FALSE, aUSBData, uLength, uLength);
         ++psConnData->uPacketsToAck;
+        _HCI_txStampPush();
+        psConnData->dwTxBytes += uLen;
         return TRUE;
     }
     DBG_INFO( "HCI w ACL: BUSY\n");
@@ -756,9 +2082,6 @@ BOOL HCI_API_putData(const BYTE *pData, unsigned uLen)
     BOOL bContinuation = FALSE;
     UINT16 uConnHandle;
 
-    /*Verify the connection*/
-    ASSERT(_HCI_isConnected());
-
     /*Verify the data*/
     if(NULL == pData || (uLen<HCI_ACL_HDR_LEN))
     {
@@ -766,9 +2089,27 @@ BOOL HCI_API_putData(const BYTE *pData, unsigned uLen)
         return FALSE;
     }
 
-	DelayMs(10);
+    /*
+     * Verify the connection: the transport may deliver a buffer read before
+     * the DISCONNECTION_COMPLETE it handed over first. The controller frees
+     * the host buffers of a closed handle, so no completion is owed.
+     */
+    uConnHandle = BT_readLE16(pData,0);
+    if(!_HCI_isConnected() ||
+       (uConnHandle & 0x0FFF) != gpsHCICB->psHCIConnData->uConnHandler)
+    {
+        DBG_INFO("HCI ACL for handle 0x%03X dropped, not connected.\n",
+                uConnHandle & 0x0FFF);
+        return FALSE;
+    }
+
     DBG_INFO( "HCI r ACL: ");
     DBG_DUMP(pData,uLen);
+    BT_snoopRecord(BT_SNOOP_ACL, TRUE, pData, uLen, uLen);
+
+    /*The peer is sending, keep the link active*/
+    _HCI_linkActivity();
+    gpsHCICB->psHCIConnData->dwRxBytes += uLen - HCI_ACL_HDR_LEN;
 
     /*
      * Check if the Packet Boundary flag is set (bContinuation):
@@ -776,7 +2117,6 @@ BOOL HCI_API_putData(const BYTE *pData, unsigned uLen)
      * bContinuation FALSE: This is the last fragment of a given packet.
      * bContinuation TRUE: More fragments follow this one.
      */
-    uConnHandle = BT_readLE16(pData,0);
     if(uConnHandle & 0x1000)
     {
         bContinuation = TRUE;
@@ -785,6 +2125,196 @@ BOOL HCI_API_putData(const BYTE *pData, unsigned uLen)
     /*Put the data into the L2CAP layer*/
     gpsHCICB->L2CAPputData(&pData[HCI_ACL_HDR_LEN], uLen-HCI_ACL_HDR_LEN,
             bContinuation);
+
+    /*The RX buffer is free again, account it for the controller*/
+    if(gpsHCICB->psHCIConfData->bCHFlowControl)
+    {
+        ++gpsHCICB->psHCIConnData->uHostPendingAcks;
+        _HCI_cmdSend();
+    }
+    return TRUE;
+}
+
+void HCI_API_putACLDone()
+{
+    ASSERT(NULL != gpsHCICB);
+
+    /*The USB endpoint is free again, send the next frame*/
+    if (NULL != gpsHCICB->L2CAPtxReady)
+    {
+        gpsHCICB->L2CAPtxReady();
+    }
+}
+
+void HCI_API_putCMDDone()
+{
+    ASSERT(NULL != gpsHCICB);
+
+    /*EP0 is free again, send the next queued command*/
+    gpsHCICB->isCtlBusy = FALSE;
+    _HCI_cmdSend();
+}
+
+/*Periodic HCI work: transport, scans, paging and link power policy*/
+void HCI_API_tasks()
+{
+    BYTE aData[HCI_SNIFF_MODE_PLEN - HCI_CMD_HDR_LEN];
+    HCI_CONNECTION_DATA *psConnData;
+    const HCI_POWER_POLICY *psPolicy;
+
+    ASSERT(NULL != gpsHCICB);
+    psConnData = gpsHCICB->psHCIConnData;
+    psPolicy = &gasHCIPolicy[psConnData->bPolicy];
+
+    /*Stream transports move their bytes here*/
+    if(NULL != gpsHCICB->PHY_tasks)
+    {
+        gpsHCICB->PHY_tasks();
+    }
+    /*
+     * Bring-up steps that found no room for their command buffer, and the
+     * commands or completed packets the transport was too busy to take:
+     * on an idle link nothing else would retry them, the controller would
+     * run out of ACL credits for us.
+     */
+    _HCI_initFill();
+    _HCI_cmdSend();
+    _HCI_eventMaskTasks();
+    _HCI_scanTasks();
+    _HCI_pageTasks();
+
+    /*Only an idle active link (nothing unacknowledged) goes to sniff*/
+    if(!_HCI_isConnected() || 0 == psPolicy->uIdleMs ||
+       HCI_MODE_ACTIVE != psConnData->bLinkMode ||
+       psConnData->isModePending || psConnData->uPacketsToAck > 0)
+    {
+        return;
+    }
+    if(BT_ticksToUs(BT_getTicks() - psConnData->dwLastActivity) / 1000 <
+            psPolicy->uIdleMs)
+    {
+        return;
+    }
+
+    /*Connection handle, max and min interval, attempt and timeout*/
+    BT_storeLE16(psConnData->uConnHandler, aData, 0);
+    BT_storeLE16(psConnData->uSniffInterval, aData, 2);
+    BT_storeLE16(psConnData->uSniffInterval / 2, aData, 4);
+    BT_storeLE16(HCI_SNIFF_ATTEMPT, aData, 6);
+    BT_storeLE16(HCI_SNIFF_TIMEOUT, aData, 8);
+    if(_HCI_cmd(aData, HCI_SNIFF_MODE_OCF, HCI_LINK_POLICY_OGF,
+            HCI_SNIFF_MODE_PLEN, &_HCI_linkModeCmdDone))
+    {
+        psConnData->isModePending = TRUE;
+    }
+}
+
+BOOL HCI_API_subscribeEvent(UINT8 bEvent, void (*putEvent)(const BYTE*))
+{
+    UINT i;
+
+    ASSERT(NULL != gpsHCICB);
+
+    if(bEvent >= HCI_NUM_EVENTS || NULL == putEvent)
+    {
+        return FALSE;
+    }
+    for(i = 0; i < HCI_MAX_EVT_SUBSCRIBERS; ++i)
+    {
+        if(NULL == gpsHCICB->asEvtSubscriber[i].putEvent)
+        {
+            gpsHCICB->asEvtSubscriber[i].bEvent = bEvent;
+            gpsHCICB->asEvtSubscriber[i].putEvent = putEvent;
+            break;
+        }
+    }
+    if(HCI_MAX_EVT_SUBSCRIBERS == i)
+    {
+        DBG_ERROR("HCI: No room for event subscribers.\n");
+        return FALSE;
+    }
+
+    /*
+     * Have the controller report it. Before bring-up the mask goes with the
+     * SET_EVENT_MASK step, after it the new mask is sent on its own.
+     */
+    if(bEvent > 0 && !(gpsHCICB->qwEventMask & HCI_EVENT_BIT(bEvent)))
+    {
+        gpsHCICB->qwEventMask |= HCI_EVENT_BIT(bEvent);
+        gpsHCICB->isEventMaskPending = TRUE;
+        _HCI_eventMaskTasks();
+    }
+    return TRUE;
+}
+
+BOOL HCI_API_setScanProfile(UINT8 bProfile, const HCI_SCAN_PROFILE *psProfile)
+{
+    HCI_CONFIGURATION_DATA *psConfData;
+
+    ASSERT(NULL != gpsHCICB);
+    psConfData = gpsHCICB->psHCIConfData;
+
+    /*Intervals and windows are even, 0x0012 to 0x1000, window <= interval*/
+    if(bProfile >= HCI_NUM_SCAN_PROFILES || NULL == psProfile ||
+       psProfile->uPageWindow > psProfile->uPageInterval ||
+       psProfile->uInqWindow > psProfile->uInqInterval)
+    {
+        return FALSE;
+    }
+    psConfData->asScanProfile[bProfile] = *psProfile;
+
+    /*Takes effect at once if the profile is in use*/
+    if(_HCI_isConfigured() && bProfile == psConfData->bScanProfile)
+    {
+        _HCI_scanApply(bProfile);
+    }
+    return TRUE;
+}
+
+BOOL HCI_API_getEventStats(UINT8 bEvent, UINT16 *puCount, DWORD *pdwCycles)
+{
+    ASSERT(NULL != gpsHCICB);
+
+    if(bEvent >= HCI_NUM_EVENTS)
+    {
+        return FALSE;
+    }
+    *puCount = gpsHCICB->asEvtStats[bEvent].uCount;
+    *pdwCycles = gpsHCICB->asEvtStats[bEvent].dwCycles;
+    return TRUE;
+}
+
+UINT16 HCI_API_getAclLength()
+{
+    ASSERT(NULL != gpsHCICB);
+    return _HCI_getMaxAclFrameSize() - HCI_ACL_HDR_LEN;
+}
+
+UINT16 HCI_API_getPacketType()
+{
+    ASSERT(NULL != gpsHCICB);
+    return gpsHCICB->psHCIConnData->uPacketType;
+}
+
+BOOL HCI_API_setPowerPolicy(UINT8 bPolicy)
+{
+    HCI_CONNECTION_DATA *psConnData;
+
+    ASSERT(NULL != gpsHCICB);
+    psConnData = gpsHCICB->psHCIConnData;
+
+    if(bPolicy >= HCI_NUM_POLICIES)
+    {
+        return FALSE;
+    }
+    psConnData->bPolicy = bPolicy;
+    psConnData->uSniffInterval = gasHCIPolicy[bPolicy].uMinInterval;
+
+    /*Latency first: wake the link up now*/
+    if(_HCI_isConnected() && 0 == gasHCIPolicy[bPolicy].uIdleMs)
+    {
+        _HCI_linkActivity();
+    }
     return TRUE;
 }
 
@@ -796,11 +2326,51 @@ BOOL HCI_API_putEvent(const BYTE *pData, unsigned uLen)
         DBG_ERROR("Not a correct event.");
         return FALSE;
     }
-	DelayMs(10);
+    /*The rest of an event too long for the buffer is not an event*/
+    if(gpsHCICB->uEvtSkip > 0)
+    {
+        gpsHCICB->uEvtSkip -= (uLen < gpsHCICB->uEvtSkip) ?
+                uLen : gpsHCICB->uEvtSkip;
+        return TRUE;
+    }
+    if(uLen < HCI_EVENT_HDR_LEN + (unsigned) pData[1])
+    {
+        gpsHCICB->uEvtSkip = HCI_EVENT_HDR_LEN + pData[1] - uLen;
+    }
     DBG_INFO( "HCI r EVT: ");
     DBG_DUMP(pData,uLen);
+    BT_snoopRecord(BT_SNOOP_EVT, TRUE, pData, uLen,
+            HCI_EVENT_HDR_LEN + pData[1]);
 
     /*Forward the event to the event handler*/
     _HCI_eventHandler(pData);
     return TRUE;
 }
+
+BOOL HCI_API_addPageTarget(const BYTE *pBDAddr)
+{
+    HCI_PAGE_DATA *psPageData;
+    UINT i;
+
+    ASSERT(NULL != gpsHCICB);
+    psPageData = gpsHCICB->psHCIPageData;
+
+    if(NULL == pBDAddr || psPageData->bNumTargets >= HCI_MAX_PAGE_TARGETS)
+    {
+        return FALSE;
+    }
+    for(i = 0; i < psPageData->bNumTargets; ++i)
+    {
+        if(BT_isEqualBD_ADDR(psPageData->aaTarget[i], pBDAddr))
+        {
+            return TRUE;
+        }
+    }
+    for(i = 0; i < HCI_BD_ADDR_LEN; ++i)
+    {
+        psPageData->aaTarget[psPageData->bNumTargets][i] = pBDAddr[i];
+    }
+    /*Paged from the next HCI_API_tasks on*/
+    ++psPageData->bNumTargets;
+    return TRUE;
+}
@@ -30,9 +30,12 @@
 #define HCI_CMD_HDR_LEN 3
 
 /*Possible event codes*/
+#define HCI_INQUIRY_COMPLETE 0x01
+#define HCI_INQUIRY_RESULT 0x02
 #define HCI_CONNECTION_COMPLETE 0x03
 #define HCI_CONNECTION_REQUEST 0x04
 #define HCI_DISCONNECTION_COMPLETE 0x05
+#define HCI_REMOTE_NAME_REQ_COMPLETE 0x07
 #define HCI_COMMAND_COMPLETE 0x0E
 #define HCI_COMMAND_STATUS 0x0F
 #define HCI_NBR_OF_COMPLETED_PACKETS 0x13
@@ -40,9 +43,18 @@
 #define HCI_PIN_CODE_REQUEST 0x16
 #define HCI_LINK_KEY_REQUEST 0x17
 #define HCI_LINK_KEY_NOTIFICATION 0x18
+#define HCI_MODE_CHANGE 0x14
+#define HCI_READ_REMOTE_FEATURES_COMPLETE 0x0B
+#define HCI_CONN_PACKET_TYPE_CHANGED 0x1D
+#define HCI_MAX_SLOTS_CHANGE 0x1B
 
-/*Success code*/
+/*Event codes dispatched (and counted) by the HCI*/
+#define HCI_NUM_EVENTS 0x30
+#define HCI_MAX_EVT_SUBSCRIBERS 4
+
+/*Success and error codes*/
 #define HCI_SUCCESS 0x00
+#define HCI_UNKNOWN_COMMAND 0x01
 
 /*Specification specific parameters*/
 #define HCI_BD_ADDR_LEN 6
@@ -54,6 +66,9 @@
 #define HCI_INFO_PARAM_OGF 0x04
 
 /*Command OCF*/
+#define HCI_INQUIRY_OCF 0x01
+#define HCI_CREATE_CONN_OCF 0x05
+#define HCI_REMOTE_NAME_REQ_OCF 0x19
 #define HCI_DISCONN_OCF 0x06
 #define HCI_ACCEPT_CONN_REQ_OCF 0x09
 #define HCI_RESET_OCF 0x03
@@ -69,8 +84,24 @@
 #define HCI_R_STORED_LINK_KEY_OCF 0x0D
 #define HCI_W_STORED_LINK_KEY_OCF 0x11
 #define HCI_LINK_KEY_REQ_REP_OCF 0x0B
+#define HCI_LINK_KEY_NEG_REP_OCF 0x0C
+#define HCI_SET_EVENT_MASK_OCF 0x01
+#define HCI_SET_CH_FLOW_CTRL_OCF 0x31
+#define HCI_SNIFF_MODE_OCF 0x03
+#define HCI_EXIT_SNIFF_MODE_OCF 0x04
+#define HCI_W_LINK_POLICY_OCF 0x0D
+#define HCI_R_LOCAL_FEATURES_OCF 0x03
+#define HCI_R_REMOTE_FEATURES_OCF 0x1B
+#define HCI_CHANGE_PKT_TYPE_OCF 0x0F
+#define HCI_W_PAGE_SCAN_ACT_OCF 0x1C
+#define HCI_W_INQ_SCAN_ACT_OCF 0x1E
+#define HCI_W_INQ_SCAN_TYPE_OCF 0x43
+#define HCI_W_PAGE_SCAN_TYPE_OCF 0x47
 
 /*Command packet length (including ACL header)*/
+#define HCI_INQUIRY_PLEN 8
+#define HCI_CREATE_CONN_PLEN 16
+#define HCI_REMOTE_NAME_REQ_PLEN 13
 #define HCI_DISCONN_PLEN 6
 #define HCI_ACCEPT_CONN_REQ_PLEN 10
 #define HCI_PIN_CODE_REQ_REP_PLEN 26
@@ -80,12 +111,122 @@
 #define HCI_R_COD_PLEN 3
 #define HCI_W_COD_PLEN 6
 #define HCI_H_BUF_SIZE_PLEN 10
-#define HCI_H_NUM_COMPL_PLEN 7
-#define HCI_R_BUF_SIZE_PLEN 4
+#define HCI_H_NUM_COMPL_PLEN 8
+#define HCI_R_BUF_SIZE_PLEN 3
 #define HCI_R_BD_ADDR_PLEN 3
 #define HCI_R_STORED_LINK_KEY_PLEN 10
 #define HCI_W_STORED_LINK_KEY_PLEN 26
-#define HCI_LINK_KEY_REQ_REP_PLEN 27
+#define HCI_LINK_KEY_REQ_REP_PLEN 25
+#define HCI_LINK_KEY_NEG_REP_PLEN 9
+#define HCI_SET_EVENT_MASK_PLEN 11
+#define HCI_SET_CH_FLOW_CTRL_PLEN 4
+#define HCI_SNIFF_MODE_PLEN 13
+#define HCI_EXIT_SNIFF_MODE_PLEN 5
+#define HCI_W_LINK_POLICY_PLEN 7
+#define HCI_R_LOCAL_FEATURES_PLEN 3
+#define HCI_R_REMOTE_FEATURES_PLEN 5
+#define HCI_CHANGE_PKT_TYPE_PLEN 7
+#define HCI_W_SCAN_ACT_PLEN 7
+#define HCI_W_SCAN_TYPE_PLEN 4
+
+/*Event mask (64 bits): bit (event code - 1), the events the stack handles*/
+#define HCI_EVENT_BIT(E) (1ULL << ((E) - 1))
+#define HCI_EVENT_MASK (HCI_EVENT_BIT(HCI_INQUIRY_COMPLETE) |              \
+                        HCI_EVENT_BIT(HCI_INQUIRY_RESULT) |                \
+                        HCI_EVENT_BIT(HCI_CONNECTION_COMPLETE) |           \
+                        HCI_EVENT_BIT(HCI_CONNECTION_REQUEST) |            \
+                        HCI_EVENT_BIT(HCI_DISCONNECTION_COMPLETE) |        \
+                        HCI_EVENT_BIT(HCI_REMOTE_NAME_REQ_COMPLETE) |      \
+                        HCI_EVENT_BIT(HCI_COMMAND_COMPLETE) |              \
+                        HCI_EVENT_BIT(HCI_COMMAND_STATUS) |                \
+                        HCI_EVENT_BIT(HCI_NBR_OF_COMPLETED_PACKETS) |      \
+                        HCI_EVENT_BIT(HCI_PIN_CODE_REQUEST) |              \
+                        HCI_EVENT_BIT(HCI_LINK_KEY_REQUEST) |              \
+                        HCI_EVENT_BIT(HCI_LINK_KEY_NOTIFICATION) |         \
+                        HCI_EVENT_BIT(HCI_MODE_CHANGE) |                   \
+                        HCI_EVENT_BIT(HCI_READ_REMOTE_FEATURES_COMPLETE) | \
+                        HCI_EVENT_BIT(HCI_CONN_PACKET_TYPE_CHANGED) |      \
+                        HCI_EVENT_BIT(HCI_MAX_SLOTS_CHANGE))
+
+/*Link policy settings: allow sniff mode*/
+#define HCI_LINK_POLICY_SNIFF 0x0004
+
+/*Link modes (as reported by the MODE_CHANGE event)*/
+#define HCI_MODE_ACTIVE 0x00
+#define HCI_MODE_SNIFF 0x02
+
+/*Power policies: latency/throughput against power trade-off*/
+#define HCI_POLICY_LATENCY 0 /*Never sniff*/
+#define HCI_POLICY_BALANCED 1
+#define HCI_POLICY_POWER 2
+#define HCI_NUM_POLICIES 3
+#define HCI_DEFAULT_POLICY HCI_POLICY_BALANCED
+
+/*Sniff parameters (intervals in 0.625 ms baseband slots)*/
+#define HCI_SNIFF_ATTEMPT 0x0004
+#define HCI_SNIFF_TIMEOUT 0x0001
+/*A sniff period shorter than this many intervals halves the interval*/
+#define HCI_SNIFF_BUSY_PERIODS 8
+
+/*LMP features (byte, bit mask) deciding the ACL packet types*/
+#define HCI_FEATURES_LEN 8
+#define HCI_FEAT_3_SLOT 0, 0x01
+#define HCI_FEAT_5_SLOT 0, 0x02
+#define HCI_FEAT_EDR_2M 3, 0x02
+#define HCI_FEAT_EDR_3M 3, 0x04
+#define HCI_FEAT_EDR_3_SLOT 4, 0x80
+#define HCI_FEAT_EDR_5_SLOT 5, 0x01
+
+/*ACL packet types (the EDR bits mean "shall not be used")*/
+#define HCI_PKT_DM1 0x0008
+#define HCI_PKT_DH1 0x0010
+#define HCI_PKT_DM3 0x0400
+#define HCI_PKT_DH3 0x0800
+#define HCI_PKT_DM5 0x4000
+#define HCI_PKT_DH5 0x8000
+#define HCI_PKT_NO_2_DH1 0x0002
+#define HCI_PKT_NO_3_DH1 0x0004
+#define HCI_PKT_NO_2_DH3 0x0100
+#define HCI_PKT_NO_3_DH3 0x0200
+#define HCI_PKT_NO_2_DH5 0x1000
+#define HCI_PKT_NO_3_DH5 0x2000
+
+/*Scan profiles: fast connectable window, then low duty*/
+#define HCI_SCAN_FAST 0
+#define HCI_SCAN_LOW_DUTY 1
+#define HCI_NUM_SCAN_PROFILES 2
+/*Fast connectable window after boot or disconnection*/
+#define HCI_FAST_CONNECTABLE_MS 30000
+
+/*ACL packets timed from the write to the completed packets event*/
+#define HCI_TX_STAMPS 8
+
+/*Outbound paging: known targets and the inquiry cache*/
+#define HCI_MAX_PAGE_TARGETS 4
+#define HCI_INQ_CACHE_SIZE 4
+/*Cached page scan parameters are trusted this long (the core timer
+  wraps after 214 s, expired entries are swept before that)*/
+#define HCI_INQ_CACHE_TTL_MS 120000
+/*General inquiry access code, inquiry length (1.28 s units) and responses*/
+#define HCI_GIAC_LAP 0x9E8B33UL
+#define HCI_INQUIRY_LEN 0x04
+#define HCI_INQUIRY_MAX_RSP HCI_INQ_CACHE_SIZE
+/*Pause after a whole round of targets failed*/
+#define HCI_PAGE_ROUND_MS 10000
+/*Page scan repetition mode R1 (used when the target is not cached)*/
+#define HCI_PSRM_R1 0x01
+/*Clock offset valid flag*/
+#define HCI_CLOCK_OFFSET_VALID 0x8000
+/*Remote name bytes kept (the event is cut to EVENT_PACKET_LENGTH)*/
+#define HCI_REMOTE_NAME_LEN (EVENT_PACKET_LENGTH - 9)
+
+/*Paging states*/
+#define HCI_PAGE_IDLE 0
+#define HCI_PAGE_INQUIRY 1
+#define HCI_PAGE_CONNECTING 2
+
+/*Number of commands of the controller bring-up sequence*/
+#define HCI_INIT_STEPS 14
 
 /*
  * HCI structure definitions
@@ -98,8 +239,106 @@ typedef struct _HCI_CONNECTION_DATA
 	BYTE aRemoteADDR[6];
 	UINT16 uConnHandler;
         unsigned uPacketsToAck;
+        /*RX packets consumed but not yet reported to the controller*/
+        UINT16 uHostPendingAcks;
+        /*Power policy, link mode and time spent in each mode (ms)*/
+        BYTE bPolicy;
+        BYTE bLinkMode;
+        BOOL isModePending;
+        UINT16 uSniffInterval;
+        DWORD dwLastActivity;
+        DWORD dwModeSince;
+        DWORD dwActiveMs;
+        DWORD dwSniffMs;
+        /*ACL packet types in use and the traffic they carried*/
+        UINT16 uPacketType;
+        DWORD dwTxBytes;
+        DWORD dwRxBytes;
+        /*Write time of the packets the controller still holds (FIFO)*/
+        DWORD adwTxStamp[HCI_TX_STAMPS];
+        UINT8 bStampHead;
+        UINT8 bStampCount;
 } HCI_CONNECTION_DATA;
 
+/*Inquiry cache entry: what paging a device needs*/
+typedef struct _HCI_INQ_ENTRY
+{
+    BOOL isValid;
+    BYTE aBDAddr[HCI_BD_ADDR_LEN];
+    BYTE bPageScanRepMode;
+    UINT16 uClockOffset;
+    /*The offset is to the native clock of the controller that saw it*/
+    BOOL isClockValid;
+    DWORD dwSeen;
+} HCI_INQ_ENTRY;
+
+/*Outbound paging: targets, scheduling state and the inquiry cache*/
+typedef struct _HCI_PAGE_DATA
+{
+    BYTE aaTarget[HCI_MAX_PAGE_TARGETS][HCI_BD_ADDR_LEN];
+    UINT8 bNumTargets;
+    UINT8 bNextTarget;
+    UINT8 bState;
+    BOOL isInquired;
+    /*A page failed, inquire before the next one*/
+    BOOL isInquiryDue;
+    DWORD dwLastInquiry;
+    DWORD dwRoundEnd;
+    BOOL isRoundPause;
+    BOOL isRoundHit;
+    HCI_INQ_ENTRY asInqCache[HCI_INQ_CACHE_SIZE];
+} HCI_PAGE_DATA;
+
+/*Sniff behaviour of a power policy*/
+typedef struct _HCI_POWER_POLICY
+{
+    /*Idle time before entering sniff (0 = never)*/
+    UINT16 uIdleMs;
+    /*Range the sniff interval adapts in*/
+    UINT16 uMinInterval;
+    UINT16 uMaxInterval;
+} HCI_POWER_POLICY;
+
+/*Event subscription of an upper layer or the application*/
+typedef struct _HCI_EVT_SUBSCRIBER
+{
+    BYTE bEvent;
+    void (*putEvent)(const BYTE*);
+} HCI_EVT_SUBSCRIBER;
+
+/*Per event statistics*/
+typedef struct _HCI_EVENT_STATS
+{
+    UINT16 uCount;
+    DWORD dwCycles;
+} HCI_EVENT_STATS;
+
+/*Queued HCI command, kept until its COMMAND_COMPLETE/STATUS arrives*/
+typedef struct _HCI_COMMAND
+{
+    struct _HCI_COMMAND *pNext;
+    UINT16 uOpcode;
+    BOOL isSent;
+    /*Event, opcode and status (from COMMAND_COMPLETE or COMMAND_STATUS)*/
+    void (*cmdDone)(const BYTE*, UINT16, BYTE);
+    unsigned uLen;
+    BYTE aCmd[];
+} HCI_COMMAND;
+
+/*Step of the controller bring-up sequence*/
+typedef struct _HCI_INIT_STEP
+{
+    BYTE bOCF;
+    BYTE bOGF;
+    const CHAR *sName;
+    /*A failure skips the step instead of stopping the bring-up*/
+    BOOL isOptional;
+    /*Fills the command parameters and returns their length*/
+    unsigned (*getParams)(BYTE*);
+    /*Parses the COMMAND_COMPLETE return parameters (on success only)*/
+    void (*cmdDone)(const BYTE*);
+} HCI_INIT_STEP;
+
 /*Configuration data structure*/
 typedef struct _HCI_CONFIGURATION_DATA
 {
@@ -109,9 +348,25 @@ typedef struct _HCI_CONFIGURATION_DATA
 	char *sPinCode;
 	unsigned uPinCodeLen;
 	BYTE aLocalADDR[6];
+	BYTE aLocalFeatures[HCI_FEATURES_LEN];
         UINT16 uHostAclBufferSize;
         UINT16 uHostNumAclBuffers;
         BOOL bCHFlowControl;
+        UINT16 uCtrlNumAclBuffers;
+        /*ACL payload one controller buffer takes (0: not read yet)*/
+        UINT16 uCtrlAclLen;
+        /*Next bring-up step to queue (HCI_INIT_STEPS: none pending)*/
+        BYTE bInitNext;
+        /*A mandatory step failed: the device is never configured*/
+        BOOL isInitFailed;
+        /*Bring-up timing (core timer ticks) and time to connectable*/
+        DWORD dwInitStart;
+        DWORD adwInitDone[HCI_INIT_STEPS];
+        DWORD dwConnectableUs;
+        /*Scan profiles, the one in use and since when*/
+        HCI_SCAN_PROFILE asScanProfile[HCI_NUM_SCAN_PROFILES];
+        BYTE bScanProfile;
+        DWORD dwScanSince;
 } HCI_CONFIGURATION_DATA;
 
 /* Control block */
@@ -120,13 +375,38 @@ typedef struct _HCI_CONTROL_BLOCK
     BOOL isInitialised;
     HCI_CONFIGURATION_DATA *psHCIConfData;
     HCI_CONNECTION_DATA *psHCIConnData;
+    HCI_PAGE_DATA *psHCIPageData;
 
     INT (*PHY_w_ACL)(const BYTE*,UINT);
     INT (*PHY_w_CTL)(const BYTE*,UINT);
+    void (*PHY_tasks)(void);
+
+    /*Command queue and the controller Num_HCI_Command_Packets credits*/
+    HCI_COMMAND *pCmdHead;
+    HCI_COMMAND *pCmdTail;
+    BYTE bNumCmdPackets;
+    /*A control transfer is in flight (its buffer must stay untouched)*/
+    BOOL isCtlBusy;
+    BYTE aHostNumCompl[HCI_H_NUM_COMPL_PLEN];
 
     BOOL (*L2CAPputData)(const BYTE*, UINT16, BOOL);
+    void (*L2CAPtxReady)(void);
+    /*The ACL link is gone, and the channels on it*/
+    void (*L2CAPlinkClosed)(void);
 
     BOOL (*configurationComplete)(void);
+    /*An ACL link is up (TRUE when it is the outcome of our own page)*/
+    BOOL (*linkOpen)(BOOL);
+
+    /*Event subscribers and the events the controller reports*/
+    HCI_EVT_SUBSCRIBER asEvtSubscriber[HCI_MAX_EVT_SUBSCRIBERS];
+    QWORD qwEventMask;
+    /*The mask changed after bring-up, SET_EVENT_MASK still to send*/
+    BOOL isEventMaskPending;
+    /*Tail of an event longer than the event buffer, still to discard*/
+    UINT16 uEvtSkip;
+    /*Events of this controller since the stack was created*/
+    HCI_EVENT_STATS asEvtStats[HCI_NUM_EVENTS];
 } HCI_CONTROL_BLOCK;
 
 /*
@@ -140,6 +420,16 @@ BOOL HCI_API_setPINCode(const CHAR *pCode, UINT uLen);
 BOOL HCI_API_sendData(const BYTE *pData, unsigned uLen);
 BOOL HCI_API_putData(const BYTE *pData, unsigned uLen);
 BOOL HCI_API_putEvent(const BYTE *pData, unsigned uLen);
+void HCI_API_putACLDone();
+void HCI_API_putCMDDone();
+void HCI_API_tasks();
+UINT16 HCI_API_getPacketType();
+BOOL HCI_API_subscribeEvent(UINT8 bEvent, void (*putEvent)(const BYTE*));
+BOOL HCI_API_getEventStats(UINT8 bEvent, UINT16 *puCount, DWORD *pdwCycles);
+BOOL HCI_API_setScanProfile(UINT8 bProfile, const HCI_SCAN_PROFILE *psProfile);
+BOOL HCI_API_setPowerPolicy(UINT8 bPolicy);
+BOOL HCI_API_addPageTarget(const BYTE *pBDAddr);
+UINT16 HCI_API_getAclLength();
 
 /* Private functions */
 BOOL _HCI_isInitialized();
@@ -147,11 +437,75 @@ BOOL _HCI_isConfigured();
 BOOL _HCI_isConnected();
 int _HCI_getMaxAclFrameSize();
 
-int _HCI_cmd(const BYTE *pData, BYTE bOCF, BYTE bOGF, unsigned uLen);
+int _HCI_cmd(const BYTE *pData, BYTE bOCF, BYTE bOGF, unsigned uLen,
+        void (*cmdDone)(const BYTE*, UINT16, BYTE));
+void _HCI_cmdSend();
+void _HCI_cmdFlush();
+BOOL _HCI_hostNumComplSend();
 void _HCI_cmdDisconnect();
 int _HCI_cmdPinCodeRequestReply(BYTE aBDAddr[6], const char *sPIN, unsigned uPINLen);
 
 void _HCI_commandEnd(const BYTE *pEventData);
+void _HCI_linkOpen();
+void _HCI_linkClosed();
+void _HCI_txStampPush();
+void _HCI_txStampPop(UINT uPackets);
+void _HCI_linkActivity();
+void _HCI_linkSetMode(BYTE bMode);
+void _HCI_linkModeCmdDone(const BYTE *pEventData, UINT16 uOpcode,
+        BYTE bStatus);
+BOOL _HCI_initQueue(UINT uStep);
+void _HCI_initFill();
+void _HCI_initStepDone(const BYTE *pEventData, UINT16 uOpcode,
+        BYTE bStatus);
+void _HCI_initComplete();
+unsigned _HCI_initHostBufSize(BYTE *pData);
+unsigned _HCI_initFlowControl(BYTE *pData);
+void _HCI_flowControlDone(const BYTE *pEventData);
+unsigned _HCI_initLocalName(BYTE *pData);
+unsigned _HCI_initClassOfDevice(BYTE *pData);
+unsigned _HCI_initEventMask(BYTE *pData);
+unsigned _HCI_initScanEnable(BYTE *pData);
+unsigned _HCI_initPageScanActivity(BYTE *pData);
+unsigned _HCI_initPageScanType(BYTE *pData);
+unsigned _HCI_initInqScanActivity(BYTE *pData);
+unsigned _HCI_initInqScanType(BYTE *pData);
+void _HCI_scanApply(BYTE bProfile);
+void _HCI_scanTasks();
+void _HCI_eventMaskTasks();
+void _HCI_pageTasks();
+void _HCI_pageNext(BOOL isConnected);
+void _HCI_pageCmdDone(const BYTE *pEventData, UINT16 uOpcode,
+        BYTE bStatus);
+void _HCI_inquiryCmdDone(const BYTE *pEventData, UINT16 uOpcode,
+        BYTE bStatus);
+HCI_INQ_ENTRY* _HCI_inqCacheFind(const BYTE *pBDAddr);
+void _HCI_inqCachePut(const BYTE *pBDAddr, BYTE bPageScanRepMode,
+        UINT16 uClockOffset);
+void _HCI_remoteNameRequest(const BYTE *pBDAddr);
+void _HCI_readBufSizeDone(const BYTE *pEventData);
+void _HCI_readBDAddrDone(const BYTE *pEventData);
+void _HCI_readLocalFeaturesDone(const BYTE *pEventData);
+BOOL _HCI_hasFeature(const BYTE *pRemoteFeatures, UINT uByte, BYTE bMask);
+UINT16 _HCI_selectPacketType(const BYTE *pRemoteFeatures);
+#ifdef BT_PROFILE_ENABLE
+BOOL _HCI_profSendData(const BYTE *pData, unsigned uLen);
+BOOL _HCI_profPutData(const BYTE *pData, unsigned uLen);
+#endif
 void _HCI_eventHandler(const BYTE *pEventData);
+void _HCI_evtCompletedPackets(const BYTE *pEventData);
+void _HCI_evtPinCodeRequest(const BYTE *pEventData);
+void _HCI_evtConnectionRequest(const BYTE *pEventData);
+void _HCI_evtConnectionComplete(const BYTE *pEventData);
+void _HCI_evtDisconnectionComplete(const BYTE *pEventData);
+void _HCI_evtModeChange(const BYTE *pEventData);
+void _HCI_evtRemoteFeatures(const BYTE *pEventData);
+void _HCI_evtPacketTypeChanged(const BYTE *pEventData);
+void _HCI_evtMaxSlotsChange(const BYTE *pEventData);
+void _HCI_evtLinkKeyRequest(const BYTE *pEventData);
+void _HCI_evtLinkKeyNotification(const BYTE *pEventData);
+void _HCI_evtInquiryResult(const BYTE *pEventData);
+void _HCI_evtInquiryComplete(const BYTE *pEventData);
+void _HCI_evtRemoteNameComplete(const BYTE *pEventData);
 
 #endif //HCI.H
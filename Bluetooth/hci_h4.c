@@ -0,0 +1,523 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+#include <string.h>
+#include "bt_utils.h"
+#include "hci_h4.h"
+#include "debug.h"
+#include "HardwareProfile.h"
+
+/*Control block of the selected stack instance*/
+#define gpsHCIH4CB (gpsBTStack->psHCIH4CB)
+
+/*
+ * Byte stream port: non-blocking, each call moves what it can.
+ */
+
+#if defined(__PIC32MX__)
+
+static void _HCIH4_portOpen()
+{
+    /*A single controller UART: the first stack instance only*/
+    ASSERT(0 == gpsBTStack->uIndex);
+
+    /*UART2 on RPB1 (RX) and RPB0 (TX), 8N1, high speed baud rate*/
+    ANSELBCLR = BIT_0 | BIT_1;
+    U2RXRbits.U2RXR = 0b0010;
+    RPB0Rbits.RPB0R = 0b0010;
+    U2MODE = 0;
+    U2MODEbits.BRGH = 1;
+    U2BRG = (GetPeripheralClock() / 4 + HCI_H4_BAUD / 2) / HCI_H4_BAUD - 1;
+    U2STA = 0;
+    U2STAbits.URXEN = 1;
+    U2STAbits.UTXEN = 1;
+    U2MODEbits.ON = 1;
+}
+
+static void _HCIH4_portClose()
+{
+    U2MODEbits.ON = 0;
+}
+
+static UINT _HCIH4_portRead(BYTE *pData, UINT uMax)
+{
+    UINT uCount = 0;
+
+    /*An overrun stops the receiver, the parser resynchronises*/
+    if(U2STAbits.OERR)
+    {
+        U2STAbits.OERR = 0;
+        ++gpsHCIH4CB->dwRxErrors;
+    }
+    while(uCount < uMax && U2STAbits.URXDA)
+    {
+        pData[uCount++] = U2RXREG;
+    }
+    return uCount;
+}
+
+static UINT _HCIH4_portWrite(const BYTE *pData, UINT uLen)
+{
+    UINT uCount = 0;
+
+    while(uCount < uLen && !U2STAbits.UTXBF)
+    {
+        U2TXREG = pData[uCount++];
+    }
+    return uCount;
+}
+
+#else
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <sys/un.h>
+
+static void _HCIH4_portOpen()
+{
+    const char *sBase = getenv(HCI_H4_PATH_ENV);
+    char sPath[HCI_H4_PATH_LEN];
+    struct sockaddr_un sAddr;
+    struct termios sTio;
+    struct stat sStat;
+    int iFd, iLen;
+
+    gpsHCIH4CB->iFd = -1;
+    if(NULL == sBase)
+    {
+        sBase = HCI_H4_DEFAULT_PATH;
+    }
+    if(0 == gpsBTStack->uIndex)
+    {
+        iLen = snprintf(sPath, sizeof(sPath), "%s", sBase);
+    }
+    else
+    {
+        iLen = snprintf(sPath, sizeof(sPath), "%s.%u", sBase,
+                gpsBTStack->uIndex);
+    }
+    /*A cut path would open another device, the socket one must fit too*/
+    if(iLen < 0 || (size_t) iLen >= sizeof(sPath) ||
+       (size_t) iLen >= sizeof(sAddr.sun_path))
+    {
+        DBG_ERROR("H4: Path too long %s\n", sBase);
+        return;
+    }
+    if(0 == stat(sPath, &sStat) && S_ISSOCK(sStat.st_mode))
+    {
+        iFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&sAddr, 0, sizeof(sAddr));
+        sAddr.sun_family = AF_UNIX;
+        memcpy(sAddr.sun_path, sPath, iLen + 1);
+        if(iFd >= 0 &&
+           connect(iFd, (struct sockaddr *) &sAddr, sizeof(sAddr)) < 0)
+        {
+            close(iFd);
+            iFd = -1;
+        }
+    }
+    else
+    {
+        iFd = open(sPath, O_RDWR | O_NOCTTY);
+        /*A pty or serial line: raw bytes*/
+        if(iFd >= 0 && 0 == tcgetattr(iFd, &sTio))
+        {
+            cfmakeraw(&sTio);
+            tcsetattr(iFd, TCSANOW, &sTio);
+        }
+    }
+    gpsHCIH4CB->iFd = iFd;
+    if(iFd < 0)
+    {
+        DBG_ERROR("H4: Cannot open %s\n", sPath);
+        return;
+    }
+    fcntl(iFd, F_SETFL, fcntl(iFd, F_GETFL) | O_NONBLOCK);
+}
+
+static void _HCIH4_portClose()
+{
+    if(gpsHCIH4CB->iFd >= 0)
+    {
+        close(gpsHCIH4CB->iFd);
+        gpsHCIH4CB->iFd = -1;
+    }
+}
+
+static UINT _HCIH4_portRead(BYTE *pData, UINT uMax)
+{
+    int iFd = gpsHCIH4CB->iFd;
+    ssize_t iLen = (iFd < 0) ? -1 : read(iFd, pData, uMax);
+
+    return (iLen > 0) ? (UINT) iLen : 0;
+}
+
+static UINT _HCIH4_portWrite(const BYTE *pData, UINT uLen)
+{
+    int iFd = gpsHCIH4CB->iFd;
+    ssize_t iLen = (iFd < 0) ? -1 : write(iFd, pData, uLen);
+
+    return (iLen > 0) ? (UINT) iLen : 0;
+}
+
+#endif
+
+/*
+ * HCIH4 public functions implementation
+ */
+
+BOOL HCIH4_create()
+{
+    ASSERT(NULL == gpsHCIH4CB);
+
+    gpsHCIH4CB = (HCIH4_CONTROL_BLOCK *) BT_malloc(sizeof(HCIH4_CONTROL_BLOCK));
+    if(NULL == gpsHCIH4CB)
+    {
+        DBG_ERROR("H4: No room for the control block\n");
+        return FALSE;
+    }
+
+    /*The controller may send packets as long as the host buffer size*/
+    gpsHCIH4CB->pRxData = (BYTE *) BT_malloc(DATA_PACKET_LENGTH);
+    if(NULL == gpsHCIH4CB->pRxData)
+    {
+        DBG_ERROR("H4: No room for the receive buffer\n");
+        BT_free(gpsHCIH4CB);
+        gpsHCIH4CB = NULL;
+        return FALSE;
+    }
+    gpsHCIH4CB->bRxState = HCI_H4_RX_TYPE;
+    gpsHCIH4CB->dwRxErrors = 0;
+
+    /*One ACL packet on the wire at a time: its buffer is kept*/
+    gpsHCIH4CB->pTxAcl = (BYTE *) BT_malloc(DATA_PACKET_LENGTH);
+    if(NULL == gpsHCIH4CB->pTxAcl)
+    {
+        DBG_ERROR("H4: No room for the transmit buffer\n");
+        BT_free(gpsHCIH4CB->pRxData);
+        BT_free(gpsHCIH4CB);
+        gpsHCIH4CB = NULL;
+        return FALSE;
+    }
+    gpsHCIH4CB->pTxCmd = NULL;
+    gpsHCIH4CB->uTxAclLen = 0;
+    gpsHCIH4CB->bTxType = 0;
+
+    gpsHCIH4CB->HCIputData = NULL;
+    gpsHCIH4CB->HCIputEvent = NULL;
+    gpsHCIH4CB->HCIputACLDone = NULL;
+    gpsHCIH4CB->HCIputCMDDone = NULL;
+
+    _HCIH4_portOpen();
+    gpsHCIH4CB->isInitialised = TRUE;
+    return TRUE;
+}
+
+BOOL HCIH4_destroy()
+{
+    if(NULL != gpsHCIH4CB)
+    {
+        _HCIH4_portClose();
+        if(NULL != gpsHCIH4CB->pRxData)
+        {
+            BT_free(gpsHCIH4CB->pRxData);
+        }
+        BT_free(gpsHCIH4CB->pTxAcl);
+        BT_free(gpsHCIH4CB);
+        gpsHCIH4CB = NULL;
+    }
+    return TRUE;
+}
+
+BOOL HCIH4_getAPI(HCI_TRANSPORT_API *psAPI)
+{
+    ASSERT(NULL != gpsHCIH4CB);
+    psAPI->writeACL = &_HCIH4_w_ACL;
+    psAPI->writeCTL = &_HCIH4_w_CTRL;
+    psAPI->tasks = &_HCIH4_tasks;
+    return TRUE;
+}
+
+BOOL HCIH4_installHCI(HCI_API *psAPI)
+{
+    ASSERT(NULL != gpsHCIH4CB);
+    gpsHCIH4CB->HCIputData = psAPI->putData;
+    gpsHCIH4CB->HCIputEvent = psAPI->putEvent;
+    gpsHCIH4CB->HCIputACLDone = psAPI->putACLDone;
+    gpsHCIH4CB->HCIputCMDDone = psAPI->putCMDDone;
+    return TRUE;
+}
+
+/*
+ * HCIH4 private functions implementation
+ */
+
+/*
+ * Queue an ACL packet. The caller's frame lives on its stack: the packet
+ * is copied into the transmit buffer and sent from there, the indicator
+ * first. No allocation per packet.
+ */
+INT _HCIH4_w_ACL(const BYTE *pData, UINT uLength)
+{
+    ASSERT(NULL != gpsHCIH4CB);
+
+    if(uLength > DATA_PACKET_LENGTH)
+    {
+        return HCI_TRANSPORT_ERROR;
+    }
+    if(0 != gpsHCIH4CB->uTxAclLen)
+    {
+        return HCI_TRANSPORT_BUSY;
+    }
+    memcpy(gpsHCIH4CB->pTxAcl, pData, uLength);
+    gpsHCIH4CB->uTxAclLen = uLength;
+    _HCIH4_txMove();
+    return HCI_TRANSPORT_SUCCESS;
+}
+
+/*Queue a command, pData stays valid until putCMDDone (as on EP0)*/
+INT _HCIH4_w_CTRL(const BYTE *pData, UINT uLength)
+{
+    ASSERT(NULL != gpsHCIH4CB);
+
+    if(NULL != gpsHCIH4CB->pTxCmd)
+    {
+        return HCI_TRANSPORT_BUSY;
+    }
+    gpsHCIH4CB->pTxCmd = pData;
+    gpsHCIH4CB->uTxCmdLen = uLength;
+    _HCIH4_txMove();
+    return HCI_TRANSPORT_SUCCESS;
+}
+
+void _HCIH4_tasks()
+{
+    ASSERT(NULL != gpsHCIH4CB);
+    _HCIH4_rxTasks();
+    _HCIH4_txTasks();
+}
+
+/*
+ * Feed the port, commands go before ACL data. TRUE once the packet on the
+ * wire is out, its slot is freed by _HCIH4_txTasks: a write never calls
+ * the HCI back, the HCI would write again before it marked the first one.
+ */
+BOOL _HCIH4_txMove()
+{
+    HCIH4_CONTROL_BLOCK *psCB = gpsHCIH4CB;
+
+    if(0 == psCB->bTxType)
+    {
+        if(NULL != psCB->pTxCmd)
+        {
+            psCB->bTxType = HCI_H4_CMD;
+            psCB->pTx = psCB->pTxCmd;
+            psCB->uTxLen = psCB->uTxCmdLen;
+        }
+        else if(0 != psCB->uTxAclLen)
+        {
+            psCB->bTxType = HCI_H4_ACL;
+            psCB->pTx = psCB->pTxAcl;
+            psCB->uTxLen = psCB->uTxAclLen;
+        }
+        else
+        {
+            return FALSE;
+        }
+        psCB->isTxTypeSent = FALSE;
+        psCB->uTxPos = 0;
+    }
+
+    if(!psCB->isTxTypeSent)
+    {
+        if(0 == _HCIH4_portWrite(&psCB->bTxType, 1))
+        {
+            return FALSE;
+        }
+        psCB->isTxTypeSent = TRUE;
+    }
+    psCB->uTxPos += _HCIH4_portWrite(&psCB->pTx[psCB->uTxPos],
+            psCB->uTxLen - psCB->uTxPos);
+    return psCB->uTxPos >= psCB->uTxLen;
+}
+
+void _HCIH4_txTasks()
+{
+    HCIH4_CONTROL_BLOCK *psCB = gpsHCIH4CB;
+    BYTE bType;
+
+    if(!_HCIH4_txMove())
+    {
+        return;
+    }
+
+    /*Sent: free the slot before the HCI queues the next packet*/
+    bType = psCB->bTxType;
+    psCB->bTxType = 0;
+    if(HCI_H4_CMD == bType)
+    {
+        psCB->pTxCmd = NULL;
+        if(NULL != psCB->HCIputCMDDone)
+        {
+            psCB->HCIputCMDDone();
+        }
+    }
+    else
+    {
+        psCB->uTxAclLen = 0;
+        if(NULL != psCB->HCIputACLDone)
+        {
+            psCB->HCIputACLDone();
+        }
+    }
+}
+
+/*
+ * Parse the input stream: indicator, header, then the payload, read
+ * straight behind the header so the packet is complete where it lands.
+ */
+void _HCIH4_rxTasks()
+{
+    HCIH4_CONTROL_BLOCK *psCB = gpsHCIH4CB;
+    UINT uLen;
+
+    while(TRUE)
+    {
+        if(HCI_H4_RX_TYPE == psCB->bRxState)
+        {
+            if(0 == _HCIH4_portRead(&psCB->bRxType, 1))
+            {
+                return;
+            }
+            psCB->uRxPos = 0;
+            psCB->bRxState = HCI_H4_RX_HEADER;
+            switch(psCB->bRxType)
+            {
+                case HCI_H4_EVT:
+                    psCB->uRxLen = HCI_H4_EVT_HDR_LEN;
+                    break;
+                case HCI_H4_ACL:
+                    psCB->uRxLen = HCI_H4_ACL_HDR_LEN;
+                    break;
+                case HCI_H4_SCO:
+                    psCB->uRxLen = HCI_H4_SCO_HDR_LEN;
+                    break;
+                default:
+                    /*Out of sync, wait for a known indicator*/
+                    ++psCB->dwRxErrors;
+                    psCB->bRxState = HCI_H4_RX_TYPE;
+                    break;
+            }
+            continue;
+        }
+
+        if(HCI_H4_RX_SKIP == psCB->bRxState)
+        {
+            /*The receive buffer is scratch space meanwhile*/
+            uLen = psCB->uRxLen - psCB->uRxPos;
+            if(uLen > DATA_PACKET_LENGTH)
+            {
+                uLen = DATA_PACKET_LENGTH;
+            }
+            uLen = _HCIH4_portRead(psCB->pRxData, uLen);
+        }
+        else
+        {
+            uLen = _HCIH4_portRead(&psCB->pRxData[psCB->uRxPos],
+                    psCB->uRxLen - psCB->uRxPos);
+        }
+        if(0 == uLen)
+        {
+            return;
+        }
+        psCB->uRxPos += uLen;
+        if(psCB->uRxPos < psCB->uRxLen)
+        {
+            continue;
+        }
+
+        if(HCI_H4_RX_HEADER == psCB->bRxState)
+        {
+            _HCIH4_rxHeader();
+            if(HCI_H4_RX_HEADER != psCB->bRxState)
+            {
+                continue;
+            }
+        }
+        else if(HCI_H4_RX_SKIP == psCB->bRxState)
+        {
+            psCB->bRxState = HCI_H4_RX_TYPE;
+            continue;
+        }
+
+        /*Complete packet*/
+        psCB->bRxState = HCI_H4_RX_TYPE;
+        if(HCI_H4_EVT == psCB->bRxType && NULL != psCB->HCIputEvent)
+        {
+            psCB->HCIputEvent(psCB->pRxData, psCB->uRxLen);
+        }
+        else if(HCI_H4_ACL == psCB->bRxType && NULL != psCB->HCIputData)
+        {
+            psCB->HCIputData(psCB->pRxData, psCB->uRxLen);
+        }
+    }
+}
+
+/*The header is in: size the payload (or plan to skip it)*/
+void _HCIH4_rxHeader()
+{
+    HCIH4_CONTROL_BLOCK *psCB = gpsHCIH4CB;
+    UINT uPayload;
+
+    switch(psCB->bRxType)
+    {
+        case HCI_H4_EVT:
+            uPayload = psCB->pRxData[1];
+            break;
+        case HCI_H4_ACL:
+            uPayload = BT_readLE16(psCB->pRxData, 2);
+            break;
+        default:
+            /*SCO is not supported*/
+            psCB->uRxLen = psCB->pRxData[2];
+            psCB->uRxPos = 0;
+            psCB->bRxState = (0 != psCB->uRxLen) ?
+                    HCI_H4_RX_SKIP : HCI_H4_RX_TYPE;
+            return;
+    }
+
+    if(psCB->uRxLen + uPayload > DATA_PACKET_LENGTH)
+    {
+        ++psCB->dwRxErrors;
+        DBG_ERROR("H4: %d byte packet dropped\n", psCB->uRxLen + uPayload);
+        psCB->uRxLen = uPayload;
+        psCB->uRxPos = 0;
+        psCB->bRxState = HCI_H4_RX_SKIP;
+        return;
+    }
+    psCB->uRxLen += uPayload;
+    /*Header only packets are complete already*/
+    if(psCB->uRxPos < psCB->uRxLen)
+    {
+        psCB->bRxState = HCI_H4_RX_PAYLOAD;
+    }
+}
@@ -0,0 +1,107 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef __HCI_H4_H__
+#define __HCI_H4_H__
+
+#include "GenericTypeDefs.h"
+#include "bt_common.h"
+
+/*
+ * H4 (UART) transport: every packet is sent as its packet indicator
+ * followed by the HCI packet, over a PIC32 UART to a serial controller
+ * module or, on host builds, over a pty or a Unix socket.
+ */
+
+/*Packet indicators*/
+#define HCI_H4_CMD 0x01
+#define HCI_H4_ACL 0x02
+#define HCI_H4_SCO 0x03
+#define HCI_H4_EVT 0x04
+
+/*Packet header lengths and the offset of their length field*/
+#define HCI_H4_EVT_HDR_LEN 2
+#define HCI_H4_ACL_HDR_LEN 4
+#define HCI_H4_SCO_HDR_LEN 3
+
+/*Receive states*/
+#define HCI_H4_RX_TYPE 0
+#define HCI_H4_RX_HEADER 1
+#define HCI_H4_RX_PAYLOAD 2
+#define HCI_H4_RX_SKIP 3
+
+/*Controller UART (PIC32: UART2, RX on RPB1 and TX on RPB0)*/
+#define HCI_H4_BAUD 115200
+/*
+ * Host builds: path of the pty or Unix socket of the controller, the
+ * stack instances after the first one add ".<index>" to it.
+ */
+#define HCI_H4_PATH_ENV "BT_H4_PATH"
+#define HCI_H4_DEFAULT_PATH "/tmp/bt_h4"
+#define HCI_H4_PATH_LEN 108
+
+typedef struct _HCIH4_CONTROL_BLOCK
+{
+    BOOL isInitialised;
+#if !defined(__PIC32MX__)
+    int iFd;
+#endif
+
+    /*
+     * Receive: one buffer for every packet type, the stream is parsed in
+     * place and the HCI gets the packet where its bytes landed.
+     */
+    BYTE *pRxData;
+    BYTE bRxState;
+    BYTE bRxType;
+    UINT uRxPos;
+    UINT uRxLen;
+    DWORD dwRxErrors;
+
+    /*
+     * Transmit: the command stays with the HCI, the ACL packet is copied
+     * into a buffer allocated with the control block
+     */
+    const BYTE *pTxCmd;
+    UINT uTxCmdLen;
+    BYTE *pTxAcl;
+    UINT uTxAclLen;
+    /*Packet on the wire (0 = idle) and the bytes already sent*/
+    BYTE bTxType;
+    BOOL isTxTypeSent;
+    const BYTE *pTx;
+    UINT uTxLen;
+    UINT uTxPos;
+
+    BOOL (*HCIputData)(const BYTE*, UINT);
+    BOOL (*HCIputEvent)(const BYTE*, UINT);
+    void (*HCIputACLDone)(void);
+    void (*HCIputCMDDone)(void);
+} HCIH4_CONTROL_BLOCK;
+
+/*
+ * HCIH4 layer private function prototypes
+ */
+
+INT _HCIH4_w_ACL(const BYTE *pData, UINT uLength);
+INT _HCIH4_w_CTRL(const BYTE *pData, UINT uLength);
+void _HCIH4_tasks();
+BOOL _HCIH4_txMove();
+void _HCIH4_txTasks();
+void _HCIH4_rxTasks();
+void _HCIH4_rxHeader();
+
+#endif /*HCI_H4*/
@@ -22,7 +22,8 @@
 #include "PIC32_USB/usb_host_bluetooth.h"
 #include "HardwareProfile.h"
 
-static HCIUSB_CONTROL_BLOCK *gpsHCIUSBCB = NULL;
+/*Control block of the selected stack instance*/
+#define gpsHCIUSBCB (gpsBTStack->psHCIUSBCB)
 
 /*
  * HCIUSB public functions implementation
@@ -34,10 +35,25 @@ BOOL HCIUSB_create()
 
     gpsHCIUSBCB =
             (HCIUSB_CONTROL_BLOCK *) BT_malloc(sizeof(HCIUSB_CONTROL_BLOCK));
+    if(NULL == gpsHCIUSBCB)
+    {
+        DBG_ERROR("HCIUSB: No room for the control block\n");
+        return FALSE;
+    }
 
     gpsHCIUSBCB->isInitialised = TRUE;
-    gpsHCIUSBCB->pRAclData = (BYTE *) BT_malloc(DATA_PACKET_LENGTH);
-    gpsHCIUSBCB->pREvtData = (BYTE *) BT_malloc(EVENT_PACKET_LENGTH);
+    /*Receive rings: the USB interrupt reads into a free buffer while the
+      stack still processes the previous one*/
+    gpsHCIUSBCB->pRAclData =
+            (BYTE *) BT_malloc(MAX_ACL_R_BUFF_SIZE * DATA_PACKET_LENGTH);
+    gpsHCIUSBCB->pREvtData =
+            (BYTE *) BT_malloc(MAX_EVT_R_BUFF_SIZE * EVENT_PACKET_LENGTH);
+    if(NULL == gpsHCIUSBCB->pRAclData || NULL == gpsHCIUSBCB->pREvtData)
+    {
+        DBG_ERROR("HCIUSB: No room for the receive rings\n");
+        HCIUSB_destroy();
+        return FALSE;
+    }
 
     return TRUE;
 }
@@ -96,13 +112,16 @@ INT _w_ACL(const BYTE *pData, UINT uLength)
 
     if(bRetVal == USB_SUCCESS)
     {
-        DelayMs(1);
         return HCI_USB_SUCCESS;
     }
     return HCI_USB_BUSY;
 }
 
-/*Write the data in the EP0 (control)*/
+/*
+ * Write the data in the EP0 (control)
+ * The transfer is asynchronous: pData must stay valid until the EP0 done
+ * event, a second write meanwhile returns HCI_USB_BUSY.
+ */
 INT _w_CTRL(const BYTE *pData, UINT uLength)
 {
     BYTE bDevAddr = USBHostBluetoothGetDeviceAddress();
@@ -114,7 +133,6 @@ INT _w_CTRL(const BYTE *pData, UINT uLength)
 
     if (bRetVal == USB_SUCCESS )
     {
-        DelayMs(25);
         return HCI_USB_SUCCESS;
     }
     return HCI_USB_BUSY;
@@ -20,9 +20,9 @@
 #include "GenericTypeDefs.h"
 #include "bt_common.h"
 
-#define HCI_USB_SUCCESS 0x10
-#define HCI_USB_BUSY 0x11
-#define HCI_USB_ERROR 0x12
+#define HCI_USB_SUCCESS HCI_TRANSPORT_SUCCESS
+#define HCI_USB_BUSY HCI_TRANSPORT_BUSY
+#define HCI_USB_ERROR HCI_TRANSPORT_ERROR
 
 typedef struct _HCIUSB_CONTROL_BLOCK
 {
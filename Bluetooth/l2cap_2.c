@@ -16,6 +16,7 @@
 
 #include "GenericTypeDefs.h"
 #include "l2cap_2.h"
+#include "l2cap_fcs.h"
 #include "bt_utils.h"
 #include "debug.h"
 
@@ -32,7 +33,8 @@
  * L2CAP variables
  */
 
-static L2CAP_CONTROL_BLOCK *gpsL2CAPCB = NULL;
+/*Control block of the selected stack instance*/
+#define gpsL2CAPCB (gpsBTStack->psL2CAPCB)
 
 /*
  * L2CAP public functions implementation
@@ -56,17 +58,33 @@ BOOL L2CAP_create()
     /*Initialise the structure*/
     gpsL2CAPCB->isInitialised = TRUE;
     gpsL2CAPCB->bSigID = 0;
+    gpsL2CAPCB->DEVconnected = NULL;
+    gpsL2CAPCB->sSigQueue.pHead = NULL;
+    gpsL2CAPCB->sSigQueue.pTail = NULL;
+    gpsL2CAPCB->bTxIndex = 0;
+    gpsL2CAPCB->bTxBurst = 0;
 
     for (i = 0; i < L2CAP_MAX_CHANNELS; ++i)
     {
         gpsL2CAPCB->pasChannel[i] = NULL;
     }
 
+    /*Every PSM uses the basic mode unless requested otherwise*/
+    for (i = 0; i < L2CAP_MAX_PSM_MODES; ++i)
+    {
+        gpsL2CAPCB->asPSMMode[i].uPSM = 0x0000;
+        gpsL2CAPCB->asPSMMode[i].bMode = L2CAP_MODE_BASIC;
+        gpsL2CAPCB->asPSMMode[i].bTxWindow = L2CAP_ERTM_TX_WINDOW;
+    }
+
     /* Get the HCI API */
     HCI_getAPI(&sHCI);
     gpsL2CAPCB->HCIsendData = sHCI.sendData;
+    gpsL2CAPCB->HCIgetAclLength = sHCI.getAclLength;
     sAPI.sendData = &L2CAP_API_sendData;
     sAPI.putData = &L2CAP_API_putData;
+    sAPI.txReady = &L2CAP_API_txReady;
+    sAPI.linkClosed = &L2CAP_API_linkClosed;
     HCI_installL2CAP(&sAPI);
 
     DBG_INFO("L2CAP Initialised\n");
@@ -82,22 +100,57 @@ BOOL L2CAP_destroy()
         {
             if(NULL != gpsL2CAPCB->pasChannel[i])
             {
-//                BT_free(gpsL2CAPCB);
-                BT_free(gpsL2CAPCB->pasChannel[i]);
+                _L2CAP_destroyChannel(gpsL2CAPCB->pasChannel[i]);
             }
         }
+        _L2CAP_flushQueue(&gpsL2CAPCB->sSigQueue);
         BT_free(gpsL2CAPCB);
         gpsL2CAPCB = NULL;
     }
     return TRUE;
 }
 
+/*The link is gone: close every channel, keep the PSM modes*/
+BOOL L2CAP_reset()
+{
+    UINT i;
+
+    if (NULL == gpsL2CAPCB)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < L2CAP_MAX_CHANNELS; ++i)
+    {
+        if (NULL != gpsL2CAPCB->pasChannel[i])
+        {
+            _L2CAP_channelClosed(gpsL2CAPCB->pasChannel[i]);
+        }
+    }
+    _L2CAP_flushQueue(&gpsL2CAPCB->sSigQueue);
+    gpsL2CAPCB->bSigID = 0;
+    gpsL2CAPCB->bTxIndex = 0;
+    gpsL2CAPCB->bTxBurst = 0;
+    return TRUE;
+}
+
 BOOL L2CAP_getAPI(L2CAP_API *psAPI)
 {
     ASSERT(NULL != psAPI);
+#ifdef BT_PROFILE_ENABLE
+    psAPI->putData = &_L2CAP_profPutData;
+    psAPI->sendData = &_L2CAP_profSendData;
+#else
     psAPI->putData = &L2CAP_API_putData;
     psAPI->sendData = &L2CAP_API_sendData;
+#endif
     psAPI->disconnect = &L2CAP_API_disconnect;
+    psAPI->setMode = &L2CAP_API_setMode;
+    psAPI->connect = &L2CAP_API_connect;
+    psAPI->getMTU = &L2CAP_API_getMTU;
+    psAPI->sendControl = &L2CAP_API_sendControl;
+    psAPI->setWeight = &L2CAP_API_setWeight;
+    psAPI->txReady = &L2CAP_API_txReady;
+    psAPI->linkClosed = &L2CAP_API_linkClosed;
     return TRUE;
 }
 
@@ -109,6 +162,14 @@ BOOL L2CAP_installRFCOMM(RFCOMM_API *psAPI)
     return TRUE;
 }
 
+BOOL L2CAP_installDevCB(DEVICE_API *psAPI)
+{
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != psAPI);
+    gpsL2CAPCB->DEVconnected = psAPI->L2CAPconnected;
+    return TRUE;
+}
+
 BOOL L2CAP_installSDP(SDP_API *psAPI)
 {
     ASSERT(NULL != gpsL2CAPCB);
@@ -121,12 +182,32 @@ BOOL L2CAP_installSDP(SDP_API *psAPI)
  * L2CAP API functions implementation
  */
 
+#ifdef BT_PROFILE_ENABLE
+/*Data path entry points, profiled*/
+BOOL _L2CAP_profPutData(const BYTE *pData, UINT16 uLen, BOOL bContinuation)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = L2CAP_API_putData(pData, uLen, bContinuation);
+    BT_profileLeave(BT_LAYER_L2CAP, uLen);
+    return bRetVal;
+}
+
+BOOL _L2CAP_profSendData(UINT16 uPSM, const BYTE *pData, UINT16 uLen)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = L2CAP_API_sendData(uPSM, pData, uLen);
+    BT_profileLeave(BT_LAYER_L2CAP, uLen);
+    return bRetVal;
+}
+#endif
+
 BOOL L2CAP_API_putData(const BYTE *pData, UINT16 uLen, BOOL bContinuation)
 {
-    INT i, uDataLen;
-    UINT16 uCID, uCtrlDataLen;
-    const BYTE *pCmdData;
-    UINT8 bCmdCode, bCmdId;
+    UINT16 uDataLen, uCID;
 
     ASSERT(NULL != gpsL2CAPCB);
     ASSERT(gpsL2CAPCB->isInitialised);
@@ -150,7 +231,13 @@ BOOL L2CAP_API_putData(const BYTE *pData, UINT16 uLen, BOOL bContinuation)
     /*Get the CID*/
     uCID = BT_readLE16(pData, 2);
 
- 	DelayMs(10);
+    /*The payload must be contained in the received frame*/
+    if (uDataLen > (uLen - L2CAP_HDR_LEN))
+    {
+        DBG_ERROR("Wrong frame size\n");
+        return FALSE;
+    }
+
 	DBG_INFO("L2CAP putData: ");
     DBG_DUMP(pData, uLen);
 
@@ -162,43 +249,13 @@ BOOL L2CAP_API_putData(const BYTE *pData, UINT16 uLen, BOOL bContinuation)
     /*Control frame*/
     if (uCID == L2CAP_SIG_CID)
     {
-        /*Check the length*/
-        if (uDataLen < L2CAP_SIGHDR_LEN)
-        {
-            DBG_ERROR("Wrong frame size\n");
-            return FALSE;
-        }
-
-        /*Handle all the commands contained in the packet*/
-        uCtrlDataLen = 0;
-        for(i = 0; i < (uDataLen - L2CAP_SIGHDR_LEN) ; i =+ uCtrlDataLen)
-        {
-            /*
-             * Get the command parameters:
-             * Code (1 octet): Command code
-             * Id (1 octet): Command identifier
-             * Length (2 octet): Command data length
-             * Data: Command data
-             */
-            bCmdCode = pData[L2CAP_HDR_LEN];
-            bCmdId = pData[L2CAP_HDR_LEN + 1];
-            uCtrlDataLen = BT_readLE16(pData, L2CAP_HDR_LEN + 2);
-            
-            /*Get a pointer to the command data (if any)*/
-            if(uCtrlDataLen == 0)
-                pCmdData = NULL;
-            else
-                pCmdData = &pData[L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN + i];
-
-            /*Handle the command*/
-            _L2CAP_cmdHandler(bCmdCode, bCmdId, uCtrlDataLen, pCmdData);
-        }
+        return _L2CAP_sigHandler(&pData[L2CAP_HDR_LEN], uDataLen);
     }
     /*Data frame*/
     else if (uCID >= L2CAP_MIN_CID)
     {
         /*Forward the data to the upper layers*/
-        _L2CAP_dataHandler(uCID, uDataLen, &pData[4]);
+        _L2CAP_dataHandler(uCID, uDataLen, &pData[L2CAP_HDR_LEN]);
     }
     /*Unexpected CID*/
     else
@@ -224,12 +281,36 @@ BOOL L2CAP_API_sendData(UINT16 uPSM, const BYTE *pData, UINT16 uLen)
         DBG_INFO("sendData Non-existant channel\n");
         return FALSE;
     }
-    
+
+    /*Never send more than the remote takes in*/
+    if (uLen > _L2CAP_getMTU(pChannel))
+    {
+        DBG_ERROR("SDU bigger than the MTU\n");
+        return FALSE;
+    }
+
+    /*Push back on the upper layer while the channel backlog is full*/
+    if (_L2CAP_queueLength(&pChannel->sDataQueue) >= L2CAP_TX_QUEUE_DEPTH)
+    {
+        DBG_INFO("sendData Queue full\n");
+        return FALSE;
+    }
+
+    /*ERTM and Streaming channels carry the SDU in (segmented) I-frames*/
+    if (pChannel->bMode != L2CAP_MODE_BASIC)
+    {
+        if (pChannel->uState != L2CAP_STATE_OPEN)
+        {
+            return FALSE;
+        }
+        return _L2CAP_sendSegmented(pChannel, pData, uLen);
+    }
+
     /*Generate an L2CAP data frame*/
     /*Set the length*/
     uL2CAPLength  = uLen + L2CAP_HDR_LEN;
     /*Allocate the memory (mind the L2CAP HDR)*/
-    pL2CAPData = (BYTE *) BT_malloc(uL2CAPLength);
+    pL2CAPData = _L2CAP_newFrame(uL2CAPLength);
     if(NULL == pL2CAPData)
     {
         DBG_ERROR("Not enough memory!\n");
@@ -248,16 +329,13 @@ BOOL L2CAP_API_sendData(UINT16 uPSM, const BYTE *pData, UINT16 uLen)
         pL2CAPData[i + L2CAP_HDR_LEN] = pData[i];
     }
 
-    /*Send the local frame*/
-    if (!gpsL2CAPCB->HCIsendData(pL2CAPData, uL2CAPLength))
+    /*Queue the local frame (sent as soon as the scheduler allows)*/
+    if (!_L2CAP_queueFrame(&pChannel->sDataQueue, pL2CAPData))
     {
         DBG_ERROR("Unexpected error\n");
         return FALSE;
     }
 
-    /*Free the memory*/
-    BT_free(pL2CAPData);
-
     DBG_INFO("L2CAP Data sent\n");
 
     return TRUE;
@@ -285,7 +363,7 @@ BOOL L2CAP_API_disconnect(UINT16 uPSM)
     /*Set the length*/
     uReqLen = L2CAP_DISCONN_REQ_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
     /*Allocate the memory (mind the L2CAP HDR)*/
-    pReqData = BT_malloc(uReqLen);
+    pReqData = _L2CAP_newFrame(uReqLen);
     if(NULL == pReqData)
     {
         DBG_ERROR("Not enough memory!\n");
@@ -302,8 +380,8 @@ BOOL L2CAP_API_disconnect(UINT16 uPSM)
     uOffset = L2CAP_HDR_LEN;
     /* Command code */
     pReqData[uOffset + 0] = L2CAP_DISCONN_REQ;
-    /* Command id (we can randomize it) */
-    pReqData[uOffset + 1] = 0x01;
+    /* Command id */
+    pReqData[uOffset + 1] = _L2CAP_newSigID(pChannel);
     /* Command length */
     BT_storeLE16(L2CAP_DISCONN_REQ_SIZE, pReqData, uOffset + 2);
 
@@ -319,27 +397,253 @@ BOOL L2CAP_API_disconnect(UINT16 uPSM)
     BT_storeLE16(pChannel->uLocalCID, pReqData, uOffset + 2);
 
     /*Send the frame to the remote device*/
-    bRetVal = gpsL2CAPCB->HCIsendData(pReqData, uReqLen);
+    bRetVal = _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pReqData);
     if(bRetVal)
     {
         DBG_INFO("L2CAP Disconn req sent\n")
+        /*The channel is released once the remote answers*/
+        pChannel->uState = L2CAP_STATE_WAIT_DISCONNECT;
     }
     else
     {
         DBG_ERROR("Unable to send data\n");
     }
 
-    /*Free the data*/
-    BT_free(pReqData);
     return bRetVal;
 }
+
+BOOL L2CAP_API_connect(UINT16 uPSM)
+{
+    L2CAP_CHANNEL *pChannel = NULL;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(gpsL2CAPCB->isInitialised);
+
+    /*One channel per PSM*/
+    if (NULL != _L2CAP_getChannelByPSM(uPSM))
+    {
+        DBG_INFO("connect Channel already exists\n");
+        return FALSE;
+    }
+
+    pChannel = _L2CAP_createChannel();
+    if (NULL == pChannel)
+    {
+        DBG_ERROR("No free channels\n");
+        return FALSE;
+    }
+    pChannel->uPSMultiplexor = uPSM;
+    _L2CAP_setPSMMode(pChannel);
+
+    /*
+     * Do not wait for the response: the connection goes on from the
+     * signalling handler, so several channels can be set up at once.
+     */
+    if (!_L2CAP_connRequest(_L2CAP_newSigID(pChannel), pChannel))
+    {
+        _L2CAP_destroyChannel(pChannel);
+        return FALSE;
+    }
+    pChannel->uState = L2CAP_STATE_WAIT_CONNECT_RSP;
+    return TRUE;
+}
+
+UINT16 L2CAP_API_getMTU(UINT16 uPSM)
+{
+    L2CAP_CHANNEL *pChannel = NULL;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(gpsL2CAPCB->isInitialised);
+
+    pChannel = _L2CAP_getChannelByPSM(uPSM);
+    if (NULL == pChannel || pChannel->uState != L2CAP_STATE_OPEN)
+    {
+        return 0;
+    }
+    return _L2CAP_getMTU(pChannel);
+}
+
+BOOL L2CAP_API_sendControl(UINT16 uPSM, const BYTE *pData, UINT16 uLen)
+{
+    BYTE *pL2CAPData = NULL;
+    UINT16 i;
+    L2CAP_CHANNEL *pChannel = NULL;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(gpsL2CAPCB->isInitialised);
+
+    pChannel = _L2CAP_getChannelByPSM(uPSM);
+    if (NULL == pChannel)
+    {
+        DBG_INFO("sendControl Non-existant channel\n");
+        return FALSE;
+    }
+
+    /*Enhanced channels have to keep the I-frame sequence*/
+    if (pChannel->bMode != L2CAP_MODE_BASIC)
+    {
+        return L2CAP_API_sendData(uPSM, pData, uLen);
+    }
+    if (uLen > _L2CAP_getMTU(pChannel))
+    {
+        DBG_ERROR("SDU bigger than the MTU\n");
+        return FALSE;
+    }
+
+    /*Generate an L2CAP data frame (same as the data, other queue)*/
+    pL2CAPData = _L2CAP_newFrame(uLen + L2CAP_HDR_LEN);
+    if(NULL == pL2CAPData)
+    {
+        DBG_ERROR("Not enough memory!\n");
+        return FALSE;
+    }
+    BT_storeLE16(uLen, pL2CAPData, 0);
+    BT_storeLE16(pChannel->uRemoteCID, pL2CAPData, 2);
+    for (i = 0; i < uLen; ++i)
+    {
+        pL2CAPData[i + L2CAP_HDR_LEN] = pData[i];
+    }
+
+    return _L2CAP_queueFrame(&pChannel->sCtrlQueue, pL2CAPData);
+}
+
+BOOL L2CAP_API_setWeight(UINT16 uPSM, UINT8 bWeight)
+{
+    L2CAP_CHANNEL *pChannel = NULL;
+
+    ASSERT(NULL != gpsL2CAPCB);
+
+    pChannel = _L2CAP_getChannelByPSM(uPSM);
+    if (NULL == pChannel || bWeight == 0)
+    {
+        return FALSE;
+    }
+    pChannel->bWeight = bWeight;
+    return TRUE;
+}
+
+void L2CAP_API_txReady()
+{
+    ASSERT(NULL != gpsL2CAPCB);
+
+    /*The HCI can take more data: keep on sending*/
+    _L2CAP_txSchedule();
+}
+
+void L2CAP_API_linkClosed()
+{
+    ASSERT(NULL != gpsL2CAPCB);
+
+    /*Every channel was on the ACL link: closed, the device is told*/
+    L2CAP_reset();
+}
+
+BOOL L2CAP_API_setMode(UINT16 uPSM, UINT8 bMode, UINT8 bTxWindow)
+{
+    UINT i;
+    L2CAP_PSM_MODE *psFree = NULL;
+
+    ASSERT(NULL != gpsL2CAPCB);
+
+    if (bMode != L2CAP_MODE_BASIC &&
+        bMode != L2CAP_MODE_ERTM &&
+        bMode != L2CAP_MODE_STREAMING)
+    {
+        DBG_ERROR("Unsupported L2CAP mode\n");
+        return FALSE;
+    }
+    /*TxWindow: 1 to 63 I-frames*/
+    if (bTxWindow == 0 || bTxWindow > L2CAP_SEQ_MASK)
+    {
+        bTxWindow = L2CAP_ERTM_TX_WINDOW;
+    }
+
+    /*Update the PSM entry (or take a free one)*/
+    for (i = 0; i < L2CAP_MAX_PSM_MODES; ++i)
+    {
+        if (gpsL2CAPCB->asPSMMode[i].uPSM == uPSM)
+        {
+            psFree = &gpsL2CAPCB->asPSMMode[i];
+            break;
+        }
+        if (NULL == psFree && gpsL2CAPCB->asPSMMode[i].uPSM == 0x0000)
+        {
+            psFree = &gpsL2CAPCB->asPSMMode[i];
+        }
+    }
+    if (NULL == psFree)
+    {
+        DBG_ERROR("No room for the PSM mode\n");
+        return FALSE;
+    }
+
+    psFree->uPSM = (bMode == L2CAP_MODE_BASIC) ? 0x0000 : uPSM;
+    psFree->bMode = bMode;
+    psFree->bTxWindow = bTxWindow;
+    return TRUE;
+}
+
 /*
  * L2CAP private functions implementation
  */
 
+BOOL _L2CAP_sigHandler(const BYTE *pData, UINT16 uLen)
+{
+    UINT16 uOffset, uCmdLen;
+    const BYTE *pCmdData;
+    UINT8 bCmdCode, bCmdId;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pData);
+
+    /*Check the length*/
+    if (uLen < L2CAP_SIGHDR_LEN)
+    {
+        DBG_ERROR("Wrong frame size\n");
+        return FALSE;
+    }
+
+    /*
+     * A C-frame may carry several commands back to back, walk all of them.
+     * Each command is bounds-checked against the C-frame payload length.
+     */
+    for (uOffset = 0; (uLen - uOffset) >= L2CAP_SIGHDR_LEN;
+            uOffset += L2CAP_SIGHDR_LEN + uCmdLen)
+    {
+        /*
+         * Get the command parameters:
+         * Code (1 octet): Command code
+         * Id (1 octet): Command identifier
+         * Length (2 octet): Command data length
+         * Data: Command data
+         */
+        bCmdCode = pData[uOffset];
+        bCmdId = pData[uOffset + 1];
+        uCmdLen = BT_readLE16(pData, uOffset + 2);
+
+        /*Truncated command, drop the rest of the frame*/
+        if (uCmdLen > (uLen - uOffset - L2CAP_SIGHDR_LEN))
+        {
+            DBG_ERROR("Truncated signalling command\n");
+            return FALSE;
+        }
+
+        /*Get a pointer to the command data (if any)*/
+        if (uCmdLen == 0)
+            pCmdData = NULL;
+        else
+            pCmdData = &pData[uOffset + L2CAP_SIGHDR_LEN];
+
+        /*Handle the command (a failure must not stall the following ones)*/
+        _L2CAP_cmdHandler(bCmdCode, bCmdId, uCmdLen, pCmdData);
+    }
+
+    return TRUE;
+}
+
 BOOL _L2CAP_cmdHandler(UINT8 bCode, UINT8 bId, UINT16 uLen, const BYTE *pData)
 {
-    UINT16 uLocalCID, uInfoType = 0;
+    UINT16 uLocalCID, uResult, uInfoType = 0;
     L2CAP_CHANNEL *pChannel = NULL;
 
     ASSERT(NULL != gpsL2CAPCB);
@@ -350,6 +654,11 @@ BOOL _L2CAP_cmdHandler(UINT8 bCode, UINT8 bId, UINT16 uLen, const BYTE *pData)
         case L2CAP_INFO_REQ:
             DBG_INFO("L2CAP Info req received\n");
 
+            if (uLen < L2CAP_INFO_REQ_SIZE)
+            {
+                DBG_ERROR("Wrong command size\n");
+                return FALSE;
+            }
             uInfoType = BT_readLE16(pData,0);
             /*Accept the configuration*/
             if(!_L2CAP_infoResponse(bId, uInfoType))
@@ -363,13 +672,24 @@ BOOL _L2CAP_cmdHandler(UINT8 bCode, UINT8 bId, UINT16 uLen, const BYTE *pData)
         case L2CAP_CONN_REQ:
             DBG_INFO("L2CAP Conn req received\n");
 
+            if (uLen < L2CAP_CONN_REQ_SIZE)
+            {
+                DBG_ERROR("Wrong command size\n");
+                return FALSE;
+            }
             pChannel = _L2CAP_createChannel(gpsL2CAPCB);
+            if (NULL == pChannel)
+            {
+                DBG_ERROR("No free channels\n");
+                return FALSE;
+            }
 
             /*Get the connection request parameters*/
             pChannel->uPSMultiplexor = BT_readLE16(pData, 0);
             pChannel->uRemoteCID = BT_readLE16(pData, 2);
-            /*Create a local CID (random)*/
-            pChannel->uLocalCID = pChannel->uRemoteCID + 4;
+
+            /*Start with the mode requested for the PSM (if any)*/
+            _L2CAP_setPSMMode(pChannel);
 
             /*Accept the connection*/
             if (!_L2CAP_acceptConnetion(bId, pChannel))
@@ -377,147 +697,185 @@ BOOL _L2CAP_cmdHandler(UINT8 bCode, UINT8 bId, UINT16 uLen, const BYTE *pData)
                 DBG_ERROR("Unexpected error\n");
                 return FALSE;
             }
-            /*Go to the next state*/
+            /*Go to the next state, the remote configures first*/
             pChannel->uState = L2CAP_STATE_WAIT_CONFIG;
+            BT_timerStart(&pChannel->sSigTimer, L2CAP_ERTX_MS);
             return TRUE;
             break;
 
-        default:
-            DBG_ERROR("l2cap unknown request ");
-//			UART1PutDec(bCode);
-            DBG_ERROR("\n");
-            break;
-    }
-	DelayMs(10);
+        case L2CAP_CONN_RSP:
+            DBG_INFO("L2CAP Conn resp received\n");
 
-    uLocalCID = BT_readLE16(pData, 0);
-    pChannel = _L2CAP_getChannelByLCID(uLocalCID);
-    if (NULL == pChannel)
-    {
-        DBG_ERROR("cmdHandler Non-existant channel\n");
-        return FALSE;
-    }
+            /*
+             * Destination CID (remote), Source CID (local),
+             * Result and Status
+             */
+            if (uLen < L2CAP_CONN_RSP_SIZE)
+            {
+                DBG_ERROR("Wrong command size\n");
+                return FALSE;
+            }
+            pChannel = _L2CAP_getChannelByLCID(BT_readLE16(pData, 2));
+            if (NULL == pChannel ||
+                pChannel->uState != L2CAP_STATE_WAIT_CONNECT_RSP ||
+                pChannel->bSigID != bId)
+            {
+                DBG_ERROR("Unexpected conn resp\n");
+                return FALSE;
+            }
 
-    /*Switch according to the L2CAP state*/
-    switch (pChannel->uState)
-    {      
-        case L2CAP_STATE_WAIT_CONFIG:
-            /*Switch according to the command code*/
-            switch (bCode)
+            uResult = BT_readLE16(pData, 4);
+            /*Keep waiting, the final response will follow (ERTX)*/
+            if (uResult == L2CAP_CONN_PENDING)
             {
-                case L2CAP_CFG_REQ:
-
-                    DBG_INFO("L2CAP Conf req received\n");
-
-                    /*Accept the configuration*/
-                    if(!_L2CAP_configResponse(bId, L2CAP_MTU, pChannel))
-                    {
-                        DBG_TRACE();
-                        return FALSE;
-                    }
-
-                    /*Request configuration*/
-                    if(!_L2CAP_configRequest(bId, L2CAP_MTU, pChannel))
-                    {
-                        DBG_TRACE();
-                        return FALSE;
-                    }
-                        
-                    /*Go to the next state*/
-                    pChannel->uState = L2CAP_STATE_WAIT_CONFIG_RSP;
-                    break;
+                BT_timerStart(&pChannel->sSigTimer, L2CAP_ERTX_MS);
+                return TRUE;
+            }
+            if (uResult != L2CAP_CONN_SUCCESS)
+            {
+                DBG_ERROR("L2CAP Conn refused\n");
+                _L2CAP_channelClosed(pChannel);
+                return TRUE;
+            }
 
-                default:
-                    break;
+            /*Connected: both sides configure the channel at once*/
+            pChannel->uRemoteCID = BT_readLE16(pData, 0);
+            if (!_L2CAP_configRequest(_L2CAP_newSigID(pChannel), pChannel))
+            {
+                DBG_TRACE();
+                return FALSE;
             }
+            pChannel->uState = L2CAP_STATE_WAIT_CONFIG_REQ_RSP;
+            return TRUE;
             break;
 
-        case L2CAP_STATE_WAIT_SEND_CONFIG:
-            /*Not implemented*/
-            break;
+        case L2CAP_CMD_REJ:
+            DBG_INFO("L2CAP Command reject received\n");
 
-        case L2CAP_STATE_WAIT_CONFIG_REQ_RSP:
-            /*Not implemented*/
+            /*The rejected command is identified by its signalling ID*/
+            pChannel = _L2CAP_getChannelBySigID(bId);
+            if (NULL != pChannel && pChannel->uState != L2CAP_STATE_OPEN)
+            {
+                _L2CAP_channelClosed(pChannel);
+            }
+            return TRUE;
             break;
 
-        case L2CAP_STATE_WAIT_CONFIG_RSP:
-            /*Switch according to the command code*/
-            switch (bCode)
+        case L2CAP_DISCONN_RSP:
+            DBG_INFO("L2CAP Disconn resp received\n");
+
+            /*Destination CID (remote), Source CID (local)*/
+            if (uLen < L2CAP_DISCONN_RSP_SIZE)
             {
-                case L2CAP_CFG_RSP:
-
-                    DBG_INFO("L2CAP Conf resp received\n");
-
-                    /*
-                     * Check the response frame parameters
-                     * Source CID (LocalCID expected)
-                     * Flags (0x0000 expected)
-                     * Result (0x0000 expected)
-                     */
-                    if ((BT_readLE16(pData, 0) != pChannel->uLocalCID) ||
-                        (BT_readLE16(pData, 2) != 0x0000) ||
-                        (BT_readLE16(pData, 4) != L2CAP_CFG_SUCCESS))
-                    {
-                        DBG_ERROR("Wrong config\n")
-                        return FALSE;
-                    }
-
-                    /*Raise the linked flag in the L2CAP control block*/
-                    pChannel->isLinked = TRUE;
-                    /*Go to the next state*/
-                    pChannel->uState = L2CAP_STATE_OPEN;
-                    break;
+                DBG_ERROR("Wrong command size\n");
+                return FALSE;
+            }
+            pChannel = _L2CAP_getChannelByLCID(BT_readLE16(pData, 2));
+            if (NULL != pChannel &&
+                pChannel->uState == L2CAP_STATE_WAIT_DISCONNECT)
+            {
+                _L2CAP_channelClosed(pChannel);
+            }
+            return TRUE;
+            break;
+
+        default:
+            break;
+    }
 
-                case L2CAP_DISCONN_REQ:
+    /*All the remaining commands start with a CID*/
+    if (uLen < 2)
+    {
+        DBG_ERROR("Wrong command size\n");
+        return FALSE;
+    }
+    uLocalCID = BT_readLE16(pData, 0);
+    pChannel = _L2CAP_getChannelByLCID(uLocalCID);
+    if (NULL == pChannel)
+    {
+        DBG_ERROR("cmdHandler Non-existant channel\n");
+        return FALSE;
+    }
 
-                    DBG_INFO("L2CAP Disconn req received\n");
+    /*The remote may close the channel at any state*/
+    if (bCode == L2CAP_DISCONN_REQ)
+    {
+        DBG_INFO("L2CAP Disconn req received\n");
 
-                    /*Disconnect the channel as requested*/
-                    if (!_L2CAP_disconnResponse(bId, pChannel))
-                    {
-                        DBG_TRACE();
-                        return FALSE;
-                    }
-                    /*Go to the next state*/
-                    _L2CAP_destroyChannel(pChannel);
-                    pChannel = NULL;
-                    break;
+        /*Disconnect the channel as requested*/
+        if (!_L2CAP_disconnResponse(bId, pChannel))
+        {
+            DBG_ERROR( "Unexpected error\n");
+            return FALSE;
+        }
+        /*Go to the next state*/
+        _L2CAP_channelClosed(pChannel);
+        return TRUE;
+    }
 
-                default:
-                    break;
+    /*
+     * Switch according to the L2CAP state. The configuration goes both
+     * ways and the two halves may complete in any order:
+     * Acceptor: WAIT_CONFIG -> WAIT_CONFIG_RSP -> OPEN
+     * Initiator: WAIT_CONFIG_REQ_RSP -> WAIT_CONFIG_REQ or
+     *            WAIT_CONFIG_RSP -> OPEN
+     */
+    switch (pChannel->uState)
+    {      
+        case L2CAP_STATE_WAIT_CONFIG:
+            if (bCode == L2CAP_CFG_REQ &&
+                _L2CAP_configReqHandler(bId, uLen, pData, pChannel))
+            {
+                /*Request configuration*/
+                if(!_L2CAP_configRequest(_L2CAP_newSigID(pChannel), pChannel))
+                {
+                    DBG_TRACE();
+                    return FALSE;
+                }
+                /*Go to the next state*/
+                pChannel->uState = L2CAP_STATE_WAIT_CONFIG_RSP;
             }
             break;
 
-        case L2CAP_STATE_WAIT_CONFIG_REQ:
-            /*Not implemented*/
+        case L2CAP_STATE_WAIT_SEND_CONFIG:
+            /*Our configuration request is sent as soon as we connect*/
             break;
 
-        case L2CAP_STATE_OPEN:
-            /*Switch according to the command code*/
-            switch (bCode)
+        case L2CAP_STATE_WAIT_CONFIG_REQ_RSP:
+            if (bCode == L2CAP_CFG_REQ &&
+                _L2CAP_configReqHandler(bId, uLen, pData, pChannel))
             {
-                case L2CAP_DISCONN_REQ:
-
-                    DBG_INFO("L2CAP Disconn req received\n");
-
-                    /*Disconnect the channel as requested*/
-                    if (!_L2CAP_disconnResponse(bId, pChannel))
-                    {
-                        DBG_ERROR( "Unexpected error\n");
-                        return FALSE;
-                    }
-                    /*Go to the next state*/
-                    _L2CAP_destroyChannel(pChannel);
-                    pChannel = NULL;
-                    break;
+                pChannel->uState = L2CAP_STATE_WAIT_CONFIG_RSP;
+            }
+            else if (bCode == L2CAP_CFG_RSP &&
+                _L2CAP_configRspHandler(bId, uLen, pData, pChannel))
+            {
+                pChannel->uState = L2CAP_STATE_WAIT_CONFIG_REQ;
+                BT_timerStart(&pChannel->sSigTimer, L2CAP_ERTX_MS);
+            }
+            break;
 
-                default:
-                    break;
+        case L2CAP_STATE_WAIT_CONFIG_RSP:
+            if (bCode == L2CAP_CFG_RSP &&
+                _L2CAP_configRspHandler(bId, uLen, pData, pChannel))
+            {
+                _L2CAP_channelOpen(pChannel);
+            }
+            break;
+
+        case L2CAP_STATE_WAIT_CONFIG_REQ:
+            if (bCode == L2CAP_CFG_REQ &&
+                _L2CAP_configReqHandler(bId, uLen, pData, pChannel))
+            {
+                _L2CAP_channelOpen(pChannel);
             }
             break;
 
+        case L2CAP_STATE_OPEN:
+            break;
+
         case L2CAP_STATE_WAIT_DISCONNECT:
-            /*Not implemented*/
+            /*Waiting for the disconnection response*/
             break;
                 
         default:
@@ -528,121 +886,1170 @@ BOOL _L2CAP_cmdHandler(UINT8 bCode, UINT8 bId, UINT16 uLen, const BYTE *pData)
     return TRUE;
 }
 
-BOOL _L2CAP_dataHandler(UINT16 uCID, UINT16 uLen, const BYTE *pData)
+BOOL _L2CAP_configReqHandler(UINT8 bId, UINT16 uLen, const BYTE *pData,
+        L2CAP_CHANNEL *pChannel)
+{
+    UINT16 uResult;
+
+    ASSERT(NULL != pChannel);
+
+    DBG_INFO("L2CAP Conf req received\n");
+
+    /*
+     * Check the options (they follow the DCID and flags)
+     * and answer the configuration
+     */
+    if (uLen < L2CAP_CFG_REQ_SIZE)
+    {
+        DBG_ERROR("Wrong command size\n");
+        return FALSE;
+    }
+    uResult = _L2CAP_parseConfig(pChannel, &pData[L2CAP_CFG_REQ_SIZE],
+            uLen - L2CAP_CFG_REQ_SIZE, FALSE);
+    if(!_L2CAP_configResponse(bId, uResult, pChannel))
+    {
+        DBG_TRACE();
+        return FALSE;
+    }
+    /*Wait for an acceptable configuration otherwise*/
+    return (uResult == L2CAP_CFG_SUCCESS);
+}
+
+BOOL _L2CAP_configRspHandler(UINT8 bId, UINT16 uLen, const BYTE *pData,
+        L2CAP_CHANNEL *pChannel)
+{
+    UINT16 uResult;
+
+    ASSERT(NULL != pChannel);
+
+    DBG_INFO("L2CAP Conf resp received\n");
+
+    /*
+     * Check the response frame parameters
+     * Source CID (LocalCID expected)
+     * Flags (0x0000 expected)
+     * Result
+     */
+    if ((uLen < L2CAP_CFG_RSP_SIZE) ||
+        (BT_readLE16(pData, 2) != 0x0000) ||
+        (bId != pChannel->bSigID))
+    {
+        DBG_ERROR("Wrong config\n")
+        return FALSE;
+    }
+    /*Our request is answered*/
+    BT_timerStop(&pChannel->sSigTimer);
+
+    uResult = BT_readLE16(pData, 4);
+    /*The remote suggests another mode, request it again*/
+    if (uResult == L2CAP_CFG_UNACCEPTABLE)
+    {
+        if (_L2CAP_parseConfig(pChannel, &pData[L2CAP_CFG_RSP_SIZE],
+                uLen - L2CAP_CFG_RSP_SIZE, TRUE) != L2CAP_CFG_SUCCESS)
+        {
+            DBG_ERROR("Wrong config\n")
+            return FALSE;
+        }
+        if(!_L2CAP_configRequest(_L2CAP_newSigID(pChannel), pChannel))
+        {
+            DBG_TRACE();
+        }
+        return FALSE;
+    }
+    if (uResult != L2CAP_CFG_SUCCESS)
+    {
+        DBG_ERROR("Wrong config\n")
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void _L2CAP_channelOpen(L2CAP_CHANNEL *pChannel)
+{
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    /*The configuration is over*/
+    BT_timerStop(&pChannel->sSigTimer);
+    /*Start the sequence numbers from scratch*/
+    _L2CAP_resetEnhanced(pChannel);
+    /*Raise the linked flag in the L2CAP control block*/
+    pChannel->isLinked = TRUE;
+    /*Go to the next state*/
+    pChannel->uState = L2CAP_STATE_OPEN;
+
+    DBG_INFO("L2CAP Channel open\n");
+    if (NULL != gpsL2CAPCB->DEVconnected)
+    {
+        gpsL2CAPCB->DEVconnected(pChannel->uPSMultiplexor, TRUE);
+    }
+}
+
+void _L2CAP_channelClosed(L2CAP_CHANNEL *pChannel)
+{
+    UINT16 uPSM;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    uPSM = pChannel->uPSMultiplexor;
+    _L2CAP_destroyChannel(pChannel);
+
+    /*Tell the device the channel is gone (or could not be set up)*/
+    if (NULL != gpsL2CAPCB->DEVconnected)
+    {
+        gpsL2CAPCB->DEVconnected(uPSM, FALSE);
+    }
+}
+
+BOOL _L2CAP_dataHandler(UINT16 uCID, UINT16 uLen, const BYTE *pData)
+{
+    L2CAP_CHANNEL *pChannel = NULL;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(gpsL2CAPCB->isInitialised);
+
+    pChannel = _L2CAP_getChannelByLCID(uCID);
+    if (NULL == pChannel)
+    {
+        DBG_INFO("dataHandler Non-existant channel\n");
+        return FALSE;
+    }
+
+    /*Check L2CAP state*/
+    if (pChannel->uState != L2CAP_STATE_OPEN)
+    {
+        DBG_TRACE();
+        return FALSE;
+    }
+
+    /*ERTM and Streaming mode frames carry a control field and a FCS*/
+    if (pChannel->bMode != L2CAP_MODE_BASIC)
+    {
+        return _L2CAP_enhancedHandler(pChannel, pData, uLen);
+    }
+
+    /*The remote must honour our MTU*/
+    if (uLen > pChannel->uInMTU)
+    {
+        DBG_ERROR("SDU bigger than the MTU\n");
+        return FALSE;
+    }
+
+    return _L2CAP_deliverSDU(pChannel, pData, uLen);
+}
+
+BOOL _L2CAP_deliverSDU(L2CAP_CHANNEL *pChannel, const BYTE *pData,
+        UINT16 uLen)
+{
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    /*Switch according to the PSM*/
+    switch(pChannel->uPSMultiplexor)
+    {
+        case L2CAP_SDP_PSM:
+            /*Put the data into the SDP layer*/
+            DBG_INFO("L2CAP SDP data received\n");
+            gpsL2CAPCB->SDPputData(pData, uLen);
+            break;
+        case L2CAP_RFCOMM_PSM:
+            /*Put the data into the RFCOMM layer*/
+            DBG_INFO("L2CAP RFCOMM data received\n");
+            gpsL2CAPCB->RFCOMMputData(pData, uLen);
+            break;
+    }
+
+    return TRUE;
+}
+
+BOOL _L2CAP_enhancedHandler(L2CAP_CHANNEL *pChannel, const BYTE *pData,
+        UINT16 uLen)
+{
+    BYTE aHdr[L2CAP_HDR_LEN];
+    UINT16 uCtrl, uFCS;
+    UINT8 bTxSeq, bReqSeq, bSAR;
+    BOOL bRetVal, isFinal = FALSE;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    if (uLen < L2CAP_CTRL_LEN + L2CAP_FCS_LEN)
+    {
+        DBG_ERROR("Wrong frame size\n");
+        return FALSE;
+    }
+
+    /*Check the FCS (it covers the basic header too), drop corrupted frames*/
+    BT_storeLE16(uLen, aHdr, 0);
+    BT_storeLE16(pChannel->uLocalCID, aHdr, 2);
+    uFCS = L2CAP_FCS_CRC(aHdr, L2CAP_HDR_LEN, L2CAP_INITIAL_CRC);
+    uFCS = L2CAP_FCS_CRC(pData, uLen - L2CAP_FCS_LEN, uFCS);
+    if (uFCS != BT_readLE16(pData, uLen - L2CAP_FCS_LEN))
+    {
+        DBG_ERROR("L2CAP Invalid Frame (Wrong FCS)\n");
+        return FALSE;
+    }
+    uLen -= L2CAP_FCS_LEN;
+
+    uCtrl = BT_readLE16(pData, 0);
+    bReqSeq = (uCtrl >> L2CAP_CTRL_REQSEQ_SHIFT) & L2CAP_SEQ_MASK;
+
+    /*The answer to our poll: back to the retransmission timer*/
+    if ((uCtrl & L2CAP_CTRL_FINAL) && pChannel->isWaitFinal)
+    {
+        BT_timerStop(&pChannel->sAckTimer);
+        pChannel->isWaitFinal = FALSE;
+        isFinal = TRUE;
+    }
+
+    /*S-frame (never used in Streaming mode)*/
+    if (uCtrl & L2CAP_CTRL_SFRAME)
+    {
+        if (pChannel->bMode != L2CAP_MODE_ERTM)
+        {
+            return FALSE;
+        }
+
+        /*Every S-frame acknowledges up to ReqSeq - 1*/
+        _L2CAP_ackFrames(pChannel, bReqSeq);
+
+        switch ((uCtrl >> L2CAP_CTRL_SUPER_SHIFT) & 0x03)
+        {
+            case L2CAP_SUPER_RR:
+                pChannel->isRemoteBusy = FALSE;
+                break;
+
+            case L2CAP_SUPER_RNR:
+                pChannel->isRemoteBusy = TRUE;
+                break;
+
+            case L2CAP_SUPER_REJ:
+                /*Send again every I-frame from ReqSeq*/
+                pChannel->isRemoteBusy = FALSE;
+                return _L2CAP_retransmit(pChannel, bReqSeq, FALSE,
+                        (uCtrl & L2CAP_CTRL_POLL) != 0);
+
+            case L2CAP_SUPER_SREJ:
+                /*Send again the I-frame ReqSeq only*/
+                return _L2CAP_retransmit(pChannel, bReqSeq, TRUE,
+                        (uCtrl & L2CAP_CTRL_POLL) != 0);
+        }
+
+        /*Whatever the poll found unacknowledged is sent again*/
+        if (isFinal && !pChannel->isRemoteBusy)
+        {
+            _L2CAP_retransmit(pChannel, pChannel->bExpectedAckSeq, FALSE,
+                    FALSE);
+        }
+        /*A poll must be answered with the final bit*/
+        if (uCtrl & L2CAP_CTRL_POLL)
+        {
+            return _L2CAP_sendSFrame(pChannel, L2CAP_SUPER_RR, FALSE, TRUE);
+        }
+        return TRUE;
+    }
+
+    /*I-frame*/
+    bTxSeq = (uCtrl >> L2CAP_CTRL_TXSEQ_SHIFT) & L2CAP_SEQ_MASK;
+    bSAR = (uCtrl >> L2CAP_CTRL_SAR_SHIFT) & 0x03;
+    pData += L2CAP_CTRL_LEN;
+    uLen -= L2CAP_CTRL_LEN;
+
+    /*Streaming: no acknowledgements, a gap just loses the current SDU*/
+    if (pChannel->bMode == L2CAP_MODE_STREAMING)
+    {
+        if (bTxSeq != pChannel->bExpectedTxSeq)
+        {
+            pChannel->isInSDU = FALSE;
+        }
+        pChannel->bExpectedTxSeq = (bTxSeq + 1) & L2CAP_SEQ_MASK;
+        return _L2CAP_reassemble(pChannel, bSAR, pData, uLen);
+    }
+
+    /*ERTM: the I-frame acknowledges our frames too*/
+    _L2CAP_ackFrames(pChannel, bReqSeq);
+    if (isFinal)
+    {
+        _L2CAP_retransmit(pChannel, pChannel->bExpectedAckSeq, FALSE, FALSE);
+    }
+
+    if (bTxSeq != pChannel->bExpectedTxSeq)
+    {
+        /*Duplicated I-frame (already received), ignore it*/
+        if (((pChannel->bExpectedTxSeq - bTxSeq) & L2CAP_SEQ_MASK) <=
+                pChannel->bRxWindow)
+        {
+            return TRUE;
+        }
+        /*Out of sequence, ask (once) for everything from ExpectedTxSeq*/
+        if (!pChannel->isRejSent)
+        {
+            pChannel->isRejSent = TRUE;
+            _L2CAP_sendSFrame(pChannel, L2CAP_SUPER_REJ, FALSE, FALSE);
+        }
+        return FALSE;
+    }
+
+    pChannel->isRejSent = FALSE;
+    pChannel->bExpectedTxSeq = (pChannel->bExpectedTxSeq + 1) & L2CAP_SEQ_MASK;
+    ++pChannel->bUnackedRx;
+
+    bRetVal = _L2CAP_reassemble(pChannel, bSAR, pData, uLen);
+
+    /*
+     * Acknowledge at the end of every SDU, or once half of the window is
+     * used, so the remote never stalls waiting for its retransmission timer
+     */
+    if (bSAR == L2CAP_SAR_UNSEGMENTED || bSAR == L2CAP_SAR_END ||
+        (pChannel->bUnackedRx << 1) >= pChannel->bRxWindow)
+    {
+        _L2CAP_sendSFrame(pChannel, L2CAP_SUPER_RR, FALSE, FALSE);
+    }
+    return bRetVal;
+}
+
+BOOL _L2CAP_reassemble(L2CAP_CHANNEL *pChannel, UINT8 bSAR,
+        const BYTE *pData, UINT16 uLen)
+{
+    UINT16 i;
+
+    ASSERT(NULL != pChannel);
+
+    /*Any SDU start discards the previous (incomplete) SDU*/
+    if ((bSAR == L2CAP_SAR_UNSEGMENTED || bSAR == L2CAP_SAR_START) &&
+        pChannel->isInSDU)
+    {
+        DBG_ERROR("L2CAP Incomplete SDU dropped\n");
+        pChannel->isInSDU = FALSE;
+    }
+
+    switch (bSAR)
+    {
+        case L2CAP_SAR_UNSEGMENTED:
+            return _L2CAP_deliverSDU(pChannel, pData, uLen);
+
+        case L2CAP_SAR_START:
+            /*The first segment carries the SDU length*/
+            if (uLen < L2CAP_SDULEN_LEN)
+            {
+                return FALSE;
+            }
+            pChannel->uSDULen = BT_readLE16(pData, 0);
+            pData += L2CAP_SDULEN_LEN;
+            uLen -= L2CAP_SDULEN_LEN;
+            /*The reassembly buffer holds uInMTU bytes*/
+            if (NULL == pChannel->pSDU ||
+                pChannel->uSDULen > pChannel->uInMTU ||
+                uLen > pChannel->uSDULen)
+            {
+                DBG_ERROR("L2CAP SDU too long\n");
+                return FALSE;
+            }
+            pChannel->isInSDU = TRUE;
+            pChannel->uSDUOffset = 0;
+            break;
+
+        case L2CAP_SAR_CONTINUE:
+        case L2CAP_SAR_END:
+            if (!pChannel->isInSDU)
+            {
+                return FALSE;
+            }
+            break;
+    }
+
+    /*Append the segment*/
+    if ((pChannel->uSDUOffset + uLen) > pChannel->uSDULen)
+    {
+        DBG_ERROR("L2CAP SDU overflow\n");
+        pChannel->isInSDU = FALSE;
+        return FALSE;
+    }
+    for (i = 0; i < uLen; ++i)
+    {
+        pChannel->pSDU[pChannel->uSDUOffset + i] = pData[i];
+    }
+    pChannel->uSDUOffset += uLen;
+
+    /*A complete SDU goes to the upper layer*/
+    if (bSAR == L2CAP_SAR_END)
+    {
+        pChannel->isInSDU = FALSE;
+        if (pChannel->uSDUOffset == pChannel->uSDULen)
+        {
+            _L2CAP_deliverSDU(pChannel, pChannel->pSDU, pChannel->uSDULen);
+        }
+    }
+    return TRUE;
+}
+
+BOOL _L2CAP_sendSegmented(L2CAP_CHANNEL *pChannel, const BYTE *pData,
+        UINT16 uLen)
+{
+    L2CAP_TX_FRAME *psFirst = NULL, *psLast = NULL, *psFrame;
+    BYTE *pFrame;
+    UINT16 uMPS, uChunk, uOffset;
+    UINT8 bFrames, bSAR, bTxSeq;
+
+    ASSERT(NULL != pChannel);
+
+    /*Never send more than the remote takes in*/
+    if (uLen > pChannel->uOutMTU)
+    {
+        DBG_ERROR("SDU bigger than the MTU\n");
+        return FALSE;
+    }
+
+    uMPS = pChannel->uRemoteMPS;
+
+    /*Number of I-frames needed (the first segment carries the SDU length)*/
+    if (uLen <= uMPS)
+    {
+        bFrames = 1;
+    }
+    else
+    {
+        bFrames = 1 + (uLen - (uMPS - L2CAP_SDULEN_LEN) + uMPS - 1) / uMPS;
+    }
+
+    /*ERTM: the whole SDU must fit in the transmit window*/
+    if (pChannel->bMode == L2CAP_MODE_ERTM)
+    {
+        if (pChannel->isRemoteBusy ||
+            (((pChannel->bNextTxSeq - pChannel->bExpectedAckSeq) &
+                L2CAP_SEQ_MASK) + bFrames) > pChannel->bTxWindow)
+        {
+            return FALSE;
+        }
+    }
+
+    /*
+     * Build every segment before queueing any of them: a retried SDU must
+     * not follow the segments of a first, partial, attempt.
+     */
+    bTxSeq = pChannel->bNextTxSeq;
+    for (uOffset = 0; uOffset < uLen || NULL == psFirst; uOffset += uChunk)
+    {
+        uChunk = uLen - uOffset;
+        if (bFrames == 1)
+        {
+            bSAR = L2CAP_SAR_UNSEGMENTED;
+        }
+        else if (uOffset == 0)
+        {
+            bSAR = L2CAP_SAR_START;
+            uChunk = uMPS - L2CAP_SDULEN_LEN;
+        }
+        else if (uChunk > uMPS)
+        {
+            bSAR = L2CAP_SAR_CONTINUE;
+            uChunk = uMPS;
+        }
+        else
+        {
+            bSAR = L2CAP_SAR_END;
+        }
+
+        pFrame = _L2CAP_newIFrame(pChannel, bTxSeq, bSAR, uLen,
+                &pData[uOffset], uChunk);
+        if (NULL == pFrame)
+        {
+            /*Out of memory: nothing was sent, the caller may retry*/
+            while (NULL != psFirst)
+            {
+                psFrame = psFirst;
+                psFirst = psFrame->pNext;
+                _L2CAP_releaseFrame(psFrame->aData);
+            }
+            return FALSE;
+        }
+        psFrame = L2CAP_TX_FRAME_OF(pFrame);
+        if (NULL == psFirst)
+        {
+            psFirst = psFrame;
+        }
+        else
+        {
+            psLast->pNext = psFrame;
+        }
+        psLast = psFrame;
+        bTxSeq = (bTxSeq + 1) & L2CAP_SEQ_MASK;
+    }
+
+    /*Every segment is there: queue them in sequence*/
+    while (NULL != psFirst)
+    {
+        psFrame = psFirst;
+        psFirst = psFrame->pNext;
+        _L2CAP_sendIFrame(pChannel, psFrame->aData);
+    }
+    return TRUE;
+}
+
+BYTE* _L2CAP_newIFrame(L2CAP_CHANNEL *pChannel, UINT8 bTxSeq, UINT8 bSAR,
+        UINT16 uSDULen, const BYTE *pData, UINT16 uLen)
+{
+    BYTE *pFrame = NULL;
+    UINT16 i, uPDULen, uFrameLen, uCtrl, uOffset;
+
+    ASSERT(NULL != pChannel);
+
+    /*Control + [SDU length] + Payload + FCS*/
+    uPDULen = L2CAP_CTRL_LEN + uLen + L2CAP_FCS_LEN;
+    if (bSAR == L2CAP_SAR_START)
+    {
+        uPDULen += L2CAP_SDULEN_LEN;
+    }
+    uFrameLen = uPDULen + L2CAP_HDR_LEN;
+    pFrame = _L2CAP_newFrame(uFrameLen);
+    if (NULL == pFrame)
+    {
+        DBG_ERROR("Not enough memory!\n");
+        return NULL;
+    }
+
+    /*Basic header*/
+    BT_storeLE16(uPDULen, pFrame, 0);
+    BT_storeLE16(pChannel->uRemoteCID, pFrame, 2);
+
+    /*Control field (ReqSeq is always 0 in Streaming mode)*/
+    uCtrl = (bTxSeq << L2CAP_CTRL_TXSEQ_SHIFT) |
+            (bSAR << L2CAP_CTRL_SAR_SHIFT);
+    if (pChannel->bMode == L2CAP_MODE_ERTM)
+    {
+        uCtrl |= pChannel->bExpectedTxSeq << L2CAP_CTRL_REQSEQ_SHIFT;
+    }
+    BT_storeLE16(uCtrl, pFrame, L2CAP_HDR_LEN);
+    uOffset = L2CAP_HDR_LEN + L2CAP_CTRL_LEN;
+
+    if (bSAR == L2CAP_SAR_START)
+    {
+        BT_storeLE16(uSDULen, pFrame, uOffset);
+        uOffset += L2CAP_SDULEN_LEN;
+    }
+    for (i = 0; i < uLen; ++i)
+    {
+        pFrame[uOffset + i] = pData[i];
+    }
+    uOffset += uLen;
+    BT_storeLE16(L2CAP_FCS_CRC(pFrame, uOffset, L2CAP_INITIAL_CRC),
+            pFrame, uOffset);
+    return pFrame;
+}
+
+void _L2CAP_sendIFrame(L2CAP_CHANNEL *pChannel, BYTE *pFrame)
+{
+    UINT8 bSlot;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    if (pChannel->bMode == L2CAP_MODE_ERTM)
+    {
+        /*Keep the frame until it is acknowledged, ReqSeq went with it*/
+        bSlot = (pChannel->bTxHead + ((pChannel->bNextTxSeq -
+                pChannel->bExpectedAckSeq) & L2CAP_SEQ_MASK)) %
+                L2CAP_ERTM_TX_WINDOW;
+        _L2CAP_holdFrame(pFrame);
+        pChannel->apTxFrame[bSlot] = pFrame;
+        pChannel->abTxCount[bSlot] = 1;
+        pChannel->bUnackedRx = 0;
+        /*The oldest outstanding frame runs the retransmission timer*/
+        if (!pChannel->isWaitFinal &&
+            !BT_timerIsArmed(&pChannel->sAckTimer))
+        {
+            BT_timerStart(&pChannel->sAckTimer, L2CAP_ERTM_RTX_TIMEOUT);
+        }
+    }
+    pChannel->bNextTxSeq = (pChannel->bNextTxSeq + 1) & L2CAP_SEQ_MASK;
+    _L2CAP_queueFrame(&pChannel->sDataQueue, pFrame);
+}
+
+BOOL _L2CAP_sendSFrame(L2CAP_CHANNEL *pChannel, UINT8 bSuper, BOOL bPoll,
+        BOOL bFinal)
+{
+    BYTE *pFrame;
+    UINT16 uCtrl;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    pFrame = _L2CAP_newFrame(L2CAP_HDR_LEN + L2CAP_CTRL_LEN + L2CAP_FCS_LEN);
+    if (NULL == pFrame)
+    {
+        DBG_ERROR("Not enough memory!\n");
+        return FALSE;
+    }
+
+    /*Basic header*/
+    BT_storeLE16(L2CAP_CTRL_LEN + L2CAP_FCS_LEN, pFrame, 0);
+    BT_storeLE16(pChannel->uRemoteCID, pFrame, 2);
+
+    /*Control field*/
+    uCtrl = L2CAP_CTRL_SFRAME | (bSuper << L2CAP_CTRL_SUPER_SHIFT) |
+            (pChannel->bExpectedTxSeq << L2CAP_CTRL_REQSEQ_SHIFT);
+    if (bPoll)
+    {
+        uCtrl |= L2CAP_CTRL_POLL;
+    }
+    if (bFinal)
+    {
+        uCtrl |= L2CAP_CTRL_FINAL;
+    }
+    BT_storeLE16(uCtrl, pFrame, L2CAP_HDR_LEN);
+    BT_storeLE16(L2CAP_FCS_CRC(pFrame, L2CAP_HDR_LEN + L2CAP_CTRL_LEN,
+            L2CAP_INITIAL_CRC), pFrame, L2CAP_HDR_LEN + L2CAP_CTRL_LEN);
+
+    /*Acknowledgements must not wait behind the data*/
+    if (!_L2CAP_queueFrame(&pChannel->sCtrlQueue, pFrame))
+    {
+        return FALSE;
+    }
+    pChannel->bUnackedRx = 0;
+    return TRUE;
+}
+
+BOOL _L2CAP_retransmit(L2CAP_CHANNEL *pChannel, UINT8 bTxSeq, BOOL bSingle,
+        BOOL bFinal)
+{
+    BYTE *pFrame;
+    UINT16 uCtrl, uFrameLen;
+    UINT8 bSlot, bPending;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    /*Only the outstanding frames can be sent again*/
+    bPending = (pChannel->bNextTxSeq - pChannel->bExpectedAckSeq) &
+            L2CAP_SEQ_MASK;
+    while (((bTxSeq - pChannel->bExpectedAckSeq) & L2CAP_SEQ_MASK) < bPending)
+    {
+        bSlot = (pChannel->bTxHead + ((bTxSeq - pChannel->bExpectedAckSeq) &
+                L2CAP_SEQ_MASK)) % L2CAP_ERTM_TX_WINDOW;
+        pFrame = pChannel->apTxFrame[bSlot];
+        if (NULL == pFrame)
+        {
+            break;
+        }
+
+        /*MaxTransmit reached (0 = infinite), give up the channel*/
+        if (pChannel->bMaxTransmit != 0 &&
+            pChannel->abTxCount[bSlot] >= pChannel->bMaxTransmit)
+        {
+            DBG_ERROR("L2CAP MaxTransmit reached\n");
+            L2CAP_API_disconnect(pChannel->uPSMultiplexor);
+            return FALSE;
+        }
+        ++pChannel->abTxCount[bSlot];
+
+        /*Refresh ReqSeq and the final bit, then the FCS*/
+        uFrameLen = BT_readLE16(pFrame, 0) + L2CAP_HDR_LEN;
+        uCtrl = BT_readLE16(pFrame, L2CAP_HDR_LEN);
+        uCtrl &= ~((L2CAP_SEQ_MASK << L2CAP_CTRL_REQSEQ_SHIFT) |
+                L2CAP_CTRL_FINAL);
+        uCtrl |= pChannel->bExpectedTxSeq << L2CAP_CTRL_REQSEQ_SHIFT;
+        if (bFinal)
+        {
+            uCtrl |= L2CAP_CTRL_FINAL;
+            bFinal = FALSE;
+        }
+        BT_storeLE16(uCtrl, pFrame, L2CAP_HDR_LEN);
+        BT_storeLE16(L2CAP_FCS_CRC(pFrame, uFrameLen - L2CAP_FCS_LEN,
+                L2CAP_INITIAL_CRC), pFrame, uFrameLen - L2CAP_FCS_LEN);
+
+        /*Still waiting in the queue: it goes out with the new values*/
+        _L2CAP_holdFrame(pFrame);
+        if (!_L2CAP_queueFrame(&pChannel->sDataQueue, pFrame))
+        {
+            return FALSE;
+        }
+        pChannel->bUnackedRx = 0;
+
+        if (bSingle)
+        {
+            break;
+        }
+        bTxSeq = (bTxSeq + 1) & L2CAP_SEQ_MASK;
+    }
+    return TRUE;
+}
+
+void _L2CAP_ackFrames(L2CAP_CHANNEL *pChannel, UINT8 bReqSeq)
+{
+    UINT8 bPending;
+    BOOL isAcked = FALSE;
+
+    ASSERT(NULL != pChannel);
+
+    /*Ignore a ReqSeq outside of the outstanding frames*/
+    bPending = (pChannel->bNextTxSeq - pChannel->bExpectedAckSeq) &
+            L2CAP_SEQ_MASK;
+    if (((bReqSeq - pChannel->bExpectedAckSeq) & L2CAP_SEQ_MASK) > bPending)
+    {
+        DBG_ERROR("L2CAP Invalid ReqSeq\n");
+        return;
+    }
+
+    /*Release every acknowledged frame*/
+    while (pChannel->bExpectedAckSeq != bReqSeq)
+    {
+        if (NULL != pChannel->apTxFrame[pChannel->bTxHead])
+        {
+            _L2CAP_releaseFrame(pChannel->apTxFrame[pChannel->bTxHead]);
+            pChannel->apTxFrame[pChannel->bTxHead] = NULL;
+        }
+        pChannel->bTxHead = (pChannel->bTxHead + 1) % L2CAP_ERTM_TX_WINDOW;
+        pChannel->bExpectedAckSeq =
+                (pChannel->bExpectedAckSeq + 1) & L2CAP_SEQ_MASK;
+        isAcked = TRUE;
+    }
+
+    /*The monitor timer runs until the poll is answered*/
+    if (pChannel->isWaitFinal)
+    {
+        return;
+    }
+    if (pChannel->bExpectedAckSeq == pChannel->bNextTxSeq)
+    {
+        BT_timerStop(&pChannel->sAckTimer);
+    }
+    else if (isAcked || !BT_timerIsArmed(&pChannel->sAckTimer))
+    {
+        BT_timerStart(&pChannel->sAckTimer, L2CAP_ERTM_RTX_TIMEOUT);
+    }
+}
+
+void _L2CAP_resetEnhanced(L2CAP_CHANNEL *pChannel)
+{
+    UINT i;
+
+    ASSERT(NULL != pChannel);
+
+    for (i = 0; i < L2CAP_ERTM_TX_WINDOW; ++i)
+    {
+        if (NULL != pChannel->apTxFrame[i])
+        {
+            _L2CAP_releaseFrame(pChannel->apTxFrame[i]);
+        }
+        pChannel->apTxFrame[i] = NULL;
+        pChannel->abTxCount[i] = 0;
+    }
+    /*The reassembly buffer stays, only the SDU in it is dropped*/
+    pChannel->isInSDU = FALSE;
+    pChannel->uSDULen = 0;
+    pChannel->uSDUOffset = 0;
+
+    pChannel->bTxHead = 0;
+    pChannel->bNextTxSeq = 0;
+    pChannel->bExpectedAckSeq = 0;
+    pChannel->bExpectedTxSeq = 0;
+    pChannel->bUnackedRx = 0;
+    pChannel->isRemoteBusy = FALSE;
+    pChannel->isRejSent = FALSE;
+    BT_timerStop(&pChannel->sAckTimer);
+    pChannel->isWaitFinal = FALSE;
+    pChannel->bPolls = 0;
+}
+
+/*RTX/ERTX: the remote never answered, give the channel up*/
+void _L2CAP_sigTimeout(void *pContext)
+{
+    L2CAP_CHANNEL *pChannel = (L2CAP_CHANNEL *) pContext;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    DBG_ERROR("L2CAP Signalling timeout\n");
+    /*Nothing left to negotiate, or the disconnection could not go out*/
+    if (pChannel->uState == L2CAP_STATE_WAIT_CONNECT_RSP ||
+        pChannel->uState == L2CAP_STATE_WAIT_DISCONNECT ||
+        !L2CAP_API_disconnect(pChannel->uPSMultiplexor))
+    {
+        _L2CAP_channelClosed(pChannel);
+    }
+}
+
+/*
+ * Retransmission timer: poll the remote (RR with P = 1) and wait for the
+ * final bit under the monitor timer, polling again up to MaxTransmit times
+ */
+void _L2CAP_ackTimeout(void *pContext)
+{
+    L2CAP_CHANNEL *pChannel = (L2CAP_CHANNEL *) pContext;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    if (pChannel->uState != L2CAP_STATE_OPEN)
+    {
+        return;
+    }
+    if (!pChannel->isWaitFinal)
+    {
+        DBG_INFO("L2CAP Retransmission timeout\n");
+        pChannel->isWaitFinal = TRUE;
+        pChannel->bPolls = 0;
+    }
+    else if (pChannel->bMaxTransmit != 0 &&
+             pChannel->bPolls >= pChannel->bMaxTransmit)
+    {
+        DBG_ERROR("L2CAP Monitor timeout\n");
+        L2CAP_API_disconnect(pChannel->uPSMultiplexor);
+        return;
+    }
+    ++pChannel->bPolls;
+    _L2CAP_sendSFrame(pChannel, L2CAP_SUPER_RR, TRUE, FALSE);
+    BT_timerStart(&pChannel->sAckTimer, L2CAP_ERTM_MONITOR_TIMEOUT);
+}
+
+BOOL _L2CAP_acceptConnetion(UINT8 bId, L2CAP_CHANNEL *pChannel)
+{
+    UINT16 uRspLen;
+    BYTE *pRspData = NULL;
+    UINT uOffset = 0;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(gpsL2CAPCB->isInitialised);
+    ASSERT(NULL != pChannel);
+
+    /*Generate a connection response frame*/
+    /*Set the length*/
+    uRspLen = L2CAP_CONN_RSP_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
+    /*Allocate the memory (mind the L2CAP HDR)*/
+    pRspData = _L2CAP_newFrame(uRspLen);
+    if(NULL == pRspData)
+    {
+        DBG_ERROR("Not enough memory!\n");
+        return FALSE;
+    }
+
+    /*Set the L2CAP frame header*/
+    /*Length*/
+    BT_storeLE16(uRspLen - L2CAP_HDR_LEN, pRspData, 0);
+    /*Channel*/
+    BT_storeLE16(L2CAP_SIG_CID, pRspData, 2);
+
+    /*Set the response command header values*/
+    uOffset = L2CAP_HDR_LEN;
+    /*Command code*/
+    pRspData[uOffset + 0] = L2CAP_CONN_RSP;
+    /*Command id*/
+    pRspData[uOffset + 1] = bId;
+    /*Command length*/
+    BT_storeLE16(L2CAP_CONN_RSP_SIZE, pRspData, uOffset + 2);
+
+    /*
+     * Set the response command data values
+     * LocalCID (2 octet)
+     * RemoteCID (2 octet)
+     * Response (2 octet): 0x0000 = Connection successful
+     * Status (2 octet): 0x0000 = No further information
+     */
+    uOffset = L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN;
+    BT_storeLE16(pChannel->uLocalCID, pRspData, uOffset);
+    BT_storeLE16(pChannel->uRemoteCID, pRspData, uOffset + 2);
+    BT_storeLE16(L2CAP_CONN_SUCCESS, pRspData, uOffset + 4);
+    BT_storeLE16(0x0000, pRspData, uOffset + 6);
+
+    /*Send the frame to the remote device*/
+    return _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pRspData);
+}
+
+BOOL _L2CAP_connRequest(UINT8 bId, L2CAP_CHANNEL *pChannel)
+{
+    UINT16 uReqLen;
+    BYTE *pReqData = NULL;
+    UINT uOffset = 0;
+    BOOL bRetVal = FALSE;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(gpsL2CAPCB->isInitialised);
+    ASSERT(NULL != pChannel);
+
+    /*Generate a connection request frame*/
+    /*Set the length*/
+    uReqLen = L2CAP_CONN_REQ_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
+    /*Allocate the memory (mind the L2CAP HDR)*/
+    pReqData = _L2CAP_newFrame(uReqLen);
+    if(NULL == pReqData)
+    {
+        DBG_ERROR("Not enough memory!\n");
+        return FALSE;
+    }
+
+    /*Set the L2CAP frame header*/
+    /*Length*/
+    BT_storeLE16(uReqLen - L2CAP_HDR_LEN, pReqData, 0);
+    /*Channel*/
+    BT_storeLE16(L2CAP_SIG_CID, pReqData, 2);
+
+    /*Set the request command header values*/
+    uOffset = L2CAP_HDR_LEN;
+    /*Command code*/
+    pReqData[uOffset + 0] = L2CAP_CONN_REQ;
+    /*Command id*/
+    pReqData[uOffset + 1] = bId;
+    /*Command length*/
+    BT_storeLE16(L2CAP_CONN_REQ_SIZE, pReqData, uOffset + 2);
+
+    /*
+     * Set the request command data values
+     * PSM (2 octet)
+     * LocalCID (2 octet)
+     */
+    uOffset = L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN;
+    BT_storeLE16(pChannel->uPSMultiplexor, pReqData, uOffset);
+    BT_storeLE16(pChannel->uLocalCID, pReqData, uOffset + 2);
+
+    /*Send the frame to the remote device*/
+    bRetVal = _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pReqData);
+    if(bRetVal)
+    {
+        DBG_INFO("L2CAP Conn req sent\n")
+    }
+    else
+    {
+        DBG_ERROR("Unable to send data\n");
+    }
+
+    return bRetVal;
+}
+
+UINT16 _L2CAP_parseConfig(L2CAP_CHANNEL *pChannel, const BYTE *pOptions,
+        UINT16 uLen, BOOL bResponse)
+{
+    UINT16 uOffset, uOptLen, uMPS, uResult = L2CAP_CFG_SUCCESS;
+    UINT8 bType, bMode;
+    BOOL isRFCFound = FALSE, isMTUFound = FALSE;
+
+    ASSERT(NULL != pChannel);
+
+    /*Options: Type (1 octet), Length (1 octet), Value (Length octets)*/
+    for (uOffset = 0; (uLen - uOffset) >= L2CAP_CFG_OPT_HDR_LEN;
+            uOffset += L2CAP_CFG_OPT_HDR_LEN + uOptLen)
+    {
+        bType = pOptions[uOffset];
+        uOptLen = pOptions[uOffset + 1];
+        if ((uLen - uOffset - L2CAP_CFG_OPT_HDR_LEN) < uOptLen)
+        {
+            DBG_ERROR("Truncated config option\n");
+            return L2CAP_CFG_REJECTED;
+        }
+
+        switch (bType & ~L2CAP_CFG_HINT)
+        {
+            case L2CAP_CFG_MTU:
+                if (uOptLen < L2CAP_CFG_MTU_LEN)
+                {
+                    return L2CAP_CFG_REJECTED;
+                }
+                /*The response MTU only echoes our own one*/
+                if (bResponse)
+                {
+                    break;
+                }
+                /*Largest SDU the remote takes in (our outgoing MTU)*/
+                isMTUFound = TRUE;
+                pChannel->uOutMTU = BT_readLE16(pOptions, uOffset + 2);
+                if (pChannel->uOutMTU < L2CAP_MIN_MTU)
+                {
+                    pChannel->uOutMTU = L2CAP_MIN_MTU;
+                    uResult = L2CAP_CFG_UNACCEPTABLE;
+                }
+                break;
+
+            case L2CAP_CFG_FLUSHTO:
+            case L2CAP_CFG_QOS:
+            case L2CAP_CFG_FCS:
+                /*Accepted as they come (the FCS is always used)*/
+                break;
+
+            case L2CAP_CFG_RFC:
+                if (uOptLen < L2CAP_CFG_RFC_LEN)
+                {
+                    return L2CAP_CFG_REJECTED;
+                }
+                /*
+                 * Mode (1), TxWindow (1), MaxTransmit (1),
+                 * Retransmission timeout (2), Monitor timeout (2), MPS (2)
+                 */
+                bMode = pOptions[uOffset + 2];
+                if (bMode != L2CAP_MODE_BASIC &&
+                    bMode != L2CAP_MODE_ERTM &&
+                    bMode != L2CAP_MODE_STREAMING)
+                {
+                    /*Suggest our own mode (or give up on a response)*/
+                    return bResponse ? L2CAP_CFG_REJECTED :
+                            L2CAP_CFG_UNACCEPTABLE;
+                }
+                isRFCFound = TRUE;
+                pChannel->bMode = bMode;
+                /*A response only tells us the mode the remote wants*/
+                if (bResponse || bMode == L2CAP_MODE_BASIC)
+                {
+                    break;
+                }
+
+                /*The remote receive window limits what we send*/
+                pChannel->bTxWindow = pOptions[uOffset + 3];
+                if (pChannel->bTxWindow == 0 ||
+                    pChannel->bTxWindow > L2CAP_ERTM_TX_WINDOW)
+                {
+                    pChannel->bTxWindow = L2CAP_ERTM_TX_WINDOW;
+                }
+                pChannel->bMaxTransmit = pOptions[uOffset + 4];
+                uMPS = BT_readLE16(pOptions, uOffset + 9);
+                pChannel->uRemoteMPS = _L2CAP_getMaxMPS();
+                if (uMPS != 0 && uMPS < pChannel->uRemoteMPS)
+                {
+                    pChannel->uRemoteMPS = uMPS;
+                }
+                break;
+
+            default:
+                /*Unknown hints are silently ignored*/
+                if (!(bType & L2CAP_CFG_HINT))
+                {
+                    DBG_ERROR("Unknown config option\n");
+                    return L2CAP_CFG_UNKNOWN;
+                }
+                break;
+        }
+    }
+
+    /*A request without RFC option means basic mode*/
+    if (!bResponse && !isRFCFound)
+    {
+        pChannel->bMode = L2CAP_MODE_BASIC;
+    }
+    /*A request without MTU option means the default MTU*/
+    if (!bResponse && !isMTUFound)
+    {
+        pChannel->uOutMTU = L2CAP_DEFAULT_MTU;
+    }
+    return uResult;
+}
+
+UINT16 _L2CAP_reserveInMTU(L2CAP_CHANNEL *pChannel)
 {
-    L2CAP_CHANNEL *pChannel = NULL;
+    UINT16 uMTU;
 
     ASSERT(NULL != gpsL2CAPCB);
-    ASSERT(gpsL2CAPCB->isInitialised);
+    ASSERT(NULL != pChannel);
 
-    pChannel = _L2CAP_getChannelByLCID(uCID);
-    if (NULL == pChannel)
-    {
-        DBG_INFO("dataHandler Non-existant channel\n");
-        return FALSE;
-    }
+    /*Give back the previous buffer (configuration retried)*/
+    _L2CAP_releaseSDU(pChannel);
 
-    /*Check L2CAP state*/
-    if (pChannel->uState != L2CAP_STATE_OPEN)
+    /*Basic mode frames are taken as they come in the ACL buffer*/
+    if (pChannel->bMode == L2CAP_MODE_BASIC)
     {
-        DBG_TRACE();
-        return FALSE;
+        pChannel->uInMTU = L2CAP_MTU;
+        return pChannel->uInMTU;
     }
 
-    /*Switch according to the PSM*/
-    switch(pChannel->uPSMultiplexor)
+    /*
+     * ERTM and Streaming SDUs are reassembled in a buffer of their own:
+     * advertise the largest buffer the heap gives now (up to the basic
+     * mode MTU), nothing is allocated on the data path afterwards.
+     */
+    for (uMTU = L2CAP_MTU; ; uMTU >>= 1)
     {
-        case L2CAP_SDP_PSM:
-            /*Put the data into the SDP layer*/
-            DBG_INFO("L2CAP SDP data received\n");
-            gpsL2CAPCB->SDPputData(pData, uLen);
-            break;
-        case L2CAP_RFCOMM_PSM:
-            /*Put the data into the RFCOMM layer*/
-            DBG_INFO("L2CAP RFCOMM data received\n");
-            gpsL2CAPCB->RFCOMMputData(pData, uLen);
+        if (uMTU < L2CAP_MIN_MTU)
+        {
+            uMTU = L2CAP_MIN_MTU;
+        }
+        pChannel->pSDU = BT_malloc(uMTU);
+        if (NULL != pChannel->pSDU)
+        {
+            pChannel->uInMTU = uMTU;
+            return pChannel->uInMTU;
+        }
+        if (uMTU == L2CAP_MIN_MTU)
+        {
             break;
+        }
     }
-
-    return TRUE;
+    DBG_ERROR("L2CAP No room for the SDU reassembly\n");
+    return 0;
 }
 
-BOOL _L2CAP_acceptConnetion(UINT8 bId, L2CAP_CHANNEL *pChannel)
+void _L2CAP_releaseSDU(L2CAP_CHANNEL *pChannel)
 {
-    UINT16 uRspLen;
-    BYTE *pRspData = NULL;
-    UINT uOffset = 0;
-
-    ASSERT(NULL != gpsL2CAPCB);
-    ASSERT(gpsL2CAPCB->isInitialised);
     ASSERT(NULL != pChannel);
 
-    /*Generate a connection response frame*/
-    /*Set the length*/
-    uRspLen = L2CAP_CONN_RSP_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
-    /*Allocate the memory (mind the L2CAP HDR)*/
-    pRspData = BT_malloc(uRspLen);
-    if(NULL == pRspData)
+    if (NULL != pChannel->pSDU)
     {
-        DBG_ERROR("Not enough memory!\n");
-        return FALSE;
+        BT_free(pChannel->pSDU);
+        pChannel->pSDU = NULL;
     }
+    pChannel->isInSDU = FALSE;
+    pChannel->uInMTU = L2CAP_MTU;
+}
 
-    /*Set the L2CAP frame header*/
-    /*Length*/
-    BT_storeLE16(uRspLen - L2CAP_HDR_LEN, pRspData, 0);
-    /*Channel*/
-    BT_storeLE16(L2CAP_SIG_CID, pRspData, 2);
-
-    /*Set the response command header values*/
-    uOffset = L2CAP_HDR_LEN;
-    /*Command code*/
-    pRspData[uOffset + 0] = L2CAP_CONN_RSP;
-    /*Command id*/
-    pRspData[uOffset + 1] = bId;
-    /*Command length*/
-    BT_storeLE16(L2CAP_CONN_RSP_SIZE, pRspData, uOffset + 2);
+UINT16 _L2CAP_storeRFCOption(const L2CAP_CHANNEL *pChannel, BYTE *pData,
+        BOOL bResponse)
+{
+    ASSERT(NULL != pChannel);
 
+    /*Option: Type (4 = RFC)*/
+    pData[0] = L2CAP_CFG_RFC;
+    /*Option: Length*/
+    pData[1] = L2CAP_CFG_RFC_LEN;
+    /*Mode*/
+    pData[2] = pChannel->bMode;
     /*
-     * Set the response command data values
-     * LocalCID (2 octet)
-     * RemoteCID (2 octet)
-     * Response (2 octet): 0x0000 = Connection successful
-     * Status (2 octet): 0x0000 = No further information
+     * A request carries our own receive window and retransmission limit,
+     * the timeouts are only given in the response (0 on the request).
      */
-    uOffset = L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN;
-    BT_storeLE16(pChannel->uLocalCID, pRspData, uOffset);
-    BT_storeLE16(pChannel->uRemoteCID, pRspData, uOffset + 2);
-    BT_storeLE16(L2CAP_CONN_SUCCESS, pRspData, uOffset + 4);
-    BT_storeLE16(0x0000, pRspData, uOffset + 6);
-
-    /*Send the frame to the remote device*/
-    if (gpsL2CAPCB->HCIsendData(pRspData, uRspLen))
+    if (bResponse)
     {
-        /*Free the data*/
-        free(pRspData);
-        return TRUE;
+        pData[3] = pChannel->bTxWindow;
+        pData[4] = pChannel->bMaxTransmit;
+        BT_storeLE16(L2CAP_ERTM_RTX_TIMEOUT, pData, 5);
+        BT_storeLE16(L2CAP_ERTM_MONITOR_TIMEOUT, pData, 7);
+        BT_storeLE16(pChannel->uRemoteMPS, pData, 9);
     }
-
-    return FALSE;
+    else
+    {
+        pData[3] = pChannel->bRxWindow;
+        pData[4] = L2CAP_ERTM_MAX_TRANSMIT;
+        BT_storeLE16(0x0000, pData, 5);
+        BT_storeLE16(0x0000, pData, 7);
+        BT_storeLE16(L2CAP_ERTM_MPS, pData, 9);
+    }
+    return L2CAP_CFG_OPT_HDR_LEN + L2CAP_CFG_RFC_LEN;
 }
 
-BOOL _L2CAP_configResponse(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
+BOOL _L2CAP_configResponse(UINT8 bId, UINT16 uResult, L2CAP_CHANNEL *pChannel)
 {
-    UINT16 uRspLen;
+    UINT16 uRspLen, uCmdLen;
     BYTE *pRspData = NULL;
     UINT uOffset = 0;
-    BOOL bRetVal = FALSE;
+    BOOL bRetVal = FALSE, hasRFC;
 
     ASSERT(NULL != gpsL2CAPCB);
     ASSERT(gpsL2CAPCB->isInitialised);
     ASSERT(NULL != pChannel);
 
+    /*The RFC option tells the agreed (or the suggested) mode*/
+    hasRFC = (pChannel->bMode != L2CAP_MODE_BASIC) ||
+            (uResult == L2CAP_CFG_UNACCEPTABLE);
+
     /*Generate a connection response frame*/
     /*Set the length*/
-    uRspLen = L2CAP_CFG_RSP_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
+    uCmdLen = L2CAP_CFG_RSP_SIZE;
+    if (uResult == L2CAP_CFG_UNACCEPTABLE)
+    {
+        uCmdLen += L2CAP_CFG_OPT_HDR_LEN + L2CAP_CFG_MTU_LEN;
+    }
+    if (hasRFC)
+    {
+        uCmdLen += L2CAP_CFG_OPT_HDR_LEN + L2CAP_CFG_RFC_LEN;
+    }
+    uRspLen = uCmdLen + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
     /*Allocate the memory (mind the L2CAP HDR)*/
-    pRspData = BT_malloc(uRspLen);
+    pRspData = _L2CAP_newFrame(uRspLen);
     if(NULL == pRspData)
     {
         DBG_ERROR("Not enough memory!\n");
@@ -662,25 +2069,38 @@ BOOL _L2CAP_configResponse(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
     /*Command id*/
     pRspData[uOffset + 1] = bId;
     /*Command length*/
-    BT_storeLE16(L2CAP_CFG_RSP_SIZE, pRspData, uOffset + 2);
+    BT_storeLE16(uCmdLen, pRspData, uOffset + 2);
 
     /*
      * Set the response command data values
      * RemoteCID (2 octet)
      * Flags (2 octet): 0x0000 = No continuation
-     * Status (2 octet): 0x0000 = Success
+     * Status (2 octet)
      * Configuration options:
-     *     1. MTU
+     *     1. MTU (suggested outgoing MTU, unacceptable only)
+     *     2. RFC (ERTM and Streaming modes only)
      */
     uOffset = L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN;
     /*Remote CID*/
     BT_storeLE16(pChannel->uRemoteCID, pRspData, uOffset);
     /*Flags + Status*/
     BT_storeLE16(0x0000, pRspData, uOffset + 2);
-    BT_storeLE16(L2CAP_CFG_SUCCESS, pRspData, uOffset + 4);
+    BT_storeLE16(uResult, pRspData, uOffset + 4);
+    uOffset += L2CAP_CFG_RSP_SIZE;
+    if (uResult == L2CAP_CFG_UNACCEPTABLE)
+    {
+        pRspData[uOffset + 0] = L2CAP_CFG_MTU;
+        pRspData[uOffset + 1] = L2CAP_CFG_MTU_LEN;
+        BT_storeLE16(pChannel->uOutMTU, pRspData, uOffset + 2);
+        uOffset += L2CAP_CFG_OPT_HDR_LEN + L2CAP_CFG_MTU_LEN;
+    }
+    if (hasRFC)
+    {
+        _L2CAP_storeRFCOption(pChannel, &pRspData[uOffset], TRUE);
+    }
 
     /*Send the frame to the remote device*/
-    bRetVal = gpsL2CAPCB->HCIsendData(pRspData, uRspLen);
+    bRetVal = _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pRspData);
     if (bRetVal)
     {
         DBG_INFO("L2CAP Conf resp sent\n");
@@ -690,15 +2110,12 @@ BOOL _L2CAP_configResponse(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
         DBG_ERROR( "Unable to send data\n");
     }
 
-    /*Free the data*/
-//    free(pRspData);
-	BT_free(pRspData);
     return bRetVal;
 }
 
-BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
+BOOL _L2CAP_configRequest(UINT8 bId, L2CAP_CHANNEL *pChannel)
 {
-    UINT16 uRspLen;
+    UINT16 uRspLen, uCmdLen, uMTU;
     BYTE *pRspData = NULL;
     UINT uOffset = 0;
     BOOL bRetVal = FALSE;
@@ -709,9 +2126,14 @@ BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
 
     /*Generate a connection response frame*/
     /*Set the length*/
-    uRspLen = L2CAP_CFG_REQ_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN + 4;
+    uCmdLen = L2CAP_CFG_REQ_SIZE + L2CAP_CFG_OPT_HDR_LEN + L2CAP_CFG_MTU_LEN;
+    if (pChannel->bMode != L2CAP_MODE_BASIC)
+    {
+        uCmdLen += L2CAP_CFG_OPT_HDR_LEN + L2CAP_CFG_RFC_LEN;
+    }
+    uRspLen = uCmdLen + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
     /*Allocate the memory (mind the L2CAP HDR)*/
-    pRspData = BT_malloc(uRspLen);
+    pRspData = _L2CAP_newFrame(uRspLen);
     if(NULL == pRspData)
     {
         DBG_ERROR("Not enough memory!\n");
@@ -731,7 +2153,7 @@ BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
     /*Command id*/
     pRspData[uOffset + 1] = bId;
     /*Command length*/
-    BT_storeLE16(L2CAP_CFG_REQ_SIZE + 4, pRspData, uOffset + 2);
+    BT_storeLE16(uCmdLen, pRspData, uOffset + 2);
 
     /*
      * Set the response command data values
@@ -739,6 +2161,7 @@ BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
      * Flags (2 octet): 0x0000 = No continuation
      * Configuration options:
      *     1. MTU
+     *     2. RFC (ERTM and Streaming modes only)
      */
     uOffset = L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN;
     /*Remote CID*/
@@ -750,11 +2173,24 @@ BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
     pRspData[uOffset + 4] = L2CAP_CFG_MTU;
     /*Option1: Length*/
     pRspData[uOffset + 5] = L2CAP_CFG_MTU_LEN;
-    /*Option1: Value*/
+    /*Option1: Value (what we can take in)*/
+    uMTU = _L2CAP_reserveInMTU(pChannel);
+    if (0 == uMTU)
+    {
+        /*Never advertise a MTU we cannot reassemble: give the channel up*/
+        _L2CAP_releaseFrame(pRspData);
+        L2CAP_API_disconnect(pChannel->uPSMultiplexor);
+        return FALSE;
+    }
     BT_storeLE16(uMTU, pRspData, uOffset + 6);
+    /*Option2: Retransmission and flow control*/
+    if (pChannel->bMode != L2CAP_MODE_BASIC)
+    {
+        _L2CAP_storeRFCOption(pChannel, &pRspData[uOffset + 8], FALSE);
+    }
 
     /*Send the frame to the remote device*/
-    bRetVal = gpsL2CAPCB->HCIsendData(pRspData, uRspLen);
+    bRetVal = _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pRspData);
     if(bRetVal)
     {
         DBG_INFO("L2CAP Conf req sent\n")
@@ -764,8 +2200,6 @@ BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL *pChannel)
         DBG_ERROR("Unable to send data\n");
     }
 
-    /*Free the data*/
-    BT_free(pRspData);
     return bRetVal;
 }
 
@@ -784,7 +2218,7 @@ BOOL _L2CAP_disconnResponse(UINT8 bId, L2CAP_CHANNEL *pChannel)
     /*Set the length*/
     uRspLen = L2CAP_DISCONN_RSP_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
     /*Allocate the memory (mind the L2CAP HDR)*/
-    pRspData = BT_malloc(uRspLen);
+    pRspData = _L2CAP_newFrame(uRspLen);
     if(NULL == pRspData)
     {
         DBG_ERROR("Not enough memory!\n");
@@ -818,7 +2252,7 @@ BOOL _L2CAP_disconnResponse(UINT8 bId, L2CAP_CHANNEL *pChannel)
     BT_storeLE16(pChannel->uRemoteCID, pRspData, uOffset + 2);
 
     /*Send the frame to the remote device*/
-    bRetVal = gpsL2CAPCB->HCIsendData(pRspData, uRspLen);
+    bRetVal = _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pRspData);
     if(bRetVal)
     {
         DBG_INFO("L2CAP Disconn resp sent\n");
@@ -828,28 +2262,31 @@ BOOL _L2CAP_disconnResponse(UINT8 bId, L2CAP_CHANNEL *pChannel)
         DBG_ERROR("Unable to send data\n");
     }
 
-    /*Free the data*/
-    BT_free(pRspData);
     return bRetVal;
 }
 
 BOOL _L2CAP_infoResponse(UINT8 bId, UINT16 uInfoType)
 {
-    UINT16 uRspLen;
+    UINT16 uRspLen, uCmdLen;
     BYTE *pRspData = NULL;
     UINT uOffset = 0;
     BOOL bRetVal = FALSE;
 
     ASSERT(NULL != gpsL2CAPCB);
     ASSERT(gpsL2CAPCB->isInitialised);
-    /*InfoType must be 0x0002 (Connection based)*/
-    ASSERT(uInfoType == L2CAP_INFO_EXTENDED_FEATURES);
-    
+
+    /*Only the extended features mask is answered*/
+    uCmdLen = L2CAP_INFO_RSP_SIZE;
+    if (uInfoType == L2CAP_INFO_EXTENDED_FEATURES)
+    {
+        uCmdLen += L2CAP_INFO_FEAT_SIZE;
+    }
+
     /*Generate a information response frame*/
     /*Set the length*/
-    uRspLen = L2CAP_INFO_RSP_SIZE + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
+    uRspLen = uCmdLen + L2CAP_SIGHDR_LEN + L2CAP_HDR_LEN;
     /*Allocate the memory (mind the L2CAP HDR)*/
-    pRspData = BT_malloc(uRspLen);
+    pRspData = _L2CAP_newFrame(uRspLen);
     if(NULL == pRspData)
     {
         DBG_ERROR("Not enough memory!\n");
@@ -869,21 +2306,34 @@ BOOL _L2CAP_infoResponse(UINT8 bId, UINT16 uInfoType)
     /*Command id*/
     pRspData[uOffset + 1] = bId;
     /*Command length*/
-    BT_storeLE16(L2CAP_INFO_RSP_SIZE, pRspData, uOffset + 2);
+    BT_storeLE16(uCmdLen, pRspData, uOffset + 2);
 
     /*
      * Set the response command data values
      * InfoType (2 octet)
      * Result (2 octet)
+     * Data (4 octet): Extended features mask
      */
     uOffset = L2CAP_HDR_LEN + L2CAP_SIGHDR_LEN;
     /*InfoType*/
     BT_storeLE16(uInfoType, pRspData, uOffset);
-    /*Result (Not supported)*/
-    BT_storeLE16(L2CAP_INFO_NOT_SUPPORTED, pRspData, uOffset + 2);
+    if (uInfoType == L2CAP_INFO_EXTENDED_FEATURES)
+    {
+        /*Result (Success)*/
+        BT_storeLE16(L2CAP_INFO_SUCCESS, pRspData, uOffset + 2);
+        /*Features: ERTM, Streaming and FCS option*/
+        BT_storeLE16((L2CAP_FEAT_ERTM | L2CAP_FEAT_STREAMING |
+                L2CAP_FEAT_FCS) & 0xFFFF, pRspData, uOffset + 4);
+        BT_storeLE16(0x0000, pRspData, uOffset + 6);
+    }
+    else
+    {
+        /*Result (Not supported)*/
+        BT_storeLE16(L2CAP_INFO_NOT_SUPPORTED, pRspData, uOffset + 2);
+    }
 
     /*Send the frame to the remote device*/
-    bRetVal = gpsL2CAPCB->HCIsendData(pRspData, uRspLen);
+    bRetVal = _L2CAP_queueFrame(&gpsL2CAPCB->sSigQueue, pRspData);
     if(bRetVal)
     {
         DBG_INFO("L2CAP Info resp sent\n");
@@ -893,11 +2343,181 @@ BOOL _L2CAP_infoResponse(UINT8 bId, UINT16 uInfoType)
         DBG_ERROR("Unable to send data\n");
     }
 
-    /*Free the data*/
-    BT_free(pRspData);
     return bRetVal;    
 }
 
+BYTE* _L2CAP_newFrame(UINT16 uLen)
+{
+    L2CAP_TX_FRAME *psFrame;
+
+    /*The frame data follows the queue bookkeeping*/
+    psFrame = BT_malloc(sizeof(L2CAP_TX_FRAME) + uLen);
+    if (NULL == psFrame)
+    {
+        return NULL;
+    }
+    psFrame->pNext = NULL;
+    psFrame->uLen = uLen;
+    psFrame->bRefs = 1;
+    psFrame->isQueued = FALSE;
+    return psFrame->aData;
+}
+
+void _L2CAP_holdFrame(BYTE *pData)
+{
+    ++L2CAP_TX_FRAME_OF(pData)->bRefs;
+}
+
+void _L2CAP_releaseFrame(BYTE *pData)
+{
+    L2CAP_TX_FRAME *psFrame = L2CAP_TX_FRAME_OF(pData);
+
+    ASSERT(psFrame->bRefs > 0);
+    if (--psFrame->bRefs == 0)
+    {
+        BT_free(psFrame);
+    }
+}
+
+BOOL _L2CAP_queueFrame(L2CAP_TX_QUEUE *psQueue, BYTE *pData)
+{
+    L2CAP_TX_FRAME *psFrame = L2CAP_TX_FRAME_OF(pData);
+
+    ASSERT(NULL != psQueue);
+
+    /*The queue takes over the caller reference*/
+    if (psFrame->isQueued)
+    {
+        /*Already waiting (retransmission of a queued I-frame)*/
+        _L2CAP_releaseFrame(pData);
+    }
+    else
+    {
+        psFrame->pNext = NULL;
+        psFrame->isQueued = TRUE;
+        if (NULL == psQueue->pTail)
+        {
+            psQueue->pHead = psFrame;
+        }
+        else
+        {
+            psQueue->pTail->pNext = psFrame;
+        }
+        psQueue->pTail = psFrame;
+    }
+
+    _L2CAP_txSchedule();
+    return TRUE;
+}
+
+UINT _L2CAP_queueLength(const L2CAP_TX_QUEUE *psQueue)
+{
+    UINT uLength = 0;
+    const L2CAP_TX_FRAME *psFrame;
+
+    for (psFrame = psQueue->pHead; NULL != psFrame; psFrame = psFrame->pNext)
+    {
+        ++uLength;
+    }
+    return uLength;
+}
+
+void _L2CAP_flushQueue(L2CAP_TX_QUEUE *psQueue)
+{
+    L2CAP_TX_FRAME *psFrame;
+
+    while (NULL != psQueue->pHead)
+    {
+        psFrame = psQueue->pHead;
+        psQueue->pHead = psFrame->pNext;
+        psFrame->isQueued = FALSE;
+        _L2CAP_releaseFrame(psFrame->aData);
+    }
+    psQueue->pTail = NULL;
+}
+
+L2CAP_TX_QUEUE* _L2CAP_nextQueue(BOOL *pisData)
+{
+    UINT i, uIndex;
+    L2CAP_CHANNEL *pChannel;
+
+    ASSERT(NULL != gpsL2CAPCB);
+
+    *pisData = FALSE;
+
+    /*1. Signalling*/
+    if (NULL != gpsL2CAPCB->sSigQueue.pHead)
+    {
+        return &gpsL2CAPCB->sSigQueue;
+    }
+
+    /*2. Control frames of the upper layers (mux, credits, S-frames)*/
+    for (i = 0; i < L2CAP_MAX_CHANNELS; ++i)
+    {
+        pChannel = gpsL2CAPCB->pasChannel[i];
+        if (NULL != pChannel && NULL != pChannel->sCtrlQueue.pHead)
+        {
+            return &pChannel->sCtrlQueue;
+        }
+    }
+
+    /*
+     * 3. Data, weighted round-robin: the current channel sends up to
+     * its weight in frames, then the next channel with data goes on.
+     */
+    *pisData = TRUE;
+    pChannel = gpsL2CAPCB->pasChannel[gpsL2CAPCB->bTxIndex];
+    if (gpsL2CAPCB->bTxBurst > 0 && NULL != pChannel &&
+        NULL != pChannel->sDataQueue.pHead)
+    {
+        return &pChannel->sDataQueue;
+    }
+    for (i = 1; i <= L2CAP_MAX_CHANNELS; ++i)
+    {
+        uIndex = (gpsL2CAPCB->bTxIndex + i) % L2CAP_MAX_CHANNELS;
+        pChannel = gpsL2CAPCB->pasChannel[uIndex];
+        if (NULL != pChannel && NULL != pChannel->sDataQueue.pHead)
+        {
+            gpsL2CAPCB->bTxIndex = uIndex;
+            gpsL2CAPCB->bTxBurst = pChannel->bWeight;
+            return &pChannel->sDataQueue;
+        }
+    }
+    return NULL;
+}
+
+void _L2CAP_txSchedule()
+{
+    L2CAP_TX_QUEUE *psQueue;
+    L2CAP_TX_FRAME *psFrame;
+    BOOL isData;
+
+    ASSERT(NULL != gpsL2CAPCB);
+
+    /*Send the most urgent frames while the HCI takes them*/
+    while (NULL != (psQueue = _L2CAP_nextQueue(&isData)))
+    {
+        psFrame = psQueue->pHead;
+        if (!gpsL2CAPCB->HCIsendData(psFrame->aData, psFrame->uLen))
+        {
+            /*Busy: carry on when the HCI is ready again*/
+            break;
+        }
+
+        psQueue->pHead = psFrame->pNext;
+        if (NULL == psQueue->pHead)
+        {
+            psQueue->pTail = NULL;
+        }
+        psFrame->isQueued = FALSE;
+        if (isData)
+        {
+            --gpsL2CAPCB->bTxBurst;
+        }
+        _L2CAP_releaseFrame(psFrame->aData);
+    }
+}
+
 L2CAP_CHANNEL* _L2CAP_getChannelByLCID(UINT16 uLocalCID)
 {
     UINT i = 0;
@@ -935,9 +2555,91 @@ L2CAP_CHANNEL* _L2CAP_getChannelByPSM(UINT16 uPSM)
     return NULL;
 }
 
+L2CAP_CHANNEL* _L2CAP_getChannelBySigID(UINT8 bId)
+{
+    UINT i;
+
+    ASSERT(NULL != gpsL2CAPCB);
+
+    for (i = 0; i < L2CAP_MAX_CHANNELS; ++i)
+    {
+        if(gpsL2CAPCB->pasChannel[i] != NULL &&
+                gpsL2CAPCB->pasChannel[i]->bSigID == bId)
+        {
+            return (L2CAP_CHANNEL*) gpsL2CAPCB->pasChannel[i];
+        }
+    }
+    return NULL;
+}
+
+UINT8 _L2CAP_newSigID(L2CAP_CHANNEL *pChannel)
+{
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    /*The identifier 0x00 is not valid*/
+    if (++gpsL2CAPCB->bSigID == 0x00)
+    {
+        gpsL2CAPCB->bSigID = 0x01;
+    }
+    /*Remember it to match the response, due before the RTX expires*/
+    pChannel->bSigID = gpsL2CAPCB->bSigID;
+    BT_timerStart(&pChannel->sSigTimer, L2CAP_RTX_MS);
+    return pChannel->bSigID;
+}
+
+UINT16 _L2CAP_getMTU(const L2CAP_CHANNEL *pChannel)
+{
+    UINT16 uMaxMTU;
+
+    ASSERT(NULL != pChannel);
+
+    /*Enhanced SDUs are segmented, basic frames must fit in one ACL frame*/
+    uMaxMTU = gpsL2CAPCB->HCIgetAclLength() - L2CAP_HDR_LEN;
+    if (uMaxMTU > L2CAP_MTU)
+    {
+        uMaxMTU = L2CAP_MTU;
+    }
+    if (pChannel->bMode == L2CAP_MODE_BASIC &&
+        pChannel->uOutMTU > uMaxMTU)
+    {
+        return uMaxMTU;
+    }
+    return pChannel->uOutMTU;
+}
+
+/*Largest I-frame payload (SDU length included) one ACL packet carries*/
+UINT16 _L2CAP_getMaxMPS()
+{
+    UINT16 uMPS;
+
+    ASSERT(NULL != gpsL2CAPCB);
+
+    uMPS = gpsL2CAPCB->HCIgetAclLength() - L2CAP_HDR_LEN - L2CAP_CTRL_LEN -
+            L2CAP_FCS_LEN;
+    return (uMPS < L2CAP_ERTM_MPS) ? uMPS : L2CAP_ERTM_MPS;
+}
+
+void _L2CAP_setPSMMode(L2CAP_CHANNEL *pChannel)
+{
+    UINT i;
+
+    ASSERT(NULL != gpsL2CAPCB);
+    ASSERT(NULL != pChannel);
+
+    for (i = 0; i < L2CAP_MAX_PSM_MODES; ++i)
+    {
+        if (gpsL2CAPCB->asPSMMode[i].uPSM == pChannel->uPSMultiplexor)
+        {
+            pChannel->bMode = gpsL2CAPCB->asPSMMode[i].bMode;
+            pChannel->bRxWindow = gpsL2CAPCB->asPSMMode[i].bTxWindow;
+        }
+    }
+}
+
 L2CAP_CHANNEL* _L2CAP_createChannel()
 {
-    UINT i = 0;
+    UINT i = 0, j;
     L2CAP_CHANNEL* psRetChannel = NULL;
 
     ASSERT(NULL != gpsL2CAPCB);
@@ -950,13 +2652,45 @@ L2CAP_CHANNEL* _L2CAP_createChannel()
         if(NULL == psRetChannel)
         {
             psRetChannel = (L2CAP_CHANNEL*) BT_malloc(sizeof(L2CAP_CHANNEL));
+            if (NULL == psRetChannel)
+            {
+                DBG_ERROR("Not enough memory!\n");
+                return NULL;
+            }
             psRetChannel->uIndex = i;
             psRetChannel->isLinked = FALSE;
-            psRetChannel->uLocalCID = 0x00;
+            /*Every channel slot owns a local CID*/
+            psRetChannel->uLocalCID = L2CAP_MIN_CID + i;
             psRetChannel->uRemoteCID = 0x00;
             psRetChannel->uPSMultiplexor = 0x00;
             psRetChannel->uState = L2CAP_STATE_CLOSED;
-            
+            psRetChannel->bSigID = 0x00;
+
+            /*Basic mode until configured otherwise*/
+            psRetChannel->bMode = L2CAP_MODE_BASIC;
+            psRetChannel->bTxWindow = L2CAP_ERTM_TX_WINDOW;
+            psRetChannel->bRxWindow = L2CAP_ERTM_TX_WINDOW;
+            psRetChannel->bMaxTransmit = L2CAP_ERTM_MAX_TRANSMIT;
+            psRetChannel->uRemoteMPS = _L2CAP_getMaxMPS();
+            psRetChannel->uInMTU = L2CAP_MTU;
+            psRetChannel->uOutMTU = L2CAP_DEFAULT_MTU;
+            psRetChannel->sCtrlQueue.pHead = NULL;
+            psRetChannel->sCtrlQueue.pTail = NULL;
+            psRetChannel->sDataQueue.pHead = NULL;
+            psRetChannel->sDataQueue.pTail = NULL;
+            psRetChannel->bWeight = L2CAP_DEFAULT_WEIGHT;
+            for (j = 0; j < L2CAP_ERTM_TX_WINDOW; ++j)
+            {
+                psRetChannel->apTxFrame[j] = NULL;
+            }
+            psRetChannel->pSDU = NULL;
+            psRetChannel->isInSDU = FALSE;
+            BT_timerInit(&psRetChannel->sSigTimer, &_L2CAP_sigTimeout,
+                    psRetChannel);
+            BT_timerInit(&psRetChannel->sAckTimer, &_L2CAP_ackTimeout,
+                    psRetChannel);
+            _L2CAP_resetEnhanced(psRetChannel);
+
             (gpsL2CAPCB->pasChannel)[i] = psRetChannel;
             return psRetChannel;
         }
@@ -977,6 +2711,13 @@ BOOL _L2CAP_destroyChannel(L2CAP_CHANNEL* pChannel)
     ASSERT(pChannel == gpsL2CAPCB->pasChannel[pChannel->uIndex]);
 
     gpsL2CAPCB->pasChannel[pChannel->uIndex] = NULL;
+    /*No response awaited any more*/
+    BT_timerStop(&pChannel->sSigTimer);
+    /*Drop what is still queued, then the pending I-frames and SDU*/
+    _L2CAP_flushQueue(&pChannel->sCtrlQueue);
+    _L2CAP_flushQueue(&pChannel->sDataQueue);
+    _L2CAP_resetEnhanced(pChannel);
+    _L2CAP_releaseSDU(pChannel);
     BT_free(pChannel);
     
     return TRUE;
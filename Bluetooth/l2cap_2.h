@@ -17,7 +17,9 @@
 #ifndef __L2CAP_H__
 #define __L2CAP_H__
 
+#include <stddef.h>
 #include "bt_common.h"
+#include "bt_timer.h"
 
 /*
  * L2CAP Definitions
@@ -36,6 +38,7 @@
 #define L2CAP_DISCONN_RSP_SIZE 4
 #define L2CAP_INFO_REQ_SIZE 2
 #define L2CAP_INFO_RSP_SIZE 4
+#define L2CAP_INFO_FEAT_SIZE 4
 
 /*Signal codes*/
 #define L2CAP_CMD_REJ 0x01
@@ -57,10 +60,17 @@
 /*Configuration types*/
 #define L2CAP_CFG_MTU 0x01
 #define L2CAP_CFG_FLUSHTO 0x02
+#define L2CAP_CFG_QOS 0x03
+#define L2CAP_CFG_RFC 0x04
+#define L2CAP_CFG_FCS 0x05
+#define L2CAP_CFG_HINT 0x80
 
 /*Configuration types length*/
+#define L2CAP_CFG_OPT_HDR_LEN 2
 #define L2CAP_CFG_MTU_LEN 2
 #define L2CAP_CFG_FLUSHTO_LEN 2
+#define L2CAP_CFG_RFC_LEN 9
+#define L2CAP_CFG_FCS_LEN 1
 
 /*Information request InfoType*/
 #define L2CAP_INFO_CONNECTIONLESS_MTU 0x0001
@@ -69,11 +79,54 @@
 #define L2CAP_INFO_SUCCESS 0x0000
 #define L2CAP_INFO_NOT_SUPPORTED 0x0001
 
+/*Extended features mask*/
+#define L2CAP_FEAT_ERTM 0x00000008
+#define L2CAP_FEAT_STREAMING 0x00000010
+#define L2CAP_FEAT_FCS 0x00000020
+
 /*Configuration response types*/
 #define L2CAP_CFG_SUCCESS 0x0000
+#define L2CAP_CFG_UNACCEPTABLE 0x0001
+#define L2CAP_CFG_REJECTED 0x0002
+#define L2CAP_CFG_UNKNOWN 0x0003
+
+/*Channel modes (Retransmission and Flow Control option)*/
+#define L2CAP_MODE_BASIC 0x00
+#define L2CAP_MODE_ERTM 0x03
+#define L2CAP_MODE_STREAMING 0x04
+
+/*
+ * Enhanced control field (I-frames and S-frames):
+ * I-frame: 0 | TxSeq(6) | F | ReqSeq(6) | SAR(2)
+ * S-frame: 1 | 0 | S(2) | P | 00 | F | ReqSeq(6) | 00
+ */
+#define L2CAP_CTRL_LEN 2
+#define L2CAP_SDULEN_LEN 2
+#define L2CAP_FCS_LEN 2
+#define L2CAP_CTRL_SFRAME 0x0001
+#define L2CAP_CTRL_POLL 0x0010
+#define L2CAP_CTRL_FINAL 0x0080
+#define L2CAP_CTRL_TXSEQ_SHIFT 1
+#define L2CAP_CTRL_SUPER_SHIFT 2
+#define L2CAP_CTRL_REQSEQ_SHIFT 8
+#define L2CAP_CTRL_SAR_SHIFT 14
+#define L2CAP_SEQ_MASK 0x3F
+
+/*Segmentation and reassembly*/
+#define L2CAP_SAR_UNSEGMENTED 0x00
+#define L2CAP_SAR_START 0x01
+#define L2CAP_SAR_END 0x02
+#define L2CAP_SAR_CONTINUE 0x03
+
+/*Supervisory functions*/
+#define L2CAP_SUPER_RR 0x00
+#define L2CAP_SUPER_REJ 0x01
+#define L2CAP_SUPER_RNR 0x02
+#define L2CAP_SUPER_SREJ 0x03
 
 /*Connection response results*/
 #define L2CAP_CONN_SUCCESS 0x0000
+#define L2CAP_CONN_PENDING 0x0001
 
 /*Protocol and service multiplexor*/
 #define L2CAP_SDP_PSM 0x0001
@@ -91,9 +144,51 @@
 //#define L2CAP_MTU 248
 #define L2CAP_MTU 672
 
+/*
+ * Minimum MTU allowed by the specification. The SDUs of an ERTM or
+ * Streaming channel are rebuilt in a buffer taken from the heap when the
+ * channel is configured: the advertised MTU is the buffer actually
+ * obtained, L2CAP_MTU as in basic mode or, on a busy heap, halved down to
+ * the minimum MTU.
+ */
+#define L2CAP_MIN_MTU 48
+
 //#define L2CAP_MAX_CHANNELS 2
 #define L2CAP_MAX_CHANNELS 6
 
+/*
+ * Enhanced Retransmission and Streaming mode parameters
+ * TX_WINDOW = Unacknowledged I-frames we accept and keep for retransmission.
+ *             Every outstanding I-frame is held in the heap, keep it small.
+ * MPS = MTU minus the enhanced control field, SDU length and FCS (2 + 2 + 2)
+ *       or less: an I-frame never takes more than one controller ACL buffer
+ */
+#define L2CAP_ERTM_TX_WINDOW 4
+#define L2CAP_ERTM_MAX_TRANSMIT 3
+#define L2CAP_ERTM_RTX_TIMEOUT 2000
+#define L2CAP_ERTM_MONITOR_TIMEOUT 12000
+#define L2CAP_ERTM_MPS (L2CAP_MTU - L2CAP_CTRL_LEN - L2CAP_SDULEN_LEN - L2CAP_FCS_LEN)
+
+/*
+ * Transmit scheduler parameters
+ * TX_QUEUE_DEPTH = Data frames a channel may have waiting (heap bound)
+ * DEFAULT_WEIGHT = Data frames a channel sends per round-robin turn
+ */
+#define L2CAP_TX_QUEUE_DEPTH 2
+#define L2CAP_DEFAULT_WEIGHT 1
+
+/*
+ * Signalling timers (ms)
+ * RTX = Response to each of our requests.
+ * ERTX = Final connection response once the remote answered pending, and
+ *        the remote half of the configuration once ours is done.
+ */
+#define L2CAP_RTX_MS 5000
+#define L2CAP_ERTX_MS 60000
+
+/*Number of PSMs with a non-basic mode preference*/
+#define L2CAP_MAX_PSM_MODES 2
+
 /*
  * L2CAP structure definitions
  */
@@ -112,6 +207,27 @@ typedef enum
 	L2CAP_STATE_WAIT_DISCONNECT
 } L2CAP_STATE;
 
+/* Frame waiting to be sent (the L2CAP frame follows the header) */
+typedef struct _L2CAP_TX_FRAME
+{
+    struct _L2CAP_TX_FRAME *pNext;
+    UINT16 uLen;
+    /* Owners: the queue and/or the ERTM retransmission slot */
+    UINT8 bRefs;
+    BOOL isQueued;
+    BYTE aData[];
+} L2CAP_TX_FRAME;
+
+#define L2CAP_TX_FRAME_OF(P) \
+    ((L2CAP_TX_FRAME *)((BYTE *)(P) - offsetof(L2CAP_TX_FRAME, aData)))
+
+/* FIFO of frames waiting to be sent */
+typedef struct _L2CAP_TX_QUEUE
+{
+    L2CAP_TX_FRAME *pHead;
+    L2CAP_TX_FRAME *pTail;
+} L2CAP_TX_QUEUE;
+
 /* Channel definition */
 typedef struct _L2CAP_CHANNEL
 {
@@ -123,21 +239,87 @@ typedef struct _L2CAP_CHANNEL
     UINT16 uRemoteCID;
 
     UINT16 uPSMultiplexor;
+    /* Identifier of our last signalling request on this channel */
+    UINT8 bSigID;
+    /* RTX/ERTX: a stuck handshake closes the channel */
+    BT_TIMER sSigTimer;
+
+    /* Largest SDU we take in (advertised) and the remote takes in */
+    UINT16 uInMTU;
+    UINT16 uOutMTU;
+
+    /* Transmit queues: control frames go before any data frame */
+    L2CAP_TX_QUEUE sCtrlQueue;
+    L2CAP_TX_QUEUE sDataQueue;
+    /* Data frames sent per round-robin turn */
+    UINT8 bWeight;
+
+    /* Retransmission and Flow Control (L2CAP_MODE_X) */
+    UINT8 bMode;
+    /* I-frames the remote accepts before acknowledging (our TX limit) */
+    UINT8 bTxWindow;
+    /* I-frames we accept before acknowledging (advertised to the remote) */
+    UINT8 bRxWindow;
+    UINT8 bMaxTransmit;
+    /* Maximum PDU payload the remote accepts */
+    UINT16 uRemoteMPS;
+
+    /* Sequence state (ERTM and Streaming) */
+    UINT8 bNextTxSeq;
+    UINT8 bExpectedAckSeq;
+    UINT8 bExpectedTxSeq;
+    UINT8 bUnackedRx;
+    BOOL isRemoteBusy;
+    BOOL isRejSent;
+    /* Retransmission timer, the monitor timer while our poll is unanswered */
+    BT_TIMER sAckTimer;
+    BOOL isWaitFinal;
+    UINT8 bPolls;
+
+    /* Sent I-frames pending acknowledgement (ring, bTxHead = ExpectedAckSeq) */
+    UINT8 bTxHead;
+    BYTE *apTxFrame[L2CAP_ERTM_TX_WINDOW];
+    UINT8 abTxCount[L2CAP_ERTM_TX_WINDOW];
+
+    /* Reassembly buffer (uInMTU bytes, ERTM and Streaming only) */
+    BYTE *pSDU;
+    /* SDU under reassembly */
+    BOOL isInSDU;
+    UINT16 uSDULen;
+    UINT16 uSDUOffset;
 } L2CAP_CHANNEL;
 
+/* Mode requested by the local upper layers for a given PSM */
+typedef struct _L2CAP_PSM_MODE
+{
+    UINT16 uPSM;
+    UINT8 bMode;
+    UINT8 bTxWindow;
+} L2CAP_PSM_MODE;
+
 /* Control Block */
 typedef struct _L2CAP_CONTROL_BLOCK
 {
     BOOL isInitialised;
     UINT8 bSigID;
     L2CAP_CHANNEL *pasChannel[L2CAP_MAX_CHANNELS];
+    L2CAP_PSM_MODE asPSMMode[L2CAP_MAX_PSM_MODES];
+
+    /* Signalling queue (highest priority) */
+    L2CAP_TX_QUEUE sSigQueue;
+    /* Data round-robin: channel index and frames left in its turn */
+    UINT8 bTxIndex;
+    UINT8 bTxBurst;
 
     /* HCI API */
     BOOL (*HCIsendData)(const BYTE*, UINT);
+    UINT16 (*HCIgetAclLength)(void);
     /* RFCOMM API */
     BOOL (*RFCOMMputData)(const BYTE*, UINT);
     /* SDP API */
     BOOL (*SDPputData)(const BYTE*, UINT);
+    /* Device API */
+    BOOL (*DEVconnected)(UINT16, BOOL);
 } L2CAP_CONTROL_BLOCK;
 
 /*
@@ -147,21 +329,81 @@ typedef struct _L2CAP_CONTROL_BLOCK
 /* Private API */
 BOOL L2CAP_API_putData(const BYTE *pData, UINT16 uLen, BOOL bContinuation);
 BOOL L2CAP_API_sendData(UINT16 uPSM, BYTE const *pData, UINT16 uLen);
+#ifdef BT_PROFILE_ENABLE
+BOOL _L2CAP_profPutData(const BYTE *pData, UINT16 uLen, BOOL bContinuation);
+BOOL _L2CAP_profSendData(UINT16 uPSM, const BYTE *pData, UINT16 uLen);
+#endif
 BOOL L2CAP_API_disconnect(UINT16 uPSM);
+BOOL L2CAP_API_setMode(UINT16 uPSM, UINT8 bMode, UINT8 bTxWindow);
+BOOL L2CAP_API_connect(UINT16 uPSM);
+UINT16 L2CAP_API_getMTU(UINT16 uPSM);
+BOOL L2CAP_API_sendControl(UINT16 uPSM, const BYTE *pData, UINT16 uLen);
+BOOL L2CAP_API_setWeight(UINT16 uPSM, UINT8 bWeight);
+void L2CAP_API_txReady();
+void L2CAP_API_linkClosed();
 
 /* Private functions */
 L2CAP_CHANNEL* _L2CAP_createChannel();
 BOOL _L2CAP_destroyChannel(L2CAP_CHANNEL* pChannel);
 L2CAP_CHANNEL* _L2CAP_getChannelByLCID(UINT16 uLocalCID);
 L2CAP_CHANNEL* _L2CAP_getChannelByPSM(UINT16 uPSM);
-
+L2CAP_CHANNEL* _L2CAP_getChannelBySigID(UINT8 bId);
+UINT8 _L2CAP_newSigID(L2CAP_CHANNEL* pChannel);
+UINT16 _L2CAP_getMTU(const L2CAP_CHANNEL* pChannel);
+UINT16 _L2CAP_getMaxMPS();
+void _L2CAP_setPSMMode(L2CAP_CHANNEL* pChannel);
+void _L2CAP_channelOpen(L2CAP_CHANNEL* pChannel);
+void _L2CAP_channelClosed(L2CAP_CHANNEL* pChannel);
+
+BYTE* _L2CAP_newFrame(UINT16 uLen);
+void _L2CAP_holdFrame(BYTE *pData);
+void _L2CAP_releaseFrame(BYTE *pData);
+BOOL _L2CAP_queueFrame(L2CAP_TX_QUEUE *psQueue, BYTE *pData);
+UINT _L2CAP_queueLength(const L2CAP_TX_QUEUE *psQueue);
+void _L2CAP_flushQueue(L2CAP_TX_QUEUE *psQueue);
+L2CAP_TX_QUEUE* _L2CAP_nextQueue(BOOL *pisData);
+void _L2CAP_txSchedule();
+
+BOOL _L2CAP_sigHandler(const BYTE *pData, UINT16 uLen);
 BOOL _L2CAP_dataHandler(UINT16 uCID, UINT16 uLen, const BYTE *pData);
 BOOL _L2CAP_cmdHandler(UINT8 bCode, UINT8 bId, UINT16 uLen, const BYTE *pData);
+BOOL _L2CAP_configReqHandler(UINT8 bId, UINT16 uLen, const BYTE *pData,
+        L2CAP_CHANNEL* pChannel);
+BOOL _L2CAP_configRspHandler(UINT8 bId, UINT16 uLen, const BYTE *pData,
+        L2CAP_CHANNEL* pChannel);
 
 BOOL _L2CAP_acceptConnetion(UINT8 bId, L2CAP_CHANNEL* pChannel);
-BOOL _L2CAP_configResponse(UINT8 bId, UINT uMTU, L2CAP_CHANNEL* pChannel);
-BOOL _L2CAP_configRequest(UINT8 bId, UINT uMTU, L2CAP_CHANNEL* pChannel);
+BOOL _L2CAP_connRequest(UINT8 bId, L2CAP_CHANNEL* pChannel);
+UINT16 _L2CAP_parseConfig(L2CAP_CHANNEL* pChannel, const BYTE *pOptions,
+        UINT16 uLen, BOOL bResponse);
+UINT16 _L2CAP_storeRFCOption(const L2CAP_CHANNEL* pChannel, BYTE *pData,
+        BOOL bResponse);
+UINT16 _L2CAP_reserveInMTU(L2CAP_CHANNEL* pChannel);
+void _L2CAP_releaseSDU(L2CAP_CHANNEL* pChannel);
+BOOL _L2CAP_configResponse(UINT8 bId, UINT16 uResult, L2CAP_CHANNEL* pChannel);
+BOOL _L2CAP_configRequest(UINT8 bId, L2CAP_CHANNEL* pChannel);
 BOOL _L2CAP_disconnResponse(UINT8 bId, L2CAP_CHANNEL* pChannel);
 BOOL _L2CAP_infoResponse(UINT8 bId, UINT16 uInfoType);
 
+BOOL _L2CAP_deliverSDU(L2CAP_CHANNEL* pChannel, const BYTE *pData,
+        UINT16 uLen);
+BOOL _L2CAP_enhancedHandler(L2CAP_CHANNEL* pChannel, const BYTE *pData,
+        UINT16 uLen);
+BOOL _L2CAP_reassemble(L2CAP_CHANNEL* pChannel, UINT8 bSAR,
+        const BYTE *pData, UINT16 uLen);
+BOOL _L2CAP_sendSegmented(L2CAP_CHANNEL* pChannel, const BYTE *pData,
+        UINT16 uLen);
+BYTE* _L2CAP_newIFrame(L2CAP_CHANNEL* pChannel, UINT8 bTxSeq, UINT8 bSAR,
+        UINT16 uSDULen, const BYTE *pData, UINT16 uLen);
+void _L2CAP_sendIFrame(L2CAP_CHANNEL* pChannel, BYTE *pFrame);
+BOOL _L2CAP_sendSFrame(L2CAP_CHANNEL* pChannel, UINT8 bSuper, BOOL bPoll,
+        BOOL bFinal);
+BOOL _L2CAP_retransmit(L2CAP_CHANNEL* pChannel, UINT8 bTxSeq, BOOL bSingle,
+        BOOL bFinal);
+void _L2CAP_ackFrames(L2CAP_CHANNEL* pChannel, UINT8 bReqSeq);
+void _L2CAP_resetEnhanced(L2CAP_CHANNEL* pChannel);
+
+void _L2CAP_sigTimeout(void *pContext);
+void _L2CAP_ackTimeout(void *pContext);
+
 #endif /*L2CAP*/
@@ -0,0 +1,44 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "GenericTypeDefs.h"
+#include "l2cap_fcs.h"
+
+/*
+ * Reversed CRC nibble table, 16-bit, poly=0x8005 (x^16 + x^15 + x^2 + 1).
+ * The L2CAP FCS is sent LSB first, so the reflected form (0xA001) is used.
+ */
+static const UINT16 crc16table[16] = {
+  0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+  0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
+/*
+ * Based on the Frame Check Sequence definition (Core V2.1 Vol3 Part A 3.3.5).
+ * The previous value is passed in uFCS so a frame can be checked in pieces.
+ */
+UINT16 L2CAP_FCS_CRC(const BYTE *pData, UINT uLen, UINT16 uFCS)
+{
+    UINT i;
+    UINT16 uRetFCS = uFCS;
+
+    for (i = 0; i < uLen; ++i)
+    {
+        uRetFCS = (uRetFCS >> 4) ^ crc16table[(uRetFCS ^ pData[i]) & 0x0F];
+        uRetFCS = (uRetFCS >> 4) ^ crc16table[(uRetFCS ^ (pData[i] >> 4)) & 0x0F];
+    }
+    return uRetFCS;
+}
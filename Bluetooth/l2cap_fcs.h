@@ -0,0 +1,24 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef __L2CAP_FCS_H__
+#define __L2CAP_FCS_H__
+
+#define L2CAP_INITIAL_CRC 0x0000
+
+UINT16 L2CAP_FCS_CRC(const BYTE *pData, UINT uLen, UINT16 uFCS);
+
+#endif /* __L2CAP_FCS_H__ */
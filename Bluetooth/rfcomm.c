@@ -37,7 +37,8 @@
  * RFCOMM variables
  */
 
-static RFCOMM_CONTROL_BLOCK *gpsRFCOMMCB = NULL;
+/*Control block of the selected stack instance*/
+#define gpsRFCOMMCB (gpsBTStack->psRFCOMMCB)
 
 /*
  * RFCOMM public functions implementation
@@ -52,13 +53,22 @@ BOOL RFCOMM_create()
     if (NULL == gpsRFCOMMCB)
     {
         gpsRFCOMMCB = BT_malloc(sizeof(RFCOMM_CONTROL_BLOCK));
+        for (i = 0; i < RFCOMM_NUM_CHANNELS; ++i)
+        {
+            BT_timerInit(&gpsRFCOMMCB->asChannel[i].sAckTimer,
+                    &_RFCOMM_ackTimeout, &gpsRFCOMMCB->asChannel[i]);
+        }
+        BT_timerInit(&gpsRFCOMMCB->sMuxTimer, &_RFCOMM_muxTimeout, NULL);
     }
 
     /* Initialise the channels */
+    BT_timerStop(&gpsRFCOMMCB->sMuxTimer);
     for (i = 0; i < RFCOMM_NUM_CHANNELS; ++i)
     {
+        BT_timerStop(&gpsRFCOMMCB->asChannel[i].sAckTimer);
         gpsRFCOMMCB->asChannel[i].bDLC = i;
         gpsRFCOMMCB->asChannel[i].bEstablished = FALSE;
+        gpsRFCOMMCB->asChannel[i].bDataEnabled = FALSE;
         gpsRFCOMMCB->asChannel[i].bLocalCr = 0;
         gpsRFCOMMCB->asChannel[i].bRemoteCr = 0;
     }
@@ -70,10 +80,14 @@ BOOL RFCOMM_create()
 
     L2CAP_getAPI(&sL2CAP);
     gpsRFCOMMCB->L2CAPsendData = sL2CAP.sendData;
+    gpsRFCOMMCB->L2CAPgetMTU = sL2CAP.getMTU;
+    gpsRFCOMMCB->L2CAPsendControl = sL2CAP.sendControl;
+    gpsRFCOMMCB->L2CAPdisconnect = sL2CAP.disconnect;
     
     sAPI.putData = &RFCOMM_API_putData;
     sAPI.sendData = &RFCOMM_API_sendData;
     sAPI.disconnect = &RFCOMM_API_disconnect;
+    sAPI.connect = &RFCOMM_API_connect;
     L2CAP_installRFCOMM(&sAPI);
     
     return TRUE;
@@ -83,17 +97,42 @@ BOOL RFCOMM_destroy()
 {
     if(NULL != gpsRFCOMMCB)
     {
+        RFCOMM_reset();
         BT_free(gpsRFCOMMCB);
     }
     return TRUE;
 }
 
+/*The L2CAP channel is gone: every DLC is closed*/
+BOOL RFCOMM_reset()
+{
+    UINT i;
+
+    if(NULL == gpsRFCOMMCB)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < RFCOMM_NUM_CHANNELS; ++i)
+    {
+        _RFCOMM_closeDLC(&gpsRFCOMMCB->asChannel[i]);
+    }
+    BT_timerStop(&gpsRFCOMMCB->sMuxTimer);
+    gpsRFCOMMCB->bRole = RFCOMM_ROLE_RESPONDER;
+    return TRUE;
+}
+
 BOOL RFCOMM_getAPI(RFCOMM_API *psAPI)
 {
     ASSERT(NULL != psAPI);
+#ifdef BT_PROFILE_ENABLE
+    psAPI->putData = &_RFCOMM_profPutData;
+    psAPI->sendData = &_RFCOMM_profSendData;
+#else
     psAPI->putData = &RFCOMM_API_putData;
     psAPI->sendData = &RFCOMM_API_sendData;
+#endif
     psAPI->disconnect = &RFCOMM_API_disconnect;
+    psAPI->connect = &RFCOMM_API_connect;
     return TRUE;
 }
 
@@ -109,15 +148,37 @@ BOOL RFCOMM_installDevCB(DEVICE_API *psAPI)
  * RFCOMM API functions implementation
  */
 
+#ifdef BT_PROFILE_ENABLE
+/*Data path entry points, profiled*/
+BOOL _RFCOMM_profPutData(const BYTE *pData, UINT uLen)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = RFCOMM_API_putData(pData, uLen);
+    BT_profileLeave(BT_LAYER_RFCOMM, uLen);
+    return bRetVal;
+}
+
+BOOL _RFCOMM_profSendData(const BYTE *pData, UINT uLen)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = RFCOMM_API_sendData(pData, uLen);
+    BT_profileLeave(BT_LAYER_RFCOMM, uLen);
+    return bRetVal;
+}
+#endif
+
 BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
 {
     BYTE bCtrl, bFCS, bMsgType, bMsgLen;
     UINT8 uOffset, uMsgOffset, bChNumber;
     UINT16 uFrameHdrLen, uFrameInfLen;
-    BOOL bRetVal, bHasCrField = FALSE;
+    BOOL bRetVal = TRUE, bHasCrField = FALSE;
     RFCOMM_CHANNEL *psChannel = NULL;
 
-	DelayMs(10);
     DBG_INFO ("RFCOMM Data received: \r\n");
     DBG_DUMP(pData, uLen);
 
@@ -145,7 +206,8 @@ BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
     else
     {
         uFrameHdrLen = RFCOMM_HDR_LEN_2B;
-        uFrameInfLen = BT_readBE16(pData, 2) >> 1;
+        /* 7 bits in the first octet (after the EA bit), 8 in the second */
+        uFrameInfLen = (pData[2] >> 1) | ((UINT16) pData[3] << 7);
     }
     uOffset = uFrameHdrLen;
 
@@ -201,6 +263,10 @@ BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
                     bRetVal = _RFCOMM_handlePN(&pData[uMsgOffset], bMsgLen);
                     break;
 
+                case RFCOMM_PN_RSP:
+                    bRetVal = _RFCOMM_handlePNRsp(&pData[uMsgOffset], bMsgLen);
+                    break;
+
                 case RFCOMM_TEST_CMD:
                     bRetVal = _RFCOMM_handleTEST(&pData[uMsgOffset], bMsgLen);
                     break;
@@ -209,6 +275,12 @@ BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
                     bRetVal = _RFCOMM_handleMSC(&pData[uMsgOffset], bMsgLen);
                     break;
 
+                case RFCOMM_MSC_RSP:
+                    /* Our MSC command is answered */
+                    BT_timerStop(&gpsRFCOMMCB->sMuxTimer);
+                    bRetVal = TRUE;
+                    break;
+
                 case RFCOMM_RPN_CMD:
                     bRetVal = _RFCOMM_handleRPN(&pData[uMsgOffset], bMsgLen);
                     break;
@@ -281,10 +353,41 @@ BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
                 break;
 
             case RFCOMM_UA_FRAME|RFCOMM_PF_BIT:
+                /* Nothing of ours is waiting for it */
+                if (!BT_timerIsArmed(&psChannel->sAckTimer))
+                {
+                    break;
+                }
+                /* Our DISC is acknowledged */
+                if (psChannel->bEstablished)
+                {
+                    _RFCOMM_closeDLC(psChannel);
+                    break;
+                }
+                /*
+                 * Our SABM is acknowledged: the multiplexer goes on with
+                 * the data channel parameters, the data channel with
+                 * its modem status.
+                 */
+                BT_timerStop(&psChannel->sAckTimer);
+                psChannel->bEstablished = TRUE;
+                if (bChNumber == RFCOMM_CH_MUX)
+                {
+                    bRetVal = _RFCOMM_sendPN(RFCOMM_CH_DATA);
+                }
+                else
+                {
+                    bRetVal = _RFCOMM_sendMSC(bChNumber);
+                }
                 break;
 
             case RFCOMM_DM_FRAME:
             case RFCOMM_DM_FRAME|RFCOMM_PF_BIT:
+                /* Our SABM is refused, or our DISC found no DLC */
+                if (BT_timerIsArmed(&psChannel->sAckTimer))
+                {
+                    _RFCOMM_closeDLC(psChannel);
+                }
                 break;
 
             case RFCOMM_DISC_FRAME|RFCOMM_PF_BIT:
@@ -292,9 +395,7 @@ BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
                 bRetVal = _RFCOMM_sendUA(bChNumber);
                 if (bRetVal)
                 {
-                    psChannel->bEstablished = FALSE;
-                    psChannel->bLocalCr = 0;
-                    psChannel->bRemoteCr = 0;
+                    _RFCOMM_closeDLC(psChannel);
                 }
                 break;
 
@@ -305,6 +406,7 @@ BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen)
                  */
                 break;
         }
+        return bRetVal;
     }
 }
 
@@ -353,13 +455,34 @@ BOOL RFCOMM_API_disconnect(UINT8 bChannel)
     /* FCS */
     aData[3] = RFCOMM_FCS_CalcCRC(aData, RFCOMM_HDR_LEN_1B);
 
-    /* Send the frame */
-    bRetVal = gpsRFCOMMCB->L2CAPsendData(L2CAP_RFCOMM_PSM,
+    /* Send the frame (ahead of the data), the remote acknowledges it */
+    bRetVal = gpsRFCOMMCB->L2CAPsendControl(L2CAP_RFCOMM_PSM,
             aData, RFCOMM_DISC_LEN);
+    if (bRetVal)
+    {
+        BT_timerStart(&psChannel->sAckTimer, RFCOMM_T1_MS);
+    }
 
     return bRetVal;
 }
 
+/*
+ * Open the session as initiator (the L2CAP channel is open already): the
+ * SABM of the multiplexer goes first, the parameters (PN), the SABM and
+ * the modem status (MSC) of the data channel follow as they are answered.
+ */
+BOOL RFCOMM_API_connect()
+{
+    ASSERT(NULL != gpsRFCOMMCB);
+
+    if (gpsRFCOMMCB->asChannel[RFCOMM_CH_MUX].bEstablished)
+    {
+        return FALSE;
+    }
+    gpsRFCOMMCB->bRole = RFCOMM_ROLE_INITIATIOR;
+    return _RFCOMM_sendSABM(RFCOMM_CH_MUX);
+}
+
 /*
  * RFCOMM private functions implementation
  */
@@ -382,13 +505,49 @@ BYTE _RFCOMM_getAddress(UINT8 bChNumber, BYTE bType)
     bRole = gpsRFCOMMCB->bRole;
 
     /* Set the Command/Response bit according to the role */
-    if ((bType == RFCOMM_DATA) && (bRole == RFCOMM_ROLE_INITIATIOR)||
-        (bType == RFCOMM_CMD) && (bRole == RFCOMM_ROLE_INITIATIOR) ||
-        (bType == RFCOMM_RSP) && (bRole == RFCOMM_ROLE_RESPONDER))
+    if (((bType == RFCOMM_DATA) && (bRole == RFCOMM_ROLE_INITIATIOR)) ||
+        ((bType == RFCOMM_CMD) && (bRole == RFCOMM_ROLE_INITIATIOR)) ||
+        ((bType == RFCOMM_RSP) && (bRole == RFCOMM_ROLE_RESPONDER)))
     {
         bCR = 0x01;
     }
-    return (bChNumber << 3) + (bRole << 2) + (bCR << 1) | 0x01;
+    /*
+     * The initiator opens every DLC on a server channel of the responder,
+     * so the direction bit of the DLCI is 0 whatever our role.
+     */
+    return ((bChNumber << 3) + (bCR << 1)) | 0x01;
+}
+
+BOOL _RFCOMM_sendSABM(UINT8 bChNum)
+{
+    BYTE aData[RFCOMM_SABM_LEN];
+    BOOL bRetVal = FALSE;
+    RFCOMM_CHANNEL *psChannel = NULL;
+
+    psChannel = _RFCOMM_getChannel(bChNum);
+    if(NULL == psChannel)
+    {
+        return FALSE;
+    }
+    /* Prepare the frame */
+    /* Address */
+    aData[0] = _RFCOMM_getAddress(bChNum, RFCOMM_CMD);
+    /* Control */
+    aData[1] = RFCOMM_SABM_FRAME|RFCOMM_PF_BIT;
+    /* InfoLength */
+    aData[2] = (0x00 << 1) | 0x01;
+    /* FCS */
+    aData[3] = RFCOMM_FCS_CalcCRC(aData, RFCOMM_HDR_LEN_1B);
+
+    /* Send the frame (ahead of the data), the remote acknowledges it */
+    bRetVal = gpsRFCOMMCB->L2CAPsendControl(L2CAP_RFCOMM_PSM,
+            aData, RFCOMM_SABM_LEN);
+    if (bRetVal)
+    {
+        BT_timerStart(&psChannel->sAckTimer, RFCOMM_T1_MS);
+    }
+
+    return bRetVal;
 }
 
 BOOL _RFCOMM_sendUA(UINT8 bChNum)
@@ -412,8 +571,8 @@ BOOL _RFCOMM_sendUA(UINT8 bChNum)
     /* FCS */
     aData[3] = RFCOMM_FCS_CalcCRC(aData, RFCOMM_HDR_LEN_1B);
 
-    /* Send the frame */
-    bRetVal = gpsRFCOMMCB->L2CAPsendData(L2CAP_RFCOMM_PSM,
+    /* Send the frame (ahead of the data) */
+    bRetVal = gpsRFCOMMCB->L2CAPsendControl(L2CAP_RFCOMM_PSM,
             aData, RFCOMM_UA_LEN);
 
     return bRetVal;
@@ -459,9 +618,18 @@ BOOL _RFCOMM_sendUIH(UINT8 bChNum, const BYTE *pData, UINT uLen)
     /* Calculate the FCS */
     aFrame[uOffset + i] = RFCOMM_FCS_CalcCRC(aFrame, 2);
 
-    /* Send the frame */
-    bRetVal = gpsRFCOMMCB->L2CAPsendData(L2CAP_RFCOMM_PSM,
-            aFrame, RFCOMM_UIH_LEN + uLen);
+    /* Send the frame (header, payload and FCS), the multiplexer control */
+    /* goes ahead of the data */
+    if (bChNum == RFCOMM_CH_MUX)
+    {
+        bRetVal = gpsRFCOMMCB->L2CAPsendControl(L2CAP_RFCOMM_PSM,
+                aFrame, uOffset + uLen + 1);
+    }
+    else
+    {
+        bRetVal = gpsRFCOMMCB->L2CAPsendData(L2CAP_RFCOMM_PSM,
+                aFrame, uOffset + uLen + 1);
+    }
 
     return bRetVal;
 }
@@ -478,7 +646,8 @@ BOOL _RFCOMM_sendUIHCr(UINT8 bChNum, UINT8 uNumCr)
     aFrame[3] = uNumCr;
     aFrame[4] = RFCOMM_FCS_CalcCRC(aFrame, 2);
 
-    bRetVal = gpsRFCOMMCB->L2CAPsendData(L2CAP_RFCOMM_PSM,
+    /* Credits must never wait behind the data */
+    bRetVal = gpsRFCOMMCB->L2CAPsendControl(L2CAP_RFCOMM_PSM,
             aFrame, RFCOMM_UIH_CR_LEN);
 
     return bRetVal;
@@ -487,7 +656,7 @@ BOOL _RFCOMM_sendUIHCr(UINT8 bChNum, UINT8 uNumCr)
 BOOL _RFCOMM_handlePN(const BYTE *pMsgData, UINT8 uMsgLen)
 {
     UINT8 uChNum;
-    UINT16 uMTU;
+    UINT16 uMTU, uL2CAPMTU;
     BYTE aPNRsp[RFCOMM_MSGHDR_LEN + RFCOMM_PNMSG_LEN];
     BOOL bRetVal = FALSE;
     RFCOMM_CHANNEL *psChannel = NULL;
@@ -545,7 +714,16 @@ BOOL _RFCOMM_handlePN(const BYTE *pMsgData, UINT8 uMsgLen)
 
     /* Same priority */
     aPNRsp[4] = pMsgData[2];
-    /* Configure the minimum MTU */
+    /*
+     * Configure the minimum MTU, a whole RFCOMM frame (header, credits
+     * and FCS included) must fit in the L2CAP MTU as well
+     */
+    uL2CAPMTU = gpsRFCOMMCB->L2CAPgetMTU(L2CAP_RFCOMM_PSM);
+    if (uL2CAPMTU > RFCOMM_UIH_CR_LEN + 1 &&
+        (uL2CAPMTU - RFCOMM_UIH_CR_LEN - 1) < uMTU)
+    {
+        uMTU = uL2CAPMTU - RFCOMM_UIH_CR_LEN - 1;
+    }
     if (uMTU < RFCOMM_MTU)
     {
         BT_storeLE16(uMTU, aPNRsp, 6);
@@ -557,12 +735,124 @@ BOOL _RFCOMM_handlePN(const BYTE *pMsgData, UINT8 uMsgLen)
     return bRetVal;
 }
 
+BOOL _RFCOMM_sendPN(UINT8 bChNum)
+{
+    BYTE aPN[RFCOMM_MSGHDR_LEN + RFCOMM_PNMSG_LEN];
+    UINT16 uMTU = RFCOMM_MTU, uL2CAPMTU;
+    BOOL bRetVal = FALSE;
+    RFCOMM_CHANNEL *psChannel = NULL;
+
+    psChannel = _RFCOMM_getChannel(bChNum);
+    if(NULL == psChannel)
+    {
+        return FALSE;
+    }
+    /*
+     * Fill the PN command, the responder answers with the values it takes:
+     * DLCI = DLCI to configure
+     * I_CL = 0xF0 (Request credit flow control) and 0x00 (Use UIH frames)
+     * P = 0x00 (No priority, the lowest one)
+     * T = 0x00 (T1 not negotiable in RFCOMM)
+     * N = RFCOMM_MTU (Maximum frame size, within the L2CAP MTU)
+     * NA = 0x00 (N2 is always 0 in RFCOMM)
+     * K = 0x07 (Starting number of credits)
+     */
+    uL2CAPMTU = gpsRFCOMMCB->L2CAPgetMTU(L2CAP_RFCOMM_PSM);
+    if (uL2CAPMTU > RFCOMM_UIH_CR_LEN + 1 &&
+        (uL2CAPMTU - RFCOMM_UIH_CR_LEN - 1) < uMTU)
+    {
+        uMTU = uL2CAPMTU - RFCOMM_UIH_CR_LEN - 1;
+    }
+    aPN[0] = RFCOMM_PN_CMD;
+    aPN[1] = (RFCOMM_PNMSG_LEN << 1) | 0x01;
+    aPN[2] = bChNum << 1;
+    aPN[3] = (0x0F << 4) | 0x00;
+    aPN[4] = 0x00;
+    aPN[5] = 0x00;
+    BT_storeLE16(uMTU, aPN, 6);
+    aPN[8] = 0x00;
+    aPN[9] = 0x07;
+
+    bRetVal = _RFCOMM_sendUIH(RFCOMM_CH_MUX, aPN,
+            RFCOMM_MSGHDR_LEN + RFCOMM_PNMSG_LEN);
+    if (bRetVal)
+    {
+        psChannel->bLocalCr = 0x07;
+        BT_timerStart(&gpsRFCOMMCB->sMuxTimer, RFCOMM_T2_MS);
+    }
+    return bRetVal;
+}
+
+BOOL _RFCOMM_handlePNRsp(const BYTE *pMsgData, UINT8 uMsgLen)
+{
+    UINT8 uChNum;
+    RFCOMM_CHANNEL *psChannel = NULL;
+
+    ASSERT(NULL != gpsRFCOMMCB);
+
+    /* Check the len */
+    if (uMsgLen != RFCOMM_PNMSG_LEN)
+    {
+        return FALSE;
+    }
+    /* Our PN command is answered */
+    BT_timerStop(&gpsRFCOMMCB->sMuxTimer);
+
+    uChNum = pMsgData[0] >> 1;
+    psChannel = _RFCOMM_getChannel(uChNum);
+    if(NULL == psChannel)
+    {
+        return FALSE;
+    }
+    /* Credit flow control accepted (0xE0) */
+    if (pMsgData[1] != ((0x0E << 4)|(0x00)))
+    {
+        DBG_ERROR("RFCOMM Credit flow control MUST be supported! \r\n");
+        _RFCOMM_muxTimeout(NULL);
+        return FALSE;
+    }
+    psChannel->bRemoteCr = pMsgData[7];
+
+    /* Open the data channel */
+    return _RFCOMM_sendSABM(uChNum);
+}
+
+/* Our modem status: the data channel is ready (DV, RTR and RTC) */
+BOOL _RFCOMM_sendMSC(UINT8 bChNum)
+{
+    BYTE aRequest[RFCOMM_MSGHDR_LEN + RFCOMM_MSCMSG_LEN];
+    BOOL bRetVal = FALSE;
+    RFCOMM_CHANNEL *psChannel = NULL;
+
+    psChannel = _RFCOMM_getChannel(bChNum);
+    if(NULL == psChannel)
+    {
+        return FALSE;
+    }
+    /* Fill the header */
+    aRequest[0] = RFCOMM_MSC_CMD;
+    aRequest[1] = (RFCOMM_MSCMSG_LEN << 1) | 0x01;
+    /* Fill the command */
+    aRequest[2] = (bChNum << 3) | (0x01 << 1) | 0x01; /* DLCI, EA bits */
+    aRequest[3] = 0x8D;         /* Set the DV, RTR, RTC and EA bits */
+    aRequest[4] = 0x00;         /* No break signal */
+    /* Send the frame, the remote answers it */
+    bRetVal = _RFCOMM_sendUIH(RFCOMM_CH_MUX, aRequest,
+            RFCOMM_MSGHDR_LEN + RFCOMM_MSCMSG_LEN);
+    if (bRetVal)
+    {
+        psChannel->bDataEnabled = TRUE;
+        BT_timerStart(&gpsRFCOMMCB->sMuxTimer, RFCOMM_T2_MS);
+    }
+    return bRetVal;
+}
+
 BOOL _RFCOMM_handleMSC(const BYTE *pMsgData, UINT8 uMsgLen)
 {
     BOOL bRetVal = FALSE;
     UINT i;
     BYTE aResponse[RFCOMM_MSGHDR_LEN + RFCOMM_MSCMSG_LEN];
-    BYTE aRequest[RFCOMM_MSGHDR_LEN + RFCOMM_MSCMSG_LEN];
+    RFCOMM_CHANNEL *psChannel = NULL;
 
     ASSERT(NULL != gpsRFCOMMCB);
     /* Check the message length */
@@ -583,18 +873,13 @@ BOOL _RFCOMM_handleMSC(const BYTE *pMsgData, UINT8 uMsgLen)
         return bRetVal;
     }
 
-    /* Send a request after responding the command */
-    /* Fill the header */
-    aRequest[0] = RFCOMM_MSC_CMD;
-    aRequest[1] = (RFCOMM_MSCMSG_LEN << 1) | 0x01;
-    /* Fill the command */
-    aRequest[2] = pMsgData[0];  /* Set the same DLCi as the initial command */
-    aRequest[3] = 0x8D;         /* Set the DV, RTR, RTC and EA bits */
-    aRequest[4] = 0x00;         /* No break signal */
-    /* Send the frame */
-    bRetVal = _RFCOMM_sendUIH(0x00, aRequest,
-            RFCOMM_MSGHDR_LEN + RFCOMM_MSCMSG_LEN);
-    return bRetVal;
+    /* Send a request after responding the command (unless sent already) */
+    psChannel = _RFCOMM_getChannel(pMsgData[0] >> 3);
+    if (NULL == psChannel || psChannel->bDataEnabled)
+    {
+        return bRetVal;
+    }
+    return _RFCOMM_sendMSC(pMsgData[0] >> 3);
 }
 
 BOOL _RFCOMM_handleRPN(const BYTE *pMsgData, UINT8 uMsgLen)
@@ -708,3 +993,43 @@ BOOL _RFCOMM_handleTEST(const BYTE *pMsgData, UINT8 uMsgLen)
     return bRetVal;
 }
 
+
+/* The DLC is released: no credits, no pending acknowledgement */
+void _RFCOMM_closeDLC(RFCOMM_CHANNEL *psChannel)
+{
+    ASSERT(NULL != psChannel);
+
+    BT_timerStop(&psChannel->sAckTimer);
+    psChannel->bEstablished = FALSE;
+    psChannel->bDataEnabled = FALSE;
+    psChannel->bLocalCr = 0;
+    psChannel->bRemoteCr = 0;
+}
+
+/* T1: our DISC was never acknowledged, release the DLC anyway */
+void _RFCOMM_ackTimeout(void *pContext)
+{
+    RFCOMM_CHANNEL *psChannel = (RFCOMM_CHANNEL *) pContext;
+
+    ASSERT(NULL != gpsRFCOMMCB);
+
+    DBG_ERROR("RFCOMM T1 expired (DLC %d)\r\n", psChannel->bDLC);
+    _RFCOMM_closeDLC(psChannel);
+    /* Without the multiplexer the session is over */
+    if (psChannel->bDLC == RFCOMM_CH_MUX)
+    {
+        _RFCOMM_muxTimeout(NULL);
+    }
+}
+
+/* T2: the multiplexer does not answer, close the session */
+void _RFCOMM_muxTimeout(void *pContext)
+{
+    ASSERT(NULL != gpsRFCOMMCB);
+
+    DBG_ERROR("RFCOMM T2 expired\r\n");
+    if (!gpsRFCOMMCB->L2CAPdisconnect(L2CAP_RFCOMM_PSM))
+    {
+        RFCOMM_reset();
+    }
+}
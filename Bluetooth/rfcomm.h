@@ -18,6 +18,7 @@
 #define __RFCOMM_H__
 
 #include "bt_common.h"
+#include "bt_timer.h"
 
 /*
  * RFCOMM definitions
@@ -85,6 +86,14 @@
 
 #define RFCOMM_MTU 242
 
+/*
+ * Timers (ms)
+ * T1 = Acknowledgement (UA or DM) of our DISC.
+ * T2 = Response to our multiplexer commands.
+ */
+#define RFCOMM_T1_MS 20000
+#define RFCOMM_T2_MS 20000
+
 /*
  * RFCOMM structure definition
  */
@@ -98,6 +107,8 @@ typedef struct _RFCOMM_CHANNEL
     UINT8 bDLC;
     UINT8 bLocalCr;
     UINT8 bRemoteCr;
+    /* T1, armed while our DISC is not acknowledged */
+    BT_TIMER sAckTimer;
 } RFCOMM_CHANNEL;
 
 typedef struct _RFCOMM_CONTROL_BLOCK
@@ -109,8 +120,13 @@ typedef struct _RFCOMM_CONTROL_BLOCK
 
     /* The role can be either initiator (0x01) or responder (0x00) */
     UINT8 bRole;
+    /* T2, armed while our multiplexer command is not answered */
+    BT_TIMER sMuxTimer;
 
     BOOL (*L2CAPsendData)(UINT16, const BYTE*, UINT16);
+    UINT16 (*L2CAPgetMTU)(UINT16);
+    BOOL (*L2CAPsendControl)(UINT16, const BYTE*, UINT16);
+    BOOL (*L2CAPdisconnect)(UINT16);
     BOOL (*putRFCOMMData)(const BYTE*, UINT);
     BOOL (*disconnComplete)(UINT8);
 
@@ -123,18 +139,31 @@ typedef struct _RFCOMM_CONTROL_BLOCK
 BYTE _RFCOMM_getAddress(UINT8 bChNumber, BYTE bType);
 RFCOMM_CHANNEL* _RFCOMM_getChannel(UINT8 uChNumber);
 
+BOOL _RFCOMM_sendSABM(UINT8 bChNum);
 BOOL _RFCOMM_sendUA(UINT8 bChNum);
+BOOL _RFCOMM_sendPN(UINT8 bChNum);
+BOOL _RFCOMM_sendMSC(UINT8 bChNum);
 BOOL _RFCOMM_sendUIH(UINT8 bChNum, const BYTE *pData, UINT uLen);
 BOOL _RFCOMM_sendUIHCr(UINT8 bChNum, UINT8 uNumCr);
 
 BOOL _RFCOMM_handlePN(const BYTE *pMsgData, UINT8 uMsgLen);
+BOOL _RFCOMM_handlePNRsp(const BYTE *pMsgData, UINT8 uMsgLen);
 BOOL _RFCOMM_handleRPN(const BYTE *pMsgData, UINT8 uMsgLen);
 BOOL _RFCOMM_handleRLS(const BYTE *pMsgData, UINT8 uMsgLen);
 BOOL _RFCOMM_handleMSC(const BYTE *pMsgData, UINT8 uMsgLen);
 BOOL _RFCOMM_handleTEST(const BYTE *pMsgData, UINT8 uMsgLen);
 
+void _RFCOMM_closeDLC(RFCOMM_CHANNEL *psChannel);
+void _RFCOMM_ackTimeout(void *pContext);
+void _RFCOMM_muxTimeout(void *pContext);
+
 BOOL RFCOMM_API_putData(const BYTE *pData, UINT uLen);
 BOOL RFCOMM_API_sendData(const BYTE *pData, UINT uLen);
+#ifdef BT_PROFILE_ENABLE
+BOOL _RFCOMM_profPutData(const BYTE *pData, UINT uLen);
+BOOL _RFCOMM_profSendData(const BYTE *pData, UINT uLen);
+#endif
 BOOL RFCOMM_API_disconnect(UINT8 bChannel);
+BOOL RFCOMM_API_connect();
 
 #endif /*__RFCOMM_H__*/
@@ -157,7 +157,8 @@ const SDP_SERVICE sServiceRFCOMM = {
 };
 #endif /*SDP_SERVICE_RFCOMM_ENABLE*/
 
-static SDP_CONTROL_BLOCK *gpsSDPCB = NULL;
+/*Control block of the selected stack instance*/
+#define gpsSDPCB (gpsBTStack->psSDPCB)
 
 /*
  * SDP public functions implementation
@@ -193,7 +194,11 @@ BOOL SDP_create()
     L2CAP_getAPI(&sL2CAP);
     gpsSDPCB->L2CAPsendData = sL2CAP.sendData;
 
+#ifdef BT_PROFILE_ENABLE
+    sAPI.putData = &_SDP_profPutPetition;
+#else
     sAPI.putData = &SDP_API_putPetition;
+#endif
     L2CAP_installSDP(&sAPI);
 
     DBG_INFO("SDP Initialised\n");
@@ -213,6 +218,19 @@ BOOL SDP_destroy()
  * SDP API functions implementation
  */
 
+#ifdef BT_PROFILE_ENABLE
+/*Data path entry point, profiled*/
+BOOL _SDP_profPutPetition(const BYTE *pData, UINT uLen)
+{
+    BOOL bRetVal;
+
+    BT_profileEnter();
+    bRetVal = SDP_API_putPetition(pData, uLen);
+    BT_profileLeave(BT_LAYER_SDP, uLen);
+    return bRetVal;
+}
+#endif
+
 BOOL SDP_API_putPetition(const BYTE *pData, UINT uLen)
 {
     BYTE bPDUID;
@@ -311,7 +329,6 @@ BOOL _SDP_handlePetition(BYTE bPDUID, UINT16 uTID, const BYTE *pData,
             break;
     }
 
-   DelayMs(10);
    return bRetVal;
 }
 
@@ -663,8 +680,9 @@ INT16 _SDP_getAttrList(const SDP_SERVICE *pService, const BYTE *pAttrIDList,
             uLen = BT_readBE16(pAttrIDList, 1);
             uInOffset = 3;
             break;
+        /* Error, the list is not a data element sequence */
         default:
-            break;
+            return FALSE;
     }
     i = 0;
     while(i < uLen)
@@ -678,7 +696,7 @@ INT16 _SDP_getAttrList(const SDP_SERVICE *pService, const BYTE *pAttrIDList,
         {
             /* 16 bit ID (single ID) */
             case SDP_DATA_T_UINT|SDP_DATA_S_16:
-                uID = BT_readBE16(pAttrIDList, uInOffset + j + 1);
+                uID = BT_readBE16(pAttrIDList, uInOffset + i + 1);
                 bFound = FALSE;
                 /* Search for that AttrID in the service record */
                 for (j = 0; (j < pService->uNumAttrs) && !bFound; ++j)
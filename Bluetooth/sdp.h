@@ -129,6 +129,9 @@ typedef struct _SDP_CONTROL_BLOCK
  */
 
 BOOL SDP_API_putPetition(const BYTE *pData, UINT uLen);
+#ifdef BT_PROFILE_ENABLE
+BOOL _SDP_profPutPetition(const BYTE *pData, UINT uLen);
+#endif
 
 BOOL _SDP_handlePetition(BYTE bPDUID, UINT16 uTID, const BYTE *pData, UINT16 uLen);
 BOOL _SDP_sendSSResp(UINT16 uTID, const BYTE *pData, UINT16 uLen);
@@ -82,6 +82,17 @@ Change History
                                             // during a bulk transfer before erroring.
 #endif
 
+#ifndef USB_BULK_NAK_BACKOFF_STEP
+    #define USB_BULK_NAK_BACKOFF_STEP   8   // A bulk endpoint NAK'd in this many
+                                            // frames in a row is polled half as
+                                            // often (and so on, doubling).
+#endif
+
+#ifndef USB_BULK_NAK_BACKOFF_MAX
+    #define USB_BULK_NAK_BACKOFF_MAX    3   // Most frames a NAK'ing bulk endpoint
+                                            // is left out.  0 polls it every frame.
+#endif
+
 #ifndef USB_NUM_COMMAND_TRIES
     #define USB_NUM_COMMAND_TRIES       3   // During enumeration, define how many
                                             // times each command will be tried before
@@ -541,6 +552,139 @@ extern CLIENT_DRIVER_TABLE  usbClientDrvTable[];                // Application's
 BYTE    USBHostClearEndpointErrors( BYTE deviceAddress, BYTE endpoint );
 
 
+// *****************************************************************************
+/* Bus Utilization Counters
+
+This structure holds the transaction counters kept by the USB interrupt since
+the last call to USBHostClearBusStats().
+*/
+typedef struct _USB_BUS_STATS
+{
+    DWORD   frames;                     // Start of frames.
+    DWORD   busyFrames;                 // Frames that moved data.
+    DWORD   transactions;               // Tokens completed, whatever the result.
+    DWORD   dataTransactions;           // Tokens that moved data (ACK, DATA0/1).
+    DWORD   naks;                       // Tokens NAK'd by the device.
+    DWORD   errors;                     // Tokens that failed (bus errors, bad PID).
+    DWORD   bytes;                      // Data bytes moved.
+    DWORD   backoffFrames;              // Frames a NAK'ing bulk endpoint was left out.
+    BYTE    maxFrameTransactions;       // Most tokens completed in one frame.
+} USB_BUS_STATS;
+
+
+/****************************************************************************
+  Function:
+    void USBHostGetBusStats( USB_BUS_STATS *pStats )
+
+  Summary:
+    This function copies the bus utilization counters.
+
+  Description:
+    This function copies the bus utilization counters.  They tell how well
+    the frames are used: data transactions against NAKs, the bytes moved and
+    the frames left idle.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_BUS_STATS *pStats   - Where to copy the counters
+
+  Returns:
+    None
+
+  Remarks:
+    The USB interrupt is masked while the counters are copied.
+  ***************************************************************************/
+
+void    USBHostGetBusStats( USB_BUS_STATS *pStats );
+
+
+/****************************************************************************
+  Function:
+    void USBHostClearBusStats( void )
+
+  Summary:
+    This function restarts the bus utilization counters.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void    USBHostClearBusStats( void );
+
+
+#if defined( USB_ENUM_ARENA_SIZE )
+/****************************************************************************
+  Function:
+    WORD USBHostGetEnumArenaPeak( void )
+
+  Summary:
+    This function returns the high-water mark of the enumeration arena.
+
+  Description:
+    This function returns the most bytes of the enumeration arena ever in
+    use.  When USB_ENUM_ARENA_SIZE is defined, the descriptors and the
+    interface and endpoint information of the attached device are kept in an
+    arena of that size instead of the heap.  The arena is released in one
+    step when the device detaches.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    High-water mark of the enumeration arena, in bytes
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+WORD    USBHostGetEnumArenaPeak( void );
+#endif
+
+
+/****************************************************************************
+  Function:
+    BOOL USBHostIsIdle( void )
+
+  Summary:
+    This function tells whether USBHostTasks() has anything to do.
+
+  Description:
+    This function returns TRUE when the host waits for a device to attach or
+    runs the attached one normally, with no state change and no transfer
+    event pending.  Until the next USB interrupt USBHostTasks() has nothing
+    to do, so the application may put the CPU to sleep.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    TRUE    - USBHostTasks() need not be called until the next USB interrupt
+    FALSE   - USBHostTasks() must keep being called
+
+  Remarks:
+    Call it with the interrupts disabled to sleep on the answer.
+  ***************************************************************************/
+
+BOOL    USBHostIsIdle( void );
+
+
 /****************************************************************************
   Function:
     BOOL    USBHostDeviceSpecificClientDriver( BYTE deviceAddress )
@@ -80,6 +80,11 @@ Change History:
 //#include "USB/usb_hal.h"
 #include <debug.h>
 
+#if defined( USB_ENUM_ARENA_SIZE ) && !defined( USB_MALLOC )
+#define USB_MALLOC(size) _USB_ArenaAlloc(size)
+#define USB_FREE(ptr) _USB_ArenaFree(ptr)
+#endif
+
 #ifndef USB_MALLOC
 #define USB_MALLOC(size) malloc(size)
 #endif
@@ -181,20 +186,169 @@ static WORD prevHostState;
 #endif
 
 static USB_BUS_INFO                  usbBusInfo;                                 // Information about the USB bus.
+static USB_BUS_STATS                 usbBusStats;                                // Bus utilization counters.
+static BYTE                          usbFrameTransactions;                       // Tokens completed in the current frame.
+static BYTE                          usbFrameData;                               // The current frame moved data.
 static USB_DEVICE_INFO               usbDeviceInfo;                              // A collection of information about the attached device.
+#if defined( USB_HOST_BT_ONLY )
+static USB_ENDPOINT_INFO            *usbEndpointMap[USB_BT_ONLY_ENDPOINTS];      // Endpoints of the HCI interface, by number and direction.
+#endif
 #if defined( USB_ENABLE_TRANSFER_EVENT )
 static USB_EVENT_QUEUE           usbEventQueue;                              // Queue of USB events used to synchronize ISR to main tasks loop.
 #endif
 static USB_ROOT_HUB_INFO             usbRootHubInfo;                             // Information about a specific port.
+#if defined( USB_ENUM_ARENA_SIZE )
+static DWORD                         usbEnumArena[(USB_ENUM_ARENA_SIZE + 3) / 4]; // Enumeration data of the attached device.
+static WORD                          usbEnumArenaTop;                            // Bytes of the arena in use.
+static WORD                          usbEnumArenaLast;                           // Offset of the topmost block.
+static WORD                          usbEnumArenaPeak;                           // Most bytes of the arena ever in use.
+static USB_ENDPOINT_INFO             usbEndpoint0;                               // EP0 node, kept out of the arena.
+#endif
 
 static volatile WORD msec_count = 0;                                             // The current millisecond count.
 
+// Keep the USB interrupt out while the main line reads its counters.
+#if defined( __C30__ ) || defined __XC16__
+    #define _USB_MASK_INTERRUPT(s)      { (s) = IEC5 & 0x0040; IEC5 &= ~0x0040; }
+    #define _USB_RESTORE_INTERRUPT(s)   { IEC5 |= (s); }
+#elif defined( __PIC32MX__ )
+    #define _USB_MASK_INTERRUPT(s)      { (s) = IEC1 & _IEC1_USBIE_MASK; IEC1CLR = _IEC1_USBIE_MASK; }
+    #define _USB_RESTORE_INTERRUPT(s)   { IEC1SET = (s); }
+#endif
+
 // *****************************************************************************
 // *****************************************************************************
 // Section: Application Callable Functions
 // *****************************************************************************
 // *****************************************************************************
 
+/****************************************************************************
+  Function:
+    void USBHostClearBusStats( void )
+
+  Description:
+    This function restarts the bus utilization counters.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void USBHostClearBusStats( void )
+{
+	DWORD intState;
+
+	_USB_MASK_INTERRUPT( intState );
+	memset( &usbBusStats, 0, sizeof(USB_BUS_STATS) );
+	usbFrameTransactions = 0;
+	usbFrameData         = 0;
+	_USB_RESTORE_INTERRUPT( intState );
+}
+
+/****************************************************************************
+  Function:
+    void USBHostGetBusStats( USB_BUS_STATS *pStats )
+
+  Description:
+    This function copies the bus utilization counters kept by the USB
+    interrupt.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_BUS_STATS *pStats   - Where to copy the counters
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void USBHostGetBusStats( USB_BUS_STATS *pStats )
+{
+	DWORD intState;
+
+	_USB_MASK_INTERRUPT( intState );
+	*pStats = usbBusStats;
+	_USB_RESTORE_INTERRUPT( intState );
+}
+
+#if defined( USB_ENUM_ARENA_SIZE )
+/****************************************************************************
+  Function:
+    WORD USBHostGetEnumArenaPeak( void )
+
+  Description:
+    This function returns the most bytes of the enumeration arena ever in
+    use, headers included.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    High-water mark of the enumeration arena
+
+  Remarks:
+    USB_ENUM_ARENA_SIZE can be trimmed down to it.
+  ***************************************************************************/
+
+WORD USBHostGetEnumArenaPeak( void )
+{
+	return usbEnumArenaPeak;
+}
+#endif
+
+/****************************************************************************
+  Function:
+    BOOL USBHostIsIdle( void )
+
+  Description:
+    This function tells whether USBHostTasks() has anything to do.  The host
+    is idle when it waits for a device to attach or runs the attached one
+    normally, with no state change and no transfer event pending.  Anything
+    changing that is signalled by the USB interrupt.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    TRUE    - USBHostTasks() need not be called until the next USB interrupt
+    FALSE   - USBHostTasks() must keep being called
+
+  Remarks:
+    Call it with the interrupts disabled to sleep on the answer.
+  ***************************************************************************/
+
+BOOL USBHostIsIdle( void )
+{
+	if (usbOverrideHostState != NO_STATE) {
+		return FALSE;
+	}
+#if defined ( USB_ENABLE_TRANSFER_EVENT )
+	if (StructQueueIsNotEmpty(&usbEventQueue, USB_EVENT_QUEUE_DEPTH)) {
+		return FALSE;
+	}
+#endif
+	return (usbHostState == (STATE_DETACHED | SUBSTATE_WAIT_FOR_DEVICE)) ||
+	       (usbHostState == (STATE_RUNNING | SUBSTATE_NORMAL_RUN));
+}
+
 /****************************************************************************
   Function:
     BYTE USBHostClearEndpointErrors( BYTE deviceAddress, BYTE endpoint )
@@ -392,15 +546,24 @@ BOOL USBHostInit(  unsigned long flags  )
 	// so we can reinitialize when another device connects.  If the Endpoint 0
 	// node already exists, free all other allocated memory.
 	if (usbDeviceInfo.pEndpoint0 == NULL) {
+#if defined( USB_ENUM_ARENA_SIZE )
+		usbDeviceInfo.pEndpoint0 = &usbEndpoint0;
+#else
 		if ((usbDeviceInfo.pEndpoint0 = (USB_ENDPOINT_INFO*)USB_MALLOC( sizeof(USB_ENDPOINT_INFO) )) == NULL) {
 			DEBUG_PutString( "HOST: Cannot allocate for endpoint 0.\r\n" );
 			return FALSE;
 		}
+#endif
 		usbDeviceInfo.pEndpoint0->next = NULL;
 	} else {
 		_USB_FreeMemory();
 	}
 
+#if defined( USB_ENUM_ARENA_SIZE )
+	// Whatever the last device left in the arena is released at once.
+	_USB_ArenaReset();
+#endif
+
 	// Initialize other variables.
 	pCurrentEndpoint                        = usbDeviceInfo.pEndpoint0;
 	usbHostState                            = STATE_DETACHED;
@@ -630,6 +793,13 @@ BYTE USBHostIssueDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRe
 //        return USB_ILLEGAL_REQUEST;
 //    }
 
+#if defined( USB_HOST_BT_ONLY )
+	// Only alternate setting 0 of the HCI interface is loaded.
+	if ((bRequest == USB_REQUEST_SET_INTERFACE) &&
+	        ((wIndex != USB_BT_ONLY_INTERFACE) || (wValue != 0))) {
+		return USB_ILLEGAL_REQUEST;
+	}
+#else
 	// If the user is doing a SET INTERFACE, we must reset DATA0 for all endpoints.
 	if (bRequest == USB_REQUEST_SET_INTERFACE) {
 		USB_ENDPOINT_INFO           *pEndpoint;
@@ -667,6 +837,7 @@ BYTE USBHostIssueDeviceRequest( BYTE deviceAddress, BYTE bmRequestType, BYTE bRe
 		// Set the pointer to the new setting.
 		pInterface->pCurrentSetting = pSetting;
 	}
+#endif
 
 	// If the user is doing a CLEAR FEATURE(ENDPOINT_HALT), we must reset DATA0 for that endpoint.
 	if ((bRequest == USB_REQUEST_CLEAR_FEATURE) && (wValue == USB_FEATURE_ENDPOINT_HALT)) {
@@ -1458,6 +1629,12 @@ void USBHostTasks( void )
 			case SUBSUBSTATE_SET_RESET:
 				DEBUG_PutString( "HOST: Resetting the device.\r\n" );
 
+#if defined( USB_ENUM_ARENA_SIZE )
+				// Enumeration starts over, so the arena does too.
+				_USB_FreeMemory();
+				_USB_ArenaReset();
+#endif
+
 				// Prepare a data buffer for us to use.  We'll make it 8 bytes for now,
 				// which is the minimum wMaxPacketSize for EP0.
 				if (pEP0Data != NULL) {
@@ -2578,6 +2755,164 @@ BYTE USBHostWrite( BYTE deviceAddress, BYTE endpoint, BYTE *data, DWORD size )
 // *****************************************************************************
 // *****************************************************************************
 
+#if defined( USB_ENUM_ARENA_SIZE )
+/****************************************************************************
+  Function:
+    void * _USB_ArenaAlloc( WORD size )
+
+  Description:
+    This function allocates a block of the enumeration arena.  The device,
+    configuration and endpoint information of the attached device is kept
+    there instead of the heap, so attaching and detaching devices does not
+    fragment the heap the application uses.
+
+  Precondition:
+    None
+
+  Parameters:
+    WORD size   - Bytes to allocate
+
+  Returns:
+    Pointer to the block, NULL if the arena is full
+
+  Remarks:
+    Blocks are word aligned.
+  ***************************************************************************/
+
+void * _USB_ArenaAlloc( WORD size )
+{
+	USB_ARENA_BLOCK *pBlock;
+	DWORD           blockSize;
+
+	blockSize = (sizeof(USB_ARENA_BLOCK) + (DWORD)size + 3) & ~3;
+	if ((size == 0) || (blockSize > sizeof(usbEnumArena) - usbEnumArenaTop)) {
+		DEBUG_PutString( "HOST: Enumeration arena full.\r\n" );
+		return NULL;
+	}
+
+	pBlock              = (USB_ARENA_BLOCK *)((BYTE *)usbEnumArena + usbEnumArenaTop);
+	pBlock->size        = (WORD)blockSize;
+	pBlock->previous    = usbEnumArenaLast;
+	usbEnumArenaLast    = usbEnumArenaTop;
+	usbEnumArenaTop    += (WORD)blockSize;
+	if (usbEnumArenaTop > usbEnumArenaPeak) {
+		usbEnumArenaPeak = usbEnumArenaTop;
+	}
+
+	return pBlock + 1;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_ArenaFree( void *ptr )
+
+  Description:
+    This function frees a block of the enumeration arena.  The block is given
+    back, together with any freed block below it, once it is the topmost
+    block.
+
+  Precondition:
+    None
+
+  Parameters:
+    void *ptr   - Block to free, NULL is ignored
+
+  Returns:
+    None
+
+  Remarks:
+    Blocks freed out of order are held until _USB_ArenaReset.
+  ***************************************************************************/
+
+void _USB_ArenaFree( void *ptr )
+{
+	USB_ARENA_BLOCK *pBlock;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	pBlock = (USB_ARENA_BLOCK *)ptr - 1;
+	pBlock->size |= USB_ARENA_FREED;
+
+	while (usbEnumArenaLast != USB_ARENA_NONE) {
+		pBlock = (USB_ARENA_BLOCK *)((BYTE *)usbEnumArena + usbEnumArenaLast);
+		if (!(pBlock->size & USB_ARENA_FREED)) {
+			break;
+		}
+		usbEnumArenaTop  = usbEnumArenaLast;
+		usbEnumArenaLast = pBlock->previous;
+	}
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_ArenaReset( void )
+
+  Description:
+    This function releases the whole enumeration arena in one step.
+
+  Precondition:
+    None
+
+  Parameters:
+    None
+
+  Returns:
+    None
+
+  Remarks:
+    Nothing may point into the arena anymore.
+  ***************************************************************************/
+
+void _USB_ArenaReset( void )
+{
+	usbEnumArenaTop  = 0;
+	usbEnumArenaLast = USB_ARENA_NONE;
+}
+#endif
+
+
+/****************************************************************************
+  Function:
+    BYTE _USB_BulkBackoff( WORD countNAKs )
+
+  Description:
+    This function returns how many frames a bulk endpoint that was NAK'd in
+    countNAKs frames in a row is left out.  It sits out one frame after
+    USB_BULK_NAK_BACKOFF_STEP NAKs, three after twice as many, and so on,
+    up to USB_BULK_NAK_BACKOFF_MAX frames.
+
+  Precondition:
+    None
+
+  Parameters:
+    WORD countNAKs  - NAKs of the current transfer
+
+  Returns:
+    Number of frames to skip
+
+  Remarks:
+    Any data moved, or a new transfer, polls the endpoint every frame again.
+  ***************************************************************************/
+
+BYTE _USB_BulkBackoff( WORD countNAKs )
+{
+	WORD steps = countNAKs / USB_BULK_NAK_BACKOFF_STEP;
+
+	if (steps >= 8) {
+		return USB_BULK_NAK_BACKOFF_MAX;
+	}
+	steps = (1 << steps) - 1;
+	if (steps > USB_BULK_NAK_BACKOFF_MAX) {
+		return USB_BULK_NAK_BACKOFF_MAX;
+	}
+	return (BYTE)steps;
+}
+
+
 /****************************************************************************
   Function:
     void _USB_CheckCommandAndEnumerationAttempts( void )
@@ -2819,7 +3154,8 @@ BOOL _USB_FindDeviceLevelClientDriver( void )
 
   Description:
     This function searches the list of interfaces to try to find the specified
-    endpoint.
+    endpoint.  The Bluetooth-only host (USB_HOST_BT_ONLY) looks it up in the
+    fixed endpoint map instead.
 
   Precondition:
     None
@@ -2836,13 +3172,21 @@ BOOL _USB_FindDeviceLevelClientDriver( void )
 
 USB_ENDPOINT_INFO * _USB_FindEndpoint( BYTE endpoint )
 {
+#if !defined( USB_HOST_BT_ONLY )
 	USB_ENDPOINT_INFO           *pEndpoint;
 	USB_INTERFACE_INFO          *pInterface;
+#endif
 
 	if (endpoint == 0) {
 		return usbDeviceInfo.pEndpoint0;
 	}
 
+#if defined( USB_HOST_BT_ONLY )
+	if ((endpoint & 0x0F) >= (USB_BT_ONLY_ENDPOINTS / 2)) {
+		return NULL;
+	}
+	return usbEndpointMap[_USB_EndpointMapIndex( endpoint )];
+#else
 	pInterface = usbDeviceInfo.pInterfaceList;
 	while (pInterface) {
 		// Look for the endpoint in the currently active setting.
@@ -2862,6 +3206,7 @@ USB_ENDPOINT_INFO * _USB_FindEndpoint( BYTE endpoint )
 	}
 
 	return NULL;
+#endif
 }
 
 
@@ -3432,6 +3777,11 @@ void _USB_FindNextToken( void )
 					pCurrentEndpoint->transferState             = TSTATE_IDLE;
 					pCurrentEndpoint->wIntervalCount            = pCurrentEndpoint->wInterval;
 					pCurrentEndpoint->status.bfTransferComplete = 1;
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+					if (_USB_NotifyDataTransfer()) {
+						break; // The client driver took it in the interrupt.
+					}
+#endif
 #if defined( USB_ENABLE_TRANSFER_EVENT )
 					if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH)) {
 						USB_EVENT_DATA *data;
@@ -3490,6 +3840,11 @@ void _USB_FindNextToken( void )
 					pCurrentEndpoint->transferState             = TSTATE_IDLE;
 					pCurrentEndpoint->wIntervalCount            = pCurrentEndpoint->wInterval;
 					pCurrentEndpoint->status.bfTransferComplete = 1;
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+					if (_USB_NotifyDataTransfer()) {
+						break; // The client driver took it in the interrupt.
+					}
+#endif
 #if defined( USB_ENABLE_TRANSFER_EVENT )
 					if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH)) {
 						USB_EVENT_DATA *data;
@@ -3581,6 +3936,11 @@ TryBulk:
 				case TSUBSTATE_BULK_READ_COMPLETE:
 					pCurrentEndpoint->transferState               = TSTATE_IDLE;
 					pCurrentEndpoint->status.bfTransferComplete   = 1;
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+					if (_USB_NotifyDataTransfer()) {
+						break; // The client driver took it in the interrupt.
+					}
+#endif
 #if defined( USB_ENABLE_TRANSFER_EVENT )
 					if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH)) {
 						USB_EVENT_DATA *data;
@@ -3637,6 +3997,11 @@ TryBulk:
 				case TSUBSTATE_BULK_WRITE_COMPLETE:
 					pCurrentEndpoint->transferState               = TSTATE_IDLE;
 					pCurrentEndpoint->status.bfTransferComplete   = 1;
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+					if (_USB_NotifyDataTransfer()) {
+						break; // The client driver took it in the interrupt.
+					}
+#endif
 #if defined( USB_ENABLE_TRANSFER_EVENT )
 					if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH)) {
 						USB_EVENT_DATA *data;
@@ -3880,6 +4245,10 @@ void _USB_FreeConfigMemory( void )
 		usbDeviceInfo.pInterfaceList = pTempInterface;
 	}
 
+#if defined( USB_HOST_BT_ONLY )
+	memset( usbEndpointMap, 0x00, sizeof(usbEndpointMap) );
+#endif
+
 	pCurrentEndpoint = usbDeviceInfo.pEndpoint0;
 
 } // _USB_FreeConfigMemory
@@ -3967,6 +4336,7 @@ void _USB_InitControlRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData, WOR
 	pEndpoint->status.bfTransferSuccessful  = 0;
 	pEndpoint->status.bfErrorCount          = 0;
 	pEndpoint->status.bfLastTransferNAKd    = 0;
+	pEndpoint->backoffFrames                = 0;
 	pEndpoint->pUserData                    = pData;
 	pEndpoint->dataCount                    = 0;
 	pEndpoint->dataCountMax                 = size;
@@ -4020,6 +4390,7 @@ void _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pControlData,
 	pEndpoint->status.bfTransferSuccessful  = 0;
 	pEndpoint->status.bfErrorCount          = 0;
 	pEndpoint->status.bfLastTransferNAKd    = 0;
+	pEndpoint->backoffFrames                = 0;
 	pEndpoint->pUserData                    = pData;
 	pEndpoint->dataCount                    = 0;
 	pEndpoint->dataCountMax                 = size;
@@ -4083,6 +4454,7 @@ void _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
 	pEndpoint->status.bfTransferSuccessful  = 0;
 	pEndpoint->status.bfErrorCount          = 0;
 	pEndpoint->status.bfLastTransferNAKd    = 0;
+	pEndpoint->backoffFrames                = 0;
 	pEndpoint->pUserData                    = pData;
 	pEndpoint->dataCount                    = 0;
 	pEndpoint->dataCountMax                 = size; // Not used for isochronous.
@@ -4145,6 +4517,7 @@ void _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size )
 	pEndpoint->status.bfTransferSuccessful  = 0;
 	pEndpoint->status.bfErrorCount          = 0;
 	pEndpoint->status.bfLastTransferNAKd    = 0;
+	pEndpoint->backoffFrames                = 0;
 	pEndpoint->pUserData                    = pData;
 	pEndpoint->dataCount                    = 0;
 	pEndpoint->dataCountMax                 = size; // Not used for isochronous.
@@ -4242,6 +4615,7 @@ void _USB_NotifyClients( BYTE address, USB_EVENT event, void *data, unsigned int
     will require modification.
   ***************************************************************************/
 
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
 void _USB_NotifyDataClients( BYTE address, USB_EVENT event, void *data, unsigned int size )
 {
 	USB_INTERFACE_INFO  *pInterface;
@@ -4257,6 +4631,54 @@ void _USB_NotifyDataClients( BYTE address, USB_EVENT event, void *data, unsigned
 		break;
 	}
 } // _USB_NotifyClients
+#endif
+
+/****************************************************************************
+  Function:
+    BOOL _USB_NotifyDataTransfer( void )
+
+  Description:
+    This routine offers the bulk or interrupt transfer that pCurrentEndpoint
+    just completed to its client driver's DataEventHandler.  It is called
+    from within the USB interrupt, so a client driver can take the data and
+    re-arm the endpoint without waiting for USBHostTasks().
+
+  Precondition:
+    pCurrentEndpoint is idle with bfTransferComplete set.
+
+  Parameters:
+    None
+
+  Return Values:
+    TRUE    - The client driver handled the transfer, no EVENT_TRANSFER is
+              queued for it
+    FALSE   - The transfer is reported through the event queue as usual
+
+  Remarks:
+    The transfer data is copied first: the client driver may start the
+    next transfer on the same endpoint.
+  ***************************************************************************/
+
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+BOOL _USB_NotifyDataTransfer( void )
+{
+	HOST_TRANSFER_DATA transferData;
+
+	if (pCurrentEndpoint->clientDriver == CLIENT_DRIVER_HOST) {
+		return FALSE;
+	}
+
+	transferData.dataCount        = pCurrentEndpoint->dataCount;
+	transferData.pUserData        = pCurrentEndpoint->pUserData;
+	transferData.bErrorCode       = USB_SUCCESS;
+	transferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
+	transferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
+	transferData.clientDriver     = pCurrentEndpoint->clientDriver;
+
+	return usbClientDrvTable[transferData.clientDriver].DataEventHandler( usbDeviceInfo.deviceAddress,
+				EVENT_TRANSFER, &transferData, sizeof(HOST_TRANSFER_DATA) );
+}
+#endif
 
 /****************************************************************************
   Function:
@@ -4418,6 +4840,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 		bDescriptorType = *ptr++;
 
 
+#if !defined( USB_HOST_BT_ONLY )
 		// Find the OTG discriptor (if present)
 		if (bDescriptorType == USB_DESCRIPTOR_OTG) {
 			// We found an OTG Descriptor, so the device supports OTG.
@@ -4432,6 +4855,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 				usbDeviceInfo.flags.bfAllowHNP = 0;
 			}
 		}
+#endif
 
 		// Find an interface descriptor
 		if (bDescriptorType != USB_DESCRIPTOR_INTERFACE) {
@@ -4447,6 +4871,16 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 			SubClass          = *ptr++;
 			Protocol          = *ptr++;
 
+#if defined( USB_HOST_BT_ONLY )
+			// Only the HCI interface is loaded.  The SCO interface and its
+			// isochronous alternate settings are never used, so skip them.
+			if ((bInterfaceNumber != USB_BT_ONLY_INTERFACE) || (bAlternateSetting != 0)) {
+				index += bLength;
+				ptr = &pCurrentConfigurationDescriptor[index];
+				continue;
+			}
+#endif
+
 			// Get client driver index
 			if (usbDeviceInfo.flags.bfUseDeviceClientDriver) {
 				ClientDriver = usbDeviceInfo.deviceClientDriver;
@@ -4459,11 +4893,20 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 				}
 			}
 
+#if defined( USB_HOST_BT_ONLY )
+			// A second HCI interface descriptor is not valid.
+			if (pTempInterfaceList != NULL) {
+				error = TRUE;
+				continue;
+			}
+			newInterfaceInfo = NULL;
+#else
 			// We can support this interface.  See if we already have a USB_INTERFACE_INFO node for it.
 			newInterfaceInfo = pTempInterfaceList;
 			while ((newInterfaceInfo != NULL) && (newInterfaceInfo->interface != bInterfaceNumber)) {
 				newInterfaceInfo = newInterfaceInfo->next;
 			}
+#endif
 			if (newInterfaceInfo == NULL) {
 				// This is the first instance of this interface, so create a new node for it.
 				if ((newInterfaceInfo = (USB_INTERFACE_INFO *)USB_MALLOC( sizeof(USB_INTERFACE_INFO) )) == NULL) {
@@ -4519,8 +4962,10 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 					} else {
 						// Create an entry for the new endpoint.
 						if ((newEndpointInfo = (USB_ENDPOINT_INFO *)USB_MALLOC( sizeof(USB_ENDPOINT_INFO) )) == NULL) {
-							// Out of memory
+							// Out of memory (or enumeration arena full): fail the parse,
+							// the lists built so far are released below.
 							error = TRUE;
+							break;
 						}
 						newEndpointInfo->bEndpointAddress           = *ptr++;
 						newEndpointInfo->bmAttributes.val           = *ptr++;
@@ -4531,9 +4976,11 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 						newEndpointInfo->status.bfUseDTS            = 1;
 						newEndpointInfo->status.bfTransferComplete  = 1;  // Initialize to success to allow preprocessing loops.
 						newEndpointInfo->dataCount                  = 0;  // Initialize to 0 since we set bfTransferComplete.
+						newEndpointInfo->backoffFrames              = 0;
 						newEndpointInfo->transferState              = TSTATE_IDLE;
 						newEndpointInfo->clientDriver               = ClientDriver;
 
+#if !defined( USB_HOST_BT_ONLY )
 						// Special setup for isochronous endpoints.
 						if (newEndpointInfo->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_ISOCHRONOUS) {
 							// Validate and convert the interval to the number of frames.  The value must
@@ -4545,6 +4992,7 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 							// Disable DTS
 							newEndpointInfo->status.bfUseDTS = 0;
 						}
+#endif
 
 						// Initialize interval count
 						newEndpointInfo->wIntervalCount = newEndpointInfo->wInterval;
@@ -4620,6 +5068,18 @@ BOOL _USB_ParseConfigurationDescriptor( void )
 		DEBUG_PutString( "HOST: Parse Descriptor success\r\n" );
 
 		usbDeviceInfo.pInterfaceList = pTempInterfaceList;
+
+#if defined( USB_HOST_BT_ONLY )
+		// Build the fixed endpoint map of the HCI interface.
+		memset( usbEndpointMap, 0x00, sizeof(usbEndpointMap) );
+		newEndpointInfo = pTempInterfaceList->pCurrentSetting->pEndpointList;
+		while (newEndpointInfo != NULL) {
+			if ((newEndpointInfo->bEndpointAddress & 0x0F) < (USB_BT_ONLY_ENDPOINTS / 2)) {
+				usbEndpointMap[_USB_EndpointMapIndex( newEndpointInfo->bEndpointAddress )] = newEndpointInfo;
+			}
+			newEndpointInfo = newEndpointInfo->next;
+		}
+#endif
 		return TRUE;
 	}
 }
@@ -5176,6 +5636,11 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 		// BDT, which, in host mode, is always 0.  To get the endpoint, we either need to look
 		// at U1TOK, or trust that pCurrentEndpoint is still accurate.
 		if ((pCurrentEndpoint->bEndpointAddress & 0x0F) == (U1TOK & 0x0F)) {
+			usbBusStats.transactions ++;
+			if (usbFrameTransactions < 0xFF) {
+				usbFrameTransactions ++;
+			}
+
 			if (copyU1STATbits.DIR) {   // TX
 				// We are processing OUT or SETUP packets.
 				// Set up the BDT pointer for the transaction we just received.
@@ -5208,6 +5673,9 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 				// count when an ACK, DATA0, or DATA1 is received.
 				packetSize                  = pBDT->count;
 				pCurrentEndpoint->dataCount += packetSize;
+				usbBusStats.dataTransactions ++;
+				usbBusStats.bytes           += packetSize;
+				usbFrameData                = 1;
 
 				// Set the NAK retries for the next transaction;
 				pCurrentEndpoint->countNAKs = 0;
@@ -5250,6 +5718,9 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 				// count when an ACK, DATA0, or DATA1 is received.
 				packetSize                  = pBDT->count;
 				pCurrentEndpoint->dataCount += packetSize;
+				usbBusStats.dataTransactions ++;
+				usbBusStats.bytes           += packetSize;
+				usbFrameData                = 1;
 
 				// Set the NAK retries for the next transaction;
 				pCurrentEndpoint->countNAKs = 0;
@@ -5278,9 +5749,16 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 #endif
 
 				pCurrentEndpoint->countNAKs ++;
+				usbBusStats.naks ++;
 
 				switch( pCurrentEndpoint->bmAttributes.bfTransferType ) {
 				case USB_TRANSFER_TYPE_BULK:
+#ifndef ALLOW_MULTIPLE_NAKS_PER_FRAME
+					// An endpoint that keeps NAK'ing (idle ACL IN, full
+					// dongle on OUT) is left out of the next frames, so the
+					// frame goes to the endpoints that move data.
+					pCurrentEndpoint->backoffFrames = _USB_BulkBackoff( pCurrentEndpoint->countNAKs );
+#endif
 					// Bulk IN and OUT transfers are allowed to retry NAK'd
 					// transactions until a timeout (if enabled) or indefinitely
 					// (if NAK timeouts disabled).
@@ -5345,6 +5823,7 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 				// that the host has received it.  But the data is not actually received, and the application
 				// layer is not informed of the packet.
 				pCurrentEndpoint->status.bfErrorCount++;
+				usbBusStats.errors ++;
 
 				if (pCurrentEndpoint->status.bfErrorCount >= USB_TRANSACTION_RETRY_ATTEMPTS) {
 					// We have too many errors.
@@ -5387,6 +5866,17 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 
 		U1IR = USB_INTERRUPT_SOF; // Clear the interrupt by writing a '1' to the flag.
 
+		// Close the utilization counters of the frame that just ended.
+		usbBusStats.frames ++;
+		if (usbFrameData) {
+			usbBusStats.busyFrames ++;
+		}
+		if (usbFrameTransactions > usbBusStats.maxFrameTransactions) {
+			usbBusStats.maxFrameTransactions = usbFrameTransactions;
+		}
+		usbFrameTransactions = 0;
+		usbFrameData         = 0;
+
 		pInterface = usbDeviceInfo.pInterfaceList;
 		while (pInterface) {
 			if (pInterface->pCurrentSetting) {
@@ -5401,7 +5891,13 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 					}
 
 #ifndef ALLOW_MULTIPLE_NAKS_PER_FRAME
-					pEndpoint->status.bfLastTransferNAKd = 0;
+					if (pEndpoint->backoffFrames) {
+						// Still backing off: the NAK'd endpoint sits this frame out.
+						pEndpoint->backoffFrames--;
+						usbBusStats.backoffFrames ++;
+					} else {
+						pEndpoint->status.bfLastTransferNAKd = 0;
+					}
 #endif
 
 					pEndpoint = pEndpoint->next;
@@ -5438,6 +5934,7 @@ void __ISR(_USB_1_VECTOR, ipl4) _USB1Interrupt(void)
 		} else {
 			// Increment the error count.
 			pCurrentEndpoint->status.bfErrorCount++;
+			usbBusStats.errors ++;
 
 			if (pCurrentEndpoint->status.bfErrorCount >= USB_TRANSACTION_RETRY_ATTEMPTS) {
 				// We have too many errors.
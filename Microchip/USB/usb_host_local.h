@@ -374,6 +374,19 @@ HOLDING state machine values
 #define USB_RESUME_TIME                     (20+1)  // RESUME signaling time - 20 ms
 #define USB_RESUME_RECOVERY_TIME            (10+1)  // RESUME recovery time - 10 ms
 
+#if defined( USB_HOST_BT_ONLY )
+    // Bluetooth-only host: only the HCI interface is loaded and its endpoints
+    // (EP1 IN events, EP2 IN/OUT ACL data) are found through a fixed map.
+    #define USB_BT_ONLY_INTERFACE           0       // HCI interface number
+    #define USB_BT_ONLY_ENDPOINTS           6       // EP0 to EP2, IN and OUT
+    #define _USB_EndpointMapIndex(x)        ((((x) & 0x0F) << 1) | (((x) & 0x80) >> 7))
+#endif
+
+#if defined( USB_ENUM_ARENA_SIZE )
+    #define USB_ARENA_FREED                 0x8000  // Block size flag - the block was freed
+    #define USB_ARENA_NONE                  0xFFFF  // No previous block
+#endif
+
 
 //******************************************************************************
 //******************************************************************************
@@ -464,6 +477,7 @@ typedef struct _USB_ENDPOINT_INFO
     volatile BYTE               bErrorCode;                     // If bfError is set, this indicates the reason
     volatile WORD               countNAKs;                      // Count of NAK's of current transaction.
     WORD                        timeoutNAKs;                    // Count of NAK's for a timeout, if bfNAKTimeoutEnabled.
+    volatile BYTE               backoffFrames;                  // Frames a NAK'ing bulk endpoint is still left out.
 
 } USB_ENDPOINT_INFO;
 
@@ -500,6 +514,19 @@ typedef struct _USB_INTERFACE_INFO
 } USB_INTERFACE_INFO;
 
 
+// *****************************************************************************
+/* Enumeration Arena Block Header
+
+This header precedes each block of the enumeration arena.  The blocks are
+stacked, so a freed block is given back as soon as the blocks above it are.
+*/
+typedef struct _USB_ARENA_BLOCK
+{
+    WORD                size;       // Block size, header included.  USB_ARENA_FREED once freed.
+    WORD                previous;   // Offset of the block below, USB_ARENA_NONE for the first one.
+} USB_ARENA_BLOCK;
+
+
 // *****************************************************************************
 /* USB Device Information
 
@@ -659,11 +686,20 @@ void                 _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *
 void                 _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size );
 void                 _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, BYTE *pData, WORD size );
 void                 _USB_NotifyClients( BYTE DevAddress, USB_EVENT event, void *data, unsigned int size );
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+BOOL                 _USB_NotifyDataTransfer( void );
+#endif
 BOOL                 _USB_ParseConfigurationDescriptor( void );
 void                 _USB_ResetDATA0( BYTE endpoint );
 void                 _USB_SendToken( BYTE endpoint, BYTE tokenType );
 void                 _USB_SetBDT( BYTE  direction );
 BOOL                 _USB_TransferInProgress( void );
+BYTE                 _USB_BulkBackoff( WORD countNAKs );
+#if defined( USB_ENUM_ARENA_SIZE )
+void *               _USB_ArenaAlloc( WORD size );
+void                 _USB_ArenaFree( void *ptr );
+void                 _USB_ArenaReset( void );
+#endif
 
 
 #endif // _USB_HOST_LOCAL_
@@ -6,17 +6,22 @@ OBJS = \
 	BTApp.o \
 	debug.o \
 	PIC32/main.o \
+	PIC32/idle.o \
 	PIC32/usb_config.o	\
 	PIC32_USB/usb_host_bluetooth.o \
 	Bluetooth/bt_utils.o \
+	Bluetooth/bt_keystore.o \
+	Bluetooth/bt_snoop.o \
+	Bluetooth/bt_timer.o \
 	Bluetooth/hci.o \
 	Bluetooth/hci_usb.o \
+	Bluetooth/hci_h4.o \
 	Bluetooth/l2cap_2.o \
+	Bluetooth/l2cap_fcs.o \
 	Bluetooth/rfcomm.o \
 	Bluetooth/rfcomm_fcs.o \
 	Bluetooth/sdp.o \
 	Microchip/USB/usb_host.o \
-	Microchip/Common/TimeDelay.o \
 	\
 	xprintf.o	\
 	uart1.o 	\
@@ -0,0 +1,78 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include "GenericTypeDefs.h"
+#include "idle.h"
+#include "bt_timer.h"
+#include "bt_utils.h"
+#include "debug.h"
+
+static const IDLE_PORT *gpsIdlePort = NULL;
+static IDLE_STATS gsIdleStats;
+/*Core timer when the time was last accounted*/
+static DWORD gdwIdleMark = 0;
+
+void IDLE_init(const IDLE_PORT *psPort)
+{
+    ASSERT(NULL != psPort);
+    gpsIdlePort = psPort;
+    IDLE_resetStats();
+    gdwIdleMark = BT_getTicks();
+}
+
+BOOL IDLE_enter(void)
+{
+    DWORD dwNow, dwMs;
+    BOOL isSlept = FALSE;
+
+    ASSERT(NULL != gpsIdlePort);
+    dwNow = BT_getTicks();
+    gsIdleStats.qwActiveTicks += dwNow - gdwIdleMark;
+    gdwIdleMark = dwNow;
+
+    gpsIdlePort->arm();
+    /*Nothing the checks see can change until the sleep*/
+    gpsIdlePort->lock();
+    dwMs = BT_timerNextMs();
+    if(0 != dwMs && gpsIdlePort->isIdle())
+    {
+        if(dwMs > IDLE_MAX_MS)
+        {
+            dwMs = IDLE_MAX_MS;
+        }
+        dwNow = BT_getTicks();
+        gpsIdlePort->sleep(BT_usToTicks(dwMs * 1000UL));
+
+        gdwIdleMark = BT_getTicks();
+        gsIdleStats.qwIdleTicks += gdwIdleMark - dwNow;
+        ++gsIdleStats.dwWakeups;
+        isSlept = TRUE;
+    }
+    gpsIdlePort->unlock();
+    return isSlept;
+}
+
+const IDLE_STATS* IDLE_getStats(void)
+{
+    return &gsIdleStats;
+}
+
+void IDLE_resetStats(void)
+{
+    gsIdleStats.qwIdleTicks = 0;
+    gsIdleStats.qwActiveTicks = 0;
+    gsIdleStats.dwWakeups = 0;
+}
@@ -0,0 +1,66 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef __IDLE_H__
+#define __IDLE_H__
+
+#include "GenericTypeDefs.h"
+
+/*
+ * Idle decision of the main loop: when it has nothing to do and no
+ * protocol timer is due, the CPU sleeps until the next interrupt or the
+ * next protocol timer. The hardware is behind IDLE_PORT (the PIC32 one is
+ * in main.c, the host test simulates one).
+ *
+ * The wake interrupts are armed first, then the checks and the sleep run
+ * with the interrupts disabled: an interrupt raised after a check stays
+ * pending and ends the sleep at once, its handler runs when the
+ * interrupts are enabled again. No wakeup is lost.
+ */
+
+/*Longest sleep: the HCI scan, paging and sniff deadlines are polled*/
+#ifndef IDLE_MAX_MS
+#define IDLE_MAX_MS 50
+#endif
+
+typedef struct _IDLE_PORT
+{
+    /*Enable the wake interrupts, a wake event is pending from here on*/
+    void (*arm)(void);
+    /*Disable and enable the interrupts*/
+    void (*lock)(void);
+    void (*unlock)(void);
+    /*Nothing for the main loop to do (called with interrupts disabled)*/
+    BOOL (*isIdle)(void);
+    /*Sleep until an interrupt is pending or dwTicks elapsed*/
+    void (*sleep)(DWORD dwTicks);
+} IDLE_PORT;
+
+/*Time asleep and active (core timer ticks) since the last reset*/
+typedef struct _IDLE_STATS
+{
+    UINT64 qwIdleTicks;
+    UINT64 qwActiveTicks;
+    DWORD dwWakeups;
+} IDLE_STATS;
+
+void IDLE_init(const IDLE_PORT *psPort);
+/*End of a main loop pass: sleeps if there is nothing to do, TRUE if so*/
+BOOL IDLE_enter(void);
+const IDLE_STATS* IDLE_getStats(void);
+void IDLE_resetStats(void);
+
+#endif /*__IDLE_H__*/
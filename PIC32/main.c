@@ -4,7 +4,12 @@
 #include "PIC32_USB/usb_host_bluetooth.h"
 #include "BTApp.h"
 #include "xprintf.h"
+#include "uart1.h"
+#include "bt_snoop.h"
+#include "bt_timer.h"
+#include "bt_utils.h"
 #include "debug.h"
+#include "idle.h"
 
 // *****************************************************************************
 // *****************************************************************************
@@ -41,6 +46,15 @@
 #endif
 
 BT_DEVICE *gpsBTAPP = NULL;
+/*Stack instance of the controller (NULL until the device is created)*/
+#define APP_STACK() ((NULL != gpsBTAPP) ? gpsBTAPP->psStack : NULL)
+/*Set by the USB interrupt when a transfer of the dongle completed*/
+volatile BOOL gisUSBPending = FALSE;
+
+/*Sleeping needs the interrupt driven USB host, the H4 stream is polled*/
+#if !defined(HCI_TRANSPORT_H4) && defined(USB_HOST_APP_DATA_EVENT_HANDLER)
+#define IDLE_WAIT
+#endif
 
 DEBUG_PutChar() {}
 DEBUG_PutString(char *ptr) {}
@@ -79,6 +93,17 @@ void SysInit(){
     SIOInit();
 }
 
+/*Prints the heap high-water mark and the USB enumeration arena peak*/
+void MemReport()
+{
+    xprintf("MEM: heap %u B", BT_heapHighWater());
+#if !defined(HCI_TRANSPORT_H4) && defined(USB_ENUM_ARENA_SIZE)
+    xprintf(", USB arena %u/%u B", USBHostGetEnumArenaPeak(),
+            USB_ENUM_ARENA_SIZE);
+#endif
+    xprintf("\r\n");
+}
+
 /*APPLICATION USB EVENT HANDLER*/
 BOOL USB_ApplicationEventHandler ( BYTE address, USB_EVENT event, void *data, DWORD size )
 {
@@ -92,6 +117,15 @@ BOOL USB_ApplicationEventHandler ( BYTE address, USB_EVENT event, void *data, DW
                 ((BLUETOOTH_DEVICE_ID *)data)->deviceAddress = address;
                 DBG_INFO("Generic device connected, deviceAddress=%d\n", address);
                 BTAPP_Start(gpsBTAPP);
+#if defined(USB_HOST_APP_DATA_EVENT_HANDLER)
+                //The USB interrupt keeps the IN endpoints reading
+                USBHostBluetoothRxStart(address, USB_EP1,
+                        gpsBTAPP->sUSB.getEVTBuff(), MAX_EVT_R_BUFF_SIZE,
+                        EVENT_PACKET_LENGTH);
+                USBHostBluetoothRxStart(address, USB_EP2,
+                        gpsBTAPP->sUSB.getACLBuff(), MAX_ACL_R_BUFF_SIZE,
+                        DATA_PACKET_LENGTH);
+#endif
                 return TRUE;
             }
             break;
@@ -99,9 +133,16 @@ BOOL USB_ApplicationEventHandler ( BYTE address, USB_EVENT event, void *data, DW
         case EVENT_BLUETOOTH_DETACH:
             DBG_INFO("USB device disconnected\n");
             *(BYTE *)data   = 0;
+            BTAPP_Stop(gpsBTAPP);
+            MemReport();
             return TRUE;
 
         case EVENT_BLUETOOTH_TX2_DONE:
+            gpsBTAPP->sUSB.writeACLDone();
+            return TRUE;
+
+        case EVENT_BLUETOOTH_TX0_DONE:
+            gpsBTAPP->sUSB.writeCTLDone();
             return TRUE;
 
         case EVENT_BLUETOOTH_RX1_DONE:
@@ -173,6 +214,51 @@ BOOL USB_ApplicationEventHandler ( BYTE address, USB_EVENT event, void *data, DW
 
 } // USB_ApplicationEventHandler
 
+#if defined(USB_HOST_APP_DATA_EVENT_HANDLER)
+/*USB interrupt: a transfer of the dongle completed, the data waits in the
+  client driver until the main loop hands it to the stack*/
+BOOL USB_ApplicationDataEventHandler ( BYTE address, USB_EVENT event, void *data, DWORD size )
+{
+    gisUSBPending = TRUE;
+    return TRUE;
+}
+
+/*Hands the transfers the USB interrupt completed to the stack*/
+void USBScan()
+{
+    BYTE bDevAddr = USBHostBluetoothGetDeviceAddress();
+    BYTE *pBuff = NULL;
+    DWORD dwLen;
+
+    if (bDevAddr != 0)
+    {
+        //Start the reads the interrupt could not (device being configured)
+        USBHostBluetoothRxArm(bDevAddr);
+        if(gisUSBPending)
+        {
+            gisUSBPending = FALSE;
+            //Events first, they return the controller ACL buffers and open
+            //the link the ACL is for (ACL of a link that closed is dropped)
+            while(NULL != (pBuff = USBHostBluetoothRxGet(bDevAddr, USB_EP1, &dwLen)))
+            {
+                gpsBTAPP->sUSB.readEVT(pBuff, dwLen);
+                USBHostBluetoothRxRelease(bDevAddr, USB_EP1);
+            }
+            while(NULL != (pBuff = USBHostBluetoothRxGet(bDevAddr, USB_EP2, &dwLen)))
+            {
+                gpsBTAPP->sUSB.readACL(pBuff, dwLen);
+                USBHostBluetoothRxRelease(bDevAddr, USB_EP2);
+            }
+            if(USBHostBluetoothTxDone(bDevAddr) & USB_BLUETOOTH_TX_ACL_DONE)
+            {
+                gpsBTAPP->sUSB.writeACLDone();
+            }
+        }
+        //Maintain the Bluetooth stack (link power policy)
+        gpsBTAPP->tasks();
+    }
+}
+#else
 /*Scans the USB Port*/
 void USBScan()
 {
@@ -192,8 +278,191 @@ void USBScan()
             pBuff = gpsBTAPP->sUSB.getACLBuff();
             USBHostBluetoothRead_EP2(bDevAddr,pBuff, DATA_PACKET_LENGTH );
 	}
+        //Maintain the Bluetooth stack (link power policy)
+        gpsBTAPP->tasks();
     }
 }
+#endif
+
+
+#if !defined(HCI_TRANSPORT_H4)
+/*Prints how the USB frames were used since the last report*/
+void USBStatsReport()
+{
+    USB_BUS_STATS sStats;
+
+    USBHostGetBusStats(&sStats);
+    USBHostClearBusStats();
+    xprintf("USB: %lu frames, %lu with data, %lu tokens (max %u/frame)\r\n",
+            sStats.frames, sStats.busyFrames, sStats.transactions,
+            sStats.maxFrameTransactions);
+    xprintf("USB: %lu data, %lu NAK, %lu errors, %lu B, %lu back-off\r\n",
+            sStats.dataTransactions, sStats.naks, sStats.errors, sStats.bytes,
+            sStats.backoffFrames);
+}
+#endif
+
+/*
+ * Low-power idle: when the USB host, the stack, the protocol timers, the
+ * console and the switch have nothing to do, the CPU waits for the next
+ * interrupt in the Idle mode (OSCCON.SLPEN left clear: the USB module and
+ * the UART keep running). The USB interrupt, a console byte, the switch
+ * changing (change notice) and the core timer (next protocol timer) wake it.
+ */
+
+/*Wake sources: each one masks itself, IdleEnter enables them again*/
+void __attribute__((interrupt,nomips16,noinline)) _CoreTimerInterrupt()
+{
+    IEC0CLR = _IEC0_CTIE_MASK;
+    IFS0CLR = _IFS0_CTIF_MASK;
+}
+
+void __attribute__((interrupt,nomips16,noinline)) _UART1Interrupt()
+{
+    //The byte and its flag are left for KeyScan
+    IEC1CLR = _IEC1_U1RXIE_MASK;
+}
+
+void __attribute__((interrupt,nomips16,noinline)) _CNInterrupt()
+{
+    //The main loop reads the switch
+    IEC1CLR = _IEC1_CNBIE_MASK;
+}
+
+#if defined(IDLE_WAIT)
+/*Switch state the main loop last saw*/
+static unsigned int guIdleSwState = 1;
+
+static void IdleArm(void)
+{
+    //From here on a byte or a switch change is pending on its flag
+    (void) PORTB;
+    IFS1CLR = _IFS1_CNBIF_MASK;
+    IEC1SET = _IEC1_U1RXIE_MASK | _IEC1_CNBIE_MASK;
+}
+
+static void __attribute__((nomips16)) IdleLock(void)
+{
+    asm volatile("di");
+    asm volatile("ehb");
+}
+
+static void __attribute__((nomips16)) IdleUnlock(void)
+{
+    asm volatile("ei");
+}
+
+/*Nothing to do until the next interrupt (called with interrupts disabled)*/
+static BOOL IdleReady(void)
+{
+    return !gisUSBPending && USBHostIsIdle() &&
+           USBHostBluetoothRxIsIdle(USBHostBluetoothGetDeviceAddress()) &&
+           !UART1IsPressed() && !U1STAbits.URXDA &&
+           !BT_snoopExportPending(APP_STACK()) &&
+           PORTBbits.RB7 == guIdleSwState;
+}
+
+/*
+ * An enabled source wakes the CPU from WAIT even with the interrupts
+ * disabled, so an interrupt raised after IdleReady ends the WAIT at once
+ */
+static void __attribute__((nomips16)) IdleSleep(DWORD dwTicks)
+{
+    _CP0_SET_COMPARE(BT_getTicks() + dwTicks);
+    IFS0CLR = _IFS0_CTIF_MASK;
+    IEC0SET = _IEC0_CTIE_MASK;
+    asm volatile("wait");
+}
+
+static const IDLE_PORT gsIdlePort =
+        {&IdleArm, &IdleLock, &IdleUnlock, &IdleReady, &IdleSleep};
+
+void IdleInit()
+{
+    IPC0bits.CTIP = 2;
+    IPC8bits.U1IP = 2;
+    IPC8bits.CNIP = 2;
+    //Change notice on the switch (RB7)
+    CNCONBbits.ON = 1;
+    CNENBbits.CNIEB7 = 1;
+    IDLE_init(&gsIdlePort);
+}
+
+/*Sleeps until the next interrupt if the main loop has nothing to do*/
+void IdleEnter(unsigned int uSwState)
+{
+    guIdleSwState = uSwState;
+    IDLE_enter();
+}
+
+/*Prints the time asleep and active since the last report*/
+void IdleReport()
+{
+    const IDLE_STATS *psStats = IDLE_getStats();
+    DWORD dwMsTicks = BT_usToTicks(1000UL);
+
+    xprintf("PWR: %lu ms asleep, %lu ms active, %lu wakeups\r\n",
+            (DWORD) (psStats->qwIdleTicks / dwMsTicks),
+            (DWORD) (psStats->qwActiveTicks / dwMsTicks), psStats->dwWakeups);
+    IDLE_resetStats();
+}
+#endif
+
+/*Console keys: 'S' (re)starts the HCI capture export, 'U' reports the USB
+  bus utilization, 'M' the memory high-water marks, 'P' the time asleep.
+  The reports are dropped while the capture is being exported*/
+void KeyScan()
+{
+    if(!UART1IsPressed())
+    {
+        return;
+    }
+    switch(UART1GetChar())
+    {
+#if defined(BT_SNOOP_ENABLE)
+        case 'S':
+            BT_snoopExportStart(APP_STACK());
+            break;
+#endif
+#if !defined(HCI_TRANSPORT_H4)
+        case 'U':
+            USBStatsReport();
+            break;
+#endif
+        case 'M':
+            MemReport();
+            break;
+#if defined(IDLE_WAIT)
+        case 'P':
+            IdleReport();
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+#if defined(BT_SNOOP_ENABLE)
+/*
+ * Streams the HCI capture (btsnoop) to the UART. The exporter owns the
+ * transmitter until the capture is out: the console reports, the debug
+ * output and the SPP data echoed by BTApp are dropped meanwhile, a byte of
+ * them would corrupt the file. With the default ring (512 B, snaplen 24)
+ * the capture holds only the last 16 or so packets.
+ */
+void SnoopScan()
+{
+    BYTE bOut;
+
+    UART1Claim(BT_snoopExportPending(APP_STACK()));
+    //Only what fits in the TX FIFO, never wait for the UART
+    while(!U1STAbits.UTXBF && BT_snoopExport(APP_STACK(), &bOut, 1))
+    {
+        U1TXREG = bOut;
+    }
+    UART1Claim(BT_snoopExportPending(APP_STACK()));
+}
+#endif
 
 
 int main ( void )
@@ -202,9 +471,22 @@ int main ( void )
         unsigned int last_sw2_state = 1;
     //Initialise the system
     SysInit();
+#if defined(IDLE_WAIT)
+    IdleInit();
+#endif
 	
 	xfunc_out=UART1PutChar;
 
+    //The main loop and the USB events drive this device: nothing runs without it
+    if ( !BTAPP_Initialise(&gpsBTAPP) )
+    {
+        DBG_ERROR( "No room for the Bluetooth stack: HALT\n" );
+        while (1);
+    }
+#if defined(HCI_TRANSPORT_H4)
+    //The serial controller is always there: start the stack now
+    BTAPP_Start(gpsBTAPP);
+#else
     //Initialise the USB Host
     if ( USBHostInit(0) == TRUE )
     {
@@ -214,13 +496,14 @@ int main ( void )
     {
         DBG_INFO( "Unable to initialise the USB: HALT\n" );
     }
-
-    DelayMs(100);
-    BTAPP_Initialise(&gpsBTAPP);
+#endif
     DBG_INFO( "USB-Bluetooth Dongle Demo v1\n" );
     //Main loop
     while (1)
     {
+        //Everything below (USB events included) drives this device's stack
+        BT_stackSelect(gpsBTAPP->psStack);
+
         if(PORTBbits.RB7 == 0)					// 0 = switch is pressed
         {
             PORTSetBits(IOPORT_B, BIT_15);			// RED LED = on (same as LATDSET = 0x0001)
@@ -264,9 +547,26 @@ int main ( void )
         }
 #endif
 
+#if defined(HCI_TRANSPORT_H4)
+        //Maintain the Bluetooth stack (H4 stream included)
+        gpsBTAPP->tasks();
+#else
         //Maintain the USB status
         USBHostTasks();
         //Maintain the application
         USBScan();
+#endif
+        //Protocol timeouts and deferred work of every stack instance
+        BT_timerRun();
+        //Console commands
+        KeyScan();
+#if defined(BT_SNOOP_ENABLE)
+        //Export the HCI capture in the background
+        SnoopScan();
+#endif
+#if defined(IDLE_WAIT)
+        //Sleep until the next interrupt when there is nothing to do
+        IdleEnter(last_sw_state);
+#endif
     }
 }
@@ -49,6 +49,9 @@ CLIENT_DRIVER_TABLE usbClientDrvTable[] =
     {
         USBHostBluetoothInit,
         USBHostBluetoothEventHandler,
+#ifdef USB_HOST_APP_DATA_EVENT_HANDLER
+        USBHostBluetoothDataEventHandler,
+#endif
         0
     }
 };
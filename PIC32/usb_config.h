@@ -56,9 +56,18 @@ DEFENSE THEREOF), OR OTHER SIMILAR COSTS.
 #define USB_SUPPORT_BULK_TRANSFERS
 #define USB_NUM_INTERRUPT_NAKS 3
 #define USB_NUM_BULK_NAKS 20
+// Idle ACL IN endpoint: poll it less often after 8 NAK'd frames, at most every 4th frame
+#define USB_BULK_NAK_BACKOFF_STEP 8
+#define USB_BULK_NAK_BACKOFF_MAX 3
 #define USB_INITIAL_VBUS_CURRENT (100/2)
-#define USB_INSERT_TIME (250+1)
+// Bluetooth dongle only: HCI interface alone, fixed endpoint map
+#define USB_HOST_BT_ONLY
+#define USB_INSERT_TIME (100+1)
+// Enumeration data comes from its own arena (bytes), released on detach
+#define USB_ENUM_ARENA_SIZE 640
 #define USB_HOST_APP_EVENT_HANDLER USB_ApplicationEventHandler
+// Transfer completions handled in the USB interrupt (data events)
+#define USB_HOST_APP_DATA_EVENT_HANDLER USB_ApplicationDataEventHandler
 
 #define USBTasks()                  \
     {                               \
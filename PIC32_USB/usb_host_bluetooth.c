@@ -15,6 +15,12 @@
 
 BLUETOOTH_DEVICE  gc_DevData;
 
+// The interrupt updates the receive rings: keep it out while the main loop does
+#define _BT_USB_LOCK(s)     { (s) = IEC1bits.USBIE; IEC1CLR = _IEC1_USBIE_MASK; }
+#define _BT_USB_UNLOCK(s)   { if (s) IEC1SET = _IEC1_USBIE_MASK; }
+
+static void _USBHostBluetoothRxArm( BLUETOOTH_RX_RING *pRing, BYTE endpoint );
+
 BOOL USBHostBluetoothInit ( BYTE address, DWORD flags, BYTE clientDriverID )
 {
     BYTE *pDesc;
@@ -23,6 +29,9 @@ BOOL USBHostBluetoothInit ( BYTE address, DWORD flags, BYTE clientDriverID )
     gc_DevData.rxEvtLength     = 0;
     gc_DevData.rxAclLength     = 0;
     gc_DevData.flags.val = 0;
+    memset(&gc_DevData.rxEvtRing, 0, sizeof(BLUETOOTH_RX_RING));
+    memset(&gc_DevData.rxAclRing, 0, sizeof(BLUETOOTH_RX_RING));
+    gc_DevData.txDone = 0;
 
     // Save device the address, VID, & PID
     gc_DevData.ID.deviceAddress = address;
@@ -76,6 +85,9 @@ BOOL USBHostBluetoothEventHandler ( BYTE address, USB_EVENT event, void *data, D
             USB_HOST_APP_EVENT_HANDLER(gc_DevData.ID.deviceAddress, EVENT_BLUETOOTH_DETACH, &gc_DevData.ID.deviceAddress, sizeof(BYTE) );
             gc_DevData.flags.val        = 0;
             gc_DevData.ID.deviceAddress = 0;
+            // The pending reads are gone with the device
+            memset(&gc_DevData.rxEvtRing, 0, sizeof(BLUETOOTH_RX_RING));
+            memset(&gc_DevData.rxAclRing, 0, sizeof(BLUETOOTH_RX_RING));
             #ifdef USBHOSTBT_DEBUG
                 SIOPrintString( "USB Host Bluetooth Device Detached: address=" );
                 SIOPutDec( address );
@@ -108,6 +120,11 @@ BOOL USBHostBluetoothEventHandler ( BYTE address, USB_EVENT event, void *data, D
                     gc_DevData.flags.txAclBusy = 0;
                     USB_HOST_APP_EVENT_HANDLER(gc_DevData.ID.deviceAddress, EVENT_BLUETOOTH_TX2_DONE, &dataCount, sizeof(DWORD) );
                 }
+                else if ( ((HOST_TRANSFER_DATA *)data)->bEndpointAddress == 0 )
+                {
+                    gc_DevData.flags.txCtlBusy = 0;
+                    USB_HOST_APP_EVENT_HANDLER(gc_DevData.ID.deviceAddress, EVENT_BLUETOOTH_TX0_DONE, &dataCount, sizeof(DWORD) );
+                }
                 else
                 {
                     return FALSE;
@@ -128,6 +145,83 @@ BOOL USBHostBluetoothEventHandler ( BYTE address, USB_EVENT event, void *data, D
     return FALSE;
 } // USBHostBluetoothEventHandler
 
+/* GVG: Bulk and interrupt completions, called from the USB interrupt. The
+   filled buffer is queued for the main loop and the endpoint is read again
+   into the next free buffer, the bus does not wait for USBHostTasks(). */
+#if defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+BOOL USBHostBluetoothDataEventHandler ( BYTE address, USB_EVENT event, void *data, DWORD size )
+{
+    HOST_TRANSFER_DATA *pTransfer = (HOST_TRANSFER_DATA *)data;
+    BLUETOOTH_RX_RING  *pRing;
+    BYTE                endpoint;
+    USB_EVENT           doneEvent;
+
+    if ( address != gc_DevData.ID.deviceAddress || event != EVENT_TRANSFER ||
+         data == NULL || size != sizeof(HOST_TRANSFER_DATA) )
+    {
+        return FALSE;
+    }
+
+    switch (pTransfer->bEndpointAddress)
+    {
+        case USB_IN_EP|USB_EP1:
+            pRing     = &gc_DevData.rxEvtRing;
+            endpoint  = USB_EP1;
+            doneEvent = EVENT_BLUETOOTH_RX1_DONE;
+            break;
+
+        case USB_IN_EP|USB_EP2:
+            pRing     = &gc_DevData.rxAclRing;
+            endpoint  = USB_EP2;
+            doneEvent = EVENT_BLUETOOTH_RX2_DONE;
+            break;
+
+        case USB_OUT_EP|USB_EP2:
+            gc_DevData.flags.txAclBusy = 0;
+            gc_DevData.txDone |= USB_BLUETOOTH_TX_ACL_DONE;
+            USB_HOST_APP_DATA_EVENT_HANDLER(address, EVENT_BLUETOOTH_TX2_DONE, &pTransfer->dataCount, sizeof(DWORD) );
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+
+    // Reads started with USBHostBluetoothRead_EPx go through the event queue
+    if (pRing->bCount == 0)
+    {
+        return FALSE;
+    }
+    pRing->bArmed = 0;
+    // An empty read leaves the buffer free for the next one
+    if (pTransfer->dataCount != 0)
+    {
+        pRing->adwLength[(pRing->bHead + pRing->bFilled) % pRing->bCount] = pTransfer->dataCount;
+        ++pRing->bFilled;
+        USB_HOST_APP_DATA_EVENT_HANDLER(address, doneEvent, &pTransfer->dataCount, sizeof(DWORD) );
+    }
+    _USBHostBluetoothRxArm( pRing, endpoint );
+    return TRUE;
+} // USBHostBluetoothDataEventHandler
+#endif
+
+/* GVG: Reads the endpoint into the next free buffer of its ring (the caller
+   keeps the USB interrupt out) */
+static void _USBHostBluetoothRxArm( BLUETOOTH_RX_RING *pRing, BYTE endpoint )
+{
+    BYTE bSlot;
+
+    if (pRing->bArmed || pRing->bCount == 0 || pRing->bFilled >= pRing->bCount)
+    {
+        return;
+    }
+    bSlot = (pRing->bHead + pRing->bFilled) % pRing->bCount;
+    if (USBHostRead( gc_DevData.ID.deviceAddress, USB_IN_EP|endpoint,
+            pRing->pBuffer + (WORD)bSlot * pRing->wSize, pRing->wSize ) == USB_SUCCESS)
+    {
+        pRing->bArmed = 1;
+    }
+}
+
 // *****************************************************************************
 // *****************************************************************************
 // Section: Application Callable Functions
@@ -218,7 +312,6 @@ BYTE USBHostBluetoothWrite_EP0( BYTE deviceAddress, void *buffer, DWORD length )
     if (RetVal != USB_SUCCESS)
     {
         gc_DevData.flags.txCtlBusy = 0;    // Clear flag to allow re-try
-        DelayMs(1);
     }
 
     return RetVal;
@@ -240,7 +333,6 @@ BYTE USBHostBluetoothWrite_EP1( BYTE deviceAddress, void *buffer, DWORD length )
     if (RetVal != USB_SUCCESS)
     {
         gc_DevData.flags.txAclBusy = 0;    // Clear flag to allow re-try
-        DelayMs(1);
     }
 
     return RetVal;
@@ -262,7 +354,6 @@ BYTE USBHostBluetoothWrite_EP2( BYTE deviceAddress, void *buffer, DWORD length )
     if (RetVal != USB_SUCCESS)
     {
         gc_DevData.flags.txAclBusy = 0;    // Clear flag to allow re-try
-        DelayMs(1);
     }
 
     return RetVal;
@@ -273,3 +364,116 @@ BYTE USBHostBluetoothGetDeviceAddress(){
 	return gc_DevData.ID.deviceAddress;
 }
 
+/* GVG: Hands count buffers of size bytes to the EP1 or EP2 receive ring and
+   starts reading into them */
+BOOL USBHostBluetoothRxStart( BYTE deviceAddress, BYTE endpoint, BYTE *buffers, BYTE count, WORD size )
+{
+    BLUETOOTH_RX_RING *pRing;
+    UINT32 intState;
+
+    if (!API_VALID(deviceAddress)) return FALSE;
+    if (count == 0 || count > USB_BLUETOOTH_RX_BUFFERS) return FALSE;
+    if (endpoint == USB_EP1)
+    {
+        pRing = &gc_DevData.rxEvtRing;
+    }
+    else if (endpoint == USB_EP2)
+    {
+        pRing = &gc_DevData.rxAclRing;
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    _BT_USB_LOCK(intState);
+    pRing->pBuffer = buffers;
+    pRing->wSize   = size;
+    pRing->bCount  = count;
+    pRing->bHead   = 0;
+    pRing->bFilled = 0;
+    _USBHostBluetoothRxArm( pRing, endpoint );
+    _BT_USB_UNLOCK(intState);
+    return TRUE;
+}
+
+/* GVG: Retries the reads that could not be started (device still being
+   configured) */
+void USBHostBluetoothRxArm( BYTE deviceAddress )
+{
+    UINT32 intState;
+
+    if (!API_VALID(deviceAddress)) return;
+    _BT_USB_LOCK(intState);
+    _USBHostBluetoothRxArm( &gc_DevData.rxEvtRing, USB_EP1 );
+    _USBHostBluetoothRxArm( &gc_DevData.rxAclRing, USB_EP2 );
+    _BT_USB_UNLOCK(intState);
+}
+
+/* GVG: TRUE when both endpoints are reading and no buffer waits for the main
+   loop: only the USB interrupt can bring new work */
+BOOL USBHostBluetoothRxIsIdle( BYTE deviceAddress )
+{
+    BLUETOOTH_RX_RING *pRing;
+    BYTE i;
+
+    if (!API_VALID(deviceAddress)) return TRUE;
+    for (i = 0; i < 2; i++)
+    {
+        pRing = (i == 0) ? &gc_DevData.rxEvtRing : &gc_DevData.rxAclRing;
+        if (pRing->bFilled != 0 || (pRing->bCount != 0 && !pRing->bArmed))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* GVG: Oldest filled buffer of the endpoint (NULL if none), it stays owned
+   by the caller until USBHostBluetoothRxRelease */
+BYTE* USBHostBluetoothRxGet( BYTE deviceAddress, BYTE endpoint, DWORD *length )
+{
+    BLUETOOTH_RX_RING *pRing;
+
+    if (!API_VALID(deviceAddress)) return NULL;
+    pRing = (endpoint == USB_EP1) ? &gc_DevData.rxEvtRing : &gc_DevData.rxAclRing;
+    if (pRing->bFilled == 0) return NULL;
+
+    *length = pRing->adwLength[pRing->bHead];
+    return pRing->pBuffer + (WORD)pRing->bHead * pRing->wSize;
+}
+
+/* GVG: The oldest buffer was consumed: free it and read into it again if the
+   endpoint was waiting for room */
+void USBHostBluetoothRxRelease( BYTE deviceAddress, BYTE endpoint )
+{
+    BLUETOOTH_RX_RING *pRing;
+    UINT32 intState;
+
+    if (!API_VALID(deviceAddress)) return;
+    pRing = (endpoint == USB_EP1) ? &gc_DevData.rxEvtRing : &gc_DevData.rxAclRing;
+
+    _BT_USB_LOCK(intState);
+    if (pRing->bFilled != 0)
+    {
+        pRing->bHead = (pRing->bHead + 1) % pRing->bCount;
+        --pRing->bFilled;
+    }
+    _USBHostBluetoothRxArm( pRing, endpoint );
+    _BT_USB_UNLOCK(intState);
+}
+
+/* GVG: Write completions seen by the interrupt since the last call */
+BYTE USBHostBluetoothTxDone( BYTE deviceAddress )
+{
+    BYTE bDone;
+    UINT32 intState;
+
+    if (!API_VALID(deviceAddress)) return 0;
+    _BT_USB_LOCK(intState);
+    bDone = gc_DevData.txDone;
+    gc_DevData.txDone = 0;
+    _BT_USB_UNLOCK(intState);
+    return bDone;
+}
+
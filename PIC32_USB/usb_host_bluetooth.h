@@ -46,6 +46,18 @@
 #define EVENT_BLUETOOTH_RX1_DONE (EVENT_GENERIC_BASE+EVENT_BLUETOOTH_OFFSET+3)	
 #define EVENT_BLUETOOTH_RX2_DONE (EVENT_GENERIC_BASE+EVENT_BLUETOOTH_OFFSET+4)
 
+        // This event indicates that a previous control (EP0) write request
+        // has completed, so the next HCI command can be issued.
+#define EVENT_BLUETOOTH_TX0_DONE (EVENT_GENERIC_BASE+EVENT_BLUETOOTH_OFFSET+5)
+
+        // Most receive buffers of one IN endpoint (see USBHostBluetoothRxStart)
+#ifndef USB_BLUETOOTH_RX_BUFFERS
+#define USB_BLUETOOTH_RX_BUFFERS 2
+#endif
+
+        // Write completions returned by USBHostBluetoothTxDone
+#define USB_BLUETOOTH_TX_ACL_DONE 0x01
+
 // *****************************************************************************
 /* Generic Device ID Information
 
@@ -59,6 +71,26 @@ typedef struct _BLUETOOTH_DEVICE_ID
 } BLUETOOTH_DEVICE_ID;
 
 
+// *****************************************************************************
+/* Receive Ring
+
+When USB_HOST_APP_DATA_EVENT_HANDLER is defined, the IN endpoints are serviced
+from the USB interrupt: a completed read is stored in the ring and the endpoint
+is read again into the next free buffer straight away.  The main loop takes
+the filled buffers in order and releases them once the stack consumed them.
+*/
+typedef struct _BLUETOOTH_RX_RING
+{
+    BYTE               *pBuffer;        // bCount buffers of wSize bytes
+    WORD                wSize;
+    BYTE                bCount;
+    volatile BYTE       bHead;          // Oldest filled buffer
+    volatile BYTE       bFilled;        // Buffers waiting for the main loop
+    volatile BYTE       bArmed;         // A read is pending on the endpoint
+    DWORD               adwLength[USB_BLUETOOTH_RX_BUFFERS];
+} BLUETOOTH_RX_RING;
+
+
 // *****************************************************************************
 /* Generic Device Information
 
@@ -85,10 +117,15 @@ typedef struct _BLUETOOTH_DEVICE
         };
     } flags;                            // Generic client driver status flags
 
+    BLUETOOTH_RX_RING   rxEvtRing;      // EP1 (HCI events)
+    BLUETOOTH_RX_RING   rxAclRing;      // EP2 (ACL data)
+    volatile BYTE       txDone;         // USB_BLUETOOTH_TX_* seen by the interrupt
+
 } BLUETOOTH_DEVICE;
 
 BOOL USBHostBluetoothInit ( BYTE address, DWORD flags, BYTE clientDriverID );
 BOOL USBHostBluetoothEventHandler ( BYTE address, USB_EVENT event, void *data, DWORD size );
+BOOL USBHostBluetoothDataEventHandler ( BYTE address, USB_EVENT event, void *data, DWORD size );
 
 //BOOL USB_ApplicationEventHandler ( BYTE address, USB_EVENT event, void *data, DWORD size );
 
@@ -152,4 +189,12 @@ BYTE USBHostBluetoothWrite_EP2( BYTE deviceAddress, void *buffer, DWORD length);
 
 BYTE USBHostBluetoothGetDeviceAddress();
 
+// Interrupt driven reception (USB_HOST_APP_DATA_EVENT_HANDLER defined)
+BOOL USBHostBluetoothRxStart( BYTE deviceAddress, BYTE endpoint, BYTE *buffers, BYTE count, WORD size );
+void USBHostBluetoothRxArm( BYTE deviceAddress );
+BOOL USBHostBluetoothRxIsIdle( BYTE deviceAddress );
+BYTE* USBHostBluetoothRxGet( BYTE deviceAddress, BYTE endpoint, DWORD *length );
+void USBHostBluetoothRxRelease( BYTE deviceAddress, BYTE endpoint );
+BYTE USBHostBluetoothTxDone( BYTE deviceAddress );
+
 #endif //#ifndef __USBHostBluetooth_H__
@@ -85,7 +85,7 @@ void DBG_error(UINT uClass, CHAR *pszString, ...)
 }
 #endif
 
-void DBG_dump(UINT uClass, BYTE *pData, UINT uLen)
+void DBG_dump(UINT uClass, const BYTE *pData, UINT uLen)
 {
     if ((uClass & DBG_MASK) && (DBG_INFO >= DBG_LEVEL))
     {
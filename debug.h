@@ -56,9 +56,9 @@ enum
 #define DEBUG_PHY (DBG_MASK & DBG_CLASS_PHY)
 
 #if DBG_ENABLE == TRUE
-    /*
-    void DBG_dump(UINT uClass, BYTE *pData, UINT uLen);
+    void DBG_dump(UINT uClass, const BYTE *pData, UINT uLen);
     void DBG_trace(UINT uClass, CHAR *pszFile, INT iLine);
+    /*
     void DBG_info(UINT uClass, CHAR *pszString, ...);
     void DBG_exInfo(UINT uClass, CHAR *pszString, ...);
     void DBG_warn(UINT uClass, CHAR *pszString, ...);
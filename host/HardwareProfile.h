@@ -0,0 +1,40 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef _HARDWARE_PROFILE_H_
+#define _HARDWARE_PROFILE_H_
+
+/*
+ * Host builds: the board the stack sees when it runs on a PC (host_port.c).
+ */
+
+#include <stdlib.h>
+#include "GenericTypeDefs.h"
+#include "xprintf.h"
+
+/*Same clock as the PIC32MX220F032B board, the core timer at half of it*/
+#define GetSystemClock() 40000000UL
+
+/*Core timer: the host monotonic clock plus the simulated time skipped*/
+DWORD ReadCoreTimer(void);
+void HOST_clockAdvanceUs(DWORD dwUs);
+
+/*Serial IO: the standard output*/
+void HOST_putChar(BYTE bChar);
+
+#define SIOPutChar HOST_putChar
+
+#endif
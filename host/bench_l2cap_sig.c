@@ -0,0 +1,146 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "HardwareProfile.h"
+#include "loopback.h"
+#include "bt_utils.h"
+#include "l2cap_2.h"
+
+/*
+ * Signalling parser benchmark: once the loopback link is up, the sensor
+ * (stack 1) is fed C-frames packing 1 to 32 INFORMATION_REQUESTs, as a
+ * peer batching its requests sends them. Every command must be answered
+ * (one INFORMATION_RESPONSE on air each), a C-frame cut in the middle of
+ * a command must get the commands before the cut answered. It reports
+ * the L2CAP cycles per command, parsing and answering, the sending of
+ * the answers by the HCI excluded: host cycles scaled to the 40 MHz core
+ * timer, as in bench_loopback.
+ */
+
+#define BENCH_SIG_COMMANDS 1024
+#define BENCH_SIG_MAX_PACK 32
+#define BENCH_TIMEOUT_MS 60000
+
+static const VCTRL_MODEL gsBenchModel = {8, 1021, 500,
+        {0x03, 0, 0, 0x06, 0x80, 0x01, 0, 0}};
+
+static DWORD gdwBenchExpected;
+
+/*
+ * Benchmark private functions
+ */
+
+static BOOL _BENCH_isConfigured(void)
+{
+    return gasLoopback[0].isConfigured && gasLoopback[1].isConfigured;
+}
+
+static BOOL _BENCH_isDataOpen(void)
+{
+    return LOOPBACK_isDataOpen(0);
+}
+
+static BOOL _BENCH_isAnswered(void)
+{
+    return gasLoopback[1].sCtrl.dwAclTx >= gdwBenchExpected;
+}
+
+/*C-frame of uCommands INFORMATION_REQUESTs, its length*/
+static UINT _BENCH_frame(BYTE *pFrame, UINT uCommands)
+{
+    UINT i, uOffset = L2CAP_HDR_LEN;
+
+    for(i = 0; i < uCommands; ++i)
+    {
+        pFrame[uOffset] = L2CAP_INFO_REQ;
+        pFrame[uOffset + 1] = (BYTE) (i + 1);
+        BT_storeLE16(L2CAP_INFO_REQ_SIZE, pFrame, uOffset + 2);
+        BT_storeLE16((i & 1) ? L2CAP_INFO_EXTENDED_FEATURES :
+                L2CAP_INFO_CONNECTIONLESS_MTU, pFrame,
+                uOffset + L2CAP_SIGHDR_LEN);
+        uOffset += L2CAP_SIGHDR_LEN + L2CAP_INFO_REQ_SIZE;
+    }
+    BT_storeLE16(uOffset - L2CAP_HDR_LEN, pFrame, 0);
+    BT_storeLE16(L2CAP_SIG_CID, pFrame, 2);
+    return uOffset;
+}
+
+/*Feed the frame, TRUE when every command in it was answered*/
+static BOOL _BENCH_feed(const BYTE *pFrame, UINT uLen, UINT uAnswers)
+{
+    gdwBenchExpected = gasLoopback[1].sCtrl.dwAclTx + uAnswers;
+    LOOPBACK_select(1);
+    gasLoopback[1].sL2CAP.putData(pFrame, uLen, FALSE);
+    return LOOPBACK_runUntil(&_BENCH_isAnswered, BENCH_TIMEOUT_MS) &&
+           gasLoopback[1].sCtrl.dwAclTx == gdwBenchExpected;
+}
+
+int main(void)
+{
+    BYTE aFrame[L2CAP_HDR_LEN + BENCH_SIG_MAX_PACK *
+            (L2CAP_SIGHDR_LEN + L2CAP_INFO_REQ_SIZE)];
+    const BT_PROFILE *psProfile;
+    UINT uPack, uLen, i;
+
+    printf("L2CAP signalling\n");
+    if(!LOOPBACK_open(&gsBenchModel) ||
+       !LOOPBACK_runUntil(&_BENCH_isConfigured, BENCH_TIMEOUT_MS))
+    {
+        printf("  bring-up failed\n");
+        return 1;
+    }
+    LOOPBACK_select(0);
+    gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr);
+    if(!LOOPBACK_runUntil(&_BENCH_isDataOpen, BENCH_TIMEOUT_MS))
+    {
+        printf("  connect timed out\n");
+        return 1;
+    }
+    /*Nothing else on the link*/
+    LOOPBACK_run(1000);
+
+    for(uPack = 1; uPack <= BENCH_SIG_MAX_PACK; uPack *= 2)
+    {
+        uLen = _BENCH_frame(aFrame, uPack);
+        BT_profileReset();
+        for(i = 0; i < BENCH_SIG_COMMANDS / uPack; ++i)
+        {
+            if(!_BENCH_feed(aFrame, uLen, uPack))
+            {
+                printf("  %u commands/C-frame: not all answered\n", uPack);
+                return 1;
+            }
+        }
+        psProfile = BT_profileGet(BT_LAYER_L2CAP);
+        printf("  %2u commands/C-frame (%3u B): %lu cycles/command\n",
+                uPack, uLen, (unsigned long) (psProfile->dwCycles /
+                    BENCH_SIG_COMMANDS));
+    }
+
+    /*Cut in the middle of the 4th command: the first 3 are answered*/
+    uLen = _BENCH_frame(aFrame, 4);
+    BT_storeLE16(uLen - L2CAP_HDR_LEN - 1, aFrame, 0);
+    if(!_BENCH_feed(aFrame, uLen - 1, 3))
+    {
+        printf("  truncated C-frame: not answered up to the cut\n");
+        return 1;
+    }
+    printf("  truncated C-frame: answered up to the cut\n");
+    LOOPBACK_close();
+    return 0;
+}
@@ -0,0 +1,316 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "HardwareProfile.h"
+#include "loopback.h"
+#include "bt_utils.h"
+#include "hci.h"
+
+/*
+ * Loopback benchmark: the gateway (stack 0) pages the sensor (stack 1),
+ * opens the RFCOMM session and streams frames to it. Per link model it
+ * reports the time to connect, the goodput, the latency of every frame
+ * (stamped when handed to RFCOMM, taken when RFCOMM delivers it), the
+ * cycles per byte each layer spent and the time to reconnect after a
+ * link loss, with and without the fast connectable window. Time is the virtual time of the
+ * controller pair; the cycles are host cycles scaled to the 40 MHz core
+ * timer, so compare them between runs, not with the PIC32.
+ */
+
+#define BENCH_FRAME_LEN 200
+#define BENCH_STREAM_FRAMES 2000
+#define BENCH_PING_FRAMES 200
+#define BENCH_TIMEOUT_MS 60000
+
+typedef struct _BENCH_SCENARIO
+{
+    const char *sName;
+    VCTRL_MODEL sModel;
+} BENCH_SCENARIO;
+
+static const BENCH_SCENARIO gasBenchScenario[] =
+{
+    /*Basic rate, single slot packets only*/
+    {"1-slot BR", {8, 1021, 500, {0, 0, 0, 0, 0, 0, 0, 0}}},
+    /*3 and 5-slot, EDR 2/3 Mb/s: both ends switch to DH5/3-DH5 on connect*/
+    {"5-slot EDR", {8, 1021, 500, {0x03, 0, 0, 0x06, 0x80, 0x01, 0, 0}}},
+};
+#define BENCH_SCENARIOS (sizeof(gasBenchScenario) / sizeof(gasBenchScenario[0]))
+
+static DWORD gadwBenchLatency[BENCH_STREAM_FRAMES];
+static UINT guBenchReceived = 0;
+static UINT guBenchOutOfOrder = 0;
+
+/*
+ * Benchmark private functions
+ */
+
+static void _BENCH_putData(UINT uStack, const BYTE *pData, UINT uLen)
+{
+    DWORD dwStamp, dwSeq;
+
+    if(uLen < 8)
+    {
+        return;
+    }
+    memcpy(&dwStamp, pData, 4);
+    memcpy(&dwSeq, &pData[4], 4);
+    if(dwSeq != guBenchReceived)
+    {
+        ++guBenchOutOfOrder;
+    }
+    if(guBenchReceived < BENCH_STREAM_FRAMES)
+    {
+        gadwBenchLatency[guBenchReceived] =
+                BT_ticksToUs(BT_getTicks() - dwStamp);
+    }
+    ++guBenchReceived;
+}
+
+static BOOL _BENCH_isConfigured(void)
+{
+    return gasLoopback[0].isConfigured && gasLoopback[1].isConfigured;
+}
+
+static BOOL _BENCH_isDataOpen(void)
+{
+    return LOOPBACK_isDataOpen(0);
+}
+
+static UINT guBenchExpected;
+
+static BOOL _BENCH_isReceived(void)
+{
+    return guBenchReceived >= guBenchExpected;
+}
+
+static BOOL _BENCH_send(UINT uSeq)
+{
+    BYTE aFrame[BENCH_FRAME_LEN];
+    DWORD dwStamp = BT_getTicks();
+    DWORD dwSeq = uSeq;
+
+    memset(aFrame, (BYTE) uSeq, sizeof(aFrame));
+    memcpy(aFrame, &dwStamp, 4);
+    memcpy(&aFrame[4], &dwSeq, 4);
+    LOOPBACK_select(0);
+    return gasLoopback[0].sRFCOMM.sendData(aFrame, sizeof(aFrame));
+}
+
+static int _BENCH_compare(const void *pA, const void *pB)
+{
+    DWORD dwA = *(const DWORD *) pA, dwB = *(const DWORD *) pB;
+
+    return (dwA > dwB) - (dwA < dwB);
+}
+
+static DWORD _BENCH_percentile(UINT uCount, UINT uPercent)
+{
+    UINT uIndex = (uCount * uPercent + 99) / 100;
+
+    return uCount ? gadwBenchLatency[uIndex ? uIndex - 1 : 0] : 0;
+}
+
+static void _BENCH_reportLatency(const char *sWhat, UINT uCount)
+{
+    qsort(gadwBenchLatency, uCount, sizeof(DWORD), &_BENCH_compare);
+    printf("  %s latency: p50 %lu us, p90 %lu us, p99 %lu us, max %lu us\n",
+            sWhat, (unsigned long) _BENCH_percentile(uCount, 50),
+            (unsigned long) _BENCH_percentile(uCount, 90),
+            (unsigned long) _BENCH_percentile(uCount, 99),
+            (unsigned long) _BENCH_percentile(uCount, 100));
+}
+
+static BOOL _BENCH_isDataClosed(void)
+{
+    return !LOOPBACK_isDataOpen(0);
+}
+
+/*Supervision timeout on the sensor, time until the session is back*/
+static BOOL _BENCH_reconnect(const char *sWhat)
+{
+    DWORD dwStart = BT_getTicks();
+
+    VCTRL_linkLoss(&gasLoopback[1].sCtrl);
+    if(!LOOPBACK_runUntil(&_BENCH_isDataClosed, BENCH_TIMEOUT_MS) ||
+       !LOOPBACK_runUntil(&_BENCH_isDataOpen, BENCH_TIMEOUT_MS))
+    {
+        printf("  reconnect (%s) timed out\n", sWhat);
+        return FALSE;
+    }
+    printf("  reconnect (%s): %lu ms (page %lu ms)\n", sWhat,
+            (unsigned long) (BT_ticksToUs(BT_getTicks() - dwStart) / 1000),
+            (unsigned long) (gasLoopback[0].sCtrl.dwPageUs / 1000));
+    return TRUE;
+}
+
+static int _BENCH_run(const BENCH_SCENARIO *psScenario)
+{
+    static const char *asLayer[BT_NUM_LAYERS] =
+            {"HCI", "L2CAP", "RFCOMM", "SDP"};
+    /*The low duty profile of the HCI, as the fast connectable one too*/
+    static const HCI_SCAN_PROFILE sLowDuty = {0x0800, 0x0012, 0x1000, 0x0012,
+            FALSE};
+    const BT_PROFILE *psProfile;
+    DWORD dwStart, dwUs;
+    UINT uSent, i;
+
+    printf("%s\n", psScenario->sName);
+    if(!LOOPBACK_open(&psScenario->sModel))
+    {
+        printf("  cannot open the loopback\n");
+        return 1;
+    }
+    if(!LOOPBACK_runUntil(&_BENCH_isConfigured, BENCH_TIMEOUT_MS))
+    {
+        printf("  bring-up timed out\n");
+        return 1;
+    }
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        LOOPBACK_select(i);
+        gasLoopback[i].sHCI.setPowerPolicy(HCI_POLICY_LATENCY);
+    }
+    gasLoopback[1].putData = &_BENCH_putData;
+
+    /*Connect: inquiry, page, L2CAP and the RFCOMM session*/
+    dwStart = BT_getTicks();
+    LOOPBACK_select(0);
+    gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr);
+    if(!LOOPBACK_runUntil(&_BENCH_isDataOpen, BENCH_TIMEOUT_MS))
+    {
+        printf("  connect timed out\n");
+        return 1;
+    }
+    printf("  connected in %lu ms (page %lu ms), packet types 0x%04X\n",
+            (unsigned long) (BT_ticksToUs(BT_getTicks() - dwStart) / 1000),
+            (unsigned long) (gasLoopback[0].sCtrl.dwPageUs / 1000),
+            gasLoopback[0].sCtrl.uPacketType);
+
+    /*Ping: one frame in flight, the latency of an idle link*/
+    for(uSent = 0; uSent < BENCH_PING_FRAMES; ++uSent)
+    {
+        guBenchExpected = uSent + 1;
+        while(!_BENCH_send(uSent))
+        {
+            LOOPBACK_step();
+        }
+        if(!LOOPBACK_runUntil(&_BENCH_isReceived, BENCH_TIMEOUT_MS))
+        {
+            printf("  ping frame %u lost\n", uSent);
+            return 1;
+        }
+    }
+    _BENCH_reportLatency("ping", BENCH_PING_FRAMES);
+
+    /*Stream: as fast as the credits let it go*/
+    guBenchReceived = 0;
+    guBenchOutOfOrder = 0;
+    guBenchExpected = BENCH_STREAM_FRAMES;
+    BT_profileReset();
+    dwStart = BT_getTicks();
+    uSent = 0;
+    while(guBenchReceived < BENCH_STREAM_FRAMES)
+    {
+        while(uSent < BENCH_STREAM_FRAMES && _BENCH_send(uSent))
+        {
+            ++uSent;
+        }
+        LOOPBACK_step();
+        if(BT_ticksToUs(BT_getTicks() - dwStart) / 1000 > BENCH_TIMEOUT_MS)
+        {
+            printf("  stream stalled at %u frames\n", guBenchReceived);
+            return 1;
+        }
+    }
+    dwUs = BT_ticksToUs(BT_getTicks() - dwStart);
+    printf("  goodput %lu kbit/s (%u frames of %u B in %lu ms),"
+            " %u out of order, %lu overruns\n",
+            (unsigned long) ((unsigned long long) BENCH_STREAM_FRAMES *
+                BENCH_FRAME_LEN * 8000 / (dwUs ? dwUs : 1)),
+            BENCH_STREAM_FRAMES, BENCH_FRAME_LEN,
+            (unsigned long) (dwUs / 1000), guBenchOutOfOrder,
+            (unsigned long) gasLoopback[0].sCtrl.dwOverruns);
+    _BENCH_reportLatency("stream", BENCH_STREAM_FRAMES);
+    printf("  controller completion: p50 < %lu us, p90 < %lu us,"
+            " p99 < %lu us\n", (unsigned long) BT_latencyPercentile(50),
+            (unsigned long) BT_latencyPercentile(90),
+            (unsigned long) BT_latencyPercentile(99));
+    /*Both stacks together: the sending and the receiving path*/
+    for(i = 0; i < BT_NUM_LAYERS; ++i)
+    {
+        psProfile = BT_profileGet(i);
+        if(psProfile->dwBytes > 0)
+        {
+            printf("  %-6s %lu frames, %lu B, %lu cycles/frame,"
+                    " %lu.%02lu cycles/B\n", asLayer[i],
+                    (unsigned long) psProfile->dwFrames,
+                    (unsigned long) psProfile->dwBytes,
+                    (unsigned long) (psProfile->dwCycles /
+                        psProfile->dwFrames),
+                    (unsigned long) (psProfile->dwCycles /
+                        psProfile->dwBytes),
+                    (unsigned long) (psProfile->dwCycles * 100ULL /
+                        psProfile->dwBytes % 100));
+        }
+    }
+
+    /*Connect latency after a link loss, with and without the fast window*/
+    if(!_BENCH_reconnect("fast connectable"))
+    {
+        return 1;
+    }
+    LOOPBACK_select(1);
+    gasLoopback[1].sHCI.setScanProfile(HCI_SCAN_FAST, &sLowDuty);
+    if(!_BENCH_reconnect("low duty only"))
+    {
+        return 1;
+    }
+    LOOPBACK_close();
+    return 0;
+}
+
+int main(void)
+{
+    UINT i;
+    pid_t iPid;
+    int iStatus, iResult = 0;
+
+    /*
+     * A fresh process per scenario: every stack instance shares the
+     * profiler and the allocator, a scenario starts from a clean heap.
+     */
+    for(i = 0; i < BENCH_SCENARIOS; ++i)
+    {
+        fflush(stdout);
+        iPid = fork();
+        if(0 == iPid)
+        {
+            exit(_BENCH_run(&gasBenchScenario[i]));
+        }
+        if(iPid < 0 || waitpid(iPid, &iStatus, 0) < 0 ||
+           !WIFEXITED(iStatus) || 0 != WEXITSTATUS(iStatus))
+        {
+            iResult = 1;
+        }
+    }
+    return iResult;
+}
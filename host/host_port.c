@@ -0,0 +1,87 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "HardwareProfile.h"
+#include "host_test.h"
+
+/*
+ * Host port: what the PIC32 board provides to the stack.
+ */
+
+static DWORD gdwHostSkippedTicks = 0;
+
+DWORD ReadCoreTimer(void)
+{
+    struct timespec sNow;
+    QWORD qwNs;
+
+    clock_gettime(CLOCK_MONOTONIC, &sNow);
+    qwNs = (QWORD) sNow.tv_sec * 1000000000ULL + sNow.tv_nsec;
+    /*Wraps at 32 bits, as the core timer does*/
+    return (DWORD) (qwNs / (1000000000ULL / (GetSystemClock() / 2))) +
+            gdwHostSkippedTicks;
+}
+
+void HOST_clockAdvanceUs(DWORD dwUs)
+{
+    gdwHostSkippedTicks += dwUs * (GetSystemClock() / 2000000UL);
+}
+
+void HOST_putChar(BYTE bChar)
+{
+    putchar(bChar);
+}
+
+/*
+ * Tests
+ */
+
+UINT guHostTestFailures = 0;
+static BOOL gisHostTestDone = FALSE;
+
+/*ASSERT ends the program with exit(0): that must not pass for success*/
+static void _HOST_testExit(void)
+{
+    if(!gisHostTestDone)
+    {
+        printf("FAIL: the test stopped early (assertion failed)\n");
+        fflush(stdout);
+        _exit(1);
+    }
+}
+
+void HOST_testBegin(const char *sName)
+{
+    printf("%s\n", sName);
+    atexit(_HOST_testExit);
+}
+
+int HOST_testEnd(void)
+{
+    gisHostTestDone = TRUE;
+    printf("%s: %u failure(s)\n", guHostTestFailures ? "FAIL" : "PASS",
+            guHostTestFailures);
+    return guHostTestFailures ? 1 : 0;
+}
+
+/*xprintf output, installed before main*/
+static void __attribute__((constructor)) _HOST_init(void)
+{
+    xdev_out(HOST_putChar);
+}
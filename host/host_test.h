@@ -0,0 +1,41 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef __HOST_TEST_H__
+#define __HOST_TEST_H__
+
+#include <stdio.h>
+#include "GenericTypeDefs.h"
+
+/*
+ * Host tests: each one is a program, it exits with 0 when every CHECK held.
+ */
+
+extern UINT guHostTestFailures;
+
+#define CHECK(X)                                                          \
+    do {                                                                  \
+        if(!(X))                                                          \
+        {                                                                 \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #X);  \
+            ++guHostTestFailures;                                         \
+        }                                                                 \
+    } while(0)
+
+void HOST_testBegin(const char *sName);
+int HOST_testEnd(void);
+
+#endif /*__HOST_TEST_H__*/
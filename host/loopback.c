@@ -0,0 +1,306 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "HardwareProfile.h"
+#include "loopback.h"
+#include "bt_utils.h"
+#include "bt_timer.h"
+#include "hci.h"
+#include "hci_h4.h"
+#include "rfcomm.h"
+
+/*
+ * Loopback harness variables
+ */
+
+LOOPBACK_STACK gasLoopback[LOOPBACK_STACKS];
+
+/*BD_ADDR of the controllers (wire order)*/
+static const BYTE gaaLoopbackAddr[LOOPBACK_STACKS][6] =
+{
+    {0x01, 0x00, 0x00, 0x5E, 0xDB, 0x00},
+    {0x02, 0x00, 0x00, 0x5E, 0xDB, 0x00},
+};
+
+/*
+ * Device call-backs: the stack calls them with its instance selected
+ */
+
+static UINT _LOOPBACK_currentIndex(void)
+{
+    UINT i;
+
+    for(i = 0; i < LOOPBACK_STACKS - 1; ++i)
+    {
+        if(gasLoopback[i].psStack == gpsBTStack)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+static LOOPBACK_STACK* _LOOPBACK_current(void)
+{
+    return &gasLoopback[_LOOPBACK_currentIndex()];
+}
+
+static BOOL _LOOPBACK_putRFCOMMData(const BYTE *pData, UINT uLen)
+{
+    LOOPBACK_STACK *psLoop = _LOOPBACK_current();
+
+    ++psLoop->dwRxFrames;
+    psLoop->dwRxBytes += uLen;
+    if(NULL != psLoop->putData)
+    {
+        psLoop->putData(_LOOPBACK_currentIndex(), pData, uLen);
+    }
+    return TRUE;
+}
+
+static BOOL _LOOPBACK_confComplete(void)
+{
+    LOOPBACK_STACK *psLoop = _LOOPBACK_current();
+
+    psLoop->isConfigured = TRUE;
+    psLoop->dwConfiguredAt = BT_getTicks();
+    return TRUE;
+}
+
+/*As BTApp: the stack that paged opens the RFCOMM session*/
+static BOOL _LOOPBACK_L2CAPconnected(UINT16 uPSM, BOOL bConnected)
+{
+    LOOPBACK_STACK *psLoop = _LOOPBACK_current();
+
+    if(L2CAP_RFCOMM_PSM != uPSM)
+    {
+        return TRUE;
+    }
+    psLoop->isChannelOpen = bConnected;
+    if(bConnected && psLoop->isPaged)
+    {
+        psLoop->sRFCOMM.connect();
+    }
+    if(!bConnected)
+    {
+        psLoop->isPaged = FALSE;
+        RFCOMM_reset();
+    }
+    return TRUE;
+}
+
+static BOOL _LOOPBACK_linkOpen(BOOL isPaged)
+{
+    LOOPBACK_STACK *psLoop = _LOOPBACK_current();
+
+    psLoop->isLinkOpen = TRUE;
+    psLoop->isPaged = isPaged;
+    if(isPaged)
+    {
+        return psLoop->sL2CAP.connect(L2CAP_RFCOMM_PSM);
+    }
+    return TRUE;
+}
+
+/*
+ * Loopback harness public functions
+ */
+
+BOOL LOOPBACK_open(const VCTRL_MODEL *psModel)
+{
+    HCI_TRANSPORT_API sTransport;
+    DEVICE_API sAPI;
+    LOOPBACK_STACK *psLoop;
+    char sPath[VCTRL_PATH_LEN];
+    UINT i;
+
+    /*
+     * The instance index names the socket of its H4 transport (indices are
+     * not reused): the controllers listen there before the stacks connect.
+     */
+    setenv(HCI_H4_PATH_ENV, LOOPBACK_PATH, 1);
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        psLoop = &gasLoopback[i];
+        memset(psLoop, 0, sizeof(LOOPBACK_STACK));
+        psLoop->psStack = BT_stackCreate();
+        if(NULL == psLoop->psStack)
+        {
+            return FALSE;
+        }
+        if(0 == psLoop->psStack->uIndex)
+        {
+            snprintf(sPath, sizeof(sPath), "%s", LOOPBACK_PATH);
+        }
+        else
+        {
+            snprintf(sPath, sizeof(sPath), "%s.%u", LOOPBACK_PATH,
+                    psLoop->psStack->uIndex);
+        }
+        if(!VCTRL_open(&psLoop->sCtrl, sPath, gaaLoopbackAddr[i], psModel))
+        {
+            return FALSE;
+        }
+        snprintf(psLoop->sCtrl.sName, sizeof(psLoop->sCtrl.sName),
+                "LOOPBACK_%u", i);
+    }
+    VCTRL_pair(&gasLoopback[0].sCtrl, &gasLoopback[1].sCtrl);
+
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        psLoop = &gasLoopback[i];
+        BT_stackSelect(psLoop->psStack);
+        if(!HCIH4_create())
+        {
+            return FALSE;
+        }
+        HCI_create();
+        L2CAP_create();
+        SDP_create();
+        RFCOMM_create();
+
+        HCI_getAPI(&psLoop->sHCI);
+        L2CAP_getAPI(&psLoop->sL2CAP);
+        RFCOMM_getAPI(&psLoop->sRFCOMM);
+        HCIH4_getAPI(&sTransport);
+        HCIH4_installHCI(&psLoop->sHCI);
+        HCI_installTransport(&sTransport);
+
+        sAPI.putRFCOMMData = &_LOOPBACK_putRFCOMMData;
+        sAPI.confComplete = &_LOOPBACK_confComplete;
+        sAPI.L2CAPconnected = &_LOOPBACK_L2CAPconnected;
+        sAPI.linkOpen = &_LOOPBACK_linkOpen;
+        RFCOMM_installDevCB(&sAPI);
+        L2CAP_installDevCB(&sAPI);
+        HCI_installDevCB(&sAPI);
+
+        psLoop->sHCI.setLocalName(psLoop->sCtrl.sName,
+                strlen(psLoop->sCtrl.sName));
+        psLoop->sHCI.cmdReset();
+    }
+    return TRUE;
+}
+
+void LOOPBACK_close(void)
+{
+    UINT i;
+
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        if(NULL != gasLoopback[i].psStack)
+        {
+            BT_stackSelect(gasLoopback[i].psStack);
+            HCIH4_destroy();
+            HCI_destroy();
+            L2CAP_destroy();
+            SDP_destroy();
+            RFCOMM_destroy();
+            BT_stackDestroy(gasLoopback[i].psStack);
+            gasLoopback[i].psStack = NULL;
+        }
+        VCTRL_close(&gasLoopback[i].sCtrl);
+    }
+}
+
+void LOOPBACK_select(UINT uStack)
+{
+    BT_stackSelect(gasLoopback[uStack].psStack);
+}
+
+/*Nothing moved: skip to the next thing due*/
+static void _LOOPBACK_idle(void)
+{
+    DWORD dwUs = LOOPBACK_IDLE_MAX_US;
+    DWORD dwNext;
+    UINT i;
+
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        dwNext = VCTRL_nextUs(&gasLoopback[i].sCtrl);
+        if(dwNext < dwUs)
+        {
+            dwUs = dwNext;
+        }
+    }
+    dwNext = BT_timerNextMs();
+    if(BT_TIMER_NONE != dwNext && dwNext * 1000 < dwUs)
+    {
+        dwUs = dwNext * 1000;
+    }
+    if(dwUs > 0)
+    {
+        HOST_clockAdvanceUs(dwUs);
+    }
+}
+
+BOOL LOOPBACK_step(void)
+{
+    BOOL isMoved = FALSE;
+    UINT i;
+
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        LOOPBACK_select(i);
+        gasLoopback[i].sHCI.tasks();
+    }
+    BT_timerRun();
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        isMoved |= VCTRL_tasks(&gasLoopback[i].sCtrl);
+    }
+    if(!isMoved)
+    {
+        _LOOPBACK_idle();
+    }
+    return isMoved;
+}
+
+void LOOPBACK_run(DWORD dwMs)
+{
+    DWORD dwStart = BT_getTicks();
+
+    while(BT_ticksToUs(BT_getTicks() - dwStart) / 1000 < dwMs)
+    {
+        LOOPBACK_step();
+    }
+}
+
+BOOL LOOPBACK_runUntil(BOOL (*isDone)(void), DWORD dwMs)
+{
+    DWORD dwStart = BT_getTicks();
+
+    while(!isDone())
+    {
+        if(BT_ticksToUs(BT_getTicks() - dwStart) / 1000 >= dwMs)
+        {
+            return FALSE;
+        }
+        LOOPBACK_step();
+    }
+    return TRUE;
+}
+
+BOOL LOOPBACK_isDataOpen(UINT uStack)
+{
+    RFCOMM_CONTROL_BLOCK *psRFCOMM = gasLoopback[uStack].psStack->psRFCOMMCB;
+
+    return NULL != psRFCOMM &&
+            psRFCOMM->asChannel[RFCOMM_CH_DATA].bDataEnabled &&
+            psRFCOMM->asChannel[RFCOMM_CH_DATA].bRemoteCr > 0;
+}
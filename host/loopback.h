@@ -0,0 +1,78 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef __LOOPBACK_H__
+#define __LOOPBACK_H__
+
+#include "GenericTypeDefs.h"
+#include "bt_common.h"
+#include "vctrl.h"
+
+/*
+ * Loopback harness: two stack instances in one process, each one on the
+ * H4 transport to its own controller of a virtual controller pair
+ * (vctrl.h). Stack 0 is the gateway, stack 1 the sensor it talks to.
+ * The run loop drives both stacks, their timers and the controllers and,
+ * when nothing moves, skips the idle time: the core timer of the host
+ * port is virtual time, a run of minutes takes milliseconds.
+ */
+
+#define LOOPBACK_STACKS 2
+/*Longest idle skip, the HCI polls some of its deadlines*/
+#define LOOPBACK_IDLE_MAX_US 10000UL
+/*Socket path of the first controller, the second one adds ".1"*/
+#define LOOPBACK_PATH "/tmp/bt_loopback"
+
+typedef struct _LOOPBACK_STACK
+{
+    BT_STACK *psStack;
+    VCTRL sCtrl;
+    HCI_API sHCI;
+    L2CAP_API sL2CAP;
+    RFCOMM_API sRFCOMM;
+
+    /*Device call-backs seen*/
+    BOOL isConfigured;
+    BOOL isLinkOpen;
+    BOOL isPaged;
+    BOOL isChannelOpen;
+    DWORD dwConfiguredAt;
+    DWORD dwRxBytes;
+    DWORD dwRxFrames;
+    /*RFCOMM data of the stack (NULL: only counted)*/
+    void (*putData)(UINT uStack, const BYTE *pData, UINT uLen);
+} LOOPBACK_STACK;
+
+extern LOOPBACK_STACK gasLoopback[LOOPBACK_STACKS];
+
+/*Open the controller pair and bring both stacks up (reset sent)*/
+BOOL LOOPBACK_open(const VCTRL_MODEL *psModel);
+void LOOPBACK_close(void);
+/*Select a stack instance before calling its APIs*/
+void LOOPBACK_select(UINT uStack);
+/*
+ * One pass over the stacks and controllers, TRUE if anything moved (if
+ * not, the virtual time skipped to the next thing due)
+ */
+BOOL LOOPBACK_step(void);
+/*Run for dwMs of (virtual) time*/
+void LOOPBACK_run(DWORD dwMs);
+/*Run until isDone() or dwMs elapsed, TRUE if done*/
+BOOL LOOPBACK_runUntil(BOOL (*isDone)(void), DWORD dwMs);
+/*The RFCOMM data channel of the stack takes data*/
+BOOL LOOPBACK_isDataOpen(UINT uStack);
+
+#endif /*__LOOPBACK_H__*/
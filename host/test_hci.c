@@ -0,0 +1,379 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+/*
+ * HCI against the virtual controller pair (loopback.h): what the stack
+ * configures in the controller and what it gets back.
+ */
+
+#include <string.h>
+#include "host_test.h"
+#include "loopback.h"
+#include "hci.h"
+#include "bt_snoop.h"
+#include "bt_utils.h"
+
+/*Events past the first mask word (Inquiry Result with RSSI, EIR)*/
+#define TEST_INQUIRY_RESULT_RSSI 0x22
+#define TEST_EXTENDED_INQUIRY_RESULT 0x2F
+
+#define TEST_TIMEOUT_MS 10000
+
+static const VCTRL_MODEL gsTestModel = {8, 1021, 500, {0}};
+
+#define TEST_OPCODE(OCF, OGF) ((OCF) | ((OGF) << 10))
+
+/*LMP features: 1-slot, 3-slot, 3-slot with 2 Mb/s EDR, all the stack uses*/
+static const BYTE gaTestFeatBR[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+static const BYTE gaTestFeat3Slot[8] = {0x01, 0, 0, 0, 0, 0, 0, 0};
+static const BYTE gaTestFeatEDR2M3Slot[8] = {0x01, 0, 0, 0x02, 0x80, 0, 0, 0};
+static const BYTE gaTestFeatAll[8] = {0x03, 0, 0, 0x06, 0x80, 0x01, 0, 0};
+
+/*Basic rate single slot: what a link starts with*/
+#define TEST_PKT_BR (HCI_PKT_DM1 | HCI_PKT_DH1 |                            \
+                     HCI_PKT_NO_2_DH1 | HCI_PKT_NO_3_DH1 |                  \
+                     HCI_PKT_NO_2_DH3 | HCI_PKT_NO_3_DH3 |                  \
+                     HCI_PKT_NO_2_DH5 | HCI_PKT_NO_3_DH5)
+
+static UINT guTestEvents = 0;
+static BYTE gbTestEvent = 0;
+
+static void _putEvent(const BYTE *pEvent)
+{
+    ++guTestEvents;
+    gbTestEvent = pEvent[0];
+}
+
+static BOOL _isConfigured(void)
+{
+    return gasLoopback[0].isConfigured && gasLoopback[1].isConfigured;
+}
+
+static BOOL _isDataOpen(void)
+{
+    return LOOPBACK_isDataOpen(0);
+}
+
+static BOOL _isMasked(UINT uStack, BYTE bEvent)
+{
+    return 0 != (gasLoopback[uStack].sCtrl.qwEventMask & HCI_EVENT_BIT(bEvent));
+}
+
+/*Subscriptions reach the controller mask, the upper word included*/
+static void testEventMask(void)
+{
+    BYTE aParams[15];
+
+    CHECK(LOOPBACK_open(&gsTestModel));
+
+    /*Before bring-up: it goes with the SET_EVENT_MASK step*/
+    LOOPBACK_select(1);
+    CHECK(gasLoopback[1].sHCI.subscribeEvent(TEST_EXTENDED_INQUIRY_RESULT,
+            &_putEvent));
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    CHECK(HCI_EVENT_MASK ==
+            (gasLoopback[0].sCtrl.qwEventMask & 0xFFFFFFFFULL));
+    CHECK(0 == (gasLoopback[0].sCtrl.qwEventMask >> 32));
+    CHECK(_isMasked(1, TEST_EXTENDED_INQUIRY_RESULT));
+
+    /*Not subscribed: the controller does not report it*/
+    memset(aParams, 0, sizeof(aParams));
+    aParams[0] = 1;
+    VCTRL_event(&gasLoopback[0].sCtrl, TEST_INQUIRY_RESULT_RSSI, aParams,
+            sizeof(aParams));
+    LOOPBACK_run(10);
+    CHECK(0 == guTestEvents);
+
+    /*After bring-up: the new mask is sent on its own*/
+    LOOPBACK_select(0);
+    CHECK(gasLoopback[0].sHCI.subscribeEvent(TEST_INQUIRY_RESULT_RSSI,
+            &_putEvent));
+    LOOPBACK_run(10);
+    CHECK(_isMasked(0, TEST_INQUIRY_RESULT_RSSI));
+    CHECK(!_isMasked(0, TEST_EXTENDED_INQUIRY_RESULT));
+    CHECK(HCI_EVENT_MASK ==
+            (gasLoopback[0].sCtrl.qwEventMask & 0xFFFFFFFFULL));
+    VCTRL_event(&gasLoopback[0].sCtrl, TEST_INQUIRY_RESULT_RSSI, aParams,
+            sizeof(aParams));
+    LOOPBACK_run(10);
+    CHECK(1 == guTestEvents);
+    CHECK(TEST_INQUIRY_RESULT_RSSI == gbTestEvent);
+    LOOPBACK_close();
+}
+
+/*The scan activity the sensor controller was given*/
+static BOOL _isScanning(UINT16 uPageInterval, UINT16 uPageWindow,
+        UINT16 uInqInterval, BYTE bType)
+{
+    const VCTRL *psCtrl = &gasLoopback[1].sCtrl;
+
+    return uPageInterval == psCtrl->uPageScanInterval &&
+           uPageWindow == psCtrl->uPageScanWindow &&
+           uInqInterval == psCtrl->uInqScanInterval &&
+           bType == psCtrl->bPageScanType && bType == psCtrl->bInqScanType;
+}
+
+/*The last page took dwUs (and the command exchange)*/
+static BOOL _isPagedIn(DWORD dwUs)
+{
+    DWORD dwPageUs = gasLoopback[0].sCtrl.dwPageUs;
+
+    return dwPageUs >= dwUs && dwPageUs < dwUs + 1000;
+}
+
+/*Fast connectable after boot and after a link loss, low duty otherwise*/
+static void testScanProfiles(void)
+{
+    static const HCI_SCAN_PROFILE sLow = {0x0400, 0x0024, 0x0800, 0x0012,
+            FALSE};
+    static const HCI_SCAN_PROFILE sBad = {0x0100, 0x0200, 0x0100, 0x0012,
+            TRUE};
+    DWORD dwLossAt;
+
+    CHECK(LOOPBACK_open(&gsTestModel));
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    CHECK(0x03 == gasLoopback[1].sCtrl.bScanEnable);
+    CHECK(_isScanning(0x0100, 0x0012, 0x0100, 0x01));
+
+    /*The window closes*/
+    LOOPBACK_run(HCI_FAST_CONNECTABLE_MS - 1000);
+    CHECK(_isScanning(0x0100, 0x0012, 0x0100, 0x01));
+    LOOPBACK_run(1100);
+    CHECK(_isScanning(0x0800, 0x0012, 0x1000, 0x00));
+
+    /*A profile in use changes at once, a bad one is refused*/
+    LOOPBACK_select(1);
+    CHECK(gasLoopback[1].sHCI.setScanProfile(HCI_SCAN_LOW_DUTY, &sLow));
+    CHECK(!gasLoopback[1].sHCI.setScanProfile(HCI_SCAN_FAST, &sBad));
+    CHECK(!gasLoopback[1].sHCI.setScanProfile(HCI_NUM_SCAN_PROFILES, &sLow));
+    LOOPBACK_run(10);
+    CHECK(_isScanning(0x0400, 0x0024, 0x0800, 0x00));
+
+    /*Paged at low duty: a whole interval (not interlaced)*/
+    LOOPBACK_select(0);
+    gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr);
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+    CHECK(_isPagedIn(0x0400 * VCTRL_SLOT_US));
+    CHECK(_isScanning(0x0400, 0x0024, 0x0800, 0x00));
+
+    /*Link loss: fast connectable, the gateway is back in half an interval*/
+    gasLoopback[0].sCtrl.dwPageUs = 0;
+    VCTRL_linkLoss(&gasLoopback[1].sCtrl);
+    dwLossAt = BT_getTicks();
+    LOOPBACK_run(10);
+    CHECK(!gasLoopback[1].sCtrl.isConnected);
+    CHECK(!LOOPBACK_isDataOpen(0));
+    CHECK(_isScanning(0x0100, 0x0012, 0x0100, 0x01));
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+    CHECK(_isPagedIn(0x0100 * VCTRL_SLOT_US / 2));
+    CHECK(BT_ticksToUs(BT_getTicks() - dwLossAt) / 1000 < 1000);
+    /*And low duty once connected*/
+    CHECK(_isScanning(0x0400, 0x0024, 0x0800, 0x00));
+    LOOPBACK_close();
+}
+
+static BOOL _isInquiring(void)
+{
+    return HCI_PAGE_INQUIRY ==
+            gasLoopback[0].psStack->psHCICB->psHCIPageData->bState;
+}
+
+/*A configured target is paged at once, an inquiry only follows a failure*/
+static void testPageFirst(void)
+{
+    HCI_PAGE_DATA *psPageData;
+    HCI_INQ_ENTRY *psEntry;
+    VCTRL *psSensor = &gasLoopback[1].sCtrl;
+
+    CHECK(LOOPBACK_open(&gsTestModel));
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    psPageData = gasLoopback[0].psStack->psHCICB->psHCIPageData;
+    LOOPBACK_select(0);
+    gasLoopback[0].sHCI.addPageTarget(psSensor->aBDAddr);
+    LOOPBACK_run(10);
+    CHECK(HCI_PAGE_CONNECTING == psPageData->bState);
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+    CHECK(!psPageData->isInquired);
+    CHECK(_isPagedIn(0x0100 * VCTRL_SLOT_US / 2));
+
+    /*Discoverable but not connectable: the page times out, then inquiry*/
+    psSensor->bScanEnable = 0x01;
+    VCTRL_linkLoss(psSensor);
+    CHECK(LOOPBACK_runUntil(&_isInquiring, TEST_TIMEOUT_MS));
+    LOOPBACK_select(0);
+    CHECK(NULL == _HCI_inqCacheFind(psSensor->aBDAddr));
+    psSensor->bScanEnable = 0x03;
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+    LOOPBACK_select(0);
+    psEntry = _HCI_inqCacheFind(psSensor->aBDAddr);
+    CHECK(NULL != psEntry && psEntry->isClockValid);
+
+    /*A new controller keeps the cache, not the clock offsets*/
+    HCI_reset();
+    CHECK(psPageData->isInquired);
+    psEntry = _HCI_inqCacheFind(psSensor->aBDAddr);
+    CHECK(NULL != psEntry && !psEntry->isClockValid);
+    LOOPBACK_close();
+}
+
+/*Connect two controllers with these features, the types each end picks*/
+static void _connect(const BYTE *pGatewayFeat, const BYTE *pSensorFeat,
+        UINT16 *puGateway, UINT16 *puSensor)
+{
+    *puGateway = 0;
+    *puSensor = 0;
+    CHECK(LOOPBACK_open(&gsTestModel));
+    memcpy(gasLoopback[0].sCtrl.sModel.aFeatures, pGatewayFeat, 8);
+    memcpy(gasLoopback[1].sCtrl.sModel.aFeatures, pSensorFeat, 8);
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    LOOPBACK_select(0);
+    gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr);
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+    /*CONN_PACKET_TYPE_CHANGED on both ends*/
+    LOOPBACK_run(100);
+
+    LOOPBACK_select(0);
+    *puGateway = gasLoopback[0].sHCI.getPacketType();
+    LOOPBACK_select(1);
+    *puSensor = gasLoopback[1].sHCI.getPacketType();
+    /*The controller agrees*/
+    CHECK(*puGateway == gasLoopback[0].sCtrl.uPacketType);
+    CHECK(*puSensor == gasLoopback[1].sCtrl.uPacketType);
+    LOOPBACK_close();
+}
+
+/*The types both ends support, from the local and the remote features*/
+static void testPacketTypes(void)
+{
+    UINT16 uGateway, uSensor;
+
+    /*Nothing in common but DM1/DH1*/
+    _connect(gaTestFeatAll, gaTestFeatBR, &uGateway, &uSensor);
+    CHECK(TEST_PKT_BR == uGateway);
+    CHECK(TEST_PKT_BR == uSensor);
+
+    /*3-slot basic rate, no EDR: the local end limits too*/
+    _connect(gaTestFeat3Slot, gaTestFeatAll, &uGateway, &uSensor);
+    CHECK((TEST_PKT_BR | HCI_PKT_DM3 | HCI_PKT_DH3) == uGateway);
+    CHECK(uGateway == uSensor);
+
+    /*2 Mb/s EDR up to 3 slots, basic rate up to 3 slots*/
+    _connect(gaTestFeatAll, gaTestFeatEDR2M3Slot, &uGateway, &uSensor);
+    CHECK((HCI_PKT_DM1 | HCI_PKT_DH1 | HCI_PKT_DM3 | HCI_PKT_DH3 |
+           HCI_PKT_NO_3_DH1 | HCI_PKT_NO_3_DH3 |
+           HCI_PKT_NO_2_DH5 | HCI_PKT_NO_3_DH5) == uGateway);
+    CHECK(uGateway == uSensor);
+
+    /*Everything: 5-slot basic rate, 2 and 3 Mb/s EDR up to 5 slots*/
+    _connect(gaTestFeatAll, gaTestFeatAll, &uGateway, &uSensor);
+    CHECK((HCI_PKT_DM1 | HCI_PKT_DH1 | HCI_PKT_DM3 | HCI_PKT_DH3 |
+           HCI_PKT_DM5 | HCI_PKT_DH5) == uGateway);
+    CHECK(uGateway == uSensor);
+}
+
+/*Bring-up on a controller without one of the commands*/
+static void _bringUp(UINT16 uUnknownOpcode)
+{
+    VCTRL_MODEL sModel = gsTestModel;
+
+    sModel.uUnknownOpcode = uUnknownOpcode;
+    CHECK(LOOPBACK_open(&sModel));
+}
+
+/*An optional step rejected is skipped, a mandatory one stops the bring-up*/
+static void testRejectedSteps(void)
+{
+    /*No interlaced scan: COMMAND_STATUS "unknown command"*/
+    _bringUp(TEST_OPCODE(HCI_W_PAGE_SCAN_TYPE_OCF, HCI_HC_BB_OGF));
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    CHECK(0x03 == gasLoopback[0].sCtrl.bScanEnable);
+    CHECK(0x00 == gasLoopback[0].sCtrl.bPageScanType);
+    LOOPBACK_select(0);
+    gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr);
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+    LOOPBACK_close();
+
+    /*No local address: the device is never configured*/
+    _bringUp(TEST_OPCODE(HCI_R_BD_ADDR_OCF, HCI_INFO_PARAM_OGF));
+    CHECK(!LOOPBACK_runUntil(&_isConfigured, 1000));
+    CHECK(!gasLoopback[0].isConfigured);
+    CHECK(!gasLoopback[0].psStack->psHCICB->psHCIConfData->isConfigured);
+    CHECK(gasLoopback[0].psStack->psHCICB->psHCIConfData->isInitFailed);
+    LOOPBACK_close();
+}
+
+/*Each instance counts the events of its controller and captures its own*/
+static void testInstanceState(void)
+{
+    BYTE aParams[15];
+    BYTE aOut[BT_SNOOP_FILE_HDR_LEN];
+    UINT16 auCount[LOOPBACK_STACKS];
+    DWORD dwCycles;
+    UINT i;
+
+    CHECK(LOOPBACK_open(&gsTestModel));
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    LOOPBACK_select(0);
+    CHECK(gasLoopback[0].sHCI.subscribeEvent(TEST_INQUIRY_RESULT_RSSI,
+            &_putEvent));
+    LOOPBACK_run(10);
+    memset(aParams, 0, sizeof(aParams));
+    VCTRL_event(&gasLoopback[0].sCtrl, TEST_INQUIRY_RESULT_RSSI, aParams,
+            sizeof(aParams));
+    LOOPBACK_run(10);
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        LOOPBACK_select(i);
+        CHECK(gasLoopback[i].sHCI.getEventStats(TEST_INQUIRY_RESULT_RSSI,
+                &auCount[i], &dwCycles));
+    }
+    CHECK(1 == auCount[0]);
+    CHECK(0 == auCount[1]);
+
+    /*Exporting the capture of one instance leaves the other alone*/
+    CHECK(!BT_snoopExportPending(gasLoopback[0].psStack));
+    CHECK(!BT_snoopExportPending(gasLoopback[1].psStack));
+    BT_snoopExportStart(gasLoopback[1].psStack);
+    CHECK(!BT_snoopExportPending(gasLoopback[0].psStack));
+    CHECK(BT_snoopExportPending(gasLoopback[1].psStack));
+    CHECK(0 == BT_snoopExport(gasLoopback[0].psStack, aOut, sizeof(aOut)));
+    CHECK(sizeof(aOut) ==
+            BT_snoopExport(gasLoopback[1].psStack, aOut, sizeof(aOut)));
+    CHECK(0 == memcmp(aOut, "btsnoop", 8));
+    /*Draining it keeps the records of the other*/
+    while(BT_snoopExport(gasLoopback[1].psStack, aOut, sizeof(aOut)) > 0)
+    {
+    }
+    CHECK(!BT_snoopExportPending(gasLoopback[1].psStack));
+    BT_snoopExportStart(gasLoopback[0].psStack);
+    CHECK(sizeof(aOut) ==
+            BT_snoopExport(gasLoopback[0].psStack, aOut, sizeof(aOut)));
+    CHECK(BT_snoopExportPending(gasLoopback[0].psStack));
+    LOOPBACK_close();
+}
+
+int main(void)
+{
+    HOST_testBegin("test_hci");
+    testEventMask();
+    testPacketTypes();
+    testScanProfiles();
+    testPageFirst();
+    testInstanceState();
+    testRejectedSteps();
+    return HOST_testEnd();
+}
@@ -0,0 +1,225 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/*
+ * Idle decision (PIC32/idle.c) on a simulated CPU: one wake source (as
+ * the USB one: its handler leaves work for the main loop), the interrupt
+ * enable, the pending flag and WAIT, which ends at once when an enabled
+ * source is pending, interrupts disabled or not. The wake event is raised
+ * at every point IDLE_enter goes through; wherever it is, its work must
+ * be seen before IDLE_enter returns and the CPU must not sleep past it.
+ * The same run on a port that leaves the interrupts enabled has to lose
+ * it: the simulation does see the race.
+ */
+
+#include "host_test.h"
+#include "HardwareProfile.h"
+#include "idle.h"
+#include "bt_timer.h"
+#include "bt_utils.h"
+
+/*Where the wake event is raised*/
+#define TEST_NOWHERE 0
+#define TEST_AFTER_ARM 1
+#define TEST_AFTER_LOCK 2
+#define TEST_BEFORE_CHECK 3
+#define TEST_AFTER_CHECK 4
+#define TEST_BEFORE_WAIT 5
+#define TEST_DURING_WAIT 6
+#define TEST_POINTS 7
+
+/*When raised during the WAIT, after this long asleep*/
+#define TEST_WAKE_US 3000UL
+#define TEST_MAX_US (IDLE_MAX_MS * 1000UL)
+
+/*Simulated CPU*/
+static BOOL gisTestIE = TRUE;
+static BOOL gisTestEnabled = FALSE;
+static BOOL gisTestPending = FALSE;
+/*Left by the handler for the main loop*/
+static BOOL gisTestWork = FALSE;
+static BOOL gisTestLocking = TRUE;
+static UINT guTestPoint = TEST_NOWHERE;
+static DWORD gdwTestSleptUs = 0;
+
+/*The handler runs as soon as the CPU takes the interrupt, it masks itself*/
+static void _dispatch(void)
+{
+    if(gisTestIE && gisTestEnabled && gisTestPending)
+    {
+        gisTestPending = FALSE;
+        gisTestEnabled = FALSE;
+        gisTestWork = TRUE;
+    }
+}
+
+static void _at(UINT uPoint)
+{
+    if(uPoint == guTestPoint)
+    {
+        gisTestPending = TRUE;
+        _dispatch();
+    }
+}
+
+static void _arm(void)
+{
+    gisTestEnabled = TRUE;
+    _at(TEST_AFTER_ARM);
+}
+
+static void _lock(void)
+{
+    gisTestIE = !gisTestLocking;
+    _at(TEST_AFTER_LOCK);
+}
+
+static void _unlock(void)
+{
+    gisTestIE = TRUE;
+    _dispatch();
+}
+
+static BOOL _isIdle(void)
+{
+    BOOL isIdle;
+
+    _at(TEST_BEFORE_CHECK);
+    isIdle = !gisTestWork;
+    _at(TEST_AFTER_CHECK);
+    return isIdle;
+}
+
+static void _sleep(DWORD dwTicks)
+{
+    DWORD dwUs = BT_ticksToUs(dwTicks);
+
+    _at(TEST_BEFORE_WAIT);
+    if(gisTestEnabled && gisTestPending)
+    {
+        return;
+    }
+    if(TEST_DURING_WAIT == guTestPoint && dwUs > TEST_WAKE_US)
+    {
+        dwUs = TEST_WAKE_US;
+        HOST_clockAdvanceUs(dwUs);
+        gdwTestSleptUs += dwUs;
+        _at(TEST_DURING_WAIT);
+        return;
+    }
+    HOST_clockAdvanceUs(dwUs);
+    gdwTestSleptUs += dwUs;
+}
+
+static const IDLE_PORT gsTestPort = {&_arm, &_lock, &_unlock, &_isIdle,
+        &_sleep};
+
+/*End of a main loop pass with the wake event at uPoint, TRUE if slept*/
+static BOOL _pass(UINT uPoint)
+{
+    BOOL isSlept;
+
+    gisTestIE = TRUE;
+    gisTestEnabled = FALSE;
+    gisTestPending = FALSE;
+    gisTestWork = FALSE;
+    gdwTestSleptUs = 0;
+    guTestPoint = uPoint;
+    isSlept = IDLE_enter();
+    guTestPoint = TEST_NOWHERE;
+    return isSlept;
+}
+
+/*The work of the event is seen and the CPU did not sleep past it*/
+static BOOL _isWakeupKept(void)
+{
+    return gisTestWork && gdwTestSleptUs <= TEST_WAKE_US;
+}
+
+static void _expired(void *pContext)
+{
+}
+
+static void testNoLostWakeup(void)
+{
+    UINT uPoint;
+
+    gisTestLocking = TRUE;
+    for(uPoint = TEST_AFTER_ARM; uPoint < TEST_POINTS; ++uPoint)
+    {
+        _pass(uPoint);
+        CHECK(_isWakeupKept());
+    }
+}
+
+static void testRaceSeen(void)
+{
+    /*Checked with the interrupts on: the handler runs before the WAIT*/
+    gisTestLocking = FALSE;
+    _pass(TEST_AFTER_CHECK);
+    CHECK(!_isWakeupKept());
+    CHECK(TEST_MAX_US == gdwTestSleptUs);
+    _pass(TEST_BEFORE_WAIT);
+    CHECK(!_isWakeupKept());
+    gisTestLocking = TRUE;
+}
+
+static void testSleepLength(void)
+{
+    BT_TIMER sTimer;
+    const IDLE_STATS *psStats = IDLE_getStats();
+
+    gisTestLocking = TRUE;
+    IDLE_resetStats();
+
+    /*Nothing at all: the longest sleep*/
+    CHECK(_pass(TEST_NOWHERE));
+    CHECK(TEST_MAX_US == gdwTestSleptUs);
+    CHECK(1 == psStats->dwWakeups);
+    CHECK(BT_ticksToUs(psStats->qwIdleTicks) >= TEST_MAX_US);
+
+    /*Up to the next protocol timer (the main loop ran the wheel)*/
+    BT_timerRun();
+    BT_timerInit(&sTimer, &_expired, NULL);
+    BT_timerStart(&sTimer, 2 * BT_TIMER_TICK_MS);
+    CHECK(_pass(TEST_NOWHERE));
+    CHECK(gdwTestSleptUs > 0);
+    /*A timer expires up to a tick late, on the wheel tick after its time*/
+    CHECK(gdwTestSleptUs <= 3 * BT_TIMER_TICK_MS * 1000UL);
+
+    /*A timer due: no sleep*/
+    BT_timerStart(&sTimer, 0);
+    CHECK(!_pass(TEST_NOWHERE));
+    CHECK(0 == gdwTestSleptUs);
+    CHECK(2 == psStats->dwWakeups);
+    BT_timerStop(&sTimer);
+
+    /*Work left by the previous pass: no sleep either*/
+    gisTestWork = TRUE;
+    gdwTestSleptUs = 0;
+    CHECK(!IDLE_enter());
+    CHECK(0 == gdwTestSleptUs);
+}
+
+int main(void)
+{
+    HOST_testBegin("test_idle");
+    IDLE_init(&gsTestPort);
+    testNoLostWakeup();
+    testRaceSeen();
+    testSleepLength();
+    return HOST_testEnd();
+}
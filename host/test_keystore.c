@@ -0,0 +1,208 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+
+/*
+ * Link-key store on the flash emulator: insert, overwrite, delete,
+ * compaction, and power losses in the middle of a compaction.
+ * The store is built in to reach the emulator (power loss, reload).
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include "host_test.h"
+
+#define BT_KEYSTORE_FILE "test_keystore.bin"
+#include "bt_keystore.c"
+
+static void _setAddr(BYTE *pAddr, UINT uDevice)
+{
+    memset(pAddr, 0, 6);
+    pAddr[0] = (BYTE) uDevice;
+    pAddr[5] = 0xA0;
+}
+
+static void _setKey(BYTE *pKey, UINT uDevice, UINT uVersion)
+{
+    memset(pKey, (BYTE) (uDevice * 16 + uVersion), BT_LINK_KEY_LEN);
+}
+
+static BOOL _hasKey(UINT uDevice, UINT uVersion)
+{
+    BYTE aAddr[6], aKey[BT_LINK_KEY_LEN], aFound[BT_LINK_KEY_LEN];
+
+    _setAddr(aAddr, uDevice);
+    _setKey(aKey, uDevice, uVersion);
+    return BT_keyStoreFind(aAddr, aFound) &&
+           0 == memcmp(aKey, aFound, BT_LINK_KEY_LEN);
+}
+
+static BOOL _put(UINT uDevice, UINT uVersion)
+{
+    BYTE aAddr[6], aKey[BT_LINK_KEY_LEN];
+
+    _setAddr(aAddr, uDevice);
+    _setKey(aKey, uDevice, uVersion);
+    return BT_keyStorePut(aAddr, aKey, 0);
+}
+
+static BOOL _delete(UINT uDevice)
+{
+    BYTE aAddr[6];
+
+    _setAddr(aAddr, uDevice);
+    return BT_keyStoreDelete(aAddr);
+}
+
+/*Power cycle: the RAM copy is gone, the file is the flash*/
+static void _reboot(void)
+{
+    giKeyStoreOpsLeft = -1;
+    gisKeyStoreLoaded = FALSE;
+}
+
+static void _blank(void)
+{
+    unlink(BT_KEYSTORE_FILE);
+    _reboot();
+}
+
+static void testInsertOverwriteDelete(void)
+{
+    _blank();
+    CHECK(!_hasKey(1, 0));
+    CHECK(_put(1, 0));
+    CHECK(_put(2, 0));
+    CHECK(_hasKey(1, 0));
+    CHECK(_hasKey(2, 0));
+
+    /*A new pairing replaces the key, an identical one writes nothing*/
+    CHECK(_put(1, 1));
+    CHECK(_hasKey(1, 1));
+    CHECK(!_hasKey(1, 0));
+    giKeyStoreOpsLeft = 0;
+    CHECK(_put(1, 1));
+    giKeyStoreOpsLeft = -1;
+
+    CHECK(_delete(1));
+    CHECK(!_hasKey(1, 1));
+    CHECK(!_delete(1));
+    CHECK(_hasKey(2, 0));
+
+    _reboot();
+    CHECK(!_hasKey(1, 1));
+    CHECK(_hasKey(2, 0));
+}
+
+/*Every slot written: the next pairing compacts onto the other page*/
+static void testCompaction(void)
+{
+    UINT i;
+    INT iPage;
+
+    _blank();
+    for(i = 0; i < BT_KEYSTORE_SLOTS; ++i)
+    {
+        CHECK(_put(i, 0));
+    }
+    for(i = 0; i < BT_KEYSTORE_SLOTS; i += 2)
+    {
+        CHECK(_delete(i));
+    }
+    iPage = _BT_keyStoreCurrent();
+    CHECK(_put(100, 0));
+    CHECK(_BT_keyStoreCurrent() != iPage);
+    CHECK(_hasKey(100, 0));
+    for(i = 0; i < BT_KEYSTORE_SLOTS; ++i)
+    {
+        CHECK(_hasKey(i, 0) == (i % 2 == 1));
+    }
+
+    /*And back to the first page*/
+    for(i = 200; i < 200 + BT_KEYSTORE_SLOTS / 2 - 1; ++i)
+    {
+        CHECK(_put(i, 0));
+    }
+    CHECK(_delete(100));
+    CHECK(_put(101, 0));
+    CHECK(_BT_keyStoreCurrent() == iPage);
+    CHECK(_hasKey(101, 0));
+    CHECK(!_hasKey(100, 0));
+    CHECK(_hasKey(15, 0));
+    CHECK(_hasKey(200, 0));
+
+    _reboot();
+    CHECK(_hasKey(101, 0));
+    CHECK(_hasKey(15, 0));
+}
+
+/*Only live keys, no slot to reclaim: the store starts over*/
+static void testFull(void)
+{
+    UINT i;
+
+    _blank();
+    for(i = 0; i < BT_KEYSTORE_SLOTS; ++i)
+    {
+        CHECK(_put(i, 0));
+    }
+    CHECK(_put(100, 0));
+    CHECK(_hasKey(100, 0));
+    CHECK(!_hasKey(0, 0));
+}
+
+/*
+ * Cut the power after each erase or program operation of a compaction in
+ * turn: the keys it started from must all be there after the reboot.
+ */
+static void testPowerLoss(void)
+{
+    UINT i;
+    INT iOps;
+    BOOL isDone = FALSE;
+
+    for(iOps = 0; !isDone; ++iOps)
+    {
+        _blank();
+        for(i = 0; i < BT_KEYSTORE_SLOTS; ++i)
+        {
+            CHECK(_put(i, 0));
+        }
+        CHECK(_delete(0));
+        giKeyStoreOpsLeft = iOps;
+        isDone = _put(100, 0);
+        _reboot();
+        for(i = 1; i < BT_KEYSTORE_SLOTS; ++i)
+        {
+            CHECK(_hasKey(i, 0));
+        }
+        CHECK(!_hasKey(0, 0));
+        CHECK(_hasKey(100, 0) == isDone);
+        CHECK(iOps < 1000);
+    }
+    printf("  %d power loss points\n", iOps - 1);
+}
+
+int main(void)
+{
+    HOST_testBegin("test_keystore");
+    testInsertOverwriteDelete();
+    testCompaction();
+    testFull();
+    testPowerLoss();
+    unlink(BT_KEYSTORE_FILE);
+    return HOST_testEnd();
+}
@@ -0,0 +1,186 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/*
+ * L2CAP channels against the virtual controller pair (loopback.h): the
+ * RFCOMM channel in Enhanced Retransmission mode, the SDUs that cross it
+ * and the frames sent to a controller with short ACL buffers.
+ */
+
+#include <string.h>
+#include "host_test.h"
+#include "loopback.h"
+#include "l2cap_2.h"
+
+#define TEST_TIMEOUT_MS 10000
+
+static const VCTRL_MODEL gsTestModel = {8, 1021, 500, {0}};
+/*A CSR8510 dongle: 310 byte ACL buffers, shorter than an L2CAP_MTU frame*/
+static const VCTRL_MODEL gsTestShortModel = {8, 310, 500, {0}};
+
+/*Last SDU the sensor got on the RFCOMM PSM*/
+static BYTE gaTestSDU[L2CAP_MTU];
+static UINT guTestSDULen = 0;
+static UINT guTestSDUs = 0;
+
+static BOOL _putSDU(const BYTE *pData, UINT uLen)
+{
+    ++guTestSDUs;
+    guTestSDULen = uLen;
+    if(uLen <= sizeof(gaTestSDU))
+    {
+        memcpy(gaTestSDU, pData, uLen);
+    }
+    return TRUE;
+}
+
+static BOOL _isDataOpen(void)
+{
+    return LOOPBACK_isDataOpen(0) && LOOPBACK_isDataOpen(1);
+}
+
+static BOOL _isSDUIn(void)
+{
+    return 0 != guTestSDUs;
+}
+
+/*Open the RFCOMM session of the pair, its L2CAP channel in bMode*/
+static BOOL _open(const VCTRL_MODEL *psModel, UINT8 bMode)
+{
+    UINT i;
+
+    guTestSDUs = 0;
+    CHECK(LOOPBACK_open(psModel));
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        LOOPBACK_select(i);
+        CHECK(gasLoopback[i].sL2CAP.setMode(L2CAP_RFCOMM_PSM, bMode, 0));
+    }
+    LOOPBACK_select(0);
+    CHECK(gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr));
+    return LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS);
+}
+
+/*The sensor end of the channel goes to the test instead of RFCOMM*/
+static void _captureSensor(void)
+{
+    RFCOMM_API sAPI;
+
+    LOOPBACK_select(1);
+    memset(&sAPI, 0, sizeof(sAPI));
+    sAPI.putData = &_putSDU;
+    L2CAP_installRFCOMM(&sAPI);
+}
+
+/*A full MTU SDU from the gateway, TRUE if the sensor got it whole*/
+static BOOL _sendFullSDU(void)
+{
+    BYTE aSDU[L2CAP_MTU];
+    UINT i;
+
+    for(i = 0; i < sizeof(aSDU); ++i)
+    {
+        aSDU[i] = (BYTE) (i * 7);
+    }
+    LOOPBACK_select(0);
+    if(!gasLoopback[0].sL2CAP.sendData(L2CAP_RFCOMM_PSM, aSDU, sizeof(aSDU)) ||
+       !LOOPBACK_runUntil(&_isSDUIn, TEST_TIMEOUT_MS))
+    {
+        return FALSE;
+    }
+    return 1 == guTestSDUs && sizeof(aSDU) == guTestSDULen &&
+            0 == memcmp(gaTestSDU, aSDU, sizeof(aSDU));
+}
+
+/*An ERTM channel takes SDUs as large as a basic mode one*/
+static void testEnhancedMTU(void)
+{
+    L2CAP_CHANNEL *pChannel;
+    UINT i;
+
+    CHECK(_open(&gsTestModel, L2CAP_MODE_ERTM));
+
+    /*Both ends reassemble the full MTU (the host heap is never short)*/
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        LOOPBACK_select(i);
+        pChannel = _L2CAP_getChannelByPSM(L2CAP_RFCOMM_PSM);
+        CHECK(NULL != pChannel);
+        if(NULL == pChannel)
+        {
+            LOOPBACK_close();
+            return;
+        }
+        CHECK(L2CAP_MODE_ERTM == pChannel->bMode);
+        CHECK(L2CAP_MTU == pChannel->uInMTU);
+        CHECK(NULL != pChannel->pSDU);
+        CHECK(L2CAP_MTU == gasLoopback[i].sL2CAP.getMTU(L2CAP_RFCOMM_PSM));
+    }
+
+    /*A full MTU SDU crosses in segments and comes out whole*/
+    _captureSensor();
+    CHECK(_sendFullSDU());
+    LOOPBACK_close();
+}
+
+/*No frame is longer than the ACL buffers READ_BUFFER_SIZE reported*/
+static void testShortAclBuffers(void)
+{
+    L2CAP_CHANNEL *pChannel;
+    UINT i;
+
+    /*Basic mode: the MTU towards the peer is what one buffer carries*/
+    CHECK(_open(&gsTestShortModel, L2CAP_MODE_BASIC));
+    for(i = 0; i < LOOPBACK_STACKS; ++i)
+    {
+        LOOPBACK_select(i);
+        CHECK(gsTestShortModel.uAclLen == gasLoopback[i].sHCI.getAclLength());
+        CHECK(gsTestShortModel.uAclLen - L2CAP_HDR_LEN ==
+                gasLoopback[i].sL2CAP.getMTU(L2CAP_RFCOMM_PSM));
+    }
+    _captureSensor();
+    LOOPBACK_select(0);
+    CHECK(!gasLoopback[0].sL2CAP.sendData(L2CAP_RFCOMM_PSM, gaTestSDU,
+            gsTestShortModel.uAclLen));
+    CHECK(0 == gasLoopback[0].sCtrl.dwOverruns);
+    CHECK(0 == gasLoopback[1].sCtrl.dwOverruns);
+    LOOPBACK_close();
+
+    /*ERTM: the I-frames are cut to fit, the MTU stays the full one*/
+    CHECK(_open(&gsTestShortModel, L2CAP_MODE_ERTM));
+    LOOPBACK_select(0);
+    pChannel = _L2CAP_getChannelByPSM(L2CAP_RFCOMM_PSM);
+    CHECK(NULL != pChannel);
+    if(NULL != pChannel)
+    {
+        CHECK(gsTestShortModel.uAclLen == L2CAP_HDR_LEN + L2CAP_CTRL_LEN +
+                pChannel->uRemoteMPS + L2CAP_FCS_LEN);
+    }
+    CHECK(L2CAP_MTU == gasLoopback[0].sL2CAP.getMTU(L2CAP_RFCOMM_PSM));
+    _captureSensor();
+    CHECK(_sendFullSDU());
+    CHECK(0 == gasLoopback[0].sCtrl.dwOverruns);
+    CHECK(0 == gasLoopback[1].sCtrl.dwOverruns);
+    LOOPBACK_close();
+}
+
+int main(void)
+{
+    HOST_testBegin("test_l2cap");
+    testEnhancedMTU();
+    testShortAclBuffers();
+    return HOST_testEnd();
+}
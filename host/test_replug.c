@@ -0,0 +1,156 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/*
+ * Dongle hot-replug on the loopback harness: the controller of the gateway
+ * (stack 0) is pulled while its RFCOMM session to the sensor is open. The
+ * gateway detaches through BTAPP_Stop, the replugged controller only gets
+ * the RESET from BTAPP_Start of the started device. Checks the state left
+ * by the detach, the configuration kept over it and reports the time from
+ * replug to connectable and to the session being back.
+ */
+
+#include <string.h>
+#include "host_test.h"
+#include "loopback.h"
+#include "hci.h"
+#include "l2cap_2.h"
+#include "bt_utils.h"
+#include "BTApp.h"
+
+#define TEST_TIMEOUT_MS 10000
+#define TEST_REPLUGS 3
+/*
+ * The virtual clock runs along with the host one, the bring-ups differ by
+ * the host scheduling; anything left over from the old controller (a
+ * timeout, a scan window) would take 100 ms or more
+ */
+#define TEST_MARGIN_US 20000UL
+
+static const VCTRL_MODEL gsTestModel = {8, 1021, 500, {0}};
+
+/*Set at run time: the bring-up must not put the default one back*/
+static const CHAR gsTestName[] = "GATEWAY-7";
+
+/*BTApp device of the gateway, on the stack the harness wired up*/
+static BT_DEVICE gsTestGateway;
+
+static BOOL _isConfigured(void)
+{
+    return gasLoopback[0].isConfigured && gasLoopback[1].isConfigured;
+}
+
+static BOOL _isDataOpen(void)
+{
+    return LOOPBACK_isDataOpen(0) && LOOPBACK_isDataOpen(1);
+}
+
+static BOOL _isSensorClosed(void)
+{
+    return !LOOPBACK_isDataOpen(1);
+}
+
+static BOOL _isGatewayConfigured(void)
+{
+    return gasLoopback[0].isConfigured;
+}
+
+/*EVENT_BLUETOOTH_DETACH*/
+static void _detach(void)
+{
+    VCTRL_unplug(&gasLoopback[0].sCtrl);
+    CHECK(BTAPP_Stop(&gsTestGateway));
+    gasLoopback[0].isConfigured = FALSE;
+    gasLoopback[0].isLinkOpen = FALSE;
+}
+
+/*Nothing of the old controller left, the configuration still there*/
+static void _checkDetached(void)
+{
+    BT_STACK *psStack = gasLoopback[0].psStack;
+    HCI_CONTROL_BLOCK *psHCI = psStack->psHCICB;
+    L2CAP_CONTROL_BLOCK *psL2CAP = psStack->psL2CAPCB;
+    UINT i;
+
+    CHECK(!psHCI->psHCIConfData->isConfigured);
+    CHECK(!psHCI->psHCIConnData->isConnected);
+    CHECK(0 == psHCI->psHCIConnData->uPacketsToAck);
+    CHECK(NULL == psHCI->pCmdHead);
+    CHECK(!psHCI->isCtlBusy);
+    CHECK(HCI_PAGE_IDLE == psHCI->psHCIPageData->bState);
+    for(i = 0; i < L2CAP_MAX_CHANNELS; ++i)
+    {
+        CHECK(NULL == psL2CAP->pasChannel[i]);
+    }
+    CHECK(NULL == psL2CAP->sSigQueue.pHead);
+    CHECK(!gasLoopback[0].isChannelOpen);
+    CHECK(!LOOPBACK_isDataOpen(0));
+
+    CHECK(strlen(gsTestName) == psHCI->psHCIConfData->uLocalNameLen);
+    CHECK(0 == memcmp(psHCI->psHCIConfData->sLocalName, gsTestName,
+            strlen(gsTestName)));
+    CHECK(1 == psHCI->psHCIPageData->bNumTargets);
+}
+
+int main(void)
+{
+    DWORD dwStart, dwReplug, dwConnectableUs, dwSessionUs, dwBringUpUs;
+    UINT i;
+
+    HOST_testBegin("test_replug");
+    dwStart = BT_getTicks();
+    CHECK(LOOPBACK_open(&gsTestModel));
+    CHECK(LOOPBACK_runUntil(&_isConfigured, TEST_TIMEOUT_MS));
+    dwBringUpUs = BT_ticksToUs(gasLoopback[0].dwConfiguredAt - dwStart);
+    gsTestGateway.psStack = gasLoopback[0].psStack;
+    gsTestGateway.isStarted = TRUE;
+
+    /*The name goes to the controller with the next bring-up*/
+    LOOPBACK_select(0);
+    CHECK(gasLoopback[0].sHCI.setLocalName(gsTestName, strlen(gsTestName)));
+    CHECK(gasLoopback[0].sHCI.addPageTarget(gasLoopback[1].sCtrl.aBDAddr));
+    CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+
+    for(i = 0; i < TEST_REPLUGS; ++i)
+    {
+        _detach();
+        _checkDetached();
+        /*The sensor sees a supervision timeout*/
+        CHECK(LOOPBACK_runUntil(&_isSensorClosed, TEST_TIMEOUT_MS));
+        CHECK(0 == gasLoopback[0].sCtrl.bScanEnable);
+
+        /*Replug: the RESET brings the new controller up*/
+        dwReplug = BT_getTicks();
+        CHECK(BTAPP_Start(&gsTestGateway));
+        CHECK(LOOPBACK_runUntil(&_isGatewayConfigured, TEST_TIMEOUT_MS));
+        dwConnectableUs = BT_ticksToUs(gasLoopback[0].dwConfiguredAt -
+                dwReplug);
+        CHECK(0 != gasLoopback[0].sCtrl.bScanEnable);
+        CHECK(0 == strcmp(gasLoopback[0].sCtrl.sName, gsTestName));
+
+        /*The kept page target brings the session back*/
+        CHECK(LOOPBACK_runUntil(&_isDataOpen, TEST_TIMEOUT_MS));
+        dwSessionUs = BT_ticksToUs(BT_getTicks() - dwReplug);
+        printf("  replug %u: connectable in %lu us (first bring-up"
+                " %lu us), session back in %lu ms\n", i,
+                (unsigned long) dwConnectableUs, (unsigned long) dwBringUpUs,
+                (unsigned long) (dwSessionUs / 1000));
+        /*Nothing is left over from the previous controller to wait for*/
+        CHECK(dwConnectableUs < dwBringUpUs + TEST_MARGIN_US);
+    }
+    LOOPBACK_close();
+    return HOST_testEnd();
+}
@@ -0,0 +1,948 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "HardwareProfile.h"
+#include "vctrl.h"
+#include "hci.h"
+#include "hci_h4.h"
+#include "bt_utils.h"
+
+/*
+ * Virtual controller definitions
+ */
+
+/*Internal packet: an ACL packet left the controller (air done)*/
+#define VCTRL_AIR_DONE 0x00
+
+#define VCTRL_HANDLE 0x0001
+#define VCTRL_DEFAULT_EVENT_MASK 0x00001FFFFFFFFFFFULL
+
+/*Error codes*/
+#define VCTRL_UNKNOWN_HANDLE 0x02
+#define VCTRL_PAGE_TIMEOUT 0x04
+#define VCTRL_CONN_EXISTS 0x0B
+#define VCTRL_DISALLOWED 0x0C
+#define VCTRL_REMOTE_USER 0x13
+#define VCTRL_LOCAL_HOST 0x16
+#define VCTRL_CONN_TIMEOUT 0x08
+
+#define VCTRL_OPCODE(OCF, OGF) ((OCF) | ((OGF) << 10))
+
+/*Baseband ACL packets: type bit, EDR (bit means "shall not be used")*/
+typedef struct _VCTRL_BB_PACKET
+{
+    UINT16 uBit;
+    BOOL isEDR;
+    UINT16 uPayload;
+    UINT8 bSlots;
+} VCTRL_BB_PACKET;
+
+static const VCTRL_BB_PACKET gasVCTRLPacket[] =
+{
+    {HCI_PKT_DM1, FALSE, 17, 1},
+    {HCI_PKT_DH1, FALSE, 27, 1},
+    {HCI_PKT_DM3, FALSE, 121, 3},
+    {HCI_PKT_DH3, FALSE, 183, 3},
+    {HCI_PKT_DM5, FALSE, 224, 5},
+    {HCI_PKT_DH5, FALSE, 339, 5},
+    {HCI_PKT_NO_2_DH1, TRUE, 54, 1},
+    {HCI_PKT_NO_3_DH1, TRUE, 83, 1},
+    {HCI_PKT_NO_2_DH3, TRUE, 367, 3},
+    {HCI_PKT_NO_3_DH3, TRUE, 552, 3},
+    {HCI_PKT_NO_2_DH5, TRUE, 679, 5},
+    {HCI_PKT_NO_3_DH5, TRUE, 1021, 5},
+};
+#define VCTRL_BB_PACKETS (sizeof(gasVCTRLPacket) / sizeof(gasVCTRLPacket[0]))
+
+/*Basic rate single slot packets until the host changes them*/
+#define VCTRL_DEFAULT_PKT_TYPE (HCI_PKT_DM1 | HCI_PKT_DH1 |                \
+        HCI_PKT_NO_2_DH1 | HCI_PKT_NO_3_DH1 | HCI_PKT_NO_2_DH3 |          \
+        HCI_PKT_NO_3_DH3 | HCI_PKT_NO_2_DH5 | HCI_PKT_NO_3_DH5)
+
+/*
+ * Virtual controller private functions
+ */
+
+static DWORD _VCTRL_usToTicks(DWORD dwUs)
+{
+    return dwUs * (GetSystemClock() / 2000000UL);
+}
+
+/*Schedule a packet to the host, after those due at the same time*/
+static void _VCTRL_schedule(VCTRL *psCtrl, BYTE bType, const BYTE *pData,
+        UINT uLen, DWORD dwDelayUs)
+{
+    VCTRL_PACKET *psPacket;
+    VCTRL_PACKET **ppNext = &psCtrl->pToHost;
+
+    psPacket = (VCTRL_PACKET *) malloc(sizeof(VCTRL_PACKET) + uLen);
+    if(NULL == psPacket)
+    {
+        return;
+    }
+    psPacket->dwDue = ReadCoreTimer() + _VCTRL_usToTicks(dwDelayUs);
+    psPacket->bType = bType;
+    psPacket->uLen = uLen;
+    if(uLen > 0)
+    {
+        memcpy(psPacket->aData, pData, uLen);
+    }
+    while(NULL != *ppNext && (INT32) ((*ppNext)->dwDue - psPacket->dwDue) <= 0)
+    {
+        ppNext = &(*ppNext)->pNext;
+    }
+    psPacket->pNext = *ppNext;
+    *ppNext = psPacket;
+}
+
+static void _VCTRL_flush(VCTRL *psCtrl)
+{
+    VCTRL_PACKET *psPacket;
+
+    while(NULL != psCtrl->pToHost)
+    {
+        psPacket = psCtrl->pToHost;
+        psCtrl->pToHost = psPacket->pNext;
+        free(psPacket);
+    }
+}
+
+/*An event, if the event mask lets it through*/
+static void _VCTRL_event(VCTRL *psCtrl, BYTE bEvent, const BYTE *pParams,
+        UINT uLen, DWORD dwDelayUs)
+{
+    BYTE aEvent[HCI_EVENT_HDR_LEN + 255];
+
+    if(HCI_COMMAND_COMPLETE != bEvent && HCI_COMMAND_STATUS != bEvent &&
+       !(psCtrl->qwEventMask & (1ULL << (bEvent - 1))))
+    {
+        return;
+    }
+    aEvent[0] = bEvent;
+    aEvent[1] = (BYTE) uLen;
+    memcpy(&aEvent[HCI_EVENT_HDR_LEN], pParams, uLen);
+    _VCTRL_schedule(psCtrl, HCI_H4_EVT, aEvent, HCI_EVENT_HDR_LEN + uLen,
+            dwDelayUs);
+}
+
+static void _VCTRL_cmdComplete(VCTRL *psCtrl, UINT16 uOpcode,
+        const BYTE *pRet, UINT uRetLen)
+{
+    BYTE aParams[3 + 64];
+
+    aParams[0] = 1;
+    BT_storeLE16(uOpcode, aParams, 1);
+    memcpy(&aParams[3], pRet, uRetLen);
+    _VCTRL_event(psCtrl, HCI_COMMAND_COMPLETE, aParams, 3 + uRetLen,
+            VCTRL_CMD_US);
+}
+
+static void _VCTRL_cmdStatus(VCTRL *psCtrl, UINT16 uOpcode, BYTE bStatus)
+{
+    BYTE aParams[4];
+
+    aParams[0] = bStatus;
+    aParams[1] = 1;
+    BT_storeLE16(uOpcode, aParams, 2);
+    _VCTRL_event(psCtrl, HCI_COMMAND_STATUS, aParams, 4, VCTRL_CMD_US);
+}
+
+/*Status and connection handle, the parameters of many events*/
+static UINT _VCTRL_handleParams(VCTRL *psCtrl, BYTE *pParams, BYTE bStatus)
+{
+    pParams[0] = bStatus;
+    BT_storeLE16(psCtrl->uHandle, pParams, 1);
+    return 3;
+}
+
+/*Both ends support an LMP feature (byte, bit mask)*/
+static BOOL _VCTRL_hasFeature(VCTRL *psCtrl, UINT uByte, BYTE bMask)
+{
+    return (psCtrl->sModel.aFeatures[uByte] &
+            psCtrl->psPeer->sModel.aFeatures[uByte] & bMask) != 0;
+}
+
+/*The packet types requested, less those the link does not support*/
+static UINT16 _VCTRL_linkPacketType(VCTRL *psCtrl, UINT16 uRequested)
+{
+    UINT16 uType = uRequested | HCI_PKT_DM1;
+
+    if(!_VCTRL_hasFeature(psCtrl, HCI_FEAT_3_SLOT))
+    {
+        uType &= ~(HCI_PKT_DM3 | HCI_PKT_DH3);
+    }
+    if(!_VCTRL_hasFeature(psCtrl, HCI_FEAT_5_SLOT))
+    {
+        uType &= ~(HCI_PKT_DM5 | HCI_PKT_DH5);
+    }
+    if(!_VCTRL_hasFeature(psCtrl, HCI_FEAT_EDR_2M))
+    {
+        uType |= HCI_PKT_NO_2_DH1 | HCI_PKT_NO_2_DH3 | HCI_PKT_NO_2_DH5;
+    }
+    if(!_VCTRL_hasFeature(psCtrl, HCI_FEAT_EDR_3M))
+    {
+        uType |= HCI_PKT_NO_3_DH1 | HCI_PKT_NO_3_DH3 | HCI_PKT_NO_3_DH5;
+    }
+    if(!_VCTRL_hasFeature(psCtrl, HCI_FEAT_EDR_3_SLOT))
+    {
+        uType |= HCI_PKT_NO_2_DH3 | HCI_PKT_NO_3_DH3;
+    }
+    if(!_VCTRL_hasFeature(psCtrl, HCI_FEAT_EDR_5_SLOT))
+    {
+        uType |= HCI_PKT_NO_2_DH5 | HCI_PKT_NO_3_DH5;
+    }
+    return uType;
+}
+
+/*The link goes down on both ends*/
+static void _VCTRL_linkDown(VCTRL *psCtrl, BYTE bLocalReason,
+        BYTE bRemoteReason)
+{
+    VCTRL *psPeer = psCtrl->psPeer;
+    BYTE aParams[4];
+
+    if(!psCtrl->isConnected)
+    {
+        return;
+    }
+    psCtrl->isConnected = FALSE;
+    _VCTRL_handleParams(psCtrl, aParams, HCI_SUCCESS);
+    aParams[3] = bLocalReason;
+    _VCTRL_event(psCtrl, HCI_DISCONNECTION_COMPLETE, aParams, 4, VCTRL_CMD_US);
+    if(NULL != psPeer && psPeer->isConnected)
+    {
+        psPeer->isConnected = FALSE;
+        _VCTRL_handleParams(psPeer, aParams, HCI_SUCCESS);
+        aParams[3] = bRemoteReason;
+        _VCTRL_event(psPeer, HCI_DISCONNECTION_COMPLETE, aParams, 4,
+                VCTRL_CMD_US);
+    }
+}
+
+static void _VCTRL_linkUp(VCTRL *psCtrl, const BYTE *pRemoteAddr,
+        DWORD dwDelayUs)
+{
+    BYTE aParams[11];
+
+    psCtrl->isConnected = TRUE;
+    psCtrl->isPaging = FALSE;
+    psCtrl->uHandle = VCTRL_HANDLE;
+    psCtrl->uPacketType = VCTRL_DEFAULT_PKT_TYPE;
+    psCtrl->bMode = HCI_MODE_ACTIVE;
+    psCtrl->uAclInController = 0;
+    psCtrl->uHostCredits = psCtrl->uHostAclBuffers;
+    psCtrl->dwAirFree = ReadCoreTimer();
+    _VCTRL_handleParams(psCtrl, aParams, HCI_SUCCESS);
+    memcpy(&aParams[3], pRemoteAddr, 6);
+    /*ACL link, no encryption*/
+    aParams[9] = 0x01;
+    aParams[10] = 0x00;
+    _VCTRL_event(psCtrl, HCI_CONNECTION_COMPLETE, aParams, 11, dwDelayUs);
+}
+
+/*Time a page takes to meet the page scan of the peer (mean)*/
+static DWORD _VCTRL_pageUs(VCTRL *psPeer)
+{
+    DWORD dwIntervalUs = psPeer->uPageScanInterval * VCTRL_SLOT_US;
+
+    /*
+     * Half an interval until the next window, plus a whole interval half
+     * of the times the pager starts on the wrong train: an interlaced
+     * scan covers both trains in the same window.
+     */
+    return (0x01 == psPeer->bPageScanType) ? dwIntervalUs / 2 : dwIntervalUs;
+}
+
+static void _VCTRL_reset(VCTRL *psCtrl)
+{
+    _VCTRL_flush(psCtrl);
+    _VCTRL_linkDown(psCtrl, VCTRL_LOCAL_HOST, VCTRL_CONN_TIMEOUT);
+    /*The host does not hear about the link it reset*/
+    _VCTRL_flush(psCtrl);
+    psCtrl->isPaging = FALSE;
+    psCtrl->bScanEnable = 0;
+    psCtrl->uPageScanInterval = 0x0800;
+    psCtrl->uPageScanWindow = 0x0012;
+    psCtrl->bPageScanType = 0;
+    psCtrl->uInqScanInterval = 0x1000;
+    psCtrl->bInqScanType = 0;
+    psCtrl->qwEventMask = VCTRL_DEFAULT_EVENT_MASK;
+    psCtrl->isHostFlowControl = FALSE;
+    psCtrl->uHostAclBuffers = 0;
+    psCtrl->uHostCredits = 0;
+    psCtrl->uAclInController = 0;
+}
+
+/*HCI_LINK_CTRL_OGF commands*/
+static void _VCTRL_linkCommand(VCTRL *psCtrl, UINT16 uOpcode, BYTE bOCF,
+        const BYTE *pParams)
+{
+    VCTRL *psPeer = psCtrl->psPeer;
+    BYTE aParams[255];
+    BOOL isPeer;
+
+    switch(bOCF)
+    {
+        case HCI_CREATE_CONN_OCF:
+            if(psCtrl->isConnected || psCtrl->isPaging)
+            {
+                _VCTRL_cmdStatus(psCtrl, uOpcode, psCtrl->isConnected ?
+                        VCTRL_CONN_EXISTS : VCTRL_DISALLOWED);
+                break;
+            }
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            psCtrl->isPaging = TRUE;
+            psCtrl->dwPageStart = ReadCoreTimer();
+            isPeer = NULL != psPeer && 0 == memcmp(pParams, psPeer->aBDAddr, 6);
+            if(isPeer && psPeer->iFd >= 0 && !psPeer->isConnected &&
+               (psPeer->bScanEnable & 0x02))
+            {
+                /*BD_ADDR, class of device and link type*/
+                memcpy(aParams, psCtrl->aBDAddr, 6);
+                aParams[6] = 0x04;
+                aParams[7] = 0x01;
+                aParams[8] = 0x18;
+                aParams[9] = 0x01;
+                _VCTRL_event(psPeer, HCI_CONNECTION_REQUEST, aParams, 10,
+                        _VCTRL_pageUs(psPeer));
+            }
+            else
+            {
+                aParams[0] = VCTRL_PAGE_TIMEOUT;
+                BT_storeLE16(0, aParams, 1);
+                memcpy(&aParams[3], pParams, 6);
+                aParams[9] = 0x01;
+                aParams[10] = 0x00;
+                _VCTRL_event(psCtrl, HCI_CONNECTION_COMPLETE, aParams, 11,
+                        VCTRL_PAGE_TIMEOUT_US);
+                psCtrl->isPaging = FALSE;
+            }
+            break;
+
+        case HCI_ACCEPT_CONN_REQ_OCF:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            if(NULL != psPeer && psPeer->isPaging)
+            {
+                psPeer->dwPageUs = BT_ticksToUs(ReadCoreTimer() -
+                        psPeer->dwPageStart);
+                _VCTRL_linkUp(psCtrl, psPeer->aBDAddr, VCTRL_CMD_US);
+                _VCTRL_linkUp(psPeer, psCtrl->aBDAddr, VCTRL_CMD_US);
+            }
+            break;
+
+        case HCI_DISCONN_OCF:
+            if(!psCtrl->isConnected)
+            {
+                _VCTRL_cmdStatus(psCtrl, uOpcode, VCTRL_UNKNOWN_HANDLE);
+                break;
+            }
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            _VCTRL_linkDown(psCtrl, VCTRL_LOCAL_HOST, pParams[2]);
+            break;
+
+        case HCI_INQUIRY_OCF:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            if(NULL != psPeer && psPeer->iFd >= 0 &&
+               (psPeer->bScanEnable & 0x01))
+            {
+                /*BD_ADDR, R1, reserved, class of device, clock offset*/
+                aParams[0] = 1;
+                memcpy(&aParams[1], psPeer->aBDAddr, 6);
+                aParams[7] = HCI_PSRM_R1;
+                aParams[8] = 0;
+                aParams[9] = 0;
+                aParams[10] = 0x04;
+                aParams[11] = 0x01;
+                aParams[12] = 0x18;
+                BT_storeLE16(0x1234, aParams, 13);
+                _VCTRL_event(psCtrl, HCI_INQUIRY_RESULT, aParams, 15,
+                        psPeer->uInqScanInterval * VCTRL_SLOT_US / 2);
+            }
+            aParams[0] = HCI_SUCCESS;
+            _VCTRL_event(psCtrl, HCI_INQUIRY_COMPLETE, aParams, 1,
+                    pParams[3] * VCTRL_INQUIRY_UNIT_US);
+            break;
+
+        case HCI_REMOTE_NAME_REQ_OCF:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            memset(aParams, 0, 255);
+            memcpy(&aParams[1], pParams, 6);
+            if(NULL != psPeer && 0 == memcmp(pParams, psPeer->aBDAddr, 6))
+            {
+                aParams[0] = HCI_SUCCESS;
+                strncpy((char *) &aParams[7], psPeer->sName, 248);
+            }
+            else
+            {
+                aParams[0] = VCTRL_PAGE_TIMEOUT;
+            }
+            _VCTRL_event(psCtrl, HCI_REMOTE_NAME_REQ_COMPLETE, aParams, 255,
+                    VCTRL_CMD_US);
+            break;
+
+        case HCI_R_REMOTE_FEATURES_OCF:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            _VCTRL_handleParams(psCtrl, aParams, psCtrl->isConnected ?
+                    HCI_SUCCESS : VCTRL_UNKNOWN_HANDLE);
+            memcpy(&aParams[3], psPeer->sModel.aFeatures, 8);
+            _VCTRL_event(psCtrl, HCI_READ_REMOTE_FEATURES_COMPLETE, aParams,
+                    11, VCTRL_CMD_US);
+            break;
+
+        case HCI_CHANGE_PKT_TYPE_OCF:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            if(psCtrl->isConnected)
+            {
+                psCtrl->uPacketType = _VCTRL_linkPacketType(psCtrl,
+                        BT_readLE16(pParams, 2));
+            }
+            _VCTRL_handleParams(psCtrl, aParams, psCtrl->isConnected ?
+                    HCI_SUCCESS : VCTRL_UNKNOWN_HANDLE);
+            BT_storeLE16(psCtrl->uPacketType, aParams, 3);
+            _VCTRL_event(psCtrl, HCI_CONN_PACKET_TYPE_CHANGED, aParams, 5,
+                    VCTRL_CMD_US);
+            break;
+
+        case HCI_LINK_KEY_REQ_REP_OCF:
+        case HCI_LINK_KEY_NEG_REP_OCF:
+        case HCI_PIN_CODE_REQ_REP_OCF:
+            aParams[0] = HCI_SUCCESS;
+            memcpy(&aParams[1], pParams, 6);
+            _VCTRL_cmdComplete(psCtrl, uOpcode, aParams, 7);
+            break;
+
+        default:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_SUCCESS);
+            break;
+    }
+}
+
+/*HCI_LINK_POLICY_OGF commands*/
+static void _VCTRL_policyCommand(VCTRL *psCtrl, UINT16 uOpcode, BYTE bOCF,
+        const BYTE *pParams)
+{
+    BYTE aParams[6];
+
+    switch(bOCF)
+    {
+        case HCI_SNIFF_MODE_OCF:
+        case HCI_EXIT_SNIFF_MODE_OCF:
+            _VCTRL_cmdStatus(psCtrl, uOpcode, psCtrl->isConnected ?
+                    HCI_SUCCESS : VCTRL_UNKNOWN_HANDLE);
+            if(!psCtrl->isConnected)
+            {
+                break;
+            }
+            psCtrl->bMode = (HCI_SNIFF_MODE_OCF == bOCF) ?
+                    HCI_MODE_SNIFF : HCI_MODE_ACTIVE;
+            _VCTRL_handleParams(psCtrl, aParams, HCI_SUCCESS);
+            aParams[3] = psCtrl->bMode;
+            BT_storeLE16((HCI_SNIFF_MODE_OCF == bOCF) ?
+                    BT_readLE16(pParams, 2) : 0, aParams, 4);
+            _VCTRL_event(psCtrl, HCI_MODE_CHANGE, aParams, 6, VCTRL_CMD_US);
+            break;
+
+        default:
+            _VCTRL_handleParams(psCtrl, aParams, HCI_SUCCESS);
+            _VCTRL_cmdComplete(psCtrl, uOpcode, aParams, 3);
+            break;
+    }
+}
+
+/*HCI_HC_BB_OGF and HCI_INFO_PARAM_OGF commands*/
+static void _VCTRL_localCommand(VCTRL *psCtrl, UINT16 uOpcode,
+        const BYTE *pParams)
+{
+    BYTE aRet[16];
+    UINT i, uHandles;
+
+    aRet[0] = HCI_SUCCESS;
+    switch(uOpcode)
+    {
+        case VCTRL_OPCODE(HCI_RESET_OCF, HCI_HC_BB_OGF):
+            _VCTRL_reset(psCtrl);
+            break;
+
+        case VCTRL_OPCODE(HCI_H_NUM_COMPL_OCF, HCI_HC_BB_OGF):
+            /*No event for this one*/
+            uHandles = pParams[0];
+            for(i = 0; i < uHandles; ++i)
+            {
+                psCtrl->uHostCredits += BT_readLE16(pParams, 3 + i * 4);
+            }
+            return;
+
+        case VCTRL_OPCODE(HCI_H_BUF_SIZE_OCF, HCI_HC_BB_OGF):
+            psCtrl->uHostAclBuffers = BT_readLE16(pParams, 3);
+            psCtrl->uHostCredits = psCtrl->uHostAclBuffers;
+            break;
+
+        case VCTRL_OPCODE(HCI_SET_CH_FLOW_CTRL_OCF, HCI_HC_BB_OGF):
+            psCtrl->isHostFlowControl = (pParams[0] & 0x01) != 0;
+            break;
+
+        case VCTRL_OPCODE(HCI_SET_EVENT_MASK_OCF, HCI_HC_BB_OGF):
+            psCtrl->qwEventMask = 0;
+            for(i = 0; i < 8; ++i)
+            {
+                psCtrl->qwEventMask |= (QWORD) pParams[i] << (8 * i);
+            }
+            break;
+
+        case VCTRL_OPCODE(HCI_W_SCAN_EN_OCF, HCI_HC_BB_OGF):
+            psCtrl->bScanEnable = pParams[0];
+            break;
+
+        case VCTRL_OPCODE(HCI_W_PAGE_SCAN_ACT_OCF, HCI_HC_BB_OGF):
+            psCtrl->uPageScanInterval = BT_readLE16(pParams, 0);
+            psCtrl->uPageScanWindow = BT_readLE16(pParams, 2);
+            break;
+
+        case VCTRL_OPCODE(HCI_W_PAGE_SCAN_TYPE_OCF, HCI_HC_BB_OGF):
+            psCtrl->bPageScanType = pParams[0];
+            break;
+
+        case VCTRL_OPCODE(HCI_W_INQ_SCAN_ACT_OCF, HCI_HC_BB_OGF):
+            psCtrl->uInqScanInterval = BT_readLE16(pParams, 0);
+            break;
+
+        case VCTRL_OPCODE(HCI_W_INQ_SCAN_TYPE_OCF, HCI_HC_BB_OGF):
+            psCtrl->bInqScanType = pParams[0];
+            break;
+
+        case VCTRL_OPCODE(HCI_W_LOCAL_NAME_OCF, HCI_HC_BB_OGF):
+            strncpy(psCtrl->sName, (const char *) pParams,
+                    sizeof(psCtrl->sName) - 1);
+            break;
+
+        case VCTRL_OPCODE(HCI_R_BUF_SIZE_OCF, HCI_INFO_PARAM_OGF):
+            BT_storeLE16(psCtrl->sModel.uAclLen, aRet, 1);
+            aRet[3] = 0;
+            BT_storeLE16(psCtrl->sModel.uAclBuffers, aRet, 4);
+            BT_storeLE16(0, aRet, 6);
+            _VCTRL_cmdComplete(psCtrl, uOpcode, aRet, 8);
+            return;
+
+        case VCTRL_OPCODE(HCI_R_BD_ADDR_OCF, HCI_INFO_PARAM_OGF):
+            memcpy(&aRet[1], psCtrl->aBDAddr, 6);
+            _VCTRL_cmdComplete(psCtrl, uOpcode, aRet, 7);
+            return;
+
+        case VCTRL_OPCODE(HCI_R_LOCAL_FEATURES_OCF, HCI_INFO_PARAM_OGF):
+            memcpy(&aRet[1], psCtrl->sModel.aFeatures, 8);
+            _VCTRL_cmdComplete(psCtrl, uOpcode, aRet, 9);
+            return;
+
+        default:
+            break;
+    }
+    _VCTRL_cmdComplete(psCtrl, uOpcode, aRet, 1);
+}
+
+static void _VCTRL_command(VCTRL *psCtrl, const BYTE *pCmd)
+{
+    UINT16 uOpcode = BT_readLE16(pCmd, 0);
+    BYTE bOGF = uOpcode >> 10;
+    BYTE bOCF = uOpcode & 0x03FF;
+
+    ++psCtrl->dwCommands;
+    if(0 != uOpcode && psCtrl->sModel.uUnknownOpcode == uOpcode)
+    {
+        _VCTRL_cmdStatus(psCtrl, uOpcode, HCI_UNKNOWN_COMMAND);
+    }
+    else if(HCI_LINK_CTRL_OGF == bOGF)
+    {
+        _VCTRL_linkCommand(psCtrl, uOpcode, bOCF, &pCmd[HCI_CMD_HDR_LEN]);
+    }
+    else if(HCI_LINK_POLICY_OGF == bOGF)
+    {
+        _VCTRL_policyCommand(psCtrl, uOpcode, bOCF, &pCmd[HCI_CMD_HDR_LEN]);
+    }
+    else
+    {
+        _VCTRL_localCommand(psCtrl, uOpcode, &pCmd[HCI_CMD_HDR_LEN]);
+    }
+}
+
+/*An ACL packet of the host goes on air, the peer gets it when it is due*/
+static void _VCTRL_acl(VCTRL *psCtrl, const BYTE *pAcl, UINT uLen)
+{
+    VCTRL *psPeer = psCtrl->psPeer;
+    BYTE aAcl[VCTRL_RX_BUFFER];
+    DWORD dwNow = ReadCoreTimer();
+    DWORD dwStart, dwDue;
+    UINT uPayload = uLen - HCI_ACL_HDR_LEN;
+
+    if(!psCtrl->isConnected || NULL == psPeer || !psPeer->isConnected)
+    {
+        return;
+    }
+    if(psCtrl->uAclInController >= psCtrl->sModel.uAclBuffers ||
+       uPayload > psCtrl->sModel.uAclLen)
+    {
+        ++psCtrl->dwOverruns;
+        return;
+    }
+    ++psCtrl->uAclInController;
+    ++psCtrl->dwAclTx;
+    psCtrl->dwAclBytesTx += uPayload;
+
+    /*One packet on air at once (either way), then the fixed latency*/
+    dwStart = ((INT32) (psCtrl->dwAirFree - dwNow) > 0) ?
+            psCtrl->dwAirFree : dwNow;
+    if((INT32) (psPeer->dwAirFree - dwStart) > 0)
+    {
+        dwStart = psPeer->dwAirFree;
+    }
+    psCtrl->dwAirFree = dwStart + _VCTRL_usToTicks(
+            VCTRL_airTimeUs(psCtrl->uPacketType, uPayload));
+    psPeer->dwAirFree = psCtrl->dwAirFree;
+    dwDue = BT_ticksToUs(psCtrl->dwAirFree - dwNow) +
+            psCtrl->sModel.dwLatencyUs;
+
+    /*Peer handle, first (automatically flushable) packet, point to point*/
+    BT_storeLE16(psPeer->uHandle | (0x2 << 12), aAcl, 0);
+    BT_storeLE16(uPayload, aAcl, 2);
+    memcpy(&aAcl[HCI_ACL_HDR_LEN], &pAcl[HCI_ACL_HDR_LEN], uPayload);
+    _VCTRL_schedule(psPeer, HCI_H4_ACL, aAcl, uLen, dwDue);
+    _VCTRL_schedule(psCtrl, VCTRL_AIR_DONE, NULL, 0, dwDue);
+}
+
+/*Parse the H4 stream of the host, TRUE if it sent anything*/
+static BOOL _VCTRL_rxTasks(VCTRL *psCtrl)
+{
+    ssize_t iLen;
+    UINT uPacket;
+    BOOL isMoved = FALSE;
+
+    iLen = read(psCtrl->iFd, &psCtrl->aRx[psCtrl->uRxPos],
+            VCTRL_RX_BUFFER - psCtrl->uRxPos);
+    if(0 == iLen)
+    {
+        /*The host went away*/
+        close(psCtrl->iFd);
+        psCtrl->iFd = -1;
+        psCtrl->uRxPos = 0;
+        return TRUE;
+    }
+    if(iLen < 0)
+    {
+        return FALSE;
+    }
+    psCtrl->uRxPos += iLen;
+
+    while(psCtrl->uRxPos > 0)
+    {
+        if(HCI_H4_CMD == psCtrl->aRx[0] && psCtrl->uRxPos > 3)
+        {
+            uPacket = 1 + HCI_CMD_HDR_LEN + psCtrl->aRx[3];
+        }
+        else if(HCI_H4_ACL == psCtrl->aRx[0] && psCtrl->uRxPos > 4)
+        {
+            uPacket = 1 + HCI_ACL_HDR_LEN + BT_readLE16(psCtrl->aRx, 3);
+        }
+        else if(HCI_H4_CMD != psCtrl->aRx[0] && HCI_H4_ACL != psCtrl->aRx[0])
+        {
+            /*Out of sync, never happens with a sane host*/
+            fprintf(stderr, "vctrl: bad H4 indicator 0x%02X\n",
+                    psCtrl->aRx[0]);
+            psCtrl->uRxPos = 0;
+            break;
+        }
+        else
+        {
+            break;
+        }
+        if(uPacket > VCTRL_RX_BUFFER)
+        {
+            fprintf(stderr, "vctrl: %u byte packet\n", uPacket);
+            psCtrl->uRxPos = 0;
+            break;
+        }
+        if(uPacket > psCtrl->uRxPos)
+        {
+            break;
+        }
+        if(HCI_H4_CMD == psCtrl->aRx[0])
+        {
+            _VCTRL_command(psCtrl, &psCtrl->aRx[1]);
+        }
+        else
+        {
+            _VCTRL_acl(psCtrl, &psCtrl->aRx[1], uPacket - 1);
+        }
+        memmove(psCtrl->aRx, &psCtrl->aRx[uPacket], psCtrl->uRxPos - uPacket);
+        psCtrl->uRxPos -= uPacket;
+        isMoved = TRUE;
+    }
+    return isMoved || iLen > 0;
+}
+
+/*Hand the due packets to the host (ACL data only while it has room)*/
+static BOOL _VCTRL_txTasks(VCTRL *psCtrl)
+{
+    VCTRL_PACKET **ppPacket = &psCtrl->pToHost;
+    VCTRL_PACKET *psPacket;
+    DWORD dwNow = ReadCoreTimer();
+    BYTE aParams[5];
+    ssize_t iLen;
+    BOOL isMoved = FALSE;
+
+    while(NULL != (psPacket = *ppPacket) &&
+          (INT32) (psPacket->dwDue - dwNow) <= 0)
+    {
+        if(VCTRL_AIR_DONE == psPacket->bType)
+        {
+            /*Sent and acknowledged: the buffer is free again*/
+            if(psCtrl->uAclInController > 0)
+            {
+                --psCtrl->uAclInController;
+            }
+            aParams[0] = 1;
+            BT_storeLE16(psCtrl->uHandle, aParams, 1);
+            BT_storeLE16(1, aParams, 3);
+            *ppPacket = psPacket->pNext;
+            free(psPacket);
+            if(psCtrl->isConnected)
+            {
+                _VCTRL_event(psCtrl, HCI_NBR_OF_COMPLETED_PACKETS, aParams, 5,
+                        0);
+            }
+            isMoved = TRUE;
+            ppPacket = &psCtrl->pToHost;
+            continue;
+        }
+        if(HCI_H4_ACL == psPacket->bType &&
+           (!psCtrl->isConnected ||
+            (psCtrl->isHostFlowControl && 0 == psCtrl->uHostCredits)))
+        {
+            if(!psCtrl->isConnected)
+            {
+                *ppPacket = psPacket->pNext;
+                free(psPacket);
+                continue;
+            }
+            ppPacket = &psPacket->pNext;
+            continue;
+        }
+        if(1 + psPacket->uLen > VCTRL_TX_BUFFER - psCtrl->uTxLen)
+        {
+            break;
+        }
+        psCtrl->aTx[psCtrl->uTxLen++] = psPacket->bType;
+        memcpy(&psCtrl->aTx[psCtrl->uTxLen], psPacket->aData, psPacket->uLen);
+        psCtrl->uTxLen += psPacket->uLen;
+        if(HCI_H4_ACL == psPacket->bType)
+        {
+            ++psCtrl->dwAclRx;
+            if(psCtrl->isHostFlowControl)
+            {
+                --psCtrl->uHostCredits;
+            }
+        }
+        *ppPacket = psPacket->pNext;
+        free(psPacket);
+        isMoved = TRUE;
+    }
+
+    if(psCtrl->uTxLen > 0)
+    {
+        iLen = write(psCtrl->iFd, psCtrl->aTx, psCtrl->uTxLen);
+        if(iLen > 0)
+        {
+            memmove(psCtrl->aTx, &psCtrl->aTx[iLen], psCtrl->uTxLen - iLen);
+            psCtrl->uTxLen -= iLen;
+            isMoved = TRUE;
+        }
+    }
+    return isMoved;
+}
+
+/*
+ * Virtual controller public functions
+ */
+
+BOOL VCTRL_open(VCTRL *psCtrl, const char *sPath, const BYTE *pBDAddr,
+        const VCTRL_MODEL *psModel)
+{
+    struct sockaddr_un sAddr;
+
+    memset(psCtrl, 0, sizeof(VCTRL));
+    snprintf(psCtrl->sPath, sizeof(psCtrl->sPath), "%s", sPath);
+    memcpy(psCtrl->aBDAddr, pBDAddr, 6);
+    psCtrl->sModel = *psModel;
+    psCtrl->iFd = -1;
+    _VCTRL_reset(psCtrl);
+
+    unlink(sPath);
+    psCtrl->iListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(psCtrl->iListenFd < 0)
+    {
+        return FALSE;
+    }
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sun_family = AF_UNIX;
+    strncpy(sAddr.sun_path, sPath, sizeof(sAddr.sun_path) - 1);
+    if(bind(psCtrl->iListenFd, (struct sockaddr *) &sAddr, sizeof(sAddr)) < 0 ||
+       listen(psCtrl->iListenFd, 1) < 0)
+    {
+        close(psCtrl->iListenFd);
+        psCtrl->iListenFd = -1;
+        return FALSE;
+    }
+    fcntl(psCtrl->iListenFd, F_SETFL,
+            fcntl(psCtrl->iListenFd, F_GETFL) | O_NONBLOCK);
+    return TRUE;
+}
+
+void VCTRL_close(VCTRL *psCtrl)
+{
+    _VCTRL_flush(psCtrl);
+    if(psCtrl->iFd >= 0)
+    {
+        close(psCtrl->iFd);
+        psCtrl->iFd = -1;
+    }
+    if(psCtrl->iListenFd >= 0)
+    {
+        close(psCtrl->iListenFd);
+        psCtrl->iListenFd = -1;
+        unlink(psCtrl->sPath);
+    }
+}
+
+void VCTRL_event(VCTRL *psCtrl, BYTE bEvent, const BYTE *pParams,
+        UINT uLen)
+{
+    _VCTRL_event(psCtrl, bEvent, pParams, uLen, VCTRL_CMD_US);
+}
+
+void VCTRL_linkLoss(VCTRL *psCtrl)
+{
+    _VCTRL_linkDown(psCtrl, VCTRL_CONN_TIMEOUT, VCTRL_CONN_TIMEOUT);
+}
+
+void VCTRL_unplug(VCTRL *psCtrl)
+{
+    _VCTRL_reset(psCtrl);
+    psCtrl->uRxPos = 0;
+    psCtrl->sName[0] = '\0';
+}
+
+void VCTRL_pair(VCTRL *psCtrl1, VCTRL *psCtrl2)
+{
+    psCtrl1->psPeer = psCtrl2;
+    psCtrl2->psPeer = psCtrl1;
+}
+
+BOOL VCTRL_tasks(VCTRL *psCtrl)
+{
+    BOOL isMoved = FALSE;
+    int iFd;
+
+    /*A (new) host: the controller starts from its power-on state*/
+    iFd = accept(psCtrl->iListenFd, NULL, NULL);
+    if(iFd >= 0)
+    {
+        if(psCtrl->iFd >= 0)
+        {
+            close(psCtrl->iFd);
+        }
+        fcntl(iFd, F_SETFL, fcntl(iFd, F_GETFL) | O_NONBLOCK);
+        psCtrl->iFd = iFd;
+        psCtrl->uRxPos = 0;
+        psCtrl->uTxLen = 0;
+        _VCTRL_reset(psCtrl);
+        isMoved = TRUE;
+    }
+    if(psCtrl->iFd < 0)
+    {
+        return isMoved;
+    }
+    isMoved |= _VCTRL_rxTasks(psCtrl);
+    if(psCtrl->iFd >= 0)
+    {
+        isMoved |= _VCTRL_txTasks(psCtrl);
+    }
+    return isMoved;
+}
+
+DWORD VCTRL_nextUs(const VCTRL *psCtrl)
+{
+    DWORD dwNow = ReadCoreTimer();
+    const VCTRL_PACKET *psPacket;
+
+    for(psPacket = psCtrl->pToHost; NULL != psPacket;
+        psPacket = psPacket->pNext)
+    {
+        /*ACL data waiting for host buffers is not due by time*/
+        if(HCI_H4_ACL == psPacket->bType && psCtrl->isHostFlowControl &&
+           0 == psCtrl->uHostCredits)
+        {
+            continue;
+        }
+        if((INT32) (psPacket->dwDue - dwNow) <= 0)
+        {
+            return 0;
+        }
+        return BT_ticksToUs(psPacket->dwDue - dwNow) + 1;
+    }
+    return 0xFFFFFFFFUL;
+}
+
+DWORD VCTRL_airTimeUs(UINT16 uPacketType, UINT uLen)
+{
+    const VCTRL_BB_PACKET *psBig = &gasVCTRLPacket[0];
+    const VCTRL_BB_PACKET *psLast;
+    DWORD dwUs = 0;
+    UINT i;
+
+    /*Full fragments in the biggest packet allowed*/
+    for(i = 0; i < VCTRL_BB_PACKETS; ++i)
+    {
+        if(((gasVCTRLPacket[i].uBit & uPacketType) != 0) !=
+                gasVCTRLPacket[i].isEDR &&
+           gasVCTRLPacket[i].uPayload > psBig->uPayload)
+        {
+            psBig = &gasVCTRLPacket[i];
+        }
+    }
+    while(uLen > psBig->uPayload)
+    {
+        dwUs += (psBig->bSlots + 1) * VCTRL_SLOT_US;
+        uLen -= psBig->uPayload;
+    }
+    /*The rest in the shortest one it fits in*/
+    psLast = psBig;
+    for(i = 0; i < VCTRL_BB_PACKETS; ++i)
+    {
+        if(((gasVCTRLPacket[i].uBit & uPacketType) != 0) !=
+                gasVCTRLPacket[i].isEDR &&
+           gasVCTRLPacket[i].uPayload >= uLen &&
+           gasVCTRLPacket[i].bSlots < psLast->bSlots)
+        {
+            psLast = &gasVCTRLPacket[i];
+        }
+    }
+    return dwUs + (psLast->bSlots + 1) * VCTRL_SLOT_US;
+}
@@ -0,0 +1,151 @@
+/*
+   Copyright 2012 Guillem Vinals Gangolells <guillem@guillem.co.uk>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#ifndef __VCTRL_H__
+#define __VCTRL_H__
+
+#include "GenericTypeDefs.h"
+
+/*
+ * Virtual controller pair: two H4 controllers, each one listening on the
+ * Unix socket an H4 stack instance connects to, sharing one simulated
+ * radio link. It answers the commands the stack sends and models:
+ *  - the controller ACL buffers (READ_BUFFER_SIZE), a host writing past
+ *    them is counted as an overrun and the packet dropped,
+ *  - the air time of every ACL packet from the baseband packet types in
+ *    use (slots, payload and the return slot), one packet on air at once,
+ *  - a fixed latency per packet on top of it,
+ *  - the host flow control (HOST_BUFFER_SIZE, Host_Number_Of_Completed),
+ *  - paging against the page scan activity of the peer and the events
+ *    the event mask lets through.
+ * Everything runs from VCTRL_tasks, on the core timer of the host port.
+ */
+
+#define VCTRL_PATH_LEN 108
+/*H4 bytes from the host not parsed yet (a command or ACL packet fits)*/
+#define VCTRL_RX_BUFFER 2048
+/*Bytes to the host waiting for the socket*/
+#define VCTRL_TX_BUFFER 8192
+
+/*Page timeout (5.12 s, the specification default)*/
+#define VCTRL_PAGE_TIMEOUT_US 5120000UL
+/*Inquiry length unit (1.28 s)*/
+#define VCTRL_INQUIRY_UNIT_US 1280000UL
+/*Baseband slot*/
+#define VCTRL_SLOT_US 625UL
+/*Command processing time*/
+#define VCTRL_CMD_US 100UL
+
+/*Link model (both controllers of a pair use the same one)*/
+typedef struct _VCTRL_MODEL
+{
+    /*Controller ACL buffers and their size*/
+    UINT16 uAclBuffers;
+    UINT16 uAclLen;
+    /*Added to the air time of every ACL packet*/
+    DWORD dwLatencyUs;
+    /*LMP features reported (READ_LOCAL/REMOTE_FEATURES)*/
+    BYTE aFeatures[8];
+    /*Command the controller does not know (0: none), as an older one*/
+    UINT16 uUnknownOpcode;
+} VCTRL_MODEL;
+
+/*Scheduled packet (to the host or on air)*/
+typedef struct _VCTRL_PACKET
+{
+    struct _VCTRL_PACKET *pNext;
+    DWORD dwDue;
+    BYTE bType;
+    UINT16 uLen;
+    BYTE aData[];
+} VCTRL_PACKET;
+
+typedef struct _VCTRL
+{
+    char sPath[VCTRL_PATH_LEN];
+    int iListenFd;
+    int iFd;
+    struct _VCTRL *psPeer;
+    VCTRL_MODEL sModel;
+    BYTE aBDAddr[6];
+    CHAR sName[32];
+
+    /*H4 stream from the host*/
+    BYTE aRx[VCTRL_RX_BUFFER];
+    UINT uRxPos;
+    /*H4 stream to the host*/
+    BYTE aTx[VCTRL_TX_BUFFER];
+    UINT uTxLen;
+    /*Packets to the host, in due order*/
+    VCTRL_PACKET *pToHost;
+
+    /*Configuration written by the host*/
+    BYTE bScanEnable;
+    UINT16 uPageScanInterval;
+    UINT16 uPageScanWindow;
+    BYTE bPageScanType;
+    UINT16 uInqScanInterval;
+    BYTE bInqScanType;
+    QWORD qwEventMask;
+    BOOL isHostFlowControl;
+    UINT16 uHostAclBuffers;
+    UINT16 uHostCredits;
+
+    /*Link*/
+    BOOL isConnected;
+    BOOL isPaging;
+    UINT16 uHandle;
+    UINT16 uPacketType;
+    BYTE bMode;
+    UINT16 uAclInController;
+    /*Air: the peer receives the packet when it is due*/
+    DWORD dwAirFree;
+
+    /*Statistics*/
+    DWORD dwCommands;
+    DWORD dwAclTx;
+    DWORD dwAclBytesTx;
+    DWORD dwAclRx;
+    DWORD dwOverruns;
+    DWORD dwPageStart;
+    DWORD dwPageUs;
+} VCTRL;
+
+/*Listen on sPath (the BT_H4_PATH of a stack instance)*/
+BOOL VCTRL_open(VCTRL *psCtrl, const char *sPath, const BYTE *pBDAddr,
+        const VCTRL_MODEL *psModel);
+void VCTRL_close(VCTRL *psCtrl);
+/*Share the radio link*/
+void VCTRL_pair(VCTRL *psCtrl1, VCTRL *psCtrl2);
+/*Supervision timeout: the link drops on both ends*/
+void VCTRL_linkLoss(VCTRL *psCtrl);
+/*
+ * The controller is pulled and plugged back: the peer sees a supervision
+ * timeout, the host hears nothing more and the controller is back in its
+ * power-on state (the name it had is gone too), waiting for a RESET.
+ */
+void VCTRL_unplug(VCTRL *psCtrl);
+/*Report an event to the host (if the event mask lets it through)*/
+void VCTRL_event(VCTRL *psCtrl, BYTE bEvent, const BYTE *pParams,
+        UINT uLen);
+/*Move the streams and deliver what is due, TRUE if anything moved*/
+BOOL VCTRL_tasks(VCTRL *psCtrl);
+/*Microseconds until the next scheduled packet (0xFFFFFFFF if none)*/
+DWORD VCTRL_nextUs(const VCTRL *psCtrl);
+/*Air time of an ACL packet with the baseband packet types allowed*/
+DWORD VCTRL_airTimeUs(UINT16 uPacketType, UINT uLen);
+
+#endif /*__VCTRL_H__*/
@@ -47,9 +47,13 @@ BUT NOT LIMITED TO ANY DEFENSE THEREOF), OR OTHER SIMILAR COSTS.
 */
 
 #include "Compiler.h"
+#include "GenericTypeDefs.h"
 #include "HardwareProfile.h"
 #include "uart1.h"
 
+//Set while a binary stream owns the transmitter
+static BOOL gisUART1Claimed = FALSE;
+
 //******************************************************************************
 // Constants
 //******************************************************************************
@@ -289,6 +293,11 @@ Output: None.
 *******************************************************************************/
 void UART1PutChar( char ch )
 {
+    if(gisUART1Claimed)
+        return;
+
+    //The FIFO may still hold the end of the stream
+    while(U1STAbits.UTXBF == 1);
     U1TXREG = ch;
     #if !defined(__PIC32MX__)
         Nop();
@@ -297,6 +306,27 @@ void UART1PutChar( char ch )
     while(U1STAbits.TRMT == 0);
 }
 
+/*******************************************************************************
+Function: UART1Claim( BOOL isClaimed )
+
+Precondition:
+    None.
+
+Overview:
+    While claimed, the transmitter belongs to a binary stream written straight
+    to U1TXREG: UART1PutChar (console, debug and SPP output) drops its bytes
+    instead of mixing them into the stream.
+
+Input: TRUE to claim the transmitter, FALSE to give it back.
+
+Output: None.
+
+*******************************************************************************/
+void UART1Claim( BOOL isClaimed )
+{
+    gisUART1Claimed = isClaimed;
+}
+
 /*******************************************************************************
 Function: UART1PutDec(unsigned char dec)
 
@@ -103,6 +103,23 @@ Note: none
 ********************************************************************/
 void UART1PutChar( char ch );
 
+/*********************************************************************
+Function: void UART1Claim(BOOL isClaimed)
+
+PreCondition: none
+
+Input: TRUE while a binary stream owns the transmitter
+
+Output: none
+
+Side Effects: UART1PutChar drops its bytes while claimed
+
+Overview: hands the transmitter to a raw U1TXREG writer
+
+Note: none
+********************************************************************/
+void UART1Claim( BOOL isClaimed );
+
 /*********************************************************************
 Function: void UART1Init(void)
 